@@ -0,0 +1,68 @@
+#ifndef CONFIG_CODEC_H
+#define CONFIG_CODEC_H
+
+#include "configuration.h"
+
+/* Compact wire encoding of the node configuration
+
+   byte 0     CONFIG_CODEC_VERSION
+   then       fields, each a key byte (tag << 1 | wire type) and a value.
+              Wire type 0 is a varint, 1 a varint length and that many bytes.
+              Unknown tags are skipped, so fields can be added later.
+
+   A channel bank (ADC, UART, I2C) is one length-delimited field:
+              varint channel count, enabled bitmap (LSB first),
+              sensor types of the enabled channels as nibbles (low first),
+              intervals of the enabled channels as varints.
+
+   Readings, reading times and the Wi-Fi password are never encoded. */
+
+#define CONFIG_CODEC_VERSION 1
+#define CONFIG_ENCODED_MAX 192      // always fits one file chunk
+
+enum ConfigWireType { CFG_VARINT = 0, CFG_BYTES = 1 };
+
+enum ConfigTag {
+  CFG_DEVICE_NAME = 1,
+  CFG_WIFI_SSID = 2,
+  CFG_LORA_MODE = 3,
+  CFG_UTC_OFFSET = 4,   // zigzag
+  CFG_PAIRING_KEY = 5,
+  CFG_DUTY_CYCLE = 6,
+  CFG_RADIO_WAKE = 7,
+  CFG_ADC = 8,
+  CFG_UART = 9,
+  CFG_I2C = 10,
+  CFG_SAMPLE_TIME_MS = 11,
+};
+
+/* Config delta: a batch of ops, each a key byte (bank << 4 | field), for
+   channel banks a channel byte, then the value as a varint or, for text
+   fields, a varint length and the bytes. A batch is applied completely or
+   not at all. */
+
+#define CONFIG_DELTA_MAX_BYTES 232
+
+enum ConfigDeltaBank { DELTA_SYS = 0, DELTA_ADC = 1, DELTA_UART = 2, DELTA_I2C = 3 };
+enum ConfigChannelField { DELTA_ENABLED = 0, DELTA_INTERVAL = 1, DELTA_SENSOR = 2 };
+enum ConfigSysField {
+  DELTA_WIFI_SSID = 0,
+  DELTA_WIFI_PASSWORD = 1,
+  DELTA_DEVICE_NAME = 2,
+  DELTA_UTC_OFFSET = 3,   // zigzag
+  DELTA_LORA_MODE = 4,
+  DELTA_PAIRING_KEY = 5,
+  DELTA_DUTY_CYCLE = 6,
+  DELTA_RADIO_WAKE = 7,
+  DELTA_SAMPLE_TIME_MS = 8,
+};
+
+size_t encodeConfigOp(uint8_t* out, size_t size, uint8_t bank, uint8_t channel, uint8_t field,
+                      uint32_t value, const char* text = nullptr);
+bool applyConfigDelta(const uint8_t* ops, size_t len, uint8_t count, DataCollectionConfig* data, SystemConfig* sys);
+
+size_t encodeConfig(const DataCollectionConfig& data, const SystemConfig& sys, uint8_t* out, size_t size);
+bool decodeConfig(const uint8_t* in, size_t len, DataCollectionConfig* data, SystemConfig* sys);
+uint32_t configBytesHash(const uint8_t* data, size_t len);
+
+#endif
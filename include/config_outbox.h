@@ -0,0 +1,36 @@
+#ifndef CONFIG_OUTBOX_H
+#define CONFIG_OUTBOX_H
+
+#include "lora_init.h"
+
+/* Gateway outbox of config deltas for nodes. Ops queued for a node are
+   batched into one transaction until it is first sent, then retried with
+   backoff until the node acknowledges it. */
+
+#define CONFIG_OUTBOX_SIZE 16
+#define CONFIG_RETRY_MS 3000          // first retry, doubled after each attempt
+#define CONFIG_MAX_ATTEMPTS 6
+
+typedef struct ConfigTransaction {
+  bool used;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t txnId;
+  uint8_t opCount;
+  uint8_t len;
+  uint8_t ops[CONFIG_DELTA_MAX_BYTES];
+  uint8_t attempts;             // 0 = not sent yet, more ops may be added
+  unsigned long queuedAt;
+  unsigned long nextAttempt;    // millis()
+} ConfigTransaction;
+
+extern ConfigTransaction configOutbox[CONFIG_OUTBOX_SIZE];
+
+void config_outbox_init();
+size_t encodeCollectionOp(uint8_t* out, size_t size, const String& type, int index, const String& key, const String& value);
+size_t encodeSysOp(uint8_t* out, size_t size, const String& key, const String& value);
+bool configOutboxAdd(const uint8_t* mac, const uint8_t* ops, size_t len, uint8_t count);
+bool configOutboxPending(const uint8_t* mac);
+void service_config_outbox();
+void handle_config_ack(const uint8_t *incomingData);
+
+#endif
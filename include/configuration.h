@@ -1,3 +1,5 @@
+#ifndef CONFIGURATION_H
+#define CONFIGURATION_H
 
 /* Data Collection Configuration */
 
@@ -7,7 +9,7 @@
 #define UART_CHANNEL_COUNT 2
 #define I2C_CHANNEL_COUNT 2
 
-// size of the SystemConfig struct is 92 bytes.
+// size of the SystemConfig struct is 100 bytes.
 struct SystemConfig {
   char WIFI_SSID[32];       // Adjust size as needed
   char WIFI_PASSWORD[32];   // Adjust size as needed
@@ -15,6 +17,13 @@ struct SystemConfig {
   int LORA_MODE;
   int utcOffset;            // UTC offset in hours
   uint32_t PAIRING_KEY;
+  int DUTY_CYCLE_PERMILLE;  // LoRa transmit budget per rolling hour, 0 = no limit (915 MHz), 10 = 1 % (EU868)
+  int RADIO_WAKE_S;         // node: deep-sleep with a radio window every this many s, 0 = always on
+  char MQTT_HOST[40];       // gateway: broker the node data is published to, empty = no uplink
+  int MQTT_PORT;            // 0 = 1883
+  char MQTT_USER[24];       // empty = connect without credentials
+  char MQTT_PASSWORD[32];
+  int SAMPLE_TIME_MS;       // 1 = sample timestamps from the synced system clock with milliseconds, 0 = whole seconds
 };
 
 enum SensorType : uint8_t {
@@ -58,4 +67,9 @@ extern DataCollectionConfig dataConfig;
 void load_system_configuration();
 void update_system_configuration(String key, String value);
 void loadDataConfigFromPreferences();
-void updateDataCollectionConfiguration(String type, int index, String key, String value);
\ No newline at end of file
+void reload_configuration();
+void updateDataCollectionConfiguration(String type, int index, String key, String value);
+bool apply_config_delta(const uint8_t* ops, size_t len, uint8_t count);
+uint32_t config_hash(const DataCollectionConfig& data, const SystemConfig& sys);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CPU_LOAD_H
+#define CPU_LOAD_H
+
+#include <Arduino.h>
+
+/* Idle share of each core, sampled in the FreeRTOS tick hook: every tick
+   counts as idle when the core's idle task is the one running. Reported
+   per window of CPU_LOAD_WINDOW_TICKS. */
+
+#define CPU_LOAD_WINDOW_TICKS 1000      // one second at the default 1 kHz tick
+#define CPU_LOAD_CORES 2
+
+typedef struct CpuLoadStats {
+  uint16_t idlePermille[CPU_LOAD_CORES]; // last complete window
+  uint16_t minIdlePermille[CPU_LOAD_CORES];
+  uint32_t windows;
+} CpuLoadStats;
+
+extern CpuLoadStats cpuLoadStats;
+
+void cpu_load_init();
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef DATALOGGING_H
 #define DATALOGGING_H
 
+#include <Arduino.h>
+
 extern const char *filename;
 extern int LOG_INTERVAL;
 extern bool loggingPaused;
@@ -12,6 +14,13 @@ enum LogErrorCode {
   PAUSED
 };  // Add more error codes as needed
 
+enum SampleBank : uint8_t { BANK_ADC, BANK_UART, BANK_I2C };
+#define SAMPLE_BANKS 3
+
+String createFilename(String type, int channel);
+const char* sampleBankName(SampleBank bank);
+String formatSampleLine(SampleBank bank, int channel, String timestamp);
+void create_data_folders();
 void log_data_init();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef FILE_INTEGRITY_H
+#define FILE_INTEGRITY_H
+
+#include <Arduino.h>
+
+/* Block hashes of data files for the verification of synced files. Every
+   VERIFY_BLOCK_SIZE block has a CRC32. The CRC32s of complete blocks are
+   kept in a .blk file next to the data file, so a verification only reads
+   the blocks written since the last one. Node and gateway keep the same
+   cache, the gateway's SD writer drops the entries of blocks it rewrites. */
+
+#define BLOCK_CACHE_SUFFIX ".blk"
+
+void file_integrity_init();
+bool integritySpanHashes(const char* path, uint32_t size, uint32_t firstBlock, uint16_t span, uint8_t count,
+                         uint32_t* hashes, uint32_t* fileSize);
+void integrityForget(const char* path, uint32_t from);
+
+#endif
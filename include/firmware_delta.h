@@ -0,0 +1,57 @@
+#ifndef FIRMWARE_DELTA_H
+#define FIRMWARE_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Binary delta between two firmware images. A patch is a header with size
+   and CRC32 of both images, then ops: COPY takes a run of the base image at
+   any offset, ADD carries new bytes. Runs and offsets are varints. The
+   patch is applied as a stream, the base is read and the target written
+   through callbacks, so a node never holds more than one op's buffer. */
+
+#define DELTA_MAGIC 0x3150444C      // "LDP1"
+#define DELTA_OP_COPY 0x00
+#define DELTA_OP_ADD 0x01
+#define DELTA_MIN_MATCH 24          // shorter matches cost more as a COPY than as bytes
+#define DELTA_HASH_BITS 20          // encoder: base positions indexed, host only
+
+typedef struct DeltaHeader {
+  uint32_t magic;
+  uint32_t baseSize;
+  uint32_t baseCrc;
+  uint32_t targetSize;
+  uint32_t targetCrc;
+} DeltaHeader;
+
+typedef bool (*DeltaReadFn)(void* ctx, uint32_t offset, uint8_t* data, size_t len);
+typedef bool (*DeltaWriteFn)(void* ctx, const uint8_t* data, size_t len);
+
+enum DeltaState {DELTA_HEADER, DELTA_OP, DELTA_ARG1, DELTA_ARG2, DELTA_BYTES, DELTA_DONE, DELTA_ERROR};
+
+typedef struct DeltaPatcher {
+  DeltaHeader header;
+  uint8_t state;
+  uint8_t op;
+  uint8_t shift;            // varint being read
+  uint32_t value;
+  uint32_t copyFrom;
+  uint32_t remaining;       // ADD bytes still to come
+  uint32_t headerBytes;
+  uint32_t written;
+  uint32_t crc;             // of the target written so far
+  DeltaReadFn readBase;
+  DeltaWriteFn write;
+  void* ctx;
+} DeltaPatcher;
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len);
+
+void deltaPatchBegin(DeltaPatcher* patcher, DeltaReadFn readBase, DeltaWriteFn write, void* ctx);
+bool deltaPatchFeed(DeltaPatcher* patcher, const uint8_t* data, size_t len);
+bool deltaPatchEnd(const DeltaPatcher* patcher);
+
+size_t deltaEncode(const uint8_t* base, size_t baseLen, const uint8_t* target, size_t targetLen,
+                   uint8_t* patch, size_t patchSize);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef LORA_AIRTIME_H
+#define LORA_AIRTIME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* LoRa time on air (Semtech SX1276 datasheet, section 4.1.1.7) */
+
+#define LORA_PREAMBLE_SYMBOLS 8   // library default
+#define LORA_BANDWIDTH_DEFAULT 125000
+#define LORA_CODING_RATE_DEFAULT 5 // 4/5
+
+uint32_t loraSymbolUs(uint8_t spreadingFactor, uint32_t bandwidthHz);
+uint32_t loraAirtimeUs(size_t payloadBytes, uint8_t spreadingFactor,
+                       uint32_t bandwidthHz = LORA_BANDWIDTH_DEFAULT,
+                       uint8_t codingRate = LORA_CODING_RATE_DEFAULT);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef LORA_CHANNELS_H
+#define LORA_CHANNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lora_scheduler.h"
+
+/* Frequency plan. Control traffic (beacons, pairing, heartbeats, time sync,
+   config updates between cycles) stays on the home channel, which every
+   device listens on outside its slot. Slots run on bulk sub-channels above
+   it: the node tunes to its slot's channel at the slot start and back home
+   once it has sent POLL_COMPLETE, the gateway follows the schedule. Slots
+   of relayed peers stay home, the relay listens there. Sub-channels are
+   ranked by the chunk loss the nodes report on them. */
+
+#define LORA_HOME_FREQUENCY_HZ 915000000UL
+#define LORA_CHANNEL_SPACING_HZ 200000UL  // 125 kHz signal plus guard band
+#define LORA_SUB_CHANNELS 4               // bulk channels above the home channel
+#define LORA_CHANNELS (1 + LORA_SUB_CHANNELS)
+#define LORA_HOME_CHANNEL 0
+#define LORA_SYNC_WORD 0xF3
+#define CHANNEL_SETTLE_MS 20              // a node's first frame on a sub-channel waits for the gateway to retune
+#define GATEWAY_RECEIVERS 1               // slot lanes in parallel, one per demodulator; the SX1276 has one
+
+typedef struct ChannelStats {
+  uint32_t slots;
+  uint32_t completed;         // slots that ended with POLL_COMPLETE
+  uint32_t chunksSent;
+  uint32_t chunksLost;
+  uint16_t lossPermille;      // moving average, ranks the sub-channels
+} ChannelStats;
+
+uint32_t channelFrequencyHz(uint8_t channel);
+void recordChannelLoss(ChannelStats* stats, uint16_t sent, uint16_t lost);
+void assignSlotChannels(SlotAssignment* slots, size_t count, const ChannelStats* stats, uint16_t rotation);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LORA_CLOCKMODEL_H
+#define LORA_CLOCKMODEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Gateway model of each node's clock: its offset from network time and its
+   skew, as line segments. A segment ends where the node corrected its clock
+   (a two-way exchange the gateway answered, or a jump in the offset), so
+   samples logged before the correction are taken back with the line that was
+   valid when they were taken. Samples come from TIME_REQUEST and from the
+   send time nodes put in POLL_COMPLETE and HEARTBEAT, of peers in direct
+   range only: relayed frames wait in the relay queues for an unknown time. */
+
+#define CLOCK_SEGMENTS 2                  // the current line and the one before the node's last correction
+#define CLOCK_JUMP_US 500000              // residuals this large start a new segment, the node stepped its clock
+#define CLOCK_SKEW_SPAN_US 60000000LL     // skew is only updated from samples at least a minute apart
+#define CLOCK_OFFSET_GAIN 4               // offset follows a quarter of each residual
+#define CLOCK_SKEW_GAIN 8                 // skew an eighth of the rate the residual implies
+#define CLOCK_SKEW_MAX_PPB 500000         // 500 ppm, beyond any crystal
+#define CLOCK_STAMP_LEN 24                // "YYYY_MM_DD_HH_MM_SS.mmm" and the terminator
+
+typedef struct ClockSegment {
+  int64_t startUs;      // network time the segment begins at, 0 = unused
+  int64_t anchorUs;     // network time offsetUs applies at
+  int64_t offsetUs;     // node minus network time
+  int32_t skewPpb;      // node clock rate error
+} ClockSegment;
+
+typedef struct PeerClock {
+  ClockSegment segments[CLOCK_SEGMENTS]; // newest first
+  uint16_t samples;       // in the newest segment
+  uint16_t corrections;   // segments started since boot
+  int32_t lastResidualUs; // last sample minus the model
+} PeerClock;
+
+void clockModelSample(PeerClock* clock, int64_t networkUs, int64_t offsetUs);
+void clockModelCorrected(PeerClock* clock, int64_t networkUs);
+bool clockModelOffset(const PeerClock* clock, int64_t nodeUs, int64_t* offsetUs);
+size_t clockModelCorrectStamp(const PeerClock* clock, const char* stamp, char* line, size_t size);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef LORA_DUTYCYCLE_H
+#define LORA_DUTYCYCLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Airtime accounting and duty-cycle budget. Every frame sent or received is
+   timed with the modem settings in loraModem and summed since boot and over
+   a rolling hour, per message type and per peer. Bulk frames are held back
+   when the hour's transmit airtime nears the budget in systemConfig. */
+
+#define AIRTIME_BUCKETS 7               // 10 min buckets, the oldest one partly counted
+#define AIRTIME_BUCKET_MS 600000UL
+#define AIRTIME_HOUR_MS 3600000UL
+#define AIRTIME_MSG_TYPES 32            // per message type counters, by msgType
+#define DUTY_CYCLE_BULK_SHARE 90        // percent of the budget bulk frames may use, the rest is kept for control
+
+typedef struct LoraModem {
+  uint8_t spreadingFactor;
+  uint32_t bandwidthHz;
+  uint8_t codingRate;       // denominator of the 4/x coding rate
+} LoraModem;
+
+typedef struct AirtimeTypeStats {
+  uint32_t txFrames;
+  uint32_t rxFrames;
+  uint64_t txUs;
+  uint64_t rxUs;
+  uint32_t txHourUs[AIRTIME_BUCKETS];
+} AirtimeTypeStats;
+
+typedef struct AirtimeStats {
+  uint64_t txUs;              // since boot
+  uint64_t rxUs;
+  uint32_t txHourUs[AIRTIME_BUCKETS];
+  uint32_t rxHourUs[AIRTIME_BUCKETS];
+  uint8_t bucket;             // bucket being filled
+  unsigned long bucketStart;  // millis() it was started
+  uint32_t bulkDeferred;      // bulk sends put off to stay in the budget
+  uint32_t overBudget;        // control frames sent with the budget used up
+  AirtimeTypeStats types[AIRTIME_MSG_TYPES];
+} AirtimeStats;
+
+enum TxClass { TX_CONTROL, TX_BULK };
+
+extern LoraModem loraModem;
+extern AirtimeStats airtimeStats;
+
+void airtime_init();
+uint32_t frameAirtimeUs(size_t bytes);
+TxClass txClassOf(uint8_t msgType);
+void airtimeRecordTx(const uint8_t* data, size_t size);
+void airtimeRecordRx(const uint8_t* data, size_t size);
+uint32_t rollingHourUs(const uint32_t buckets[AIRTIME_BUCKETS]);
+uint32_t dutyCycleBudgetUs();
+bool airtimeBulkAllowed(uint32_t airtimeUs);
+
+#endif
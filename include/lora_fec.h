@@ -0,0 +1,22 @@
+#ifndef LORA_FEC_H
+#define LORA_FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Systematic Reed-Solomon erasure code over GF(256) for file sessions.
+   A group of k data chunks is followed by m parity chunks, any k of the
+   k + m rebuild the group. Parity rows come from a Cauchy matrix, so every
+   k x k submatrix is invertible. */
+
+#define FEC_GROUP_SIZE 8          // data chunks per group
+#define FEC_MAX_PARITY 4          // parity chunks per group at the highest loss
+#define FEC_MIN_LOSS_PERMILLE 5   // below 0.5 % loss FEC is off and chunks are ACKed one by one
+#define FEC_TARGET_FAILURE 0.1    // a failed group only costs resending its missing chunks, see the fec benchmark
+
+void fecEncode(const uint8_t* const* data, uint8_t k, uint8_t* const* parity, uint8_t m, size_t len);
+bool fecDecode(uint8_t* const* blocks, const bool* present, uint8_t k, uint8_t m, size_t len);
+uint8_t fecParityForLoss(uint8_t k, uint16_t lossPermille);
+uint16_t fecLossAverage(uint16_t lossPermille, uint16_t sent, uint16_t lost);
+
+#endif
@@ -1,14 +1,120 @@
+#ifndef LORA_FILE_TRANSFER_H
+#define LORA_FILE_TRANSFER_H
+
 #include "lora_init.h"
+#include "sd_writer.h"
 
 #define MAX_ATTEMPS 1 // only attempt at gateway's request
 
+#define MAX_SESSIONS 8            // senders uploading at once, a sender has one session at a time
+#define SESSION_TIMEOUT_MS 60000  // idle session is closed, longer than a slot
+#define SAMPLE_LINE_WINDOW 128   // bytes searched for the start of the oldest unsynced sample line
+#define STAMP_FILE_SUFFIX ".time" // corrected sample timestamps next to each received data file
+
+#define VERIFY_INTERVAL_BYTES 65536 // synced bytes after which a file is verified again
+#define VERIFY_STEP_BYTES 131072  // new bytes per verification, a first one of a large file takes several slots
+#define VERIFY_MAX_REQUESTS 8     // FILE_VERIFY frames per file and slot, unresolved spans are resent whole
+#define VERIFY_REPAIR_RANGES 8    // ranges resent in place, more moves the sync back to the first one
+#define VERIFY_NODES_PER_CYCLE 4  // slots per poll cycle the gateway sets SLOT_FLAG_VERIFY in
+
 enum LoRaFileTransferMode { SEND, SYNC };
 
+// .meta of a synced data file on the node
+typedef struct SyncMeta {
+  uint32_t sent;              // acknowledged by the gateway up to here
+  uint32_t verified;          // found equal to the gateway's copy up to here
+  uint16_t generation;        // verifyGeneration of that comparison
+} SyncMeta;
+
+// One upload, keyed by node MAC and session id. A node sends one file at a
+// time, so its next session takes over the entry of the one before.
+typedef struct TransferSession {
+  bool active;
+  uint16_t previousSessionId; // session this entry had before, its late duplicates are ACKed with previousEnd
+  uint32_t previousEnd;
+  bool truncate;              // FILE_ENTIRE, the first write recreates the file
+  bool positioned;            // FILE_FLAG_AT, written in place from start
+  bool repair;                // FILE_FLAG_REPAIR
+  uint32_t start;             // file offset of session offset 0
+  uint32_t knownEnd;          // size of the file when the session opened, timestamps are only written past it
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t sessionId;
+  char path[SD_WRITER_PATH_LEN]; // destination, opened and written by the SD writer task
+  SessionReceiver rx;         // expected offset, reorder buffer and FEC group
+  unsigned long startedAt;
+  unsigned long lastActivity;
+  uint16_t ownerId;           // node id of the peer the data belongs to
+  char stamp[CLOCK_STAMP_LEN]; // start of the line being received, its sample timestamp
+  uint8_t stampLen;
+  bool stampsWritten;         // timestamp file written to by this session
+} TransferSession;
+
+typedef struct TransferStats {
+  uint32_t sessionsOpened;
+  uint32_t sessionsClosed;
+  SessionCounters receive;
+  uint32_t stampsCorrected;   // sample timestamps written with their correction
+  uint32_t stampsDropped;     // not written, no free writer buffer
+} TransferStats;
+
+// File verification, node side: requests sent and what they found,
+// receiver side: requests answered
+typedef struct VerifyStats {
+  uint32_t requests;
+  uint32_t timeouts;
+  uint32_t filesVerified;     // synced part compared up to the end of the step
+  uint32_t spansDiffering;
+  uint32_t repairs;           // ranges resent in place
+  uint32_t repairBytes;
+  uint32_t rewinds;           // sync moved back to where the gateway's copy stops matching
+  uint32_t rewindBytes;
+  uint32_t answered;
+} VerifyStats;
+
+// Sender side: TxDone of the chunk or group to its ACK taken off the queue,
+// the gateway's turnaround and ACK airtime included
+typedef struct AckRttStats {
+  uint32_t acks;
+  uint32_t timeouts;        // chunk or its ACK lost, mostly to a collision
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint64_t totalUs;
+} AckRttStats;
+
+extern TransferSession sessions[MAX_SESSIONS];
+extern TransferStats transferStats;
+extern AckRttStats ackRttStats;
+extern VerifyStats verifyStats;
+
+extern unsigned long transferDeadline;
+extern uint8_t fecParity;
+extern uint16_t chunksSent;
+extern uint16_t chunksLost;
+
 // Sender Functions
-bool sendLoRaFile(const char* filename, LoRaFileTransferMode mode = SEND);
+void file_transfer_init();
+void handle_file_ack(const uint8_t *incomingData);
+bool transferDeadlinePassed();
+unsigned long ackTimeoutMs();
+void beginSlotTransfer(unsigned long slotEndAt);
+void endSlotTransfer();
+uint32_t getUnsyncedBytes(const char* filename, time_t* oldestSample = nullptr);
+bool sendLoRaFile(const char* filename, LoRaFileTransferMode mode = SEND, uint16_t originId = 0,
+                 const char* wireName = nullptr);
 bool sendLoRaData(uint8_t *data, size_t size, const char *filename);
 bool sendChunk(file_body_message file_body);
+bool sendGroup(file_body_message& file_body, const uint8_t* data, size_t len, uint8_t parityCount);
+bool verifyDue(const SyncMeta& meta);
+void verifySyncedFile(const char* filename, uint16_t originId, const char* wireName, SyncMeta* meta);
+void handle_file_verify_result(const uint8_t *incomingData);
+void fileVerifyRestart();
 
 // Receiver Functions
 void handle_file_body(const uint8_t *incomingData);
-void handle_file_entire(const uint8_t *incomingData);
\ No newline at end of file
+void handle_file_entire(const uint8_t *incomingData);
+void handle_file_parity(const uint8_t *incomingData);
+void handle_file_verify(const uint8_t *incomingData, int len);
+void answer_file_verify(const char* path, const file_verify_message& msg);
+void closeSenderSessions(const uint8_t* mac);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef LORA_FIRMWARE_H
+#define LORA_FIRMWARE_H
+
+#include "lora_init.h"
+
+/* Firmware over LoRa. The gateway runs one campaign at a time: it repeats a
+   FW_OFFER and broadcasts the payload in FW_CHUNKs between poll cycles, so
+   every target stores the same transmission. Targets report what they miss
+   with FW_STATUS in their slot and the gateway sends those chunks again.
+   The payload is the new image, or a patch made with `program delta`
+   against the image the nodes run. A node stages the payload on its SD
+   card, checks it, writes the image to the inactive OTA partition and
+   restarts once it reported it. */
+
+#define FW_MAX_CHUNKS 6554            // a full 0x140000 app partition
+#define FW_BURST_CHUNKS 16            // chunks per burst between cycles, each one within the duty-cycle budget
+#define FW_OFFER_REPEAT_MS 30000      // everything sent: only the offer, for nodes that missed it
+#define FW_CAMPAIGN_TIMEOUT_MS 259200000UL // 72 h, a full image at 1 % duty cycle takes most of two days
+#define FW_OFFER_HEARD_MS 600000      // node: reports only while the offer is still repeated
+#define FW_MAP_SAVE_CHUNKS 64         // node: received map written to SD every this many chunks
+#define FW_STAGE_PATH "/firmware/incoming.bin"
+#define FW_MAP_PATH "/firmware/incoming.map"
+
+// Gateway side
+typedef struct FirmwareTarget {
+  uint16_t nodeId;
+  uint8_t state;            // FirmwareState from its last FW_STATUS, FW_IDLE = none yet
+  uint16_t received;
+  unsigned long lastStatus; // millis()
+} FirmwareTarget;
+
+typedef struct FirmwareCampaign {
+  bool active;
+  char path[64];
+  uint8_t kind;
+  uint16_t imageId;
+  uint32_t payloadSize;
+  uint32_t payloadCrc;
+  uint32_t baseSize;
+  uint32_t baseCrc;
+  uint32_t targetSize;
+  uint32_t targetCrc;
+  uint16_t chunkCount;
+  uint16_t sentUpTo;        // first pass, chunks below were sent once
+  uint16_t repairPending;   // chunks marked in the repair map
+  uint8_t targetCount;
+  FirmwareTarget targets[FW_OFFER_TARGETS];
+  unsigned long startedAt;
+  unsigned long nextBurst;  // millis()
+  uint32_t offersSent;
+  uint32_t chunksSent;      // first pass and repairs
+  uint32_t repairsSent;
+  uint32_t nacks;           // FW_STATUS frames with missing ranges
+  uint64_t airtimeUs;
+} FirmwareCampaign;
+
+extern FirmwareCampaign firmwareCampaign;
+extern const char* firmwareStateNames[];
+
+void firmware_gateway_init();
+bool firmwareCampaignStart(const char* path, const uint16_t* nodeIds, size_t count);
+void firmwareCampaignCancel();
+void service_firmware_campaign();
+void handle_firmware_status(const uint8_t *incomingData, int len);
+
+// Node side
+void firmware_node_init();
+void handle_firmware_offer(const uint8_t *incomingData, int len);
+void handle_firmware_chunk(const uint8_t *incomingData, int len);
+void send_firmware_status();
+void firmware_restart_if_reported();
+
+#endif
@@ -1,3 +1,30 @@
+#ifndef LORA_GATEWAY_H
+#define LORA_GATEWAY_H
+
 #include "lora_init.h"
+#include "lora_channels.h"
+
+typedef struct PollCycleStats {
+  uint16_t cycleId;
+  uint16_t slots;           // slots in the last cycle
+  uint16_t completed;       // slots closed with POLL_COMPLETE
+  uint32_t boundMs;         // planned cycle length
+  uint32_t cycleMs;         // measured cycle time
+  uint32_t liveCycleMs;     // measured cycle time minus slots of unresponsive peers
+  uint32_t cycles;
+  uint64_t totalCycleMs;
+  uint64_t totalLiveCycleMs;
+  uint16_t controlFrames;   // gateway control frames for the last cycle, the beacon pages
+  uint16_t controlBytes;
+  uint32_t controlAirtimeUs;
+  uint64_t totalControlAirtimeUs;
+} PollCycleStats;
+
+extern PollCycleStats pollCycleStats;
+extern ChannelStats channelStats[LORA_CHANNELS];
+
+void lora_gateway_init();
+void create_node_folders(const char* deviceName);
+bool wake_boundary_near(uint32_t ms);
 
-void lora_gateway_init();
\ No newline at end of file
+#endif
\ No newline at end of file
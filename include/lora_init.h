@@ -4,11 +4,13 @@
 #include "utils.h"
 #include <LoRa.h>
 #include "lora_peer.h"
+#include "config_codec.h"
+#include "lora_fec.h"
+#include "lora_session.h"
 
 #define LORA_SLAVE 0
 #define LORA_GATEWAY 1
-#define CHUNK_SIZE 200  // Size of each chunk
-#define ACK_TIMEOUT 5000  // Timeout for ACK in milliseconds
+#define LORA_RELAY 2    // node that also stores and forwards for nodes out of gateway range
 #define MAX_DEVICE_NAME_LEN 10  
 #define MAX_FILENAME_LEN 20
 #define MAX_JSON_LEN_1 20
@@ -19,11 +21,66 @@ typedef struct file_body_message {
   uint8_t msgType;
   uint8_t mac[MAC_ADDR_LENGTH];
   char filename[MAX_FILENAME_LEN];
-  uint32_t filesize;
   uint8_t len;
+  uint16_t sessionId;   // picked by the node for each transfer, never 0
+  uint8_t flags;        // FILE_FLAG_*
+  uint16_t originId;    // node the data belongs to when a relay forwards it, 0 = the sender
+  uint32_t start;       // FILE_FLAG_AT: file offset of session offset 0, changes with each range of a repair
+  uint32_t offset;      // of this chunk from the start of the session
   uint8_t data[CHUNK_SIZE];
 } file_body_message;
 
+#define FILE_FLAG_GROUPED 0x01 // sent in an FEC group burst, the gateway ACKs the group
+#define FILE_FLAG_AT 0x02      // written in place from start, not appended
+#define FILE_FLAG_REPAIR 0x04  // resends a range the file verification found different
+
+typedef struct file_parity_message { // FEC parity of a group of file chunks
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint8_t index;        // parity row, 0..parity - 1
+  uint8_t chunks;       // data chunks in the group
+  uint8_t parity;       // parity chunks sent for the group
+  uint16_t sessionId;
+  uint16_t groupBytes;  // data bytes in the group, the last chunk may be short
+  uint16_t originId;    // as in file_body_message
+  uint32_t start;       // as in file_body_message
+  uint32_t groupOffset; // session offset of the first chunk, a multiple of FEC_GROUP_SIZE * CHUNK_SIZE
+  uint8_t data[CHUNK_SIZE];
+} file_parity_message;
+
+typedef struct file_ack_message { // ACK or REJ for a file chunk
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t sessionId;
+  uint32_t nextOffset;  // all session data below this offset is queued on the gateway
+} file_ack_message;
+
+/* File verification: CRC32 of every VERIFY_BLOCK_SIZE block of a synced
+   file, compared span by span between the node and the gateway's copy */
+#define VERIFY_BLOCK_SIZE 4096
+#define VERIFY_HASHES 32
+
+typedef struct file_verify_message { // node to gateway, in the node's slot
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  char filename[MAX_FILENAME_LEN];
+  uint16_t originId;    // as in file_body_message
+  uint16_t verifyId;    // repeated in the result
+  uint32_t size;        // bytes compared, the synced part of the node's file
+  uint32_t firstBlock;
+  uint16_t span;        // blocks per hash, the last one is cut at size
+  uint8_t count;
+  uint32_t hashes[VERIFY_HASHES]; // CRC32 over the CRC32s of the span's blocks
+} file_verify_message;
+
+typedef struct file_verify_result_message {
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH]; // of the node that asked
+  uint16_t verifyId;
+  uint32_t size;        // of the gateway's copy
+  uint32_t mismatch;    // bit i set: hash i differs
+} file_verify_result_message;
+
 typedef struct signal {
   uint8_t msgType;
   uint8_t mac[MAC_ADDR_LENGTH];
@@ -45,16 +102,148 @@ typedef struct collectionconfig_message {
   char value[MAX_JSON_LEN_2];
 } collectionconfig_message;
 
-typedef struct time_sync_message {
+typedef struct config_delta_message { // batch of config ops, applied atomically
   uint8_t msgType;
-  uint32_t pairingKey; // key for network
-  uint16_t year;
-  uint8_t month;
-  uint8_t day;
-  uint8_t hour;
-  uint8_t minute;
-  uint8_t second;
-} time_sync_message;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t txnId;       // repeated on retries, the node applies each id once
+  uint8_t opCount;
+  uint8_t len;          // bytes used in ops
+  uint8_t ops[CONFIG_DELTA_MAX_BYTES];
+} config_delta_message;
+
+typedef struct config_ack_message {
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t txnId;
+  uint8_t status;       // CONFIG_APPLIED or CONFIG_REJECTED
+  uint32_t configHash;  // node config after the transaction
+} config_ack_message;
+
+enum ConfigAckStatus {CONFIG_APPLIED, CONFIG_REJECTED};
+
+typedef struct time_request_message { // node to gateway (or its relay), in the node's slot
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  int64_t t1;           // node network time when handed to the radio
+} time_request_message;
+
+typedef struct time_response_message {
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH]; // the requesting node
+  int64_t t1;           // echoed
+  int64_t t2;           // server network time at RxDone of the request
+  int64_t t3;           // server network time when the response is handed to the radio
+} time_response_message;
+
+/* Slotted Polling */
+#define MAX_BEACON_SLOTS 18     // keeps a full page within one 250 byte frame
+#define BEACON_PAGE_GAP_MS 500  // spacing between beacon pages, longer than one page airtime
+#define BEACON_GUARD_MS 500     // between the last beacon page and the first slot
+#define HEARTBEAT_INTERVAL 180000 // node reports itself after this long without a slot
+#define REPAIR_INTERVAL 720000    // no slot for this long: route lost, pair again through whoever hears us
+
+typedef struct beacon_slot {
+  uint16_t nodeId;    // short id assigned at pairing
+  uint8_t flags;
+  uint8_t fecParity;  // parity chunks per file group, 0 = no FEC
+  uint16_t offset;    // in SLOT_UNIT_MS from the start of the cycle
+  uint16_t length;    // in SLOT_UNIT_MS
+  uint32_t configHash; // hash of the node's configuration cached on the gateway, 0 = none
+} beacon_slot;
+
+typedef struct poll_beacon_message { // this is a broadcast message
+  uint8_t msgType;
+  uint8_t page;
+  uint8_t pageCount;
+  uint8_t slotCount;      // entries used in this page
+  uint32_t pairingKey;    // key for network
+  uint16_t cycleId;
+  uint16_t startDelay;    // ms from this page to the first slot
+  uint32_t cycleLength;   // ms, bound for the whole cycle
+  int64_t networkTime;    // sender network time when handed to the radio, 0 = clock not set
+  beacon_slot slots[MAX_BEACON_SLOTS];
+} poll_beacon_message;
+
+typedef struct poll_complete_message { // also sent as HEARTBEAT
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint32_t pendingBytes;  // unsynced bytes left on the node
+  uint32_t configHash;    // config_hash() of the node's current configuration
+  uint32_t oldestUnsynced; // timestamp of the oldest unsynced sample, 0 = none
+  uint16_t chunksSent;    // file chunks sent one by one since the last status
+  uint16_t chunksLost;    // of those, chunks whose ACK timed out
+  int64_t sentAt;         // node network time when sent, 0 = clock not set
+  uint16_t wakePeriodS;   // deep-sleep node: radio window every this many s, 0 = always listening
+  uint16_t avgAwakeMs;    // deep-sleep node: mean awake time per wake
+  uint16_t energyMwhDay;  // deep-sleep node: estimated daily energy
+} poll_complete_message;
+
+/* Multi-hop relay */
+#define RELAY_HEADER_SIZE offsetof(relay_message, payload)
+#define RELAY_PAYLOAD_MAX (250 - 13 - 2 * RELAY_MAX_HOPS) // receive buffer minus the header
+#define RELAY_FLAG_DOWNLINK 0x01     // from the gateway towards a node
+
+// Control frames to and from nodes behind relays, file data is stored and
+// forwarded per hop instead. Uplink frames collect the relays they pass,
+// downlink frames carry the route the gateway picked at pairing.
+typedef struct relay_message {
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH]; // uplink: relay sending this hop, downlink: relay receiving it
+  uint8_t flags;
+  uint8_t hops;                 // relays in path
+  int8_t rssi;                  // uplink: weakest link so far in dBm
+  uint16_t delayMs;             // uplink: time spent queued on relays so far
+  uint16_t path[RELAY_MAX_HOPS]; // relay node ids, the one next to the node first
+  uint8_t len;
+  uint8_t payload[RELAY_PAYLOAD_MAX];
+} relay_message;
+
+/* Firmware distribution */
+#define FW_CHUNK_SIZE 200       // payload bytes per FW_CHUNK
+#define FW_OFFER_TARGETS 32     // nodes one campaign updates
+#define FW_NACK_RANGES 16       // missing chunk ranges per FW_STATUS
+
+enum FirmwareKind {FW_KIND_IMAGE, FW_KIND_DELTA};
+enum FirmwareState {FW_IDLE, FW_RECEIVING, FW_VERIFYING, FW_VERIFIED, FW_FAILED, FW_CURRENT, FW_NOT_APPLICABLE};
+
+typedef struct fw_offer_message { // this is a broadcast message, repeated through the campaign
+  uint8_t msgType;
+  uint8_t kind;           // FW_KIND_*: the payload is the image or a patch against the base image
+  uint16_t imageId;
+  uint32_t pairingKey;    // key for network
+  uint32_t payloadSize;
+  uint32_t payloadCrc;
+  uint32_t baseSize;      // delta only, image the patch applies to
+  uint32_t baseCrc;
+  uint32_t targetSize;    // image once installed
+  uint32_t targetCrc;
+  uint16_t sentUpTo;      // chunks sent at least once, only those are reported missing
+  uint8_t targetCount;
+  uint16_t targets[FW_OFFER_TARGETS]; // node ids taking part
+} fw_offer_message;
+
+typedef struct fw_chunk_message { // broadcast, every target takes it
+  uint8_t msgType;
+  uint8_t len;
+  uint16_t imageId;
+  uint16_t index;         // offset / FW_CHUNK_SIZE
+  uint8_t data[FW_CHUNK_SIZE];
+} fw_chunk_message;
+
+typedef struct fw_range {
+  uint16_t first;
+  uint16_t count;
+} fw_range;
+
+typedef struct fw_status_message { // node to gateway, in the node's slot
+  uint8_t msgType;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint8_t state;          // FW_* state of the offered image
+  uint16_t imageId;
+  uint16_t received;      // chunks stored
+  uint8_t rangeCount;
+  fw_range missing[FW_NACK_RANGES]; // first ranges of chunks below sentUpTo not received
+} fw_status_message;
 
 typedef struct struct_pairing { // this is a broadcast message
   uint8_t msgType;
@@ -62,24 +251,31 @@ typedef struct struct_pairing { // this is a broadcast message
   uint8_t mac_master[MAC_ADDR_LENGTH]; // identity for master
   uint32_t pairingKey; // key for network
   char deviceName[MAX_DEVICE_NAME_LEN];
+  uint16_t nodeId; // assigned by the gateway in the pairing response, 0 in the request
 } struct_pairing;
 
 enum PairingStatus {NOT_PAIRED, PAIR_REQUEST, PAIR_REQUESTED, PAIR_PAIRED,};
+// TIME_SYNC, POLL_DATA and POLL_CONFIG are no longer sent, the poll beacon
+// carries time and config hashes; they keep their place in the numbering
 enum MessageType {PAIRING, DATA_VM, DATA_ADC, DATA_I2C, DATA_SAA, FILE_META, \
                   FILE_BODY, FILE_ENTIRE, ACK, REJ, TIMEOUT, TIME_SYNC, 
-                  POLL_DATA, POLL_CONFIG, POLL_COMPLETE, APPEND, DATA_CONFIG, SYS_CONFIG};
+                  POLL_DATA, POLL_CONFIG, POLL_COMPLETE, APPEND, DATA_CONFIG, SYS_CONFIG,
+                  POLL_BEACON, HEARTBEAT, CONFIG_DELTA, CONFIG_ACK, FILE_PARITY, RELAY,
+                  TIME_REQUEST, TIME_RESPONSE, BUNDLE, FW_OFFER, FW_CHUNK, FW_STATUS,
+                  FILE_VERIFY, FILE_VERIFY_RESULT};
 
 extern uint8_t mac_buffer[6];
 extern uint8_t MAC_ADDRESS_STA[6];
-extern int ack_count;
-extern int rej_count;
 extern SemaphoreHandle_t xMutex_DataPoll; // mutex for LoRa hardware usage
+extern volatile int64_t lastRxAtUs;       // esp_timer time of the RxDone of the frame being handled
+extern int lastRxRssi;                    // RSSI of the frame being handled
 
 void LoRa_rxMode();
 void LoRa_txMode();
 void LoRa_sendMessage(String message);
 void onReceive(int packetSize);
 void onTxDone();
+void onCadDone(boolean detected);
 boolean runEvery(unsigned long interval);
 void loopFunction(void *parameter);
 void handleReceivedData(void *parameter);
@@ -3,20 +3,51 @@
 
 #include <Arduino.h>
 #include <time.h>
+#include "lora_dutycycle.h"
+#include "lora_clockmodel.h"
 
-#define MAX_PEERS 30
+#define MAX_PEERS 300
+#define PEER_INDEX_CAPACITY 512   // hash buckets per index, power of two above 1.5 * MAX_PEERS
 #define MAC_ADDR_LENGTH 6
 
 #define DEVICE_NAME_MAX_LENGTH 32
+#define PEER_PRIORITY_DEFAULT 1
+#define PEER_PRIORITY_MAX 10
+#define PEER_DATA_RATE_DEFAULT 7  // spreading factor, the radio runs at SF7 (loraModem)
+#define RELAY_MAX_HOPS 3          // relays between the gateway and a node
 
 enum PeerStatus {ONLINE, OFFLINE, UNKNOWN};
 
 typedef struct Peer {
   uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t nodeId;         // short id used on the wire instead of the MAC, never 0
   char deviceName[DEVICE_NAME_MAX_LENGTH];
   struct tm lastCommTime;
   PeerStatus status;
   int SignalStrength;
+  uint32_t pendingBytes;   // backlog reported in the last POLL_COMPLETE
+  time_t oldestUnsynced;   // timestamp of the oldest unsynced sample on the node, 0 = none
+  uint8_t priority;        // poll priority, PEER_PRIORITY_DEFAULT..PEER_PRIORITY_MAX
+  unsigned long lastSlotTime; // millis() of the last cycle this peer had a slot in
+  uint8_t missedPolls;     // slots in a row without POLL_COMPLETE
+  unsigned long backoffUntil; // millis() before which the peer gets no slot, 0 = none
+  uint8_t dataRate;        // assigned spreading factor
+  uint32_t configHash;     // hash of the config cached under /node/<name>/, 0 = not read yet
+  uint32_t reportedConfigHash; // hash the node advertised in its last status, 0 = none
+  uint16_t lossPermille;   // smoothed file chunk loss rate
+  uint8_t fecParity;       // parity chunks per FEC group assigned from lossPermille
+  uint8_t routeHops;       // relays between this device and the peer, 0 = in direct range
+  uint16_t route[RELAY_MAX_HOPS]; // their node ids, the one next to the peer first
+  int8_t routeRssi;        // weakest link of the route in dBm, 0 = route not known yet
+  uint32_t airtimeHourUs[AIRTIME_BUCKETS]; // airtime of the frames heard from the peer, its duty cycle
+  uint32_t airtimeToPeerMs; // airtime of the frames sent to the peer since boot
+  PeerClock clock;         // offset and skew of the node clock, corrects its sample timestamps
+  uint16_t wakePeriodS;    // deep-sleep node: listens only at multiples of this in network time, 0 = always
+  uint16_t avgAwakeMs;     // deep-sleep node: mean awake time per wake, as reported
+  uint16_t energyMwhDay;   // deep-sleep node: estimated daily energy, as reported
+  unsigned long listenUntil; // millis() a deep-sleep node stays up after its cycle for config deltas
+  unsigned long lastPersisted; // millis() of the last peer log record for this peer
+  bool persistPending;     // a peer log record is due, written by the SD writer task
 }Peer;
 
 extern Peer peers[MAX_PEERS];
@@ -29,9 +60,28 @@ bool checkPeerGateway(const uint8_t peer_addr[MAC_ADDR_LENGTH]);
 bool compareMacAddress(const uint8_t mac1[MAC_ADDR_LENGTH], const uint8_t mac2[MAC_ADDR_LENGTH]);
 void savePeersToSD();
 void loadPeersFromSD();
+void schedulePersistPeer(int index);
+void persistPendingPeers();
 String getDeviceNameByMac(const uint8_t peer_addr[MAC_ADDR_LENGTH]);
 bool isDeviceNameValid(String deviceName);
 bool getMacByDeviceName(const String& deviceName, uint8_t* mac);
 int getIndexByMac(const uint8_t peer_addr[MAC_ADDR_LENGTH]);
+int getIndexByDeviceName(const String& deviceName);
+int getIndexByNodeId(uint16_t nodeId);
+void rebuildPeerIndex();
+void markPeerAlive(int index, int rssi);
+void markPeerMissed(int index);
+void recordPeerLoss(int index, uint16_t sent, uint16_t lost);
+
+typedef struct PeerLookupBenchmark {
+  size_t peers;
+  uint32_t lookups;
+  uint32_t linearMacUs;     // total time for all lookups
+  uint32_t hashedMacUs;
+  uint32_t linearNameUs;
+  uint32_t hashedNameUs;
+} PeerLookupBenchmark;
+
+bool benchmarkPeerLookup(size_t count, uint32_t lookups, PeerLookupBenchmark* result);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef LORA_RADIO_H
+#define LORA_RADIO_H
+
+#include <Arduino.h>
+
+/* Single owner of the LoRa transmitter. sendLoraMessage hands the frame to
+   the radio task through one queue per priority class and blocks until it
+   is on air, so callers keep their buffers and their ordering. The radio
+   task always takes the highest class first: an ACK waits at most for the
+   frame already on air, never for a queue of file chunks. Time fields are
+   stamped by the radio task right before the frame is handed to the modem.
+   An ACK that finds another frame queued rides along in the same packet.
+   Frames sent outside a slot the sender owns listen before talk: the radio
+   task runs channel activity detection first and hands a busy channel back
+   to the sender, which backs off and queues the frame again. Channel
+   changes go through the task too, ahead of any queued frame. The task
+   also reads every received packet out of the modem FIFO on RxDone and
+   queues it for the receive task, so no other task touches the modem. */
+
+#define RADIO_FRAME_MAX 250         // receive buffer size, the largest packet either side takes
+#define RADIO_QUEUE_DEPTH 4         // per class, every sender waits for its own frame
+#define RADIO_TX_MARGIN_MS 100      // TxDone later than the airtime plus this is a modem fault
+#define BUNDLE_HEADER_SIZE 1        // msgType, then length-prefixed frames
+#define RADIO_CAD_TIMEOUT_MS 100    // CadDone takes two symbols, later than this is a modem fault
+#define RADIO_RX_QUEUE_DEPTH 4      // received packets waiting for the receive task
+
+// Task notification bits. A sender waits for RADIO_NOTIFY_SENT, other bits
+// that arrive meanwhile are kept for the task's own wait.
+#define RADIO_NOTIFY_SENT 0x01
+#define RADIO_NOTIFY_BUSY 0x04      // not sent, channel activity detected
+
+enum RadioClass {RADIO_CONTROL, RADIO_ALARM, RADIO_CONFIG, RADIO_BULK, RADIO_CLASSES};
+
+typedef struct RadioClassStats {
+  uint32_t frames;
+  uint32_t piggybacked;     // sent inside another frame's packet
+  uint64_t waitUs;          // queued until handed to the modem
+  uint32_t maxWaitUs;
+  uint8_t maxDepth;         // frames queued at once
+} RadioClassStats;
+
+// A packet as read from the FIFO, with what the modem and the interrupt
+// knew about it at the time
+typedef struct RadioRxFrame {
+  int64_t rxAtUs;           // esp_timer time of its RxDone
+  int16_t rssi;
+  uint8_t len;
+  uint8_t data[RADIO_FRAME_MAX];
+} RadioRxFrame;
+
+typedef struct RadioStats {
+  RadioClassStats classes[RADIO_CLASSES];
+  uint32_t packets;         // handed to the modem, a bundle is one
+  uint32_t bundles;
+  uint32_t txTimeouts;      // no TxDone in time
+  uint32_t oversize;        // frames over RADIO_FRAME_MAX, dropped
+  uint32_t lbtFrames;       // sent outside an owned slot, after listening
+  uint32_t cadChecks;
+  uint32_t channelBusy;     // checks that found a preamble on air
+  uint32_t cadTimeouts;     // no CadDone in time, sent as if clear
+  uint32_t backoffs;
+  uint64_t backoffMs;       // total time senders backed off
+  uint32_t lbtForced;       // still busy after CSMA_MAX_ATTEMPTS, sent anyway
+  uint32_t unanswered;      // pairing requests without an answer, lost to a collision or out of range
+  uint32_t hops;            // channel changes
+  uint32_t rxPackets;       // read out of the FIFO
+  uint32_t rxDropped;       // receive queue full, the receive task fell behind
+} RadioStats;
+
+extern RadioStats radioStats;
+
+void lora_radio_init();
+RadioClass radioClassOf(const uint8_t* data);
+void radioSend(uint8_t* data, size_t size, RadioClass cls);
+void radioTxDoneFromISR();
+void radioCadDoneFromISR(bool detected);
+void radioRxDoneFromISR();
+bool radioReceive(RadioRxFrame* frame, TickType_t wait);
+void radioOwnChannel(bool owned);
+void radioTune(uint8_t channel);
+uint8_t radioChannel();
+size_t unbundleFrame(const uint8_t* packet, size_t len, size_t* pos, uint8_t* frame);
+
+#endif
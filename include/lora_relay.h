@@ -0,0 +1,48 @@
+#ifndef LORA_RELAY_H
+#define LORA_RELAY_H
+
+#include "lora_init.h"
+
+/* Multi-hop relay: a node in LORA_RELAY mode stores and forwards for nodes
+   out of gateway range. File data is received like on the gateway and sent
+   on in the relay's own slot, control frames are wrapped in RELAY frames. */
+
+#define RELAY_QUEUE_LENGTH 6            // frames waiting for the radio
+#define RELAY_TURNAROUND_MS 20          // the sender switches back to receive first
+#define RELAY_PAIRING_JITTER_MS 300     // spreads the copies of relays hearing the same request
+#define RELAY_BEACON_GAP_MS 500         // added to the beacon guard per relay level, one relayed page
+#define ROUTE_HOP_PENALTY_DB 10         // route score: weakest link minus this per relay
+#define PAIRING_COLLECT_MS 1500         // gateway: copies of a pairing request are gathered this long
+
+typedef struct RelayStats {
+  uint32_t forwardedUp;       // relay: control frames passed towards the gateway
+  uint32_t forwardedDown;     // relay: frames passed towards a node
+  uint32_t beacons;           // relay: beacons repeated for the nodes behind it
+  uint32_t pairings;          // relay: pairing requests passed on
+  uint32_t queueDrops;        // relay: queue full, or a beacon too late to be useful
+  uint32_t storeForwards;     // relay: own slots that forwarded stored file data
+  uint64_t storeDelayMs;      // relay: oldest stored data to its forwarding slot, summed
+  uint32_t received;          // gateway: relayed frames taken
+  uint32_t hops;              // gateway: relays those frames passed
+  uint32_t offRoute;          // frames of a peer heard outside its route, dropped
+  uint64_t delayMs;           // time frames spent queued on relays, summed
+  uint32_t maxDelayMs;
+  uint64_t airtimeUs;         // airtime of relay hops
+} RelayStats;
+
+extern RelayStats relayStats;
+
+// Routes, both roles
+int routeScore(int rssi, uint8_t hops);
+void setPeerRoute(int index, uint8_t hops, const uint16_t* path, int rssi);
+bool peerFrameOnRoute(int index, uint8_t hops, const uint16_t* path, int rssi);
+bool sendToPeer(int index, const uint8_t* data, size_t size);
+void recordRelayedFrame(const relay_message& msg);
+
+// Relay role
+void lora_relay_init();
+bool relay_handle_frame(const uint8_t* incomingData, int len);
+uint32_t relay_stored_bytes(time_t& oldest);
+void relay_forward_stored();
+
+#endif
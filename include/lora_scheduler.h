@@ -0,0 +1,65 @@
+#ifndef LORA_SCHEDULER_H
+#define LORA_SCHEDULER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Time-slotted (TDMA) poll schedule for the gateway. A gateway with more
+   than one receiver runs slots in parallel lanes, each on its own channel. */
+
+#define SLOT_UNIT_MS 100        // resolution of slot offsets/lengths on the wire
+#define SLOT_MIN_MS 1000        // idle node: status report only
+#define SLOT_MAX_MS 20000       // cap per node and cycle, remaining backlog waits for the next cycle
+#define SLOT_BASE_MS 1000       // POLL_COMPLETE + turnaround + guard
+#define SLOT_CHUNK_MS 500       // one FILE_BODY chunk + ACK at SF7/125kHz
+#define SLOT_CHUNK_BYTES 200    // same as CHUNK_SIZE
+#define SLOT_GROUP_CHUNKS 8     // same as FEC_GROUP_SIZE, parity chunks are budgeted per group
+#define SLOT_GUARD_MS 300       // node stops transmitting this long before its slot ends
+#define SLOT_STATUS_MARGIN_MS 50 // ACK waits in a slot end this long plus POLL_COMPLETE's airtime before the slot
+#define CYCLE_MAX_MS 60000      // target bound for a full cycle, never below count * SLOT_MIN_MS
+
+#define SLOT_FLAG_LISTEN 0x02   // deep-sleep node stays up after the cycle, config deltas are waiting
+#define SLOT_FLAG_HOME 0x04     // scheduling only: the slot stays on the home channel and lane 0
+#define SLOT_FLAG_VERIFY 0x08   // node compares its synced files with the gateway's copies again
+#define SLOT_CHANNEL_SHIFT 4    // beacon slot flags: the high nibble is the slot's channel
+#define SLOT_MAX_LANES 8        // slots run in parallel on this many sub-channels at most
+
+#define PEER_OFFLINE_MISSES 2      // missed slots in a row before a peer is OFFLINE and backed off
+#define BACKOFF_BASE_MS 60000       // first backoff, doubled for every further miss
+#define BACKOFF_MAX_MS 3600000      // a dead peer is still probed once an hour
+#define BACKOFF_JITTER_DIV 4        // up to a quarter of the backoff is added as jitter
+
+#define CSMA_BACKOFF_UNIT_MS 50     // unslotted sender: first backoff window after a busy channel
+#define CSMA_MAX_EXPONENT 5         // window doubles per busy check up to 32 units
+#define CSMA_MAX_ATTEMPTS 6         // busy checks before the frame goes out regardless
+
+#define PRIORITY_AGE_UNIT_S 600     // every 10 min of backlog age adds the node's priority again to its weight
+#define PRIORITY_AGE_MAX_S 604800   // age is capped at a week
+
+typedef struct SlotRequest {
+  uint16_t peerIndex;
+  uint8_t flags;
+  uint8_t priority;             // configured per node, 0 is treated as 1
+  uint8_t fecParity;            // parity chunks per FEC group the node will send
+  uint32_t pendingBytes;        // last backlog reported by the node
+  uint32_t backlogAgeS;         // age of the oldest unsynced sample
+} SlotRequest;
+
+typedef struct SlotAssignment {
+  uint16_t peerIndex;
+  uint8_t flags;
+  uint8_t lane;                 // parallel track of the cycle, one per gateway receiver
+  uint8_t channel;              // set by assignSlotChannels, 0 is the home channel
+  uint32_t offsetMs;            // from the start of the cycle
+  uint32_t lengthMs;
+} SlotAssignment;
+
+uint32_t slotLengthForBacklog(uint32_t pendingBytes, uint8_t fecParity = 0);
+uint32_t slotPriorityScore(const SlotRequest* request);
+uint32_t peerBackoffMs(uint8_t missedPolls, uint32_t random);
+uint32_t csmaBackoffMs(uint8_t attempt, uint32_t unitMs, uint32_t random);
+uint32_t slotStatusReserveUs(uint32_t statusAirtimeUs);
+uint32_t slotTransferGuardUs(uint32_t chunkAirtimeUs, uint32_t ackAirtimeUs, uint32_t statusAirtimeUs);
+uint32_t buildSlotSchedule(const SlotRequest* requests, size_t count, SlotAssignment* slots, uint8_t lanes = 1);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef LORA_SESSION_H
+#define LORA_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lora_fec.h"
+
+/* Receiving end of a file transfer session, without Arduino so the native
+   simulator runs the gateway's own code. Chunks are handed to the caller's
+   writer in session order. Early chunks wait in a small reorder buffer, and
+   the data and parity chunks of the current FEC group are kept until the
+   group is complete or rebuilt. */
+
+#define CHUNK_SIZE 200            // data bytes per FILE_BODY
+#define ACK_TIMEOUT 5000          // ms a sender waits for an ACK
+#define REORDER_SLOTS 4           // out-of-order chunks held per session
+#define FEC_GROUP_SPAN (FEC_GROUP_SIZE * CHUNK_SIZE) // session bytes per FEC group
+#define FEC_PROBES 2              // resends of the last parity chunk when the group ACK is lost
+
+typedef struct ReorderEntry {
+  bool used;
+  uint8_t len;
+  uint32_t offset;
+  uint8_t data[CHUNK_SIZE];
+} ReorderEntry;
+
+// Chunks of the FEC group being received, allocated for sessions that use FEC
+typedef struct FecGroup {
+  uint32_t offset;            // session offset of the first chunk
+  uint16_t bytes;             // data bytes, known once a parity chunk arrived
+  uint8_t chunks;
+  uint8_t parity;
+  uint8_t received;           // distinct data and parity chunks seen
+  bool accounted;             // loss of this group already reported to the peer
+  bool present[FEC_GROUP_SIZE + FEC_MAX_PARITY];
+  uint8_t blocks[FEC_GROUP_SIZE + FEC_MAX_PARITY][CHUNK_SIZE];
+} FecGroup;
+
+typedef struct SessionReceiver {
+  uint32_t expectedOffset;    // next in-order byte of the session
+  uint32_t duplicates;
+  uint32_t outOfOrder;
+  ReorderEntry reorder[REORDER_SLOTS];
+  FecGroup* group;            // NULL until the first grouped chunk
+} SessionReceiver;
+
+// Totals over all sessions
+typedef struct SessionCounters {
+  uint32_t bytes;
+  uint32_t duplicates;
+  uint32_t outOfOrder;
+  uint32_t reorderDrops;
+  uint32_t fecGroups;         // groups completed with FEC
+  uint32_t fecRecovered;      // chunks rebuilt from parity
+  uint32_t fecFailed;         // groups with too few chunks, resent by the node
+} SessionCounters;
+
+// Takes len bytes at offset, always the expected offset. False if they
+// cannot be taken now, the sender then resends them.
+typedef bool (*SessionWriter)(void* context, uint32_t offset, const uint8_t* data, size_t len);
+
+enum SessionChunkResult {CHUNK_WRITTEN, CHUNK_DUPLICATE, CHUNK_EARLY, CHUNK_NOT_WRITTEN};
+
+void sessionReceiverReset(SessionReceiver* rx, uint32_t expectedOffset);
+SessionChunkResult sessionReceiveChunk(SessionReceiver* rx, uint32_t offset, const uint8_t* data, uint8_t len,
+                                       bool grouped, SessionWriter write, void* context, SessionCounters* counters);
+bool sessionReceiveParity(SessionReceiver* rx, uint32_t groupOffset, uint8_t chunks, uint8_t parity, uint16_t bytes,
+                          uint8_t index, const uint8_t* data, SessionWriter write, void* context,
+                          SessionCounters* counters, uint8_t* sent, uint8_t* lost);
+uint32_t sessionGroupSpan(long msLeft, uint8_t parity);
+
+#endif
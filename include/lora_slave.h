@@ -1,3 +1,19 @@
 #include "lora_init.h"
 
-void lora_slave_init();
\ No newline at end of file
+extern PairingStatus pairingStatus;
+extern uint16_t myNodeId;
+extern volatile bool slotScheduled;
+extern volatile unsigned long slotEnd;
+extern volatile uint8_t slotFlags;
+extern volatile unsigned long cycleEndAt;
+extern volatile uint32_t slotsCompleted;
+extern EventGroupHandle_t nodeEvents;
+
+#define NODE_EVENT_SLOT 0x01          // a beacon gave this node a slot
+#define NODE_EVENT_SLOT_DONE 0x08     // a slot ended with POLL_COMPLETE
+
+#define PAIRING_BACKOFF_UNIT_MS 1000  // unanswered request: ACK_TIMEOUT plus a doubling random window
+
+void lora_slave_init();
+void send_files_to_gateway(String folderPath, uint16_t originId = 0, size_t wirePrefix = 0);
+uint32_t count_unsynced_bytes(String folderPath, time_t &oldest);
@@ -0,0 +1,53 @@
+#ifndef LORA_TIMESYNC_H
+#define LORA_TIMESYNC_H
+
+#include "lora_init.h"
+
+/* Network time is the gateway clock in local calendar time, the way nodes
+   keep it (they run without a time zone), in us. A node measures its offset
+   with a two-way exchange in its slot, slews its clock with adjtime and
+   follows a drift model between exchanges. The network time in the poll
+   beacon only brings nodes that have not synced yet close enough. */
+
+#define TIME_STEP_THRESHOLD_US 500000       // larger offsets are stepped, smaller ones slewed
+#define TIME_SYNC_MAX_DELAY_US 50000        // exchanges with more unexplained delay are dropped
+#define TIME_SYNC_TIMEOUT_MS 1000           // node waits this long for the response
+#define TIME_SYNC_MIN_INTERVAL_MS 600000    // exchanges at most every 10 min
+#define TIME_SYNC_MAX_INTERVAL_MS 21600000  // and at least every 6 h
+#define TIME_SYNC_TARGET_US 2000            // error the drift model may let build up between exchanges
+#define TIME_BEACON_APPLY_MS 600000         // beacon time slewed in at most this often without an exchange
+#define TIME_DRIFT_STEP_MS 10000            // drift model applied this often
+#define TIME_SKEW_MAX_PPB 500000            // 500 ppm, beyond any crystal
+#define RTC_WRITE_INTERVAL_MS 21600000      // DS1307 rewritten at most every 6 h while in sync
+#define NETWORK_TIME_SET_US 1451606400000000LL // 2016-01-01, earlier clocks were never set
+
+typedef struct TimeSyncStats {
+  uint32_t exchanges;       // node: two-way exchanges applied
+  uint32_t timeouts;
+  uint32_t rejected;        // delay too large to trust
+  uint32_t broadcasts;      // beacon times applied
+  uint32_t steps;
+  uint32_t slews;
+  uint32_t served;          // gateway, relay: requests answered
+  int32_t lastOffsetUs;     // server minus node, before the correction
+  int32_t lastDelayUs;      // round trip beyond both frames' airtime
+  int32_t skewPpb;          // drift model, added to the node clock
+  uint32_t intervalMs;      // time to the next exchange
+  uint32_t rtcWrites;
+  unsigned long lastSyncAt; // millis() of the last exchange, 0 = never
+} TimeSyncStats;
+
+extern TimeSyncStats timeSyncStats;
+
+int64_t calendarToEpoch(int year, int month, int day, int hour, int minute, int second);
+int64_t networkTimeUs();
+int64_t rxNetworkTimeUs();
+
+bool timeSyncDue();
+void requestTimeSync();
+void applyBeaconTime(int64_t sentUs, size_t frameLen, int64_t receivedUs);
+void handle_time_request(const uint8_t *incomingData, int len);
+void handle_time_response(const uint8_t *incomingData, int len);
+void lora_timesync_init();
+
+#endif
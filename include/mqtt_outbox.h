@@ -0,0 +1,44 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Publish window of the MQTT uplink for one data file, without Arduino so
+   the native environment can test it against a stub broker. Batches of
+   complete lines are published at QoS 1 ahead of their PUBACKs, up to
+   MQTT_INFLIGHT at a time. The published offset only moves over batches
+   the broker acknowledged, in file order. A disconnect or a missing PUBACK
+   drops the window and publishing resumes from that offset. */
+
+#define MQTT_BATCH_BYTES 2048            // lines per publish, cut at the last complete line
+#define MQTT_HEADER_BYTES 12             // "<offset>\n" in front of every payload
+#define MQTT_INFLIGHT 4                  // batches published and not acknowledged yet
+#define MQTT_ACK_TIMEOUT_MS 10000        // no PUBACK this long: the window is published again
+
+typedef struct MqttInflight {
+  int msgId;
+  uint32_t end;                // file offset after the batch
+  uint32_t lines;
+  uint32_t sentMs;
+  bool acked;
+} MqttInflight;
+
+typedef struct MqttOutbox {
+  uint32_t committed;          // acknowledged up to here, what the .mqtt file holds
+  uint32_t next;               // where the next batch starts
+  MqttInflight inflight[MQTT_INFLIGHT];
+  uint8_t count;
+} MqttOutbox;
+
+void outboxReset(MqttOutbox* outbox, uint32_t committed);
+bool outboxCanSend(const MqttOutbox* outbox);
+size_t outboxBatchEnd(const uint8_t* data, size_t n, size_t capacity);
+uint32_t outboxCountLines(const uint8_t* data, size_t n);
+size_t outboxHeader(uint8_t* payload, uint32_t offset);
+void outboxSent(MqttOutbox* outbox, int msgId, size_t len, uint32_t lines, uint32_t nowMs);
+int outboxAcked(MqttOutbox* outbox, int msgId, uint32_t* lines, uint32_t* bytes, uint32_t* rttMs, uint32_t nowMs);
+bool outboxTimedOut(const MqttOutbox* outbox, uint32_t nowMs);
+void outboxDrop(MqttOutbox* outbox);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef MQTT_UPLINK_H
+#define MQTT_UPLINK_H
+
+#include <Arduino.h>
+#include "mqtt_outbox.h"
+
+/* Gateway uplink to an MQTT broker through the ESP-IDF MQTT client. The
+   node data files on the SD card are the outbox: a .mqtt file next to each
+   .dat file holds how far it was published, like .meta does for the LoRa
+   sync on nodes. New lines are published at QoS 1 in batches per channel,
+   and the offset only moves once the broker's PUBACK for the batch came in
+   (mqtt_outbox.h). After a reboot or a broker outage publishing resumes
+   where it stopped, a batch may then arrive twice but none is lost. Lines
+   replaced by a repair of a synced file are published again. */
+
+#define MQTT_TOPIC_ROOT "datalogger"     // <root>/<gateway>/<node>/<bank>/<channel>
+#define MQTT_DEFAULT_PORT 1883
+#define MQTT_DIRTY_FILES 32              // files written since they were last published, more means a full scan
+#define MQTT_RETRY_MS 2000               // broker connection retry, doubled up to MQTT_RETRY_MAX_MS
+#define MQTT_RETRY_MAX_MS 60000
+#define MQTT_IDLE_MS 1000                // nothing to publish or no PUBACK yet: wait this long
+#define MQTT_OFFSET_SUFFIX ".mqtt"
+#define MQTT_LINE_BACK 256               // a repair rewinds the offset to the start of its line
+
+typedef struct MqttUplinkStats {
+  bool connected;
+  uint32_t connects;
+  uint32_t connectFailures;
+  int lastError;              // CONNACK return code of the last refused connect, -1 transport error
+  uint32_t published;         // batches
+  uint32_t publishFailures;   // windows published again after a disconnect or a missing PUBACK
+  uint32_t lines;
+  uint64_t bytes;
+  uint32_t backlogBytes;      // written to node files and not published yet
+  uint32_t scans;             // full scans of /node
+  uint32_t rewinds;           // published data replaced by a repair, published again
+  uint32_t lastDrainBps;      // bytes per s of the last backlog drained with the broker up
+  uint32_t maxDrainBps;
+  uint32_t lastPublishMs;     // one batch, publish to PUBACK
+  uint32_t maxPublishMs;
+} MqttUplinkStats;
+
+extern MqttUplinkStats mqttUplinkStats;
+
+void mqtt_uplink_init();
+void mqttUplinkNotify(const char* path, size_t len);
+void mqttUplinkRewind(const char* path, uint32_t offset);
+
+#endif
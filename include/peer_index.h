@@ -0,0 +1,27 @@
+#ifndef PEER_INDEX_H
+#define PEER_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Fixed-capacity open-addressing hash index over an array of records */
+
+#define PEER_INDEX_EMPTY 0xFFFF
+
+typedef struct PeerIndex {
+  uint16_t* slots;          // record index per bucket, PEER_INDEX_EMPTY if unused
+  size_t capacity;          // power of two, keep it at least twice the record count
+  const uint8_t* records;   // first record
+  size_t stride;            // size of one record
+  size_t keyOffset;         // offset of the key inside a record
+  size_t keyLength;         // key size, or maximum size for string keys
+  bool stringKey;           // key is NUL-terminated within keyLength
+} PeerIndex;
+
+void peerIndexInit(PeerIndex* index, uint16_t* slots, size_t capacity, const void* records,
+                   size_t stride, size_t keyOffset, size_t keyLength, bool stringKey);
+void peerIndexClear(PeerIndex* index);
+bool peerIndexInsert(PeerIndex* index, uint16_t recordIndex);
+int peerIndexFind(const PeerIndex* index, const void* key);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef POWER_PROFILE_H
+#define POWER_PROFILE_H
+
+#include <Arduino.h>
+
+/* Deep-sleep node profile, on when systemConfig.RADIO_WAKE_S is set. Wi-Fi,
+   the web and FTP servers stay off. Between samples the node deep-sleeps,
+   samples wait in RTC memory and go to the SD card before each radio
+   window. The radio is only started for those windows, which fall on
+   multiples of the wake period in network time; the gateway runs a poll
+   cycle for sleeping nodes at each such boundary. Awake and radio time are
+   summed over every cycle for an estimate of the daily energy. */
+
+#define LOW_POWER_GRID_S 60             // wake periods are multiples of this, the gateway checks every boundary
+#define LOW_POWER_MAX_WAKE_S 43200      // radio at least every 12 h
+#define LOW_POWER_LEAD_MS 2000          // radio up before the boundary: boot, LoRa init and sleep clock error
+#define LOW_POWER_LISTEN_MS 5000        // after the boundary, waiting for a beacon with our slot
+#define LOW_POWER_TAIL_MS 8000          // kept listening after the cycle when config deltas are pending
+#define LOW_POWER_JOIN_MS 900000        // awake after power-on to pair, sync and report, 15 min at most
+#define LOW_POWER_SAMPLE_SLACK_S 5      // samples due this soon are taken in the same wake
+#define LOW_POWER_BUFFER_BYTES 4096     // RTC memory for samples, of 8 KB
+#define LOW_POWER_FLUSH_BYTES 3072      // written to SD early once the buffer fills this far
+
+// Current draw used for the energy estimate
+#define POWER_SUPPLY_MV 3300
+#define POWER_ACTIVE_MA 45              // ESP32 at 240 MHz, Wi-Fi off
+#define POWER_LORA_RX_MA 12             // SX1276 receiving
+#define POWER_LORA_TX_MA 120            // SX1276 at +20 dBm
+#define POWER_SLEEP_UA 150              // deep sleep: ESP32, SX1276 asleep, regulator and idle SD card
+
+typedef struct PowerStats {
+  uint32_t cycles;          // wakes since power-on
+  uint32_t radioWindows;
+  uint32_t missedWindows;   // windows without a slot in them
+  uint32_t samples;         // taken while deep-sleeping
+  uint32_t droppedSamples;  // buffer full and the SD card not writable
+  uint32_t flushes;
+  uint32_t lastAwakeMs;     // last complete cycle, boot to sleep
+  uint32_t maxAwakeMs;
+  uint64_t awakeUs;         // totals since power-on
+  uint64_t radioUs;
+  uint64_t txUs;
+  uint64_t sleptUs;
+} PowerStats;
+
+extern PowerStats powerStats;
+
+bool lowPowerProfile();
+uint16_t lowPowerWakePeriodS();
+uint32_t lowPowerAverageUa();
+uint16_t lowPowerEnergyMwhDay();
+uint16_t lowPowerAvgAwakeMs();
+void low_power_start();
+void low_power_resume();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SD_WRITER_H
+#define SD_WRITER_H
+
+#include <Arduino.h>
+
+/* Gateway SD writer: received chunks are queued in RAM and written by a
+   separate task, so the receive task can ACK without waiting for the card.
+   Synced data is written in place at the node's file offset, so data sent
+   twice lands on itself instead of being appended again. The same task
+   appends the peer log records of peers updated by the receive task, and
+   answers file verifications once the chunks queued before them are
+   written. */
+
+#define SD_WRITER_POOL 32           // chunk buffers, about 7 KB
+#define SD_WRITER_PATH_LEN 64       // "/node/" + device name + filename
+#define SD_WRITER_CHUNK_LEN 200     // same as CHUNK_SIZE
+#define SD_WRITER_BUFFER 4096       // coalescing buffer, one write per file per batch when possible
+#define SD_WRITER_IDLE_MS 1000      // longest wait for chunks before pending peer log records are written
+#define SD_WRITER_VERIFIES 4        // FILE_VERIFY requests waiting to be answered
+
+typedef struct SdWriterStats {
+  uint32_t queueDepth;        // chunks waiting now
+  uint32_t maxQueueDepth;
+  uint32_t chunksQueued;
+  uint32_t chunksDropped;     // no free buffer, left unACKed for the sender to retry
+  uint32_t writeFailures;     // chunks lost because the file could not be opened or written
+  uint32_t overwrites;        // written in place below the end of the file: sent again or repaired
+  uint32_t gaps;              // written past the end of the file, the file verification fills the gap
+  uint32_t bytesWritten;
+  uint32_t writes;            // file.write calls
+  uint32_t batches;
+  uint32_t fileFlushes;       // files written per batch, summed
+  uint32_t lastWriteUs;       // open + write + close of one file in a batch
+  uint32_t maxWriteUs;
+  uint64_t totalWriteUs;
+  uint32_t lastLatencyMs;     // queued to written, per chunk
+  uint32_t maxLatencyMs;
+  uint64_t totalLatencyMs;
+} SdWriterStats;
+
+extern SdWriterStats sdWriterStats;
+
+struct file_verify_message;
+
+void sd_writer_init();
+bool sdWriterEnqueue(const char* path, const uint8_t* data, size_t len, bool truncate);
+bool sdWriterEnqueueAt(const char* path, uint32_t at, const uint8_t* data, size_t len, bool repair);
+bool sdWriterEnqueueVerify(const char* path, const file_verify_message& msg);
+
+#endif
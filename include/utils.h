@@ -34,6 +34,8 @@
 extern int LORA_MODE;
 extern RTC_DS1307 rtc;
 extern bool rtc_mounted;
+extern bool clock_synced;
+extern unsigned long lastRtcWrite;
 extern char daysOfWeek[7][12];
 extern String WIFI_SSID;
 extern String WIFI_PASSWORD;
@@ -43,6 +45,7 @@ void wifi_setting_reset();
 void wifi_init();
 String get_current_time(bool getFilename = false);
 String convertTMtoString(struct tm timeinfo);
+time_t parseFilenameTime(const char* timestamp);
 void external_rtc_init();
 void external_rtc_sync_ntp();
 void ntp_sync();
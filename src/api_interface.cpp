@@ -5,6 +5,17 @@
 #include "fileserver.h"
 #include "lora_peer.h"
 #include "lora_init.h"
+#include "lora_gateway.h"
+#include "sd_writer.h"
+#include "lora_file_transfer.h"
+#include "config_outbox.h"
+#include "lora_relay.h"
+#include "lora_dutycycle.h"
+#include "lora_timesync.h"
+#include "lora_radio.h"
+#include "lora_firmware.h"
+#include "cpu_load.h"
+#include "mqtt_uplink.h"
 
 AsyncWebServer server(80);
 
@@ -24,10 +35,22 @@ void getNodeSysConfig(AsyncWebServerRequest *request);
 void getNodeCollectionConfig(AsyncWebServerRequest *request);
 void serveRebootLogger(AsyncWebServerRequest *request);
 void getLoRaNetworkStatus(AsyncWebServerRequest *request);
+void getPollCycleStats(AsyncWebServerRequest *request);
+void getPeerLookupBenchmark(AsyncWebServerRequest *request);
+void getSdWriterStats(AsyncWebServerRequest *request);
+void getTransferSessions(AsyncWebServerRequest *request);
+void getRelayStats(AsyncWebServerRequest *request);
+void getAirtimeStats(AsyncWebServerRequest *request);
+void getTimeSyncStats(AsyncWebServerRequest *request);
+void getRadioStats(AsyncWebServerRequest *request);
+void getFirmwareCampaign(AsyncWebServerRequest *request);
+void getMqttUplinkStats(AsyncWebServerRequest *request);
 
 // POST
 AsyncCallbackJsonWebHandler *updateSysConfig();
 AsyncCallbackJsonWebHandler *updateCollectionConfig();
+AsyncCallbackJsonWebHandler *updatePeerPriority();
+AsyncCallbackJsonWebHandler *startFirmwareCampaign();
 
 void start_http_server(){
   Serial.println("\n*** Starting Server ***");
@@ -47,6 +70,16 @@ void start_http_server(){
   server.on("/api/system-configuration", HTTP_GET, getSysConfig);
   server.on("/api/collection-configuration", HTTP_GET, getCollectionConfig);
   server.on("/api/lora-network-status", HTTP_GET, getLoRaNetworkStatus);
+  server.on("/api/lora-network/cycle", HTTP_GET, getPollCycleStats);
+  server.on("/api/benchmark/peer-lookup", HTTP_GET, getPeerLookupBenchmark);
+  server.on("/api/lora-network/writer", HTTP_GET, getSdWriterStats);
+  server.on("/api/lora-network/sessions", HTTP_GET, getTransferSessions);
+  server.on("/api/lora-network/relay", HTTP_GET, getRelayStats);
+  server.on("/api/lora-network/airtime", HTTP_GET, getAirtimeStats);
+  server.on("/api/lora-network/time", HTTP_GET, getTimeSyncStats);
+  server.on("/api/lora-network/radio", HTTP_GET, getRadioStats);
+  server.on("/api/lora-network/firmware", HTTP_GET, getFirmwareCampaign);
+  server.on("/api/mqtt-uplink", HTTP_GET, getMqttUplinkStats);
   server.on("/reboot", HTTP_GET, serveRebootLogger);// Serve the text file
 
 // **************************************
@@ -54,6 +87,8 @@ void start_http_server(){
 // **************************************
   server.addHandler(updateSysConfig());
   server.addHandler(updateCollectionConfig());
+  server.addHandler(updatePeerPriority());
+  server.addHandler(startFirmwareCampaign());
 
 // **************************************
 // * FileServer
@@ -169,7 +204,7 @@ void serveVoltageHistory(AsyncWebServerRequest *request){
 
 void getSysConfig(AsyncWebServerRequest *request){
 
-  SystemConfig config;
+  SystemConfig config = {}; // a node file written before a field was added leaves it empty
 
   if (!request->hasParam("device")) {  // Check if parameter device is received
     request->send(400, "application/json", "{\"error\":\"Device query parameter is missing\"}");
@@ -204,6 +239,12 @@ void getSysConfig(AsyncWebServerRequest *request){
   obj1["LORA_MODE"] = config.LORA_MODE;
   obj1["utcOffset"] = config.utcOffset;
   obj1["PAIRING_KEY"] = config.PAIRING_KEY;
+  obj1["DUTY_CYCLE_PERMILLE"] = config.DUTY_CYCLE_PERMILLE;
+  obj1["RADIO_WAKE_S"] = config.RADIO_WAKE_S;
+  obj1["SAMPLE_TIME_MS"] = config.SAMPLE_TIME_MS;
+  obj1["MQTT_HOST"] = config.MQTT_HOST;
+  obj1["MQTT_PORT"] = config.MQTT_PORT;
+  obj1["MQTT_USER"] = config.MQTT_USER;
   serveJson(request, doc, 200, false);
 
 }
@@ -323,9 +364,26 @@ void getLoRaNetworkStatus(AsyncWebServerRequest *request) {
               timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
 
     obj["name"] = peers[i].deviceName;
+    obj["nodeId"] = peers[i].nodeId;
     obj["lastCommsTime"] = buffer;
     obj["status"] = peers[i].status;
     obj["rssi"] = peers[i].SignalStrength;
+    obj["pendingBytes"] = peers[i].pendingBytes;
+    obj["oldestUnsynced"] = (uint32_t) peers[i].oldestUnsynced;
+    obj["priority"] = peers[i].priority;
+    obj["missedPolls"] = peers[i].missedPolls;
+    obj["dataRate"] = peers[i].dataRate;
+    obj["lossPermille"] = peers[i].lossPermille;
+    obj["fecParity"] = peers[i].fecParity;
+    obj["routeHops"] = peers[i].routeHops;
+    obj["routeRssi"] = peers[i].routeRssi;
+    obj["wakePeriodS"] = peers[i].wakePeriodS;
+    obj["avgAwakeMs"] = peers[i].avgAwakeMs;
+    obj["energyMwhDay"] = peers[i].energyMwhDay;
+    JsonArray route = obj["route"].to<JsonArray>();
+    for (uint8_t hop = 0; hop < peers[i].routeHops; hop++) {
+      route.add(peers[i].route[hop]);
+    }
   }
 
   // Serve the JSON document
@@ -334,6 +392,471 @@ void getLoRaNetworkStatus(AsyncWebServerRequest *request) {
 }
 
 
+// ***********************************
+// * LoRa Poll Cycle Statistics
+// ***********************************
+
+void getPollCycleStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  obj["cycleId"] = pollCycleStats.cycleId;
+  obj["slots"] = pollCycleStats.slots;
+  obj["completed"] = pollCycleStats.completed;
+  obj["boundMs"] = pollCycleStats.boundMs;
+  obj["cycleMs"] = pollCycleStats.cycleMs;
+  obj["liveCycleMs"] = pollCycleStats.liveCycleMs;
+  obj["cycles"] = pollCycleStats.cycles;
+  if (pollCycleStats.cycles > 0) {
+    obj["avgCycleMs"] = (uint32_t) (pollCycleStats.totalCycleMs / pollCycleStats.cycles);
+    obj["avgLiveCycleMs"] = (uint32_t) (pollCycleStats.totalLiveCycleMs / pollCycleStats.cycles);
+  }
+
+  // gateway control frames per cycle: the beacon pages, nothing per node
+  JsonObject control = obj["control"].to<JsonObject>();
+  control["frames"] = pollCycleStats.controlFrames;
+  control["bytes"] = pollCycleStats.controlBytes;
+  control["airtimeMs"] = pollCycleStats.controlAirtimeUs / 1000;
+  if (pollCycleStats.cycles > 0) {
+    control["avgAirtimeMs"] = (uint32_t) (pollCycleStats.totalControlAirtimeUs / pollCycleStats.cycles / 1000);
+  }
+  if (pollCycleStats.cycleMs > 0) {
+    control["sharePermille"] = pollCycleStats.controlAirtimeUs / pollCycleStats.cycleMs; // us per ms of cycle
+  }
+
+  int offline = 0;
+  for (size_t i = 0; i < peerCount; i++) {
+    if (peers[i].status == OFFLINE) offline++;
+  }
+  obj["offlinePeers"] = offline;
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Firmware Campaign
+// ***********************************
+// The running or last campaign: how far the first pass got, what was sent
+// again, and each node's last reported state
+
+void getFirmwareCampaign(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  const FirmwareCampaign& c = firmwareCampaign;
+  obj["active"] = c.active;
+  if (c.chunkCount == 0) {
+    serveJson(request, doc, 200, false);
+    return;
+  }
+  obj["path"] = c.path;
+  obj["kind"] = c.kind == FW_KIND_DELTA ? "delta" : "image";
+  obj["imageId"] = c.imageId;
+  obj["payloadSize"] = c.payloadSize;
+  obj["targetSize"] = c.targetSize;
+  obj["chunks"] = c.chunkCount;
+  obj["sentUpTo"] = c.sentUpTo;
+  obj["repairPending"] = c.repairPending;
+  obj["offersSent"] = c.offersSent;
+  obj["chunksSent"] = c.chunksSent;
+  obj["repairsSent"] = c.repairsSent;
+  obj["nacks"] = c.nacks;
+  obj["airtimeMs"] = (uint32_t) (c.airtimeUs / 1000);
+  obj["elapsedS"] = (millis() - c.startedAt) / 1000;
+
+  JsonArray nodes = obj["nodes"].to<JsonArray>();
+  for (size_t i = 0; i < c.targetCount; i++) {
+    JsonObject node = nodes.add<JsonObject>();
+    int index = getIndexByNodeId(c.targets[i].nodeId);
+    node["device"] = index >= 0 ? peers[index].deviceName : "";
+    node["state"] = firmwareStateNames[c.targets[i].state];
+    node["received"] = c.targets[i].received;
+    if (c.targets[i].lastStatus != 0) {
+      node["lastStatusS"] = (millis() - c.targets[i].lastStatus) / 1000;
+    }
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * MQTT Uplink
+// ***********************************
+// Broker connection, what was published and what is still waiting on the
+// SD card, and how fast the last backlog drained
+
+void getMqttUplinkStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  MqttUplinkStats stats = mqttUplinkStats; // snapshot, counters may move while serving
+
+  obj["broker"] = systemConfig.MQTT_HOST;
+  obj["connected"] = stats.connected;
+  obj["connects"] = stats.connects;
+  obj["connectFailures"] = stats.connectFailures;
+  obj["lastError"] = stats.lastError;
+  obj["published"] = stats.published;
+  obj["publishFailures"] = stats.publishFailures;
+  obj["lines"] = stats.lines;
+  obj["bytes"] = stats.bytes;
+  obj["backlogBytes"] = stats.backlogBytes;
+  obj["scans"] = stats.scans;
+  obj["rewinds"] = stats.rewinds;
+  obj["lastDrainBps"] = stats.lastDrainBps;
+  obj["maxDrainBps"] = stats.maxDrainBps;
+  obj["lastPublishMs"] = stats.lastPublishMs;
+  obj["maxPublishMs"] = stats.maxPublishMs;
+  if (stats.published > 0) {
+    obj["avgBatchBytes"] = (uint32_t) (stats.bytes / stats.published);
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Gateway SD Writer Statistics
+// ***********************************
+
+void getSdWriterStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  SdWriterStats stats = sdWriterStats; // snapshot, counters may move while serving
+
+  obj["queueDepth"] = stats.queueDepth;
+  obj["maxQueueDepth"] = stats.maxQueueDepth;
+  obj["poolSize"] = SD_WRITER_POOL;
+  obj["chunksQueued"] = stats.chunksQueued;
+  obj["chunksDropped"] = stats.chunksDropped;
+  obj["writeFailures"] = stats.writeFailures;
+  obj["overwrites"] = stats.overwrites;
+  obj["gaps"] = stats.gaps;
+  obj["bytesWritten"] = stats.bytesWritten;
+  obj["writes"] = stats.writes;
+  obj["batches"] = stats.batches;
+  obj["fileFlushes"] = stats.fileFlushes;
+  obj["lastWriteUs"] = stats.lastWriteUs;
+  obj["maxWriteUs"] = stats.maxWriteUs;
+  if (stats.fileFlushes > 0) {
+    obj["avgWriteUs"] = (uint32_t) (stats.totalWriteUs / stats.fileFlushes);
+  }
+  obj["lastLatencyMs"] = stats.lastLatencyMs;
+  obj["maxLatencyMs"] = stats.maxLatencyMs;
+  uint32_t written = stats.chunksQueued - stats.queueDepth;
+  if (written > 0) {
+    obj["avgLatencyMs"] = (uint32_t) (stats.totalLatencyMs / written);
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * File Transfer Sessions
+// ***********************************
+
+void getTransferSessions(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  obj["sessionsOpened"] = transferStats.sessionsOpened;
+  obj["sessionsClosed"] = transferStats.sessionsClosed;
+  obj["bytesReceived"] = transferStats.receive.bytes;
+  obj["duplicates"] = transferStats.receive.duplicates;
+  obj["outOfOrder"] = transferStats.receive.outOfOrder;
+  obj["reorderDrops"] = transferStats.receive.reorderDrops;
+  obj["fecGroups"] = transferStats.receive.fecGroups;
+  obj["fecRecovered"] = transferStats.receive.fecRecovered;
+  obj["fecFailed"] = transferStats.receive.fecFailed;
+  obj["stampsCorrected"] = transferStats.stampsCorrected;
+  obj["stampsDropped"] = transferStats.stampsDropped;
+
+  JsonObject verify = obj["verify"].to<JsonObject>();
+  verify["requests"] = verifyStats.requests;
+  verify["timeouts"] = verifyStats.timeouts;
+  verify["filesVerified"] = verifyStats.filesVerified;
+  verify["spansDiffering"] = verifyStats.spansDiffering;
+  verify["repairs"] = verifyStats.repairs;
+  verify["repairBytes"] = verifyStats.repairBytes;
+  verify["rewinds"] = verifyStats.rewinds;
+  verify["rewindBytes"] = verifyStats.rewindBytes;
+  verify["answered"] = verifyStats.answered;
+
+  JsonArray active = obj["active"].to<JsonArray>();
+  unsigned long now = millis();
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    const TransferSession& session = sessions[i];
+    if (!session.active) continue;
+    JsonObject entry = active.add<JsonObject>();
+    entry["device"] = getDeviceNameByMac(session.mac);
+    entry["sessionId"] = session.sessionId;
+    entry["path"] = session.path;
+    entry["offset"] = session.rx.expectedOffset;
+    entry["fileOffset"] = session.start + session.rx.expectedOffset;
+    entry["repair"] = session.repair;
+    entry["ageMs"] = now - session.startedAt;
+    entry["idleMs"] = now - session.lastActivity;
+    entry["duplicates"] = session.rx.duplicates;
+    entry["outOfOrder"] = session.rx.outOfOrder;
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Relay Statistics
+// ***********************************
+// Gateway: relayed frames taken and what the relays added to them,
+// relay: what it passed on in both directions
+
+void getRelayStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  RelayStats stats = relayStats; // snapshot, counters may move while serving
+
+  obj["forwardedUp"] = stats.forwardedUp;
+  obj["forwardedDown"] = stats.forwardedDown;
+  obj["beacons"] = stats.beacons;
+  obj["pairings"] = stats.pairings;
+  obj["queueDrops"] = stats.queueDrops;
+  obj["storeForwards"] = stats.storeForwards;
+  if (stats.storeForwards > 0) {
+    obj["avgStoreDelayMs"] = (uint32_t) (stats.storeDelayMs / stats.storeForwards);
+  }
+  obj["received"] = stats.received;
+  obj["hops"] = stats.hops;
+  obj["offRoute"] = stats.offRoute;
+  obj["maxDelayMs"] = stats.maxDelayMs;
+  if (stats.hops > 0) {
+    obj["avgDelayPerHopMs"] = (uint32_t) (stats.delayMs / stats.hops);
+    obj["avgAirtimePerHopUs"] = (uint32_t) (stats.airtimeUs / stats.hops);
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Airtime and Duty Cycle
+// ***********************************
+// Transmit budget and usage over the rolling hour, per message type and per
+// peer. A peer's airtime is what this device heard from it.
+
+void getAirtimeStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  uint32_t budgetUs = dutyCycleBudgetUs();
+  uint32_t txHourUs = rollingHourUs(airtimeStats.txHourUs);
+
+  obj["spreadingFactor"] = loraModem.spreadingFactor;
+  obj["bandwidthHz"] = loraModem.bandwidthHz;
+  obj["codingRate"] = loraModem.codingRate;
+  obj["budgetPermille"] = systemConfig.DUTY_CYCLE_PERMILLE;
+  obj["budgetUs"] = budgetUs;
+  obj["bulkShare"] = DUTY_CYCLE_BULK_SHARE;
+  obj["txHourUs"] = txHourUs;
+  obj["rxHourUs"] = rollingHourUs(airtimeStats.rxHourUs);
+  obj["dutyCyclePermille"] = (uint32_t) ((uint64_t) txHourUs / AIRTIME_HOUR_MS);
+  obj["txMs"] = (uint32_t) (airtimeStats.txUs / 1000);
+  obj["rxMs"] = (uint32_t) (airtimeStats.rxUs / 1000);
+  obj["bulkDeferred"] = airtimeStats.bulkDeferred;
+  obj["overBudget"] = airtimeStats.overBudget;
+
+  JsonArray types = obj["types"].to<JsonArray>();
+  for (size_t t = 0; t < AIRTIME_MSG_TYPES; t++) {
+    const AirtimeTypeStats& stats = airtimeStats.types[t];
+    if (stats.txFrames == 0 && stats.rxFrames == 0) continue;
+    JsonObject entry = types.add<JsonObject>();
+    entry["msgType"] = t;
+    entry["txFrames"] = stats.txFrames;
+    entry["txMs"] = (uint32_t) (stats.txUs / 1000);
+    entry["txHourUs"] = rollingHourUs(stats.txHourUs);
+    entry["rxFrames"] = stats.rxFrames;
+    entry["rxMs"] = (uint32_t) (stats.rxUs / 1000);
+  }
+
+  JsonArray nodes = obj["peers"].to<JsonArray>();
+  for (size_t i = 0; i < peerCount; i++) {
+    uint32_t hourUs = rollingHourUs(peers[i].airtimeHourUs);
+    JsonObject entry = nodes.add<JsonObject>();
+    entry["name"] = peers[i].deviceName;
+    entry["hourUs"] = hourUs;
+    entry["dutyCyclePermille"] = (uint32_t) (hourUs / AIRTIME_HOUR_MS);
+    entry["sentToMs"] = peers[i].airtimeToPeerMs;
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Radio Queue
+// ***********************************
+// How long frames wait for the transmitter, per priority class, the
+// channel plan with slots and loss per channel (gateway), listen before
+// talk and backoff counters, the idle share of each core and the file ACK
+// round trip as seen by a node
+
+void getRadioStats(AsyncWebServerRequest *request) {
+
+  static const char* classNames[RADIO_CLASSES] = {"control", "alarm", "config", "bulk"};
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  obj["packets"] = radioStats.packets;
+  obj["bundles"] = radioStats.bundles;
+  obj["txTimeouts"] = radioStats.txTimeouts;
+  obj["oversize"] = radioStats.oversize;
+  obj["rxPackets"] = radioStats.rxPackets;
+  obj["rxDropped"] = radioStats.rxDropped;
+
+  obj["channel"] = radioChannel();
+  obj["hops"] = radioStats.hops;
+
+  JsonArray channels = obj["channels"].to<JsonArray>();
+  for (uint8_t c = 0; c < LORA_CHANNELS; c++) {
+    const ChannelStats& stats = channelStats[c];
+    JsonObject entry = channels.add<JsonObject>();
+    entry["channel"] = c;
+    entry["frequencyHz"] = channelFrequencyHz(c);
+    entry["slots"] = stats.slots;
+    entry["completed"] = stats.completed;
+    entry["chunksSent"] = stats.chunksSent;
+    entry["chunksLost"] = stats.chunksLost;
+    entry["lossPermille"] = stats.lossPermille;
+  }
+
+  JsonObject lbt = obj["lbt"].to<JsonObject>();
+  lbt["frames"] = radioStats.lbtFrames;
+  lbt["cadChecks"] = radioStats.cadChecks;
+  lbt["channelBusy"] = radioStats.channelBusy;
+  lbt["cadTimeouts"] = radioStats.cadTimeouts;
+  lbt["backoffs"] = radioStats.backoffs;
+  lbt["backoffMs"] = radioStats.backoffMs;
+  lbt["forced"] = radioStats.lbtForced;
+  lbt["unanswered"] = radioStats.unanswered;
+
+  JsonArray classes = obj["classes"].to<JsonArray>();
+  for (int c = 0; c < RADIO_CLASSES; c++) {
+    const RadioClassStats& stats = radioStats.classes[c];
+    JsonObject entry = classes.add<JsonObject>();
+    entry["class"] = classNames[c];
+    entry["frames"] = stats.frames;
+    entry["piggybacked"] = stats.piggybacked;
+    entry["avgWaitUs"] = stats.frames ? (uint32_t) (stats.waitUs / stats.frames) : 0;
+    entry["maxWaitUs"] = stats.maxWaitUs;
+    entry["maxDepth"] = stats.maxDepth;
+  }
+
+  JsonArray cores = obj["cores"].to<JsonArray>();
+  for (int core = 0; core < CPU_LOAD_CORES; core++) {
+    JsonObject entry = cores.add<JsonObject>();
+    entry["idlePermille"] = cpuLoadStats.idlePermille[core];
+    entry["minIdlePermille"] = cpuLoadStats.minIdlePermille[core];
+  }
+
+  JsonObject rtt = obj["ackRtt"].to<JsonObject>();
+  rtt["acks"] = ackRttStats.acks;
+  rtt["timeouts"] = ackRttStats.timeouts;
+  rtt["avgUs"] = ackRttStats.acks ? (uint32_t) (ackRttStats.totalUs / ackRttStats.acks) : 0;
+  rtt["maxUs"] = ackRttStats.maxUs;
+  rtt["lastUs"] = ackRttStats.lastUs;
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Time Sync
+// ***********************************
+// Node: its last exchange and drift model, gateway and relay: requests served.
+// The gateway adds its model of each node clock, offsets in us at this time.
+
+void getTimeSyncStats(AsyncWebServerRequest *request) {
+
+  JsonDocument doc;
+  JsonObject obj = doc.to<JsonObject>();
+
+  TimeSyncStats stats = timeSyncStats; // snapshot, counters may move while serving
+
+  obj["networkTime"] = get_current_time(true);
+  obj["clockSynced"] = clock_synced;
+  obj["exchanges"] = stats.exchanges;
+  obj["timeouts"] = stats.timeouts;
+  obj["rejected"] = stats.rejected;
+  obj["broadcasts"] = stats.broadcasts;
+  obj["steps"] = stats.steps;
+  obj["slews"] = stats.slews;
+  obj["served"] = stats.served;
+  obj["lastOffsetUs"] = stats.lastOffsetUs;
+  obj["lastDelayUs"] = stats.lastDelayUs;
+  obj["skewPpb"] = stats.skewPpb;
+  obj["intervalMs"] = stats.intervalMs;
+  obj["rtcWrites"] = stats.rtcWrites;
+  if (stats.lastSyncAt != 0) {
+    obj["lastSyncAgeMs"] = millis() - stats.lastSyncAt;
+  }
+
+  if (systemConfig.LORA_MODE == LORA_GATEWAY) {
+    int64_t now = networkTimeUs();
+    JsonArray nodes = obj["nodes"].to<JsonArray>();
+    for (size_t i = 0; i < peerCount; i++) {
+      PeerClock clock = peers[i].clock;
+      if (clock.segments[0].startUs == 0) {
+        continue;
+      }
+      JsonObject entry = nodes.add<JsonObject>();
+      int64_t offsetUs = 0;
+      clockModelOffset(&clock, now, &offsetUs);
+      entry["deviceName"] = peers[i].deviceName;
+      entry["offsetUs"] = offsetUs;
+      entry["skewPpb"] = clock.segments[0].skewPpb;
+      entry["samples"] = clock.samples;
+      entry["lastResidualUs"] = clock.lastResidualUs;
+      entry["corrections"] = clock.corrections;
+      entry["segmentAgeS"] = (int32_t) ((now - clock.segments[0].startUs) / 1000000);
+    }
+  }
+
+  serveJson(request, doc, 200, false);
+}
+
+// ***********************************
+// * Peer Lookup Benchmark
+// ***********************************
+// Linear scan vs hash index at 30, 300 and 1000 peers, times in us per lookup
+
+void getPeerLookupBenchmark(AsyncWebServerRequest *request) {
+
+  const size_t sizes[] = {30, 300, 1000};
+  const uint32_t lookups = 1000;
+
+  JsonDocument doc;
+  JsonArray results = doc.to<JsonArray>();
+
+  for (size_t size : sizes) {
+    PeerLookupBenchmark bench;
+    if (!benchmarkPeerLookup(size, lookups, &bench)) {
+      request->send(500, "text/plain", "Out of memory");
+      return;
+    }
+    JsonObject obj = results.add<JsonObject>();
+    obj["peers"] = bench.peers;
+    obj["lookups"] = bench.lookups;
+    obj["linearMacUs"] = (float) bench.linearMacUs / bench.lookups;
+    obj["hashedMacUs"] = (float) bench.hashedMacUs / bench.lookups;
+    obj["linearNameUs"] = (float) bench.linearNameUs / bench.lookups;
+    obj["hashedNameUs"] = (float) bench.hashedNameUs / bench.lookups;
+  }
+
+  serveJson(request, doc, 200, false);
+}
 
 /******************************************************************
  *                                                                *
@@ -341,6 +864,18 @@ void getLoRaNetworkStatus(AsyncWebServerRequest *request) {
  *                                                                *
  ******************************************************************/
 
+// Queues a batch of config ops for a node, answered with 202 since the
+// node applies it later
+void send_config_delta(AsyncWebServerRequest *request, const String& deviceName, const uint8_t* ops, size_t len, uint8_t count) {
+  uint8_t mac[MAC_ADDR_LENGTH];
+  getMacByDeviceName(deviceName, mac);
+  if (!configOutboxAdd(mac, ops, len, count)) {
+    request->send(503, "application/json", "{\"error\":\"Config outbox full\"}");
+    return;
+  }
+  request->send(202); // Accepted, delivered and retried by the gateway
+}
+
 // ************************************
 // * Update Data Collection Settings
 // ************************************
@@ -374,23 +909,31 @@ AsyncCallbackJsonWebHandler* updateCollectionConfig() {
 
     }
     else if(isDeviceNameValid(deviceName)){
-      // Implementation to send the configuration update to remote stations
-      collectionconfig_message msg;
-      msg.msgType = DATA_CONFIG;                                          // msgType
-      getMacByDeviceName(deviceName, msg.mac);                            // MAC
-
-
-      strncpy(msg.type, type.c_str(), MAX_JSON_LEN_2 - 1);                    // type
-      msg.key[MAX_JSON_LEN_2 - 1] = '\0'; // Null-terminate the string
-      strncpy(msg.index, String(index).c_str(), MAX_JSON_LEN_2 - 1);                    // index
-      msg.key[MAX_JSON_LEN_2 - 1] = '\0'; // Null-terminate the string
-
-      strncpy(msg.key, key.c_str(), MAX_JSON_LEN_2 - 1);                    // key
-      msg.key[MAX_JSON_LEN_2 - 1] = '\0'; // Null-terminate the string
-      strncpy(msg.value, value.c_str(), MAX_JSON_LEN_2 - 1);                //value
-      msg.value[MAX_JSON_LEN_2 - 1] = '\0'; // Null-terminate the string
-      sendLoraMessage((uint8_t *) &msg, sizeof(msg));
-      request->send(200); // Send an empty response with HTTP status code 200
+      // Queue the update as one config delta, {"ops": [...]} batches several
+      uint8_t ops[CONFIG_DELTA_MAX_BYTES];
+      size_t len = 0;
+      uint8_t count = 0;
+      JsonArray opArray = json["ops"].as<JsonArray>();
+      if (opArray.isNull()) {
+        size_t opLen = encodeCollectionOp(ops, sizeof(ops), type, index, key, value);
+        if (opLen == 0) {
+          request->send(400, "application/json", "{\"error\":\"Invalid configuration op\"}");
+          return;
+        }
+        len += opLen;
+        count++;
+      }
+      for (JsonObject op : opArray) {
+        size_t opLen = encodeCollectionOp(ops + len, sizeof(ops) - len, op["type"].as<String>(),
+                                          op["index"].as<int>(), op["key"].as<String>(), op["value"].as<String>());
+        if (opLen == 0 || count == 255) {
+          request->send(400, "application/json", "{\"error\":\"Invalid configuration op or batch too large\"}");
+          return;
+        }
+        len += opLen;
+        count++;
+      }
+      send_config_delta(request, deviceName, ops, len, count);
     }
     else {
       // Handle other device types or invalid device
@@ -428,20 +971,99 @@ AsyncCallbackJsonWebHandler* updateSysConfig() {
       update_system_configuration(key, value);
     }
     else if(isDeviceNameValid(deviceName)){
-      // Implementation to send the configuration update to remote stations
-      sysconfig_message msg;
-      msg.msgType = SYS_CONFIG;                                          // msgType
-      getMacByDeviceName(deviceName, msg.mac);                            // MAC
-      strncpy(msg.key, key.c_str(), MAX_JSON_LEN_1 - 1);                    // key
-      msg.key[MAX_JSON_LEN_1 - 1] = '\0'; // Null-terminate the string
-      strncpy(msg.value, value.c_str(), MAX_JSON_LEN_1 - 1);                //value
-      msg.value[MAX_JSON_LEN_1 - 1] = '\0'; // Null-terminate the string
-      sendLoraMessage((uint8_t *) &msg, sizeof(msg));
-      request->send(200); // Send an empty response with HTTP status code 200
+      // Every key in the object goes into one config delta
+      uint8_t ops[CONFIG_DELTA_MAX_BYTES];
+      size_t len = 0;
+      uint8_t count = 0;
+      for (JsonPair kv : jsonObj) {
+        size_t opLen = encodeSysOp(ops + len, sizeof(ops) - len, kv.key().c_str(), kv.value().as<String>());
+        if (opLen == 0 || count == 255) {
+          request->send(400, "application/json", "{\"error\":\"Invalid configuration key or batch too large\"}");
+          return;
+        }
+        len += opLen;
+        count++;
+      }
+      send_config_delta(request, deviceName, ops, len, count);
     }
     else{
       // Handle other device types or invalid device
       request->send(400, "application/json", "{\"error\":\"Invalid device parameter\"}");
     }
   });
-}
\ No newline at end of file
+}
+
+
+// ************************************
+// * Update LoRa Peer Poll Priority
+// ************************************
+
+AsyncCallbackJsonWebHandler* updatePeerPriority() {
+  return new AsyncCallbackJsonWebHandler("/api/lora-network/priority", [](AsyncWebServerRequest *request, JsonVariant &json) {
+
+    if (!request->hasParam("device")){
+      request->send(400, "application/json", "{\"error\":\"Device query parameter is missing\"}");
+      return;
+    }
+
+    String deviceName = request->getParam("device")->value();
+    int index = getIndexByDeviceName(deviceName);
+    if (index < 0) {
+      request->send(400, "application/json", "{\"error\":\"Invalid device parameter\"}");
+      return;
+    }
+
+    int priority = json["priority"].as<int>();
+    if (priority < PEER_PRIORITY_DEFAULT || priority > PEER_PRIORITY_MAX) {
+      request->send(400, "application/json", "{\"error\":\"Priority out of range\"}");
+      return;
+    }
+
+    peers[index].priority = priority;
+    schedulePersistPeer(index);
+    Serial.printf("Device: %s, poll priority: %d\n", deviceName.c_str(), priority);
+    request->send(200); // Send an empty response with HTTP status code 200
+  });
+}
+
+// ************************************
+// * Start Firmware Campaign
+// ************************************
+// {"path": "/firmware/app.bin", "nodes": ["node1", ...]} with an image or a
+// patch made by `program delta`, no nodes = every node it can reach.
+// {"cancel": true} stops the running campaign.
+
+AsyncCallbackJsonWebHandler* startFirmwareCampaign() {
+  return new AsyncCallbackJsonWebHandler("/api/lora-network/firmware", [](AsyncWebServerRequest *request, JsonVariant &json) {
+
+    if (json["cancel"].as<bool>()) {
+      firmwareCampaignCancel();
+      request->send(200);
+      return;
+    }
+
+    String path = json["path"].as<String>();
+    if (path.length() == 0 || !SD.exists(path)) {
+      request->send(400, "application/json", "{\"error\":\"Firmware file not found\"}");
+      return;
+    }
+
+    uint16_t nodeIds[FW_OFFER_TARGETS];
+    size_t count = 0;
+    for (JsonVariant device : json["nodes"].as<JsonArray>()) {
+      int index = getIndexByDeviceName(device.as<String>());
+      if (index < 0 || count >= FW_OFFER_TARGETS) {
+        request->send(400, "application/json", "{\"error\":\"Invalid node list\"}");
+        return;
+      }
+      nodeIds[count++] = peers[index].nodeId;
+    }
+
+    if (!firmwareCampaignStart(path.c_str(), nodeIds, count)) {
+      request->send(409, "application/json", "{\"error\":\"A firmware campaign is already running\"}");
+      return;
+    }
+    Serial.printf("Firmware campaign requested: %s\n", path.c_str());
+    request->send(202); // Accepted, the gateway sends it between poll cycles
+  });
+}
@@ -0,0 +1,376 @@
+#include "config_codec.h"
+
+// **************************************
+// * Writer
+// **************************************
+typedef struct ConfigWriter {
+  uint8_t* out;
+  size_t size;
+  size_t pos;
+  bool overflow;
+} ConfigWriter;
+
+static void putByte(ConfigWriter* w, uint8_t value) {
+  if (w->pos >= w->size) {
+    w->overflow = true;
+    return;
+  }
+  w->out[w->pos++] = value;
+}
+
+static void putVarint(ConfigWriter* w, uint32_t value) {
+  while (value >= 0x80) {
+    putByte(w, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  putByte(w, value);
+}
+
+static void putKey(ConfigWriter* w, uint8_t tag, uint8_t wireType) {
+  putByte(w, (tag << 1) | wireType);
+}
+
+static void putString(ConfigWriter* w, uint8_t tag, const char* value, size_t maxLen) {
+  size_t len = strnlen(value, maxLen);
+  putKey(w, tag, CFG_BYTES);
+  putVarint(w, len);
+  for (size_t i = 0; i < len; i++) {
+    putByte(w, value[i]);
+  }
+}
+
+static void putBank(ConfigWriter* w, uint8_t tag, int count, const SensorType* types,
+                    const bool* enabled, const uint16_t* intervals) {
+  uint8_t bank[64];
+  ConfigWriter b = {bank, sizeof(bank), 0, false};
+
+  putVarint(&b, count);
+  for (int i = 0; i < count; i += 8) {
+    uint8_t bits = 0;
+    for (int k = 0; k < 8 && i + k < count; k++) {
+      if (enabled[i + k]) bits |= 1 << k;
+    }
+    putByte(&b, bits);
+  }
+
+  uint8_t nibbles = 0;
+  int packed = 0;
+  for (int i = 0; i < count; i++) {
+    if (!enabled[i]) continue;
+    nibbles |= (types[i] & 0x0F) << (packed * 4);
+    if (++packed == 2) {
+      putByte(&b, nibbles);
+      nibbles = 0;
+      packed = 0;
+    }
+  }
+  if (packed) {
+    putByte(&b, nibbles);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (enabled[i]) putVarint(&b, intervals[i]);
+  }
+
+  putKey(w, tag, CFG_BYTES);
+  putVarint(w, b.pos);
+  for (size_t i = 0; i < b.pos; i++) {
+    putByte(w, bank[i]);
+  }
+  w->overflow |= b.overflow;
+}
+
+// Returns the encoded size, 0 if it does not fit
+size_t encodeConfig(const DataCollectionConfig& data, const SystemConfig& sys, uint8_t* out, size_t size) {
+  ConfigWriter w = {out, size, 0, false};
+
+  putByte(&w, CONFIG_CODEC_VERSION);
+  putString(&w, CFG_DEVICE_NAME, sys.DEVICE_NAME, sizeof(sys.DEVICE_NAME));
+  putString(&w, CFG_WIFI_SSID, sys.WIFI_SSID, sizeof(sys.WIFI_SSID));
+  putKey(&w, CFG_LORA_MODE, CFG_VARINT);
+  putVarint(&w, sys.LORA_MODE);
+  putKey(&w, CFG_UTC_OFFSET, CFG_VARINT);
+  putVarint(&w, ((uint32_t) sys.utcOffset << 1) ^ (uint32_t) (sys.utcOffset >> 31));
+  putKey(&w, CFG_PAIRING_KEY, CFG_VARINT);
+  putVarint(&w, sys.PAIRING_KEY);
+  putKey(&w, CFG_DUTY_CYCLE, CFG_VARINT);
+  putVarint(&w, sys.DUTY_CYCLE_PERMILLE);
+  putKey(&w, CFG_RADIO_WAKE, CFG_VARINT);
+  putVarint(&w, sys.RADIO_WAKE_S);
+  putKey(&w, CFG_SAMPLE_TIME_MS, CFG_VARINT);
+  putVarint(&w, sys.SAMPLE_TIME_MS);
+
+  putBank(&w, CFG_ADC, ADC_CHANNEL_COUNT, data.adcSensorType, data.adcEnabled, data.adcInterval);
+  putBank(&w, CFG_UART, UART_CHANNEL_COUNT, data.uartSensorType, data.uartEnabled, data.uartInterval);
+  putBank(&w, CFG_I2C, I2C_CHANNEL_COUNT, data.i2cSensorType, data.i2cEnabled, data.i2cInterval);
+
+  return w.overflow ? 0 : w.pos;
+}
+
+// **************************************
+// * Reader
+// **************************************
+typedef struct ConfigReader {
+  const uint8_t* in;
+  size_t len;
+  size_t pos;
+  bool error;
+} ConfigReader;
+
+static uint8_t getByte(ConfigReader* r) {
+  if (r->pos >= r->len) {
+    r->error = true;
+    return 0;
+  }
+  return r->in[r->pos++];
+}
+
+static uint32_t getVarint(ConfigReader* r) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = getByte(r);
+    value |= (uint32_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  r->error = true;
+  return 0;
+}
+
+static void getString(ConfigReader* r, size_t len, char* value, size_t size) {
+  if (r->pos + len > r->len) {
+    r->error = true;
+    return;
+  }
+  memset(value, 0, size);
+  for (size_t i = 0; i < len; i++) {
+    char c = getByte(r);
+    if (i < size - 1) value[i] = c;
+  }
+}
+
+// Channels beyond the local count are ignored. Disabled channels keep
+// their previous type and interval.
+static void getBank(ConfigReader* r, size_t len, int localCount, SensorType* types,
+                    bool* enabled, uint16_t* intervals) {
+  ConfigReader b = {r->in + r->pos, len, 0, false};
+  if (r->pos + len > r->len) {
+    r->error = true;
+    return;
+  }
+  r->pos += len;
+
+  int count = getVarint(&b);
+  if (count > 255) {
+    r->error = true;
+    return;
+  }
+  bool on[256];
+  for (int i = 0; i < count; i += 8) {
+    uint8_t bits = getByte(&b);
+    for (int k = 0; k < 8 && i + k < count; k++) {
+      on[i + k] = bits & (1 << k);
+    }
+  }
+
+  int enabledCount = 0;
+  for (int i = 0; i < count; i++) {
+    if (on[i]) enabledCount++;
+  }
+
+  uint8_t nibbleBytes[128];
+  for (int i = 0; i < (enabledCount + 1) / 2; i++) {
+    nibbleBytes[i] = getByte(&b);
+  }
+
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    uint16_t interval = 0;
+    SensorType type = Unknown;
+    if (on[i]) {
+      type = (SensorType) ((nibbleBytes[n / 2] >> ((n % 2) * 4)) & 0x0F);
+      interval = getVarint(&b);
+      n++;
+    }
+    if (i < localCount) {
+      enabled[i] = on[i];
+      if (on[i]) {
+        types[i] = type;
+        intervals[i] = interval;
+      }
+    }
+  }
+  r->error |= b.error;
+}
+
+// Applies the encoded fields onto data and sys, false if malformed or of an unknown version
+bool decodeConfig(const uint8_t* in, size_t len, DataCollectionConfig* data, SystemConfig* sys) {
+  ConfigReader r = {in, len, 0, false};
+
+  if (getByte(&r) != CONFIG_CODEC_VERSION) {
+    return false;
+  }
+
+  while (!r.error && r.pos < r.len) {
+    uint8_t key = getByte(&r);
+    uint8_t tag = key >> 1;
+    uint32_t value = getVarint(&r);  // the value, or the length of a byte field
+
+    if ((key & 1) == CFG_VARINT) {
+      switch (tag) {
+        case CFG_LORA_MODE:   sys->LORA_MODE = value; break;
+        case CFG_UTC_OFFSET:  sys->utcOffset = (int) (value >> 1) ^ -(int) (value & 1); break;
+        case CFG_PAIRING_KEY: sys->PAIRING_KEY = value; break;
+        case CFG_DUTY_CYCLE:  sys->DUTY_CYCLE_PERMILLE = value; break;
+        case CFG_RADIO_WAKE:  sys->RADIO_WAKE_S = value; break;
+        case CFG_SAMPLE_TIME_MS: sys->SAMPLE_TIME_MS = value; break;
+        default: break;
+      }
+      continue;
+    }
+
+    switch (tag) {
+      case CFG_DEVICE_NAME: getString(&r, value, sys->DEVICE_NAME, sizeof(sys->DEVICE_NAME)); break;
+      case CFG_WIFI_SSID:   getString(&r, value, sys->WIFI_SSID, sizeof(sys->WIFI_SSID)); break;
+      case CFG_ADC:  getBank(&r, value, ADC_CHANNEL_COUNT, data->adcSensorType, data->adcEnabled, data->adcInterval); break;
+      case CFG_UART: getBank(&r, value, UART_CHANNEL_COUNT, data->uartSensorType, data->uartEnabled, data->uartInterval); break;
+      case CFG_I2C:  getBank(&r, value, I2C_CHANNEL_COUNT, data->i2cSensorType, data->i2cEnabled, data->i2cInterval); break;
+      default:
+        if (r.pos + value > r.len) r.error = true;
+        else r.pos += value;  // unknown field, skip
+    }
+  }
+
+  return !r.error;
+}
+
+// **************************************
+// * Config Delta
+// **************************************
+
+static bool isTextField(uint8_t bank, uint8_t field) {
+  return bank == DELTA_SYS
+      && (field == DELTA_WIFI_SSID || field == DELTA_WIFI_PASSWORD || field == DELTA_DEVICE_NAME);
+}
+
+// Appends one op, returns its size or 0 if it does not fit
+size_t encodeConfigOp(uint8_t* out, size_t size, uint8_t bank, uint8_t channel, uint8_t field,
+                      uint32_t value, const char* text) {
+  ConfigWriter w = {out, size, 0, false};
+  putByte(&w, (bank << 4) | (field & 0x0F));
+  if (bank != DELTA_SYS) {
+    putByte(&w, channel);
+  }
+  if (isTextField(bank, field)) {
+    size_t len = text ? strlen(text) : 0;
+    putVarint(&w, len);
+    for (size_t i = 0; i < len; i++) {
+      putByte(&w, text[i]);
+    }
+  } else {
+    putVarint(&w, value);
+  }
+  return w.overflow ? 0 : w.pos;
+}
+
+static bool setText(ConfigReader* r, char* target, size_t size) {
+  uint32_t len = getVarint(r);
+  if (r->error || len > size - 1 || r->pos + len > r->len) {
+    return false;
+  }
+  memset(target, 0, size);
+  memcpy(target, r->in + r->pos, len);
+  r->pos += len;
+  return true;
+}
+
+static bool applyChannelOp(uint8_t field, uint32_t value, SensorType* type, bool* enabled, uint16_t* interval) {
+  switch (field) {
+    case DELTA_ENABLED:  *enabled = value != 0; return true;
+    case DELTA_INTERVAL: if (value > 0xFFFF) return false; *interval = value; return true;
+    case DELTA_SENSOR:   if (value > 0x0F) return false; *type = (SensorType) value; return true;
+    default: return false;
+  }
+}
+
+// Applies every op onto data and sys. The caller passes copies and keeps
+// them only if this returns true, so a bad op leaves nothing half-applied.
+bool applyConfigDelta(const uint8_t* ops, size_t len, uint8_t count, DataCollectionConfig* data, SystemConfig* sys) {
+  ConfigReader r = {ops, len, 0, false};
+
+  for (uint8_t n = 0; n < count; n++) {
+    uint8_t key = getByte(&r);
+    uint8_t bank = key >> 4;
+    uint8_t field = key & 0x0F;
+    bool ok = false;
+
+    if (bank == DELTA_SYS) {
+      switch (field) {
+        case DELTA_WIFI_SSID:     ok = setText(&r, sys->WIFI_SSID, sizeof(sys->WIFI_SSID)); break;
+        case DELTA_WIFI_PASSWORD: ok = setText(&r, sys->WIFI_PASSWORD, sizeof(sys->WIFI_PASSWORD)); break;
+        case DELTA_DEVICE_NAME:   ok = setText(&r, sys->DEVICE_NAME, sizeof(sys->DEVICE_NAME)); break;
+        case DELTA_UTC_OFFSET: {
+          uint32_t value = getVarint(&r);
+          sys->utcOffset = (int) (value >> 1) ^ -(int) (value & 1);
+          ok = true;
+          break;
+        }
+        case DELTA_LORA_MODE:     sys->LORA_MODE = getVarint(&r); ok = true; break;
+        case DELTA_PAIRING_KEY:   sys->PAIRING_KEY = getVarint(&r); ok = true; break;
+        case DELTA_DUTY_CYCLE: {
+          uint32_t value = getVarint(&r);
+          sys->DUTY_CYCLE_PERMILLE = value;
+          ok = value <= 1000;
+          break;
+        }
+        case DELTA_RADIO_WAKE: {
+          uint32_t value = getVarint(&r);
+          sys->RADIO_WAKE_S = value;
+          ok = value <= 43200;
+          break;
+        }
+        case DELTA_SAMPLE_TIME_MS: {
+          uint32_t value = getVarint(&r);
+          sys->SAMPLE_TIME_MS = value;
+          ok = value <= 1;
+          break;
+        }
+        default: break;
+      }
+    } else {
+      uint8_t channel = getByte(&r);
+      uint32_t value = getVarint(&r);
+      switch (bank) {
+        case DELTA_ADC:
+          ok = channel < ADC_CHANNEL_COUNT && applyChannelOp(field, value,
+               &data->adcSensorType[channel], &data->adcEnabled[channel], &data->adcInterval[channel]);
+          break;
+        case DELTA_UART:
+          ok = channel < UART_CHANNEL_COUNT && applyChannelOp(field, value,
+               &data->uartSensorType[channel], &data->uartEnabled[channel], &data->uartInterval[channel]);
+          break;
+        case DELTA_I2C:
+          ok = channel < I2C_CHANNEL_COUNT && applyChannelOp(field, value,
+               &data->i2cSensorType[channel], &data->i2cEnabled[channel], &data->i2cInterval[channel]);
+          break;
+        default: break;
+      }
+    }
+
+    if (!ok || r.error) {
+      return false;
+    }
+  }
+  return r.pos == r.len;
+}
+
+// FNV-1a
+uint32_t configBytesHash(const uint8_t* data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash ? hash : 1;
+}
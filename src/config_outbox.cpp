@@ -0,0 +1,231 @@
+#include <Preferences.h>
+#include "config_outbox.h"
+#include "lora_peer.h"
+#include "lora_relay.h"
+#include "lora_dutycycle.h"
+
+ConfigTransaction configOutbox[CONFIG_OUTBOX_SIZE];
+uint16_t nextTxnId = 1;       // kept in NVS, a node drops a delta with the txnId it applied last
+Preferences outboxPreferences;
+SemaphoreHandle_t xMutex_ConfigOutbox = NULL; // the HTTP server adds, the control task sends
+
+// **************************************
+// * Queue Ops
+// **************************************
+void config_outbox_init() {
+  memset(configOutbox, 0, sizeof(configOutbox));
+  xMutex_ConfigOutbox = xSemaphoreCreateMutex();
+  outboxPreferences.begin("outbox", false);
+  nextTxnId = outboxPreferences.getUShort("txn", 1);
+  if (nextTxnId == 0) nextTxnId = 1;
+}
+
+// Adds a batch of encoded ops to the node's unsent transaction, or starts
+// a new one. A batch is never split across transactions.
+bool configOutboxAdd(const uint8_t* mac, const uint8_t* ops, size_t len, uint8_t count) {
+
+  // a delta to a node behind relays has to fit a RELAY frame
+  int index = getIndexByMac(mac);
+  size_t maxBytes = CONFIG_DELTA_MAX_BYTES;
+  if (index >= 0 && peers[index].routeHops > 0) {
+    maxBytes = min(maxBytes, (size_t) (RELAY_PAYLOAD_MAX - offsetof(config_delta_message, ops)));
+  }
+
+  if (xMutex_ConfigOutbox == NULL || len == 0 || len > maxBytes) {
+    return false;
+  }
+  xSemaphoreTake(xMutex_ConfigOutbox, portMAX_DELAY);
+
+  ConfigTransaction* txn = NULL;
+  ConfigTransaction* free = NULL;
+  for (size_t i = 0; i < CONFIG_OUTBOX_SIZE; i++) {
+    ConfigTransaction* entry = &configOutbox[i];
+    if (!entry->used) {
+      if (free == NULL) free = entry;
+      continue;
+    }
+    if (entry->attempts == 0 && compareMacAddress(entry->mac, mac)
+        && entry->len + len <= maxBytes && entry->opCount + count <= 255) {
+      txn = entry;
+    }
+  }
+
+  if (txn == NULL && free != NULL) {
+    txn = free;
+    memset(txn, 0, sizeof(ConfigTransaction));
+    txn->used = true;
+    memcpy(txn->mac, mac, MAC_ADDR_LENGTH);
+    txn->txnId = nextTxnId++;
+    if (nextTxnId == 0) nextTxnId = 1;
+    outboxPreferences.putUShort("txn", nextTxnId);
+    txn->queuedAt = millis();
+    txn->nextAttempt = txn->queuedAt;
+  }
+
+  bool added = txn != NULL;
+  if (added) {
+    memcpy(txn->ops + txn->len, ops, len);
+    txn->len += len;
+    txn->opCount += count;
+  }
+  xSemaphoreGive(xMutex_ConfigOutbox);
+  return added;
+}
+
+int sensorTypeFromString(const String& value) {
+  const char* names[] = {"Unknown", "VibratingWire", "Barometric", "GeoPhone", "Inclinometer", "RainGauege"};
+  for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+    if (value.equals(names[i])) return i;
+  }
+  return -1;
+}
+
+// Same keys as updateDataCollectionConfiguration. Returns the op size, 0 if invalid or full.
+size_t encodeCollectionOp(uint8_t* out, size_t size, const String& type, int index, const String& key, const String& value) {
+
+  uint8_t bank;
+  if (type.equals("ADC") && index >= 0 && index < ADC_CHANNEL_COUNT) bank = DELTA_ADC;
+  else if (type.equals("UART") && index >= 0 && index < UART_CHANNEL_COUNT) bank = DELTA_UART;
+  else if (type.equals("I2C") && index >= 0 && index < I2C_CHANNEL_COUNT) bank = DELTA_I2C;
+  else return 0;
+
+  uint8_t field;
+  uint32_t opValue;
+  if (key.equals("enabled")) {
+    field = DELTA_ENABLED;
+    opValue = value.equals("true");
+  } else if (key.equals("interval")) {
+    field = DELTA_INTERVAL;
+    opValue = value.toInt();
+  } else if (key.equals("sensorType")) {
+    int sensor = sensorTypeFromString(value);
+    if (sensor < 0) return 0;
+    field = DELTA_SENSOR;
+    opValue = sensor;
+  } else {
+    return 0;
+  }
+
+  return encodeConfigOp(out, size, bank, index, field, opValue);
+}
+
+// Same keys as update_system_configuration. Returns the op size, 0 if invalid or full.
+size_t encodeSysOp(uint8_t* out, size_t size, const String& key, const String& value) {
+
+  uint8_t field;
+  uint32_t opValue = 0;
+  if (key.equals("WIFI_SSID")) field = DELTA_WIFI_SSID;
+  else if (key.equals("WIFI_PASSWORD")) field = DELTA_WIFI_PASSWORD;
+  else if (key.equals("DEVICE_NAME")) field = DELTA_DEVICE_NAME;
+  else if (key.equals("UTC_OFFSET")) {
+    int32_t offset = value.toInt();
+    field = DELTA_UTC_OFFSET;
+    opValue = ((uint32_t) offset << 1) ^ (uint32_t) (offset >> 31);
+  }
+  else if (key.equals("LORA_MODE")) { field = DELTA_LORA_MODE; opValue = value.toInt(); }
+  else if (key.equals("PAIRING_KEY")) { field = DELTA_PAIRING_KEY; opValue = strtoul(value.c_str(), NULL, 10); }
+  else if (key.equals("DUTY_CYCLE_PERMILLE")) { field = DELTA_DUTY_CYCLE; opValue = constrain(value.toInt(), 0, 1000); }
+  else if (key.equals("RADIO_WAKE_S")) { field = DELTA_RADIO_WAKE; opValue = constrain(value.toInt(), 0, 43200); }
+  else if (key.equals("SAMPLE_TIME_MS")) { field = DELTA_SAMPLE_TIME_MS; opValue = constrain(value.toInt(), 0, 1); }
+  else return 0;
+
+  return encodeConfigOp(out, size, DELTA_SYS, 0, field, opValue, value.c_str());
+}
+
+// **************************************
+// * Send
+// **************************************
+// Called from the control task between poll cycles. One transaction per
+// node is in flight at a time, oldest first.
+// A deep-sleep node is only told to stay up after its cycle when something waits for it
+bool configOutboxPending(const uint8_t* mac) {
+  bool pending = false;
+  xSemaphoreTake(xMutex_ConfigOutbox, portMAX_DELAY);
+  for (size_t i = 0; i < CONFIG_OUTBOX_SIZE && !pending; i++) {
+    pending = configOutbox[i].used && compareMacAddress(configOutbox[i].mac, mac);
+  }
+  xSemaphoreGive(xMutex_ConfigOutbox);
+  return pending;
+}
+
+void service_config_outbox() {
+
+  unsigned long now = millis();
+
+  for (size_t i = 0; i < CONFIG_OUTBOX_SIZE; i++) {
+    xSemaphoreTake(xMutex_ConfigOutbox, portMAX_DELAY);
+    ConfigTransaction* txn = &configOutbox[i];
+    bool due = txn->used && (long) (now - txn->nextAttempt) >= 0;
+    for (size_t k = 0; due && k < CONFIG_OUTBOX_SIZE; k++) {
+      const ConfigTransaction* other = &configOutbox[k];
+      if (k != i && other->used && compareMacAddress(other->mac, txn->mac)
+          && (long) (other->queuedAt - txn->queuedAt) < 0) {
+        due = false; // an older transaction for this node goes first
+      }
+    }
+    int index = due ? getIndexByMac(txn->mac) : -1;
+    if (due && index < 0) {
+      txn->used = false; // peer was removed
+      due = false;
+    }
+    if (due && peers[index].backoffUntil != 0 && (long) (peers[index].backoffUntil - now) > 0) {
+      due = false; // offline, try again once it is reachable
+    }
+    if (due && peers[index].wakePeriodS != 0 && (long) (peers[index].listenUntil - now) <= 0) {
+      due = false; // deep-sleep node, waits for the tail of its next cycle
+    }
+    if (due && !airtimeBulkAllowed(frameAirtimeUs(offsetof(config_delta_message, ops) + txn->len))) {
+      due = false; // duty-cycle budget nearly used, waits without using up an attempt
+    }
+    if (due && txn->attempts >= CONFIG_MAX_ATTEMPTS) {
+      Serial.printf("Config delta %u to %s dropped after %u attempts\n", txn->txnId, peers[index].deviceName, txn->attempts);
+      txn->used = false;
+      due = false;
+    }
+
+    config_delta_message msg;
+    if (due) {
+      msg.msgType = CONFIG_DELTA;
+      memcpy(msg.mac, txn->mac, MAC_ADDR_LENGTH);
+      msg.txnId = txn->txnId;
+      msg.opCount = txn->opCount;
+      msg.len = txn->len;
+      memcpy(msg.ops, txn->ops, txn->len);
+      txn->nextAttempt = now + ((unsigned long) CONFIG_RETRY_MS << txn->attempts);
+      txn->attempts++;
+    }
+    xSemaphoreGive(xMutex_ConfigOutbox);
+
+    if (due && xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
+      // nodes behind relays get the delta wrapped along their route
+      sendToPeer(getIndexByMac(msg.mac), (uint8_t *) &msg, offsetof(config_delta_message, ops) + msg.len);
+      xSemaphoreGive(xMutex_DataPoll);
+      Serial.printf("Sent config delta %u, %u ops\n", msg.txnId, msg.opCount);
+    }
+  }
+}
+
+// **************************************
+// * Acknowledgement
+// **************************************
+void handle_config_ack(const uint8_t *incomingData) {
+
+  config_ack_message ack;
+  memcpy(&ack, incomingData, sizeof(ack));
+
+  int index = getIndexByMac(ack.mac);
+  if (index >= 0) {
+    peers[index].reportedConfigHash = ack.configHash; // the next cycle pulls the new config
+  }
+
+  xSemaphoreTake(xMutex_ConfigOutbox, portMAX_DELAY);
+  for (size_t i = 0; i < CONFIG_OUTBOX_SIZE; i++) {
+    ConfigTransaction* txn = &configOutbox[i];
+    if (txn->used && txn->txnId == ack.txnId && compareMacAddress(txn->mac, ack.mac)) {
+      Serial.printf("Config delta %u %s\n", ack.txnId, ack.status == CONFIG_APPLIED ? "applied" : "rejected by node");
+      txn->used = false;
+      break;
+    }
+  }
+  xSemaphoreGive(xMutex_ConfigOutbox);
+}
@@ -1,7 +1,9 @@
 #include <Preferences.h>
+#include <nvs.h>
 #include <SD.h>
 #include <ArduinoJson.h>
 #include "configuration.h"
+#include "config_codec.h"
 #include "lora_init.h"
 
 Preferences preferences;
@@ -70,9 +72,14 @@ void load_system_configuration() {
   Serial.printf("Device Name: %s\n", systemConfig.DEVICE_NAME);
   Serial.printf("WIFI_SSID: %s\n", systemConfig.WIFI_SSID);
   Serial.printf("WIFI_PASSWORD: %s\n", systemConfig.WIFI_PASSWORD);
-  Serial.printf("Boot as: %s\n", systemConfig.LORA_MODE ? "Gateway" : "Node");
+  Serial.printf("Boot as: %s\n", systemConfig.LORA_MODE == LORA_GATEWAY ? "Gateway"
+                               : systemConfig.LORA_MODE == LORA_RELAY ? "Relay" : "Node");
   Serial.printf("PAIRING_KEY: %lu\n", systemConfig.PAIRING_KEY);
   Serial.printf("utcOffset: %d\n", systemConfig.utcOffset);
+  Serial.printf("DUTY_CYCLE_PERMILLE: %d\n", systemConfig.DUTY_CYCLE_PERMILLE);
+  Serial.printf("RADIO_WAKE_S: %d\n", systemConfig.RADIO_WAKE_S);
+  Serial.printf("SAMPLE_TIME_MS: %d\n", systemConfig.SAMPLE_TIME_MS);
+  Serial.printf("MQTT_HOST: %s:%d\n", systemConfig.MQTT_HOST, systemConfig.MQTT_PORT);
 
   saveSystemConfigToSD();
 
@@ -111,6 +118,23 @@ void update_system_configuration(String key, String value) {
     systemConfig.LORA_MODE = value.toInt();
   } else if (key.equals("PAIRING_KEY")) {
     systemConfig.PAIRING_KEY = static_cast<uint32_t>(strtoul(value.c_str(), NULL, 10));
+  } else if (key.equals("DUTY_CYCLE_PERMILLE")) {
+    systemConfig.DUTY_CYCLE_PERMILLE = constrain(value.toInt(), 0, 1000);
+  } else if (key.equals("RADIO_WAKE_S")) {
+    systemConfig.RADIO_WAKE_S = constrain(value.toInt(), 0, 43200);
+  } else if (key.equals("SAMPLE_TIME_MS")) {
+    systemConfig.SAMPLE_TIME_MS = constrain(value.toInt(), 0, 1);
+  } else if (key.equals("MQTT_HOST")) {
+    strncpy(systemConfig.MQTT_HOST, value.c_str(), sizeof(systemConfig.MQTT_HOST) - 1);
+    systemConfig.MQTT_HOST[sizeof(systemConfig.MQTT_HOST) - 1] = '\0';
+  } else if (key.equals("MQTT_PORT")) {
+    systemConfig.MQTT_PORT = constrain(value.toInt(), 0, 65535);
+  } else if (key.equals("MQTT_USER")) {
+    strncpy(systemConfig.MQTT_USER, value.c_str(), sizeof(systemConfig.MQTT_USER) - 1);
+    systemConfig.MQTT_USER[sizeof(systemConfig.MQTT_USER) - 1] = '\0';
+  } else if (key.equals("MQTT_PASSWORD")) {
+    strncpy(systemConfig.MQTT_PASSWORD, value.c_str(), sizeof(systemConfig.MQTT_PASSWORD) - 1);
+    systemConfig.MQTT_PASSWORD[sizeof(systemConfig.MQTT_PASSWORD) - 1] = '\0';
   } else {
     Serial.println("Invalid key");
   }
@@ -198,6 +222,18 @@ void loadDataConfigFromPreferences() {
   printDataConfig();
 }
 
+// Both configurations from flash only, for a deep-sleep wake: no SD copy, no printout
+void reload_configuration() {
+  preferences.begin("configurations", true);
+  if (preferences.isKey("sysconfig")) {
+    preferences.getBytes("sysconfig", &systemConfig, sizeof(systemConfig));
+  }
+  if (preferences.isKey("dataconfig")) {
+    preferences.getBytes("dataconfig", &dataConfig, sizeof(dataConfig));
+  }
+  preferences.end();
+}
+
 void updateDataCollectionConfiguration(String type, int index, String key, String value) {
   Serial.println("Updating data collection configuration...");
 
@@ -262,4 +298,65 @@ void updateDataCollectionConfiguration(String type, int index, String key, Strin
   saveDataConfigToSD();
   loadDataConfigFromPreferences(); // reload into struct after update
   Serial.println("Finished updating data collection configuration.");
-}
\ No newline at end of file
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Config Delta                          *
+ *                                                                *
+ ******************************************************************/
+
+// Applies a batch of ops from the gateway to copies of both configs, then
+// stores the changed blobs with a single NVS commit. Nothing is stored if
+// any op is invalid.
+bool apply_config_delta(const uint8_t* ops, size_t len, uint8_t count) {
+  DataCollectionConfig data = dataConfig;
+  SystemConfig sys = systemConfig;
+
+  if (!applyConfigDelta(ops, len, count, &data, &sys)) {
+    Serial.println("Config delta rejected.");
+    return false;
+  }
+
+  bool dataChanged = memcmp(&data, &dataConfig, sizeof(data)) != 0;
+  bool sysChanged = memcmp(&sys, &systemConfig, sizeof(sys)) != 0;
+
+  nvs_handle_t handle;
+  if (nvs_open("configurations", NVS_READWRITE, &handle) != ESP_OK) {
+    Serial.println("Config delta: NVS unavailable.");
+    return false;
+  }
+  esp_err_t err = ESP_OK;
+  if (dataChanged) err = nvs_set_blob(handle, "dataconfig", &data, sizeof(data));
+  if (sysChanged && err == ESP_OK) err = nvs_set_blob(handle, "sysconfig", &sys, sizeof(sys));
+  if (err == ESP_OK) err = nvs_commit(handle);
+  nvs_close(handle);
+  if (err != ESP_OK) {
+    Serial.println("Config delta: NVS write failed.");
+    return false;
+  }
+
+  dataConfig = data;
+  systemConfig = sys;
+  if (dataChanged) saveDataConfigToSD();
+  if (sysChanged) saveSystemConfigToSD();
+  Serial.printf("Config delta: %u ops applied.\n", count);
+  printDataConfig();
+  return true;
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Config Hash                           *
+ *                                                                *
+ ******************************************************************/
+
+// Hash of the compact encoding, which holds only the configured fields.
+// Readings, reading times, padding and the Wi-Fi password are left out, so
+// the hash changes only when the configuration does. Never 0, which means
+// unknown.
+uint32_t config_hash(const DataCollectionConfig& data, const SystemConfig& sys) {
+  uint8_t encoded[CONFIG_ENCODED_MAX];
+  size_t len = encodeConfig(data, sys, encoded, sizeof(encoded));
+  return configBytesHash(encoded, len);
+}
@@ -0,0 +1,43 @@
+#include <esp_freertos_hooks.h>
+#include "cpu_load.h"
+
+CpuLoadStats cpuLoadStats;
+
+volatile uint32_t idleTicks[CPU_LOAD_CORES];
+volatile uint32_t windowTicks[CPU_LOAD_CORES];
+
+void IRAM_ATTR sampleCore(int core) {
+  if (xTaskGetCurrentTaskHandleForCPU(core) == xTaskGetIdleTaskHandleForCPU(core)) {
+    idleTicks[core]++;
+  }
+  if (++windowTicks[core] < CPU_LOAD_WINDOW_TICKS) {
+    return;
+  }
+  uint16_t permille = idleTicks[core] * 1000 / windowTicks[core];
+  cpuLoadStats.idlePermille[core] = permille;
+  if (permille < cpuLoadStats.minIdlePermille[core]) {
+    cpuLoadStats.minIdlePermille[core] = permille;
+  }
+  if (core == 0) {
+    cpuLoadStats.windows++;
+  }
+  idleTicks[core] = 0;
+  windowTicks[core] = 0;
+}
+
+void IRAM_ATTR tickCore0() {
+  sampleCore(0);
+}
+
+void IRAM_ATTR tickCore1() {
+  sampleCore(1);
+}
+
+void cpu_load_init() {
+  memset(&cpuLoadStats, 0, sizeof(cpuLoadStats));
+  for (int core = 0; core < CPU_LOAD_CORES; core++) {
+    cpuLoadStats.minIdlePermille[core] = 1000;
+  }
+  esp_register_freertos_tick_hook_for_cpu(tickCore0, 0);
+  esp_register_freertos_tick_hook_for_cpu(tickCore1, 1);
+}
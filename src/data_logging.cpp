@@ -21,6 +21,21 @@ String createFilename(String type, int channel) {
   return filename;
 }
 
+const char* sampleBankName(SampleBank bank) {
+  return bank == BANK_ADC ? "ADC" : bank == BANK_UART ? "UART" : "I2C";
+}
+
+// Line a sample is logged as, also used by the deep-sleep buffer so both
+// profiles write the same files
+String formatSampleLine(SampleBank bank, int channel, String timestamp) {
+  if (bank == BANK_I2C) {
+    float temp = 100;
+    float pressure = 200;
+    return timestamp + "," + String(temp) + "," + String(pressure);
+  }
+  return timestamp + "," + String(channel) + (bank == BANK_ADC ? ",ADC data" : ",UART data");
+}
+
 void logADCData(int channel, String timestamp) {
   String filename = createFilename("ADC", channel);
   Serial.print(" Opened.");
@@ -36,7 +51,7 @@ void logADCData(int channel, String timestamp) {
   unsigned long startTime = millis(); // Start timing
   File dataFile = SD.open(filename, FILE_APPEND);
   if (dataFile) {
-    String data = timestamp + "," + String(channel) + ",ADC data";
+    String data = formatSampleLine(BANK_ADC, channel, timestamp);
     dataFile.println(data);
     dataFile.close();
     unsigned long endTime = millis(); // End timing
@@ -70,7 +85,7 @@ void logUARTData(int channel, String timestamp) {
   unsigned long startTime = millis(); // Start timing
   File dataFile = SD.open(filename, FILE_APPEND);
   if (dataFile) {
-    String data = timestamp + "," + String(channel) + ",UART data";
+    String data = formatSampleLine(BANK_UART, channel, timestamp);
     dataFile.println(data);
     dataFile.close();
     unsigned long endTime = millis(); // End timing
@@ -103,9 +118,7 @@ void logI2CData(int channel, String timestamp) {
   unsigned long startTime = millis(); // Start timing
   File dataFile = SD.open(filename, FILE_APPEND);
   if (dataFile) {
-    float temp = 100;
-    float pressure = 200;
-    String data = timestamp + "," + String(temp) + "," + String(pressure);
+    String data = formatSampleLine(BANK_I2C, channel, timestamp);
     dataFile.println(data);
     dataFile.close();
     unsigned long endTime = millis(); // End timing
@@ -154,9 +167,7 @@ void logDataTask(void *parameter) {
   }
 }
 
-void log_data_init() {
-  Serial.println("Initializing data logging.");
-
+void create_data_folders() {
   if (!SD.exists("/data/ADC")) {
     SD.mkdir("/data/ADC");
     Serial.println("Created /ADC directory on SD card.");
@@ -169,6 +180,12 @@ void log_data_init() {
     SD.mkdir("/data/I2C");
     Serial.println("Created /I2C directory on SD card.");
   }
+}
+
+void log_data_init() {
+  Serial.println("Initializing data logging.");
+
+  create_data_folders();
 
   unsigned long currentTime = millis() / 60000; // Convert milliseconds to minutes
 
@@ -0,0 +1,155 @@
+#include <SD.h>
+#include "file_integrity.h"
+#include "firmware_delta.h"
+#include "lora_init.h"
+
+SemaphoreHandle_t xMutex_BlockCache = NULL; // receive task hashing, SD writer dropping entries
+uint8_t blockBuffer[VERIFY_BLOCK_SIZE];
+
+// /data/ADC/3.dat -> /data/ADC/3.blk
+String blockCacheFilename(const char* path) {
+  String name = String(path);
+  int dot = name.lastIndexOf('.');
+  if (dot > name.lastIndexOf('/')) {
+    name = name.substring(0, dot);
+  }
+  return name + BLOCK_CACHE_SUFFIX;
+}
+
+// Opened for reading and writing anywhere, created when missing
+File openBlockCache(const String& name) {
+  if (!SD.exists(name)) {
+    File created = SD.open(name, FILE_WRITE);
+    if (!created) {
+      return created;
+    }
+    created.close();
+  }
+  return SD.open(name, "r+");
+}
+
+// CRC32 of bytes from..to of the file
+uint32_t rangeCrc(File& file, uint32_t from, uint32_t to) {
+  uint32_t crc = 0;
+  file.seek(from);
+  while (from < to) {
+    size_t n = file.read(blockBuffer, min((uint32_t) sizeof(blockBuffer), to - from));
+    if (n == 0) {
+      break;
+    }
+    crc = crc32Update(crc, blockBuffer, n);
+    from += n;
+  }
+  return crc;
+}
+
+// **************************************
+// * Span Hashes
+// **************************************
+// Hashes of the first size bytes of path, hash i over the blocks firstBlock
+// + i * span on, cut at size. A block the file does not reach counts as
+// empty, so a shorter copy differs from there. fileSize is set to the size
+// of the file, 0 if there is none.
+bool integritySpanHashes(const char* path, uint32_t size, uint32_t firstBlock, uint16_t span, uint8_t count,
+                         uint32_t* hashes, uint32_t* fileSize) {
+  if (xMutex_BlockCache == NULL || span == 0 || count == 0) {
+    return false;
+  }
+  xSemaphoreTake(xMutex_BlockCache, portMAX_DELAY);
+
+  File file = SD.open(path, FILE_READ);
+  uint32_t available = file ? file.size() : 0;
+  uint32_t end = min(size, available);
+  *fileSize = available;
+
+  // entries of a file that got shorter are of an earlier file
+  File cache;
+  uint32_t cached = 0;
+  if (available > 0) {
+    String cacheName = blockCacheFilename(path);
+    cache = openBlockCache(cacheName);
+    cached = cache ? cache.size() / sizeof(uint32_t) : 0;
+    if (cached * VERIFY_BLOCK_SIZE > available) {
+      cache.close();
+      SD.remove(cacheName);
+      cache = openBlockCache(cacheName);
+      cached = 0;
+    }
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t crc = 0;
+    uint32_t block = firstBlock + i * span;
+    for (uint16_t n = 0; n < span && (uint64_t) block * VERIFY_BLOCK_SIZE < size; n++, block++) {
+      uint32_t from = block * VERIFY_BLOCK_SIZE;
+      bool complete = from + VERIFY_BLOCK_SIZE <= end;
+      uint32_t blockCrc = 0;
+      if (complete && block < cached) {
+        cache.seek(block * sizeof(uint32_t));
+        cache.read((uint8_t*) &blockCrc, sizeof(blockCrc));
+      } else if (from < end) {
+        blockCrc = rangeCrc(file, from, min(from + VERIFY_BLOCK_SIZE, end));
+        if (complete && block == cached && cache) {
+          cache.seek(cached * sizeof(uint32_t));
+          if (cache.write((const uint8_t*) &blockCrc, sizeof(blockCrc)) == sizeof(blockCrc)) {
+            cached++;
+          }
+        }
+      }
+      crc = crc32Update(crc, (const uint8_t*) &blockCrc, sizeof(blockCrc));
+    }
+    hashes[i] = crc;
+  }
+
+  if (cache) cache.close();
+  if (file) file.close();
+  xSemaphoreGive(xMutex_BlockCache);
+  return true;
+}
+
+// **************************************
+// * Drop Cached Blocks
+// **************************************
+// The file is written again from offset from on, the entries of those
+// blocks are dropped. The rest is copied to a new cache file.
+void integrityForget(const char* path, uint32_t from) {
+  if (xMutex_BlockCache == NULL) {
+    return;
+  }
+  String cacheName = blockCacheFilename(path);
+  uint32_t keep = from / VERIFY_BLOCK_SIZE * sizeof(uint32_t);
+  xSemaphoreTake(xMutex_BlockCache, portMAX_DELAY);
+
+  File cache = SD.open(cacheName, FILE_READ);
+  if (cache && cache.size() > keep) {
+    String tempName = cacheName + "~";
+    File temp = keep > 0 ? SD.open(tempName, FILE_WRITE) : File();
+    uint32_t copied = 0;
+    while (temp && copied < keep) {
+      size_t n = cache.read(blockBuffer, min((uint32_t) sizeof(blockBuffer), keep - copied));
+      if (n == 0 || temp.write(blockBuffer, n) != n) {
+        break;
+      }
+      copied += n;
+    }
+    cache.close();
+    SD.remove(cacheName);
+    if (temp) {
+      temp.close();
+      if (copied == keep) {
+        SD.rename(tempName, cacheName);
+      } else {
+        SD.remove(tempName);
+      }
+    }
+  } else if (cache) {
+    cache.close();
+  }
+  xSemaphoreGive(xMutex_BlockCache);
+}
+
+void file_integrity_init() {
+  if (xMutex_BlockCache == NULL) {
+    xMutex_BlockCache = xSemaphoreCreateMutex();
+  }
+}
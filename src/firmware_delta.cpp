@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include "firmware_delta.h"
+
+#define DELTA_COPY_BUFFER 256
+#define DELTA_HASH_WINDOW 8
+
+// **************************************
+// * CRC32
+// **************************************
+// Same polynomial as the peer log, continued over several calls: start at 0
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// **************************************
+// * Apply
+// **************************************
+void deltaPatchBegin(DeltaPatcher* patcher, DeltaReadFn readBase, DeltaWriteFn write, void* ctx) {
+  memset(patcher, 0, sizeof(DeltaPatcher));
+  patcher->state = DELTA_HEADER;
+  patcher->readBase = readBase;
+  patcher->write = write;
+  patcher->ctx = ctx;
+}
+
+static bool emit(DeltaPatcher* patcher, const uint8_t* data, size_t len) {
+  if (patcher->written + len > patcher->header.targetSize || !patcher->write(patcher->ctx, data, len)) {
+    return false;
+  }
+  patcher->crc = crc32Update(patcher->crc, data, len);
+  patcher->written += len;
+  return true;
+}
+
+static bool copyFromBase(DeltaPatcher* patcher, uint32_t offset, uint32_t len) {
+  if (offset > patcher->header.baseSize || len > patcher->header.baseSize - offset) {
+    return false;
+  }
+  uint8_t buffer[DELTA_COPY_BUFFER];
+  while (len > 0) {
+    size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+    if (!patcher->readBase(patcher->ctx, offset, buffer, n) || !emit(patcher, buffer, n)) {
+      return false;
+    }
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Next part of the patch, in pieces of any size. False once the patch is
+// malformed or a callback failed, the rest is then ignored.
+bool deltaPatchFeed(DeltaPatcher* patcher, const uint8_t* data, size_t len) {
+  size_t i = 0;
+  while (i < len && patcher->state != DELTA_ERROR) {
+    switch (patcher->state) {
+      case DELTA_HEADER: {
+        size_t n = sizeof(DeltaHeader) - patcher->headerBytes;
+        n = n < len - i ? n : len - i;
+        memcpy((uint8_t*) &patcher->header + patcher->headerBytes, data + i, n);
+        patcher->headerBytes += n;
+        i += n;
+        if (patcher->headerBytes == sizeof(DeltaHeader)) {
+          patcher->state = patcher->header.magic == DELTA_MAGIC ? DELTA_OP : DELTA_ERROR;
+        }
+        break;
+      }
+
+      case DELTA_OP:
+        patcher->op = data[i++];
+        patcher->value = 0;
+        patcher->shift = 0;
+        patcher->state = patcher->op == DELTA_OP_COPY || patcher->op == DELTA_OP_ADD ? DELTA_ARG1 : DELTA_ERROR;
+        break;
+
+      case DELTA_ARG1:
+      case DELTA_ARG2: {
+        uint8_t byte = data[i++];
+        if (patcher->shift > 28) {
+          patcher->state = DELTA_ERROR;
+          break;
+        }
+        patcher->value |= (uint32_t) (byte & 0x7F) << patcher->shift;
+        patcher->shift += 7;
+        if (byte & 0x80) {
+          break;
+        }
+        uint32_t value = patcher->value;
+        patcher->value = 0;
+        patcher->shift = 0;
+        if (patcher->op == DELTA_OP_ADD) {
+          patcher->remaining = value;
+          patcher->state = value > 0 ? DELTA_BYTES : DELTA_OP;
+        } else if (patcher->state == DELTA_ARG1) {
+          patcher->copyFrom = value;
+          patcher->state = DELTA_ARG2;
+        } else {
+          patcher->state = copyFromBase(patcher, patcher->copyFrom, value) ? DELTA_OP : DELTA_ERROR;
+        }
+        break;
+      }
+
+      case DELTA_BYTES: {
+        size_t n = patcher->remaining < len - i ? patcher->remaining : len - i;
+        if (!emit(patcher, data + i, n)) {
+          patcher->state = DELTA_ERROR;
+          break;
+        }
+        patcher->remaining -= n;
+        i += n;
+        if (patcher->remaining == 0) {
+          patcher->state = DELTA_OP;
+        }
+        break;
+      }
+
+      default:
+        patcher->state = DELTA_ERROR;
+        break;
+    }
+  }
+  return patcher->state != DELTA_ERROR;
+}
+
+// The whole target was written and matches the CRC in the header
+bool deltaPatchEnd(const DeltaPatcher* patcher) {
+  return patcher->state == DELTA_OP && patcher->written == patcher->header.targetSize
+         && patcher->crc == patcher->header.targetCrc;
+}
+
+// **************************************
+// * Encode
+// **************************************
+// Host side, the gateway only sends patches made with `program delta`
+
+static size_t putVarint(uint8_t* out, size_t pos, size_t size, uint32_t value) {
+  do {
+    if (pos >= size) {
+      return size + 1;
+    }
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    out[pos++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return pos;
+}
+
+static size_t putAdd(const uint8_t* bytes, size_t len, uint8_t* out, size_t pos, size_t size) {
+  if (len == 0 || pos >= size) {
+    return len == 0 ? pos : size + 1;
+  }
+  out[pos++] = DELTA_OP_ADD;
+  pos = putVarint(out, pos, size, len);
+  if (pos > size || len > size - pos) {
+    return size + 1;
+  }
+  memcpy(out + pos, bytes, len);
+  return pos + len;
+}
+
+static uint32_t windowHash(const uint8_t* p) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < DELTA_HASH_WINDOW; i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash >> (32 - DELTA_HASH_BITS);
+}
+
+static size_t matchLength(const uint8_t* base, size_t baseLen, size_t from,
+                          const uint8_t* target, size_t targetLen, size_t at) {
+  size_t n = 0;
+  while (from + n < baseLen && at + n < targetLen && base[from + n] == target[at + n]) {
+    n++;
+  }
+  return n;
+}
+
+// Greedy: at each target position the longer of the run continuing the last
+// COPY and the latest base position with the same 8 bytes. Returns the patch
+// size, 0 if it does not fit or the index cannot be allocated.
+size_t deltaEncode(const uint8_t* base, size_t baseLen, const uint8_t* target, size_t targetLen,
+                   uint8_t* patch, size_t patchSize) {
+  DeltaHeader header;
+  header.magic = DELTA_MAGIC;
+  header.baseSize = baseLen;
+  header.baseCrc = crc32Update(0, base, baseLen);
+  header.targetSize = targetLen;
+  header.targetCrc = crc32Update(0, target, targetLen);
+  if (patchSize < sizeof(header)) {
+    return 0;
+  }
+  memcpy(patch, &header, sizeof(header));
+  size_t pos = sizeof(header);
+
+  uint32_t* index = (uint32_t*) calloc((size_t) 1 << DELTA_HASH_BITS, sizeof(uint32_t)); // position + 1, 0 = none
+  if (index == NULL) {
+    return 0;
+  }
+  for (size_t i = 0; i + DELTA_HASH_WINDOW <= baseLen; i++) {
+    index[windowHash(base + i)] = i + 1;
+  }
+
+  size_t literal = 0;         // start of the bytes not covered yet
+  size_t next = 0;            // base position following the last COPY
+  size_t at = 0;
+  while (at < targetLen && pos <= patchSize) {
+    size_t from = next;
+    size_t best = next < baseLen ? matchLength(base, baseLen, next, target, targetLen, at) : 0;
+    if (at + DELTA_HASH_WINDOW <= targetLen) {
+      uint32_t candidate = index[windowHash(target + at)];
+      if (candidate != 0) {
+        size_t n = matchLength(base, baseLen, candidate - 1, target, targetLen, at);
+        if (n > best) {
+          best = n;
+          from = candidate - 1;
+        }
+      }
+    }
+    if (best < DELTA_MIN_MATCH) {
+      at++;
+      next++;
+      continue;
+    }
+    pos = putAdd(target + literal, at - literal, patch, pos, patchSize);
+    if (pos >= patchSize) {
+      pos = patchSize + 1;
+      break;
+    }
+    patch[pos++] = DELTA_OP_COPY;
+    pos = putVarint(patch, pos, patchSize, from);
+    pos = putVarint(patch, pos, patchSize, best);
+    at += best;
+    literal = at;
+    next = from + best;
+  }
+  free(index);
+  if (pos <= patchSize) {
+    pos = putAdd(target + literal, targetLen - literal, patch, pos, patchSize);
+  }
+  return pos <= patchSize ? pos : 0;
+}
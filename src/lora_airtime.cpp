@@ -0,0 +1,23 @@
+#include "lora_airtime.h"
+
+uint32_t loraSymbolUs(uint8_t spreadingFactor, uint32_t bandwidthHz) {
+  return (uint32_t) (((uint64_t) 1000000 << spreadingFactor) / bandwidthHz);
+}
+
+// Explicit header and CRC on, as set up in lora_init. Low data rate
+// optimisation is on for symbols above 16 ms, like the LoRa library does.
+uint32_t loraAirtimeUs(size_t payloadBytes, uint8_t spreadingFactor, uint32_t bandwidthHz, uint8_t codingRate) {
+  uint32_t symbolUs = loraSymbolUs(spreadingFactor, bandwidthHz);
+  int lowDataRate = symbolUs > 16000 ? 1 : 0;
+
+  int numerator = 8 * (int) payloadBytes - 4 * spreadingFactor + 28 + 16;
+  int denominator = 4 * (spreadingFactor - 2 * lowDataRate);
+  int payloadSymbols = 8;
+  if (numerator > 0) {
+    payloadSymbols += (numerator + denominator - 1) / denominator * codingRate;
+  }
+
+  // preamble + 4.25 sync symbols, in quarter symbols
+  uint32_t quarterSymbols = (LORA_PREAMBLE_SYMBOLS * 4 + 17) + payloadSymbols * 4;
+  return (uint32_t) ((uint64_t) quarterSymbols * symbolUs / 4);
+}
@@ -0,0 +1,56 @@
+#include "lora_channels.h"
+
+// **************************************
+// * Frequency Plan
+// **************************************
+uint32_t channelFrequencyHz(uint8_t channel) {
+  if (channel >= LORA_CHANNELS) {
+    channel = LORA_HOME_CHANNEL;
+  }
+  return LORA_HOME_FREQUENCY_HZ + channel * LORA_CHANNEL_SPACING_HZ;
+}
+
+// Chunk loss reported by a node for a slot on this channel, weighted like
+// the per-peer loss so one bad slot does not move a channel to the back
+void recordChannelLoss(ChannelStats* stats, uint16_t sent, uint16_t lost) {
+  if (sent == 0) {
+    return;
+  }
+  if (lost > sent) {
+    lost = sent;
+  }
+  stats->chunksSent += sent;
+  stats->chunksLost += lost;
+  uint16_t sample = (uint32_t) lost * 1000 / sent;
+  stats->lossPermille = (stats->lossPermille * 3 + sample) / 4;
+}
+
+// **************************************
+// * Channel Assignment
+// **************************************
+// Sub-channels ordered by loss, ties broken by a rotation that moves on every
+// cycle so equal channels share the slots. Lane n takes the n-th best
+// channel: parallel lanes never share one, a single lane always gets the best.
+void assignSlotChannels(SlotAssignment* slots, size_t count, const ChannelStats* stats, uint16_t rotation) {
+  uint8_t ranked[LORA_SUB_CHANNELS];
+  for (uint8_t i = 0; i < LORA_SUB_CHANNELS; i++) {
+    ranked[i] = 1 + (i + rotation) % LORA_SUB_CHANNELS;
+  }
+  for (uint8_t i = 1; i < LORA_SUB_CHANNELS; i++) { // stable insertion sort, keeps the rotation among equals
+    uint8_t channel = ranked[i];
+    int j = i - 1;
+    while (j >= 0 && stats[ranked[j]].lossPermille > stats[channel].lossPermille) {
+      ranked[j + 1] = ranked[j];
+      j--;
+    }
+    ranked[j + 1] = channel;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (slots[i].flags & SLOT_FLAG_HOME) {
+      slots[i].channel = LORA_HOME_CHANNEL;
+    } else {
+      slots[i].channel = ranked[slots[i].lane % LORA_SUB_CHANNELS];
+    }
+  }
+}
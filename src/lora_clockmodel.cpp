@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lora_clockmodel.h"
+#include "lora_timesync.h"
+
+// **************************************
+// * Segments
+// **************************************
+
+int64_t segmentOffset(const ClockSegment& segment, int64_t networkUs) {
+  return segment.offsetUs + (int64_t) segment.skewPpb * (networkUs - segment.anchorUs) / 1000000000LL;
+}
+
+void startSegment(PeerClock* clock, int64_t networkUs, int64_t offsetUs, int32_t skewPpb) {
+  for (size_t i = CLOCK_SEGMENTS - 1; i > 0; i--) {
+    clock->segments[i] = clock->segments[i - 1];
+  }
+  ClockSegment* segment = &clock->segments[0];
+  segment->startUs = networkUs;
+  segment->anchorUs = networkUs;
+  segment->offsetUs = offsetUs;
+  segment->skewPpb = skewPpb;
+  clock->samples = 0;
+  clock->corrections++;
+}
+
+// **************************************
+// * Samples
+// **************************************
+
+// One offset measurement (node minus network time) at a network time. The
+// offset follows the residual in small steps, the skew only over spans long
+// enough for the jitter of a single frame not to matter.
+void clockModelSample(PeerClock* clock, int64_t networkUs, int64_t offsetUs) {
+  ClockSegment* segment = &clock->segments[0];
+  if (segment->startUs == 0) {
+    startSegment(clock, networkUs, offsetUs, 0);
+    clock->samples = 1;
+    clock->lastResidualUs = 0;
+    return;
+  }
+
+  int64_t predicted = segmentOffset(*segment, networkUs);
+  int64_t residual = offsetUs - predicted;
+  clock->lastResidualUs = (int32_t) (residual > INT32_MAX ? INT32_MAX : residual < INT32_MIN ? INT32_MIN : residual);
+  if (residual > CLOCK_JUMP_US || residual < -CLOCK_JUMP_US) {
+    startSegment(clock, networkUs, offsetUs, segment->skewPpb); // same crystal, stepped clock
+    clock->samples = 1;
+    return;
+  }
+
+  int64_t span = networkUs - segment->anchorUs;
+  if (clock->samples > 0 && span >= CLOCK_SKEW_SPAN_US) {
+    int64_t skew = segment->skewPpb + residual * 1000000000LL / span / CLOCK_SKEW_GAIN;
+    if (skew > CLOCK_SKEW_MAX_PPB) {
+      skew = CLOCK_SKEW_MAX_PPB;
+    } else if (skew < -CLOCK_SKEW_MAX_PPB) {
+      skew = -CLOCK_SKEW_MAX_PPB;
+    }
+    segment->skewPpb = (int32_t) skew;
+    segment->anchorUs = networkUs;
+    segment->offsetUs = predicted + residual / CLOCK_OFFSET_GAIN;
+  } else {
+    segment->offsetUs += residual / CLOCK_OFFSET_GAIN; // too close for the skew, the line only shifts
+  }
+  if (clock->samples < UINT16_MAX) {
+    clock->samples++;
+  }
+}
+
+// The node was answered a TIME_REQUEST and corrects its clock from it: from
+// here on it is close to network time and follows its own drift model
+void clockModelCorrected(PeerClock* clock, int64_t networkUs) {
+  startSegment(clock, networkUs, 0, 0);
+}
+
+// Offset of the node clock at a time read from it, with the segment that was
+// current then. False while there is no sample at all.
+bool clockModelOffset(const PeerClock* clock, int64_t nodeUs, int64_t* offsetUs) {
+  const ClockSegment* used = NULL;
+  for (size_t i = 0; i < CLOCK_SEGMENTS && clock->segments[i].startUs != 0; i++) {
+    used = &clock->segments[i];
+    if (nodeUs - used->offsetUs >= used->startUs) {
+      break;
+    }
+  }
+  if (used == NULL) {
+    return false;
+  }
+  *offsetUs = segmentOffset(*used, nodeUs - used->offsetUs);
+  return true;
+}
+
+// **************************************
+// * Sample Timestamps
+// **************************************
+
+// "raw,corrected,correction_us\n" for a sample timestamp as the node wrote it
+// ("YYYY_MM_DD_HH_MM_SS" with optional ".mmm"), 0 if it does not parse or
+// there is no model yet
+size_t clockModelCorrectStamp(const PeerClock* clock, const char* stamp, char* line, size_t size) {
+  int year, month, day, hour, minute, second, ms = 0, used = 0;
+  if (sscanf(stamp, "%4d_%2d_%2d_%2d_%2d_%2d%n", &year, &month, &day, &hour, &minute, &second, &used) != 6
+      || used != 19) { // also rules out the tail of a line cut inside its timestamp
+    return 0;
+  }
+  if (stamp[used] == '.') {
+    sscanf(stamp + used + 1, "%3d", &ms);
+  }
+  int64_t nodeUs = calendarToEpoch(year, month, day, hour, minute, second) * 1000000LL + ms * 1000LL;
+  int64_t offsetUs;
+  if (!clockModelOffset(clock, nodeUs, &offsetUs)) {
+    return 0;
+  }
+
+  int64_t correctedUs = nodeUs - offsetUs;
+  time_t seconds = correctedUs / 1000000;
+  struct tm t;
+  gmtime_r(&seconds, &t);
+  int written = snprintf(line, size, "%s,%04d_%02d_%02d_%02d_%02d_%02d.%03d,%lld\n", stamp,
+                         t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                         (int) (correctedUs % 1000000 / 1000), (long long) -offsetUs);
+  return written > 0 && (size_t) written < size ? written : 0;
+}
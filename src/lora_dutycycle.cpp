@@ -0,0 +1,171 @@
+#include "lora_dutycycle.h"
+#include "lora_airtime.h"
+#include "lora_init.h"
+#include "lora_peer.h"
+#include "configuration.h"
+
+LoraModem loraModem = {PEER_DATA_RATE_DEFAULT, LORA_BANDWIDTH_DEFAULT, LORA_CODING_RATE_DEFAULT};
+AirtimeStats airtimeStats;
+
+SemaphoreHandle_t xMutex_Airtime = NULL; // the receive task and every sender account here
+
+void airtime_init() {
+  memset(&airtimeStats, 0, sizeof(airtimeStats));
+  airtimeStats.bucketStart = millis();
+  xMutex_Airtime = xSemaphoreCreateMutex();
+}
+
+uint32_t frameAirtimeUs(size_t bytes) {
+  return loraAirtimeUs(bytes, loraModem.spreadingFactor, loraModem.bandwidthHz, loraModem.codingRate);
+}
+
+// File and firmware data is bulk, config deltas are retried anyway and can
+// wait as well
+TxClass txClassOf(uint8_t msgType) {
+  switch (msgType) {
+    case FILE_BODY:
+    case FILE_ENTIRE:
+    case FILE_PARITY:
+    case FW_CHUNK:
+    case CONFIG_DELTA:
+      return TX_BULK;
+    default:
+      return TX_CONTROL;
+  }
+}
+
+// **************************************
+// * Rolling Hour
+// **************************************
+
+// Starts a new bucket every AIRTIME_BUCKET_MS, clearing the one that fell
+// out of the hour for the totals, every message type and every peer
+void rotateBuckets(unsigned long now) {
+  for (uint8_t n = 0; n < AIRTIME_BUCKETS && now - airtimeStats.bucketStart >= AIRTIME_BUCKET_MS; n++) {
+    airtimeStats.bucketStart += AIRTIME_BUCKET_MS;
+    uint8_t b = (airtimeStats.bucket + 1) % AIRTIME_BUCKETS;
+    airtimeStats.bucket = b;
+    airtimeStats.txHourUs[b] = 0;
+    airtimeStats.rxHourUs[b] = 0;
+    for (size_t t = 0; t < AIRTIME_MSG_TYPES; t++) {
+      airtimeStats.types[t].txHourUs[b] = 0;
+    }
+    for (size_t i = 0; i < peerCount; i++) {
+      peers[i].airtimeHourUs[b] = 0;
+    }
+  }
+  if (now - airtimeStats.bucketStart >= AIRTIME_BUCKET_MS) {
+    // idle for more than an hour, every bucket is clear
+    airtimeStats.bucketStart = now;
+  }
+}
+
+// Full buckets of the last hour plus the part of the oldest one still in it
+uint32_t hourSum(const uint32_t buckets[AIRTIME_BUCKETS], unsigned long now) {
+  unsigned long elapsed = now - airtimeStats.bucketStart;
+  uint8_t oldest = (airtimeStats.bucket + 1) % AIRTIME_BUCKETS;
+  uint64_t sum = 0;
+  for (uint8_t b = 0; b < AIRTIME_BUCKETS; b++) {
+    if (b != oldest) {
+      sum += buckets[b];
+    }
+  }
+  sum += (uint64_t) buckets[oldest] * (AIRTIME_BUCKET_MS - elapsed) / AIRTIME_BUCKET_MS;
+  return (uint32_t) sum;
+}
+
+uint32_t rollingHourUs(const uint32_t buckets[AIRTIME_BUCKETS]) {
+  if (xMutex_Airtime == NULL) {
+    return 0;
+  }
+  xSemaphoreTake(xMutex_Airtime, portMAX_DELAY);
+  unsigned long now = millis();
+  rotateBuckets(now);
+  uint32_t sum = hourSum(buckets, now);
+  xSemaphoreGive(xMutex_Airtime);
+  return sum;
+}
+
+// Airtime allowed per hour, 0 = no limit. A permille of an hour in us is
+// the same number as the hour in ms.
+uint32_t dutyCycleBudgetUs() {
+  return (uint32_t) ((uint64_t) systemConfig.DUTY_CYCLE_PERMILLE * AIRTIME_HOUR_MS);
+}
+
+// **************************************
+// * Accounting
+// **************************************
+
+// Frames addressed to a peer, and every node frame, carry its MAC after the type
+void airtimeRecordTx(const uint8_t* data, size_t size) {
+  if (xMutex_Airtime == NULL || size == 0) {
+    return;
+  }
+  uint32_t us = frameAirtimeUs(size);
+  uint8_t type = data[0] < AIRTIME_MSG_TYPES ? data[0] : AIRTIME_MSG_TYPES - 1;
+  int index = size > MAC_ADDR_LENGTH ? getIndexByMac(data + 1) : -1;
+
+  xSemaphoreTake(xMutex_Airtime, portMAX_DELAY);
+  unsigned long now = millis();
+  rotateBuckets(now);
+  uint8_t b = airtimeStats.bucket;
+  uint32_t budget = dutyCycleBudgetUs();
+  if (budget != 0 && txClassOf(type) == TX_CONTROL && hourSum(airtimeStats.txHourUs, now) >= budget) {
+    airtimeStats.overBudget++;
+  }
+  airtimeStats.txUs += us;
+  airtimeStats.txHourUs[b] += us;
+  airtimeStats.types[type].txFrames++;
+  airtimeStats.types[type].txUs += us;
+  airtimeStats.types[type].txHourUs[b] += us;
+  if (index >= 0) {
+    peers[index].airtimeToPeerMs += us / 1000;
+  }
+  xSemaphoreGive(xMutex_Airtime);
+}
+
+// A received frame is the sender's airtime, on the gateway that is the
+// node's own duty cycle
+void airtimeRecordRx(const uint8_t* data, size_t size) {
+  if (xMutex_Airtime == NULL || size == 0) {
+    return;
+  }
+  uint32_t us = frameAirtimeUs(size);
+  uint8_t type = data[0] < AIRTIME_MSG_TYPES ? data[0] : AIRTIME_MSG_TYPES - 1;
+  int index = size > MAC_ADDR_LENGTH ? getIndexByMac(data + 1) : -1;
+
+  xSemaphoreTake(xMutex_Airtime, portMAX_DELAY);
+  rotateBuckets(millis());
+  uint8_t b = airtimeStats.bucket;
+  airtimeStats.rxUs += us;
+  airtimeStats.rxHourUs[b] += us;
+  airtimeStats.types[type].rxFrames++;
+  airtimeStats.types[type].rxUs += us;
+  if (index >= 0) {
+    peers[index].airtimeHourUs[b] += us;
+  }
+  xSemaphoreGive(xMutex_Airtime);
+}
+
+// **************************************
+// * Transmit Scheduling
+// **************************************
+
+// Whether bulk frames of this much airtime still fit the bulk share of the
+// budget. Control frames are never held back.
+bool airtimeBulkAllowed(uint32_t airtimeUs) {
+  uint32_t budget = dutyCycleBudgetUs();
+  if (budget == 0 || xMutex_Airtime == NULL) {
+    return true;
+  }
+  xSemaphoreTake(xMutex_Airtime, portMAX_DELAY);
+  unsigned long now = millis();
+  rotateBuckets(now);
+  uint64_t used = hourSum(airtimeStats.txHourUs, now);
+  bool allowed = used + airtimeUs <= (uint64_t) budget * DUTY_CYCLE_BULK_SHARE / 100;
+  if (!allowed) {
+    airtimeStats.bulkDeferred++;
+  }
+  xSemaphoreGive(xMutex_Airtime);
+  return allowed;
+}
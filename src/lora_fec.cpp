@@ -0,0 +1,165 @@
+#include <string.h>
+#include <math.h>
+#include "lora_fec.h"
+
+// **************************************
+// * GF(256)
+// **************************************
+// Polynomial x^8 + x^4 + x^3 + x^2 + 1, generator 2
+static uint8_t gfExp[512];
+static uint8_t gfLog[256];
+static bool gfReady = false;
+
+static void gfInit() {
+  uint16_t x = 1;
+  for (int i = 0; i < 255; i++) {
+    gfExp[i] = x;
+    gfLog[x] = i;
+    x <<= 1;
+    if (x & 0x100) x ^= 0x11D;
+  }
+  for (int i = 255; i < 512; i++) {
+    gfExp[i] = gfExp[i - 255];
+  }
+  gfReady = true;
+}
+
+static inline uint8_t gfMul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static inline uint8_t gfInv(uint8_t a) {
+  return gfExp[255 - gfLog[a]];
+}
+
+// Cauchy coefficient of parity row j for data chunk i: 1 / (x_j + y_i)
+// with x_j = k + j and y_i = i, disjoint as long as k + m <= 256
+static inline uint8_t cauchy(uint8_t k, uint8_t j, uint8_t i) {
+  return gfInv((k + j) ^ i);
+}
+
+// block += coefficient * source
+static void mulAdd(uint8_t* block, const uint8_t* source, uint8_t coefficient, size_t len) {
+  if (coefficient == 0) return;
+  uint8_t logC = gfLog[coefficient];
+  for (size_t b = 0; b < len; b++) {
+    if (source[b]) block[b] ^= gfExp[logC + gfLog[source[b]]];
+  }
+}
+
+// **************************************
+// * Encode
+// **************************************
+void fecEncode(const uint8_t* const* data, uint8_t k, uint8_t* const* parity, uint8_t m, size_t len) {
+  if (!gfReady) gfInit();
+  for (uint8_t j = 0; j < m; j++) {
+    memset(parity[j], 0, len);
+    for (uint8_t i = 0; i < k; i++) {
+      mulAdd(parity[j], data[i], cauchy(k, j, i), len);
+    }
+  }
+}
+
+// **************************************
+// * Decode
+// **************************************
+// blocks holds k data then m parity buffers. Missing data blocks are
+// rebuilt in place from any k present blocks, false if fewer than k.
+bool fecDecode(uint8_t* const* blocks, const bool* present, uint8_t k, uint8_t m, size_t len) {
+  if (!gfReady) gfInit();
+  if (k > FEC_GROUP_SIZE * 2) return false;
+
+  uint8_t rows[FEC_GROUP_SIZE * 2];   // block used for each equation
+  uint8_t missing[FEC_GROUP_SIZE * 2];
+  uint8_t missingCount = 0;
+  uint8_t n = 0;
+
+  for (uint8_t i = 0; i < k; i++) {
+    if (present[i]) rows[n++] = i;
+    else missing[missingCount++] = i;
+  }
+  if (missingCount == 0) return true;
+  for (uint8_t j = 0; j < m && n < k; j++) {
+    if (present[k + j]) rows[n++] = k + j;
+  }
+  if (n < k) return false;
+
+  // Matrix of the chosen rows, inverted by Gauss-Jordan elimination
+  uint8_t a[FEC_GROUP_SIZE * 2][FEC_GROUP_SIZE * 2];
+  uint8_t inv[FEC_GROUP_SIZE * 2][FEC_GROUP_SIZE * 2];
+  for (uint8_t r = 0; r < k; r++) {
+    for (uint8_t c = 0; c < k; c++) {
+      a[r][c] = rows[r] < k ? (rows[r] == c) : cauchy(k, rows[r] - k, c);
+      inv[r][c] = r == c;
+    }
+  }
+  for (uint8_t c = 0; c < k; c++) {
+    uint8_t pivot = c;
+    while (pivot < k && a[pivot][c] == 0) pivot++;
+    if (pivot == k) return false;
+    if (pivot != c) {
+      for (uint8_t x = 0; x < k; x++) {
+        uint8_t t = a[c][x]; a[c][x] = a[pivot][x]; a[pivot][x] = t;
+        t = inv[c][x]; inv[c][x] = inv[pivot][x]; inv[pivot][x] = t;
+      }
+    }
+    uint8_t scale = gfInv(a[c][c]);
+    for (uint8_t x = 0; x < k; x++) {
+      a[c][x] = gfMul(a[c][x], scale);
+      inv[c][x] = gfMul(inv[c][x], scale);
+    }
+    for (uint8_t r = 0; r < k; r++) {
+      uint8_t factor = a[r][c];
+      if (r == c || factor == 0) continue;
+      for (uint8_t x = 0; x < k; x++) {
+        a[r][x] ^= gfMul(factor, a[c][x]);
+        inv[r][x] ^= gfMul(factor, inv[c][x]);
+      }
+    }
+  }
+
+  // data_i = sum over the chosen rows of inv[i][r] * block_r
+  for (uint8_t n2 = 0; n2 < missingCount; n2++) {
+    uint8_t i = missing[n2];
+    memset(blocks[i], 0, len);
+    for (uint8_t r = 0; r < k; r++) {
+      mulAdd(blocks[i], blocks[rows[r]], inv[i][r], len);
+    }
+  }
+  return true;
+}
+
+// **************************************
+// * Code Rate
+// **************************************
+// Fewest parity chunks for which a group of k + m chunks with independent
+// losses fails less often than FEC_TARGET_FAILURE, capped at FEC_MAX_PARITY
+uint8_t fecParityForLoss(uint8_t k, uint16_t lossPermille) {
+  if (lossPermille < FEC_MIN_LOSS_PERMILLE) {
+    return 0;
+  }
+  double p = lossPermille / 1000.0;
+  for (uint8_t m = 1; m < FEC_MAX_PARITY; m++) {
+    int n = k + m;
+    double fail = 0;      // P(more than m of n lost)
+    double term = pow(1 - p, n);
+    for (int lost = 0; lost <= n; lost++) {
+      if (lost > m) fail += term;
+      term = term * (n - lost) / (lost + 1) * p / (1 - p);
+    }
+    if (fail < FEC_TARGET_FAILURE) {
+      return m;
+    }
+  }
+  return FEC_MAX_PARITY;
+}
+
+// Running loss estimate of a peer, a quarter of the new sample
+uint16_t fecLossAverage(uint16_t lossPermille, uint16_t sent, uint16_t lost) {
+  if (sent == 0) {
+    return lossPermille;
+  }
+  uint16_t sample = (uint32_t) (lost < sent ? lost : sent) * 1000 / sent;
+  return (lossPermille * 3 + sample) / 4;
+}
@@ -2,28 +2,140 @@
 #include <SD.h>
 #include "lora_init.h"
 #include "lora_file_transfer.h"
+#include "lora_scheduler.h"
+#include "lora_dutycycle.h"
+#include "sd_writer.h"
+#include "configuration.h"
+#include "file_integrity.h"
 #include "utils.h"
 
 /******************************************************************
  *                             Sender                             *
  ******************************************************************/
 
+unsigned long transferDeadline = 0; // millis() after which no new chunk is started, 0 = no limit
+unsigned long ackDeadline = 0;      // millis() ACK waits end at, POLL_COMPLETE goes out after
+
+bool transferDeadlinePassed() {
+  return transferDeadline != 0 && (long)(millis() - transferDeadline) >= 0;
+}
+
+// ACK waits end in time for POLL_COMPLETE, chunks stop early enough for
+// their ACK (lora_scheduler.cpp)
+void beginSlotTransfer(unsigned long slotEndAt) {
+  uint32_t statusUs = frameAirtimeUs(sizeof(poll_complete_message));
+  ackDeadline = slotEndAt - slotStatusReserveUs(statusUs) / 1000;
+  transferDeadline = slotEndAt - slotTransferGuardUs(frameAirtimeUs(sizeof(file_body_message)),
+                                                     frameAirtimeUs(sizeof(file_ack_message)), statusUs) / 1000;
+}
+
+void endSlotTransfer() {
+  transferDeadline = 0;
+  ackDeadline = 0;
+}
+
+// How long an ACK may still be waited for
+unsigned long ackTimeoutMs() {
+  if (ackDeadline == 0) {
+    return ACK_TIMEOUT;
+  }
+  long left = (long) (ackDeadline - millis());
+  return left <= 0 ? 0 : min((unsigned long) left, (unsigned long) ACK_TIMEOUT);
+}
+
+// Group bytes that still fit before the deadline
+size_t groupSpanBeforeDeadline(uint8_t parityCount) {
+  if (transferDeadline == 0) {
+    return FEC_GROUP_SPAN;
+  }
+  return sessionGroupSpan((long) (transferDeadline - millis()), parityCount);
+}
+
+QueueHandle_t fileAckQueue = NULL; // ACK/REJ handed over from the receive task
+QueueHandle_t verifyResultQueue = NULL;
+AckRttStats ackRttStats;
+VerifyStats verifyStats;
+RTC_DATA_ATTR uint16_t verifyGeneration = 0; // new after a restart or when the gateway asks, synced files are compared again
+
+uint8_t fecParity = 0;  // parity chunks per group from the last beacon, 0 = chunk by chunk
+uint16_t chunksSent = 0; // chunk-by-chunk sends, reported to the gateway as loss estimate
+uint16_t chunksLost = 0;
+
+uint16_t newSessionId();
+
+void file_transfer_init() {
+  fileAckQueue = xQueueCreate(4, sizeof(file_ack_message));
+  verifyResultQueue = xQueueCreate(2, sizeof(file_verify_result_message));
+  memset(&ackRttStats, 0, sizeof(ackRttStats));
+  memset(&verifyStats, 0, sizeof(verifyStats));
+  if (verifyGeneration == 0) {
+    verifyGeneration = newSessionId();
+  }
+  file_integrity_init();
+}
+
+// Each transfer gets its own session id, so late ACKs of an earlier one are ignored
+uint16_t newSessionId() {
+  uint16_t sessionId;
+  do {
+    sessionId = esp_random() & 0xFFFF;
+  } while (sessionId == 0);
+  return sessionId;
+}
+
+// **************************************
+// * Receive ACK
+// **************************************
+void handle_file_ack(const uint8_t *incomingData) {
+  file_ack_message ack;
+  memcpy(&ack, incomingData, sizeof(ack));
+  if (fileAckQueue != NULL) {
+    xQueueSend(fileAckQueue, &ack, 0);
+  }
+}
+
+void handle_file_verify_result(const uint8_t *incomingData) {
+  file_verify_result_message result;
+  memcpy(&result, incomingData, sizeof(result));
+  if (verifyResultQueue != NULL) {
+    xQueueSend(verifyResultQueue, &result, 0);
+  }
+}
+
 // **************************************
 // * Check ACK
 // **************************************
-int waitForAck() {
+// ACK once the gateway reports everything up to chunkEnd as received. The
+// offset of the last ACK of the session is stored in acked if given.
+int waitForAck(uint16_t sessionId, uint32_t chunkEnd, uint32_t* acked = nullptr) {
   unsigned long startTime = millis();
-  while (millis() - startTime < ACK_TIMEOUT) {
-      if(ack_count){
-        ack_count--;
-        return ACK;
-      }
-      if(rej_count){
-        rej_count--;
-        return REJ;
-      }
-        vTaskDelay(1 / portTICK_PERIOD_MS); // Delay for 1 second
+  unsigned long timeout = ackTimeoutMs();
+  int64_t sentUs = esp_timer_get_time(); // sendLoraMessage returns at TxDone
+  file_ack_message ack;
+  while (millis() - startTime < timeout) {
+    TickType_t wait = (timeout - (millis() - startTime)) / portTICK_PERIOD_MS;
+    if (xQueueReceive(fileAckQueue, &ack, wait) != pdTRUE) {
+      break;
+    }
+    if (ack.sessionId != sessionId) {
+      continue; // left over from an earlier transfer
+    }
+    if (ack.msgType == REJ) {
+      return REJ;
+    }
+    if (acked != nullptr) {
+      *acked = ack.nextOffset;
+    }
+    if (ack.nextOffset >= chunkEnd) {
+      uint32_t rttUs = esp_timer_get_time() - sentUs;
+      ackRttStats.acks++;
+      ackRttStats.lastUs = rttUs;
+      ackRttStats.maxUs = max(ackRttStats.maxUs, rttUs);
+      ackRttStats.totalUs += rttUs;
+      return ACK;
+    }
   }
+  ackRttStats.timeouts++;
   return TIMEOUT;
 }
 
@@ -41,18 +153,39 @@ bool sendLoRaData(uint8_t *data, size_t size, const char *filename) {
     memset(file_body.filename, 0, sizeof(file_body.filename));              // filename --> the full file path
     strncpy(file_body.filename, filename, sizeof(file_body.filename) - 1);
     file_body.filename[sizeof(file_body.filename) - 1] = '\0';
-    file_body.filesize = size; // filesize
+    file_body.start = 0;
+    file_body.sessionId = newSessionId();
+    file_body.flags = 0;
+    file_body.originId = 0;
 
     size_t offset = 0;
+    uint8_t parity = fecParity; // fixed for the transfer, groups stay aligned
 
-    // Pack File Body
+    // Pack File Body, nothing new is started once the slot is nearly over
     while (offset < size) {
 
+      if (transferDeadlinePassed()) {
+        Serial.println("File Transfer: slot over");
+        return false;
+      }
+
+      if (parity > 0) {
+        size_t groupLen = (size - offset) < FEC_GROUP_SPAN ? (size - offset) : FEC_GROUP_SPAN;
+        file_body.offset = offset;
+        if (!sendGroup(file_body, data + offset, groupLen, parity)) {
+          Serial.println("File Transfer: FAILED");
+          return false;
+        }
+        offset += groupLen;
+        continue;
+      }
+
       // Determine the length of data to copy
       file_body.len = (size - offset) < CHUNK_SIZE ? (size - offset) : CHUNK_SIZE;
 
       // Copy the data chunk into file_body.data
       memcpy(file_body.data, data + offset, file_body.len);
+      file_body.offset = offset;
 
       // Send the data chunk
       if (!sendChunk(file_body)) {
@@ -83,83 +216,203 @@ String getMetaFilename(const char* filename) {
   return filenameStr + ".meta";
 }
 
-// mode SEND: entire file transfer
-// mode SYNC: file synchronization
-bool sendLoRaFile(const char* filename, LoRaFileTransferMode mode) {
+// Sample time of the first line starting at or after offset. The .meta
+// offset usually falls inside a line, chunks are cut every CHUNK_SIZE bytes.
+// If no complete line follows, the line the offset is in is taken, and
+// without any the file's last write time.
+time_t firstSampleTime(File& file, size_t offset) {
+  char window[SAMPLE_LINE_WINDOW + 1];
+  size_t from = offset > 0 ? offset - 1 : 0;
+  file.seek(from);
+  size_t n = file.read((uint8_t*) window, SAMPLE_LINE_WINDOW);
+  window[n] = '\0';
+  size_t start = 0;
+  if (offset > 0) {
+    char* newline = (char*) memchr(window, '\n', n);
+    start = newline != NULL ? newline - window + 1 : n;
+  }
+  time_t sample = start < n && memchr(window + start, '\n', n - start) != NULL ? parseFilenameTime(window + start) : 0;
+  if (sample != 0) {
+    return sample;
+  }
 
-  Serial.printf("sendLoRaFile %s ", filename);
+  // the rest is the line still being written, its start is before the offset
+  from = offset > SAMPLE_LINE_WINDOW ? offset - SAMPLE_LINE_WINDOW : 0;
+  file.seek(from);
+  n = file.read((uint8_t*) window, offset - from);
+  window[n] = '\0';
+  while (n > 0 && window[n - 1] != '\n') {
+    n--;
+  }
+  if (n > 0 || from == 0) {
+    sample = parseFilenameTime(window + n);
+  }
+  return sample != 0 ? sample : file.getLastWrite();
+}
 
+// Bytes of a data file not yet acknowledged by the gateway. If oldestSample
+// is given, it is set to the timestamp of the first unsynced line.
+uint32_t getUnsyncedBytes(const char* filename, time_t* oldestSample) {
   size_t lastSentPosition = 0;
-  if (mode == SYNC) {
-    // File Synchronization
-    String metaFilename = getMetaFilename(filename);
-    File metaFile = SD.open(metaFilename.c_str(), FILE_READ);
-    if (!metaFile) {
-      Serial.println("Meta file does not exist. Creating new meta file.");
-      metaFile = SD.open(metaFilename.c_str(), FILE_WRITE);
-      if (!metaFile) {
-        Serial.println("Failed to create meta file!");
-        return false;
-      }
-      metaFile.println(0); // Write initial position 0 to the meta file
-    } else {
-      // Read the last sent position from the .meta file
-      lastSentPosition = metaFile.parseInt();
-    }
+  File metaFile = SD.open(getMetaFilename(filename).c_str(), FILE_READ);
+  if (metaFile) {
+    lastSentPosition = metaFile.parseInt();
     metaFile.close();
-    Serial.println("Meta file loaded.");
   }
 
   File file = SD.open(filename);
   if (!file) {
-    Serial.println("Failed to open file!");
-    return false;
+    return 0;
+  }
+  size_t fileSize = file.size();
+  if (oldestSample != nullptr && fileSize > lastSentPosition) {
+    *oldestSample = firstSampleTime(file, lastSentPosition);
   }
+  file.close();
 
-  file_body_message file_body;
+  return fileSize > lastSentPosition ? fileSize - lastSentPosition : 0;
+}
 
-  // Pack Meta Data
-  if (mode == SYNC) {
-    file_body.msgType = FILE_BODY;                                            // msgType
+// .meta holds the last sent position, then how far the file was verified
+// and the verification generation that was in
+bool readSyncMeta(const char* filename, SyncMeta* meta) {
+  File metaFile = SD.open(getMetaFilename(filename).c_str(), FILE_READ);
+  if (!metaFile) {
+    return false;
   }
-  else{
-    file_body.msgType = FILE_ENTIRE;                                            // msgType
+  meta->sent = metaFile.parseInt();
+  meta->verified = metaFile.parseInt();
+  meta->generation = metaFile.parseInt();
+  metaFile.close();
+  return true;
+}
+
+bool writeSyncMeta(const char* filename, const SyncMeta& meta) {
+  File metaFile = SD.open(getMetaFilename(filename).c_str(), FILE_WRITE);
+  if (!metaFile) {
+    return false;
   }
+  metaFile.println(meta.sent);
+  metaFile.println(meta.verified);
+  metaFile.println(meta.generation);
+  metaFile.close();
+  return true;
+}
+
+// Header of a transfer's chunks, a relay forwarding a stored file sends it
+// under the owner's originId and the name it has on the owner (wireName)
+void packFileBody(file_body_message& file_body, uint8_t msgType, const char* wireName, uint16_t originId) {
+  file_body.msgType = msgType;
   memcpy(file_body.mac, MAC_ADDRESS_STA, sizeof(file_body.mac));            // MAC
   memset(file_body.filename, 0, sizeof(file_body.filename));                // filename --> the full file path
-  strncpy(file_body.filename, filename, sizeof(file_body.filename) - 1);
+  strncpy(file_body.filename, wireName, sizeof(file_body.filename) - 1);
   file_body.filename[sizeof(file_body.filename) - 1] = '\0';
-  size_t fileSize = file.size();
-  file_body.filesize = fileSize;                                            // filesize
+  file_body.start = 0;
+  file_body.sessionId = newSessionId();
+  file_body.flags = 0;
+  file_body.originId = originId;
+  file_body.offset = 0;
+}
 
-  // Pack File Body
-  file.seek(lastSentPosition);// Seek to the last sent position in the data file
-  while ((file_body.len = file.read(file_body.data, CHUNK_SIZE)) > 0) {
+// Sends the file from `from` up to `to` in the session of file_body, in FEC
+// groups or chunk by chunk, until the slot or the duty-cycle budget runs
+// out. Returns the file position acknowledged up to.
+uint32_t sendFileRange(file_body_message& file_body, File& file, uint32_t from, uint32_t to) {
+  uint8_t parity = fecParity; // fixed for the transfer, groups stay aligned
+  uint32_t sent = from;
+  file.seek(from);
+  uint32_t chunkAirtimeUs = frameAirtimeUs(sizeof(file_body_message));
+  while (sent < to && !transferDeadlinePassed()) {
+    // stays in the duty-cycle budget, the rest waits for a later slot
+    if (!airtimeBulkAllowed(parity > 0 ? (FEC_GROUP_SIZE + parity) * chunkAirtimeUs : chunkAirtimeUs)) {
+      Serial.println("Duty-cycle budget used, transfer deferred");
+      break;
+    }
+    if (parity > 0) {
+      static uint8_t group[FEC_GROUP_SPAN];
+      size_t span = groupSpanBeforeDeadline(parity);
+      if (span == 0) {
+        parity = 0; // no room left for a group and its parity, single chunks still fit
+        continue;
+      }
+      size_t groupLen = file.read(group, min(span, (size_t) (to - sent)));
+      if (groupLen == 0) {
+        break;
+      }
+      uint32_t groupOffset = file_body.offset;
+      bool ok = sendGroup(file_body, group, groupLen, parity);
+      sent += file_body.offset - groupOffset; // acknowledged part
+      if (!ok || groupLen < FEC_GROUP_SPAN) {
+        break;
+      }
+      continue;
+    }
+
+    if ((file_body.len = file.read(file_body.data, min((uint32_t) CHUNK_SIZE, to - sent))) == 0) {
+      break;
+    }
     if(!sendChunk(file_body)){
       break;
     }
 
     // change the msgType back to SYNC to append to first chunk later
-    if (mode == SEND) {
+    if (file_body.msgType == FILE_ENTIRE) {
       file_body.msgType = FILE_BODY;
     }
-    lastSentPosition = file.position(); // Update the current position
-    vTaskDelay(1 / portTICK_PERIOD_MS); // Delay for 1 second
+    file_body.offset += file_body.len;
+    sent += file_body.len;
   }
+  return sent;
+}
+
+// mode SEND: entire file transfer
+// mode SYNC: file synchronization, written in place on the gateway from the
+// last sent position on. A file due for verification is compared first.
+bool sendLoRaFile(const char* filename, LoRaFileTransferMode mode, uint16_t originId, const char* wireName) {
+
+  Serial.printf("sendLoRaFile %s ", filename);
+
+  SyncMeta meta = {0, 0, 0};
+  if (mode == SYNC) {
+    // File Synchronization
+    if (!readSyncMeta(filename, &meta)) {
+      Serial.println("Meta file does not exist. Creating new meta file.");
+      if (!writeSyncMeta(filename, meta)) {
+        Serial.println("Failed to create meta file!");
+        return false;
+      }
+    }
+    Serial.println("Meta file loaded.");
+    if (verifyDue(meta)) {
+      verifySyncedFile(filename, originId, wireName != nullptr ? wireName : filename, &meta);
+      writeSyncMeta(filename, meta);
+    }
+  }
+
+  File file = SD.open(filename);
+  if (!file) {
+    Serial.println("Failed to open file!");
+    return false;
+  }
+
+  file_body_message file_body;
+  packFileBody(file_body, mode == SYNC ? FILE_BODY : FILE_ENTIRE, wireName != nullptr ? wireName : filename, originId);
+  if (mode == SYNC) {
+    file_body.flags = FILE_FLAG_AT;
+    file_body.start = meta.sent;
+  }
+  size_t fileSize = file.size();
+  uint32_t sent = sendFileRange(file_body, file, meta.sent, fileSize);
   file.close();
 
-  if (mode == SEND) { return true;}
+  if (mode == SEND) { return sent >= fileSize;} // sent completely
 
   // Update the meta file with the last sent position
-  String metaFilename = getMetaFilename(filename);
-  File metaFile = SD.open(metaFilename.c_str(), FILE_WRITE);
-  if (!metaFile) {
+  meta.sent = sent;
+  if (!writeSyncMeta(filename, meta)) {
     Serial.println("Failed to open meta file for updating!");
     return false;
   }
-  metaFile.seek(0);
-  metaFile.println(lastSentPosition); // Write the current position to the meta file
-  metaFile.close();
 
   Serial.println("File Transfer: SUCCESS");
   return true;
@@ -174,9 +427,10 @@ bool sendChunk(file_body_message file_body) {
   while (attempts < MAX_ATTEMPS) {
 
     sendLoraMessage((uint8_t*)&file_body, sizeof(file_body));
+    chunksSent++;
     Serial.print("Sent FILE_BODY, chunk of size: "); Serial.println(file_body.len);
 
-    int res = waitForAck();
+    int res = waitForAck(file_body.sessionId, file_body.offset + file_body.len);
     if (res == ACK) {
       // Serial.println("Received ACK");
       return true;
@@ -187,6 +441,7 @@ bool sendChunk(file_body_message file_body) {
       }
       // Check rejection before reattempt
       Serial.println("Time out. ACK for metadata not received, resending");
+      chunksLost++;
       attempts++;
     }
 
@@ -195,75 +450,685 @@ bool sendChunk(file_body_message file_body) {
   return false;
 }
 
+// **************************************
+// * Send FEC Group
+// **************************************
+// Sends len bytes from session offset file_body.offset as one FEC group:
+// the chunks back to back, then parityCount parity chunks, then a single wait
+// for the group ACK. Chunks the gateway could not rebuild are resent one by
+// one. file_body.offset is left at the first byte not acknowledged.
+bool sendGroup(file_body_message& file_body, const uint8_t* data, size_t len, uint8_t parityCount) {
+  static uint8_t parityData[FEC_MAX_PARITY][CHUNK_SIZE];
+  static uint8_t lastChunk[CHUNK_SIZE]; // short final chunk, zero padded for the encoder
+  const uint8_t* blocks[FEC_GROUP_SIZE];
+  uint8_t* parity[FEC_MAX_PARITY];
+  uint8_t chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  if (parityCount > FEC_MAX_PARITY) {
+    parityCount = FEC_MAX_PARITY;
+  }
+  uint32_t groupOffset = file_body.offset;
+  uint32_t groupEnd = groupOffset + len;
+
+  // Data chunks keep the message type, so a FILE_ENTIRE session is
+  // recognised even when its first chunk is rebuilt from parity
+  file_body.flags |= FILE_FLAG_GROUPED;
+  for (uint8_t i = 0; i < chunks; i++) {
+    size_t pos = i * CHUNK_SIZE;
+    file_body.len = (len - pos) < CHUNK_SIZE ? (len - pos) : CHUNK_SIZE;
+    file_body.offset = groupOffset + pos;
+    memcpy(file_body.data, data + pos, file_body.len);
+    sendLoraMessage((uint8_t*)&file_body, sizeof(file_body));
+    blocks[i] = data + pos;
+    if (file_body.len < CHUNK_SIZE) {
+      memset(lastChunk, 0, sizeof(lastChunk));
+      memcpy(lastChunk, data + pos, file_body.len);
+      blocks[i] = lastChunk;
+    }
+  }
+  for (uint8_t j = 0; j < parityCount; j++) {
+    parity[j] = parityData[j];
+  }
+  fecEncode(blocks, chunks, parity, parityCount, CHUNK_SIZE);
+
+  file_parity_message msg;
+  msg.msgType = FILE_PARITY;
+  memcpy(msg.mac, file_body.mac, MAC_ADDR_LENGTH);
+  msg.chunks = chunks;
+  msg.parity = parityCount;
+  msg.sessionId = file_body.sessionId;
+  msg.groupBytes = len;
+  msg.originId = file_body.originId;
+  msg.start = file_body.start;
+  msg.groupOffset = groupOffset;
+  for (uint8_t j = 0; j < parityCount; j++) {
+    msg.index = j;
+    memcpy(msg.data, parityData[j], CHUNK_SIZE);
+    sendLoraMessage((uint8_t*)&msg, sizeof(msg));
+  }
+  Serial.printf("Sent FEC group at %lu: %u chunks, %u parity\n", (unsigned long) groupOffset, chunks, parityCount);
+
+  // The last parity chunk asks for the group ACK, resent if the ACK is lost.
+  // ACKs not past the group start are left over from the previous group.
+  uint32_t acked = groupOffset;
+  int res = waitForAck(file_body.sessionId, groupOffset + 1, &acked);
+  for (int probe = 0; probe < FEC_PROBES && res == TIMEOUT && !transferDeadlinePassed(); probe++) {
+    sendLoraMessage((uint8_t*)&msg, sizeof(msg));
+    res = waitForAck(file_body.sessionId, groupOffset + 1, &acked);
+  }
+  file_body.flags &= ~FILE_FLAG_GROUPED;
+  if (file_body.msgType == FILE_ENTIRE) {
+    file_body.msgType = FILE_BODY;
+  }
+  file_body.offset = groupOffset;
+  if (res != ACK) {
+    Serial.println(res == REJ ? "Received REJ, Abort Transmission" : "FEC group not acknowledged");
+    return false;
+  }
+
+  // Resend from the first chunk the gateway could not rebuild. Each resent
+  // chunk may complete the group, the ACK then skips the rest.
+  file_body.offset = acked < groupEnd ? acked : groupEnd;
+  while (file_body.offset < groupEnd) {
+    size_t pos = file_body.offset - groupOffset;
+    file_body.len = (len - pos) < CHUNK_SIZE ? (len - pos) : CHUNK_SIZE;
+    memcpy(file_body.data, data + pos, file_body.len);
+    sendLoraMessage((uint8_t*)&file_body, sizeof(file_body));
+    chunksSent++;
+    res = waitForAck(file_body.sessionId, file_body.offset + file_body.len, &acked);
+    if (res != ACK) {
+      if (res == TIMEOUT) chunksLost++;
+      return false;
+    }
+    file_body.offset = acked < groupEnd ? acked : groupEnd;
+  }
+  return true;
+}
+
+// **************************************
+// * Verify Synced File
+// **************************************
+typedef struct BlockRange {
+  uint32_t first;
+  uint32_t count;
+} BlockRange;
+
+// The gateway asks for every synced file to be compared again, after its
+// restart or with a new SD card
+void fileVerifyRestart() {
+  uint16_t previous = verifyGeneration;
+  do {
+    verifyGeneration = newSessionId();
+  } while (verifyGeneration == previous);
+}
+
+bool verifyDue(const SyncMeta& meta) {
+  if (meta.sent == 0 || transferDeadlinePassed()) {
+    return false;
+  }
+  return meta.generation != verifyGeneration || meta.sent - meta.verified >= VERIFY_INTERVAL_BYTES;
+}
+
+// Result of request verifyId, false once the ACK timeout passed
+bool waitForVerifyResult(uint16_t verifyId, file_verify_result_message* result) {
+  unsigned long startTime = millis();
+  unsigned long timeout = ackTimeoutMs();
+  while (millis() - startTime < timeout) {
+    TickType_t wait = (timeout - (millis() - startTime)) / portTICK_PERIOD_MS;
+    if (xQueueReceive(verifyResultQueue, result, wait) != pdTRUE) {
+      break;
+    }
+    if (result->verifyId == verifyId) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Differing blocks in file order, neighbours merged. Without room left the
+// lowest block that did not fit is kept in overflow.
+void addDiffering(BlockRange* ranges, size_t* count, uint32_t* overflow, BlockRange range) {
+  size_t i = 0;
+  while (i < *count && ranges[i].first < range.first) {
+    i++;
+  }
+  if (i > 0 && ranges[i - 1].first + ranges[i - 1].count == range.first) {
+    ranges[i - 1].count += range.count;
+  } else if (i < *count && range.first + range.count == ranges[i].first) {
+    ranges[i].first = range.first;
+    ranges[i].count += range.count;
+  } else if (*count < VERIFY_REPAIR_RANGES) {
+    memmove(&ranges[i + 1], &ranges[i], (*count - i) * sizeof(BlockRange));
+    ranges[i] = range;
+    (*count)++;
+  } else {
+    *overflow = min(*overflow, range.first);
+  }
+}
+
+// Resends from..to of the file in place
+// All differing ranges of a file go in one repair session. Each range
+// starts a new FEC group past the previous range, with start set so that
+// start + session offset is its file position.
+bool sendRepair(File& file, file_body_message& file_body, uint32_t from, uint32_t to) {
+  file_body.offset = (file_body.offset + FEC_GROUP_SPAN - 1) / FEC_GROUP_SPAN * FEC_GROUP_SPAN;
+  file_body.start = from - file_body.offset;
+  uint32_t sent = sendFileRange(file_body, file, from, to);
+  verifyStats.repairs++;
+  verifyStats.repairBytes += sent - from;
+  Serial.printf("Repaired %s %lu..%lu\n", file.name(), (unsigned long) from, (unsigned long) sent);
+  return sent >= to;
+}
+
+// Compares the synced part of a file with the gateway's copy, up to
+// VERIFY_STEP_BYTES past what was verified before. Each FILE_VERIFY carries
+// hashes over spans of blocks, a span that differs is split until single
+// blocks are left. Differing blocks inside the gateway's copy are resent in
+// place. Where its copy is shorter or differs up to its end, the sync moves
+// back and sends the rest again. Without a result nothing changes.
+void verifySyncedFile(const char* filename, uint16_t originId, const char* wireName, SyncMeta* meta) {
+
+  if (meta->generation != verifyGeneration) {
+    meta->verified = 0; // everything is compared again, from the block caches
+  }
+  uint32_t upTo = min(meta->sent, meta->verified + VERIFY_STEP_BYTES);
+  uint32_t blocks = (upTo + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+
+  file_verify_message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msgType = FILE_VERIFY;
+  memcpy(msg.mac, MAC_ADDRESS_STA, sizeof(msg.mac));
+  strncpy(msg.filename, wireName, sizeof(msg.filename) - 1);
+  msg.originId = originId;
+  msg.size = upTo;
+
+  BlockRange pending[VERIFY_HASHES]; // spans known to differ, split further
+  BlockRange differing[VERIFY_REPAIR_RANGES];
+  size_t pendingCount = 0;
+  size_t differingCount = 0;
+  uint32_t overflow = UINT32_MAX;
+  uint32_t gatewaySize = 0;
+  pending[pendingCount++] = {0, blocks};
+
+  for (int requests = 0; pendingCount > 0; requests++) {
+    BlockRange range = pending[--pendingCount];
+    if (requests == VERIFY_MAX_REQUESTS || transferDeadlinePassed()) {
+      if (requests == 0) {
+        return;
+      }
+      addDiffering(differing, &differingCount, &overflow, range); // resent whole
+      continue;
+    }
+
+    msg.span = (range.count + VERIFY_HASHES - 1) / VERIFY_HASHES;
+    msg.count = (range.count + msg.span - 1) / msg.span;
+    msg.firstBlock = range.first;
+    msg.verifyId = newSessionId();
+    uint32_t nodeSize;
+    if (!integritySpanHashes(filename, upTo, msg.firstBlock, msg.span, msg.count, msg.hashes, &nodeSize)) {
+      return;
+    }
+    sendLoraMessage((uint8_t*) &msg, sizeof(msg));
+    verifyStats.requests++;
+
+    file_verify_result_message result;
+    if (!waitForVerifyResult(msg.verifyId, &result)) {
+      verifyStats.timeouts++;
+      Serial.printf("Verify %s: no result\n", filename);
+      return; // compared again in a later slot
+    }
+    gatewaySize = result.size;
+    for (uint8_t i = 0; i < msg.count; i++) {
+      if (!(result.mismatch & (1UL << i))) {
+        continue;
+      }
+      verifyStats.spansDiffering++;
+      BlockRange span = {range.first + i * msg.span, min((uint32_t) msg.span, range.count - i * msg.span)};
+      if (span.count > 1 && pendingCount < sizeof(pending) / sizeof(pending[0])) {
+        pending[pendingCount++] = span;
+      } else {
+        addDiffering(differing, &differingCount, &overflow, span);
+      }
+    }
+  }
+
+  // the sync goes on from where the gateway's copy stops matching
+  uint32_t resume = min(meta->sent, gatewaySize);
+  if (overflow != UINT32_MAX) {
+    resume = min(resume, overflow * VERIFY_BLOCK_SIZE);
+  }
+  while (differingCount > 0 && (differing[differingCount - 1].first + differing[differingCount - 1].count) * VERIFY_BLOCK_SIZE >= resume) {
+    resume = min(resume, differing[--differingCount].first * VERIFY_BLOCK_SIZE);
+  }
+  if (resume < meta->sent) {
+    verifyStats.rewinds++;
+    verifyStats.rewindBytes += meta->sent - resume;
+    Serial.printf("Verify %s: gateway copy matches up to %lu of %lu\n", filename, (unsigned long) resume,
+                  (unsigned long) meta->sent);
+    meta->sent = resume;
+  }
+
+  if (differingCount > 0) {
+    File file = SD.open(filename);
+    if (!file) {
+      return;
+    }
+    file_body_message file_body;
+    packFileBody(file_body, FILE_BODY, wireName, originId);
+    file_body.flags = FILE_FLAG_AT | FILE_FLAG_REPAIR;
+    for (size_t i = 0; i < differingCount; i++) {
+      uint32_t from = differing[i].first * VERIFY_BLOCK_SIZE;
+      uint32_t to = (differing[i].first + differing[i].count) * VERIFY_BLOCK_SIZE;
+      if (!sendRepair(file, file_body, from, to)) {
+        file.close();
+        return; // the rest is found again by the next comparison
+      }
+    }
+    file.close();
+  }
+  meta->verified = min(upTo, resume);
+  meta->generation = verifyGeneration;
+  verifyStats.filesVerified++;
+}
+
 /******************************************************************
  *                             Receiver                           *
  ******************************************************************/
 
-size_t total_bytes_received;
-size_t total_bytes_written;
-size_t bytes_written;
+TransferSession sessions[MAX_SESSIONS];
+TransferStats transferStats;
+
+void send_file_ack(const uint8_t* mac, uint16_t sessionId, uint32_t nextOffset, uint8_t msgType);
 
 // ***********************
-// * Handle File Body
+// * Session Table
 // ***********************
-void handle_file_body(const uint8_t *incomingData){
+void closeSession(TransferSession* session, const char* reason) {
+  Serial.printf("Session %04X %s %s: %lu bytes, %lu duplicates, %lu out of order\n",
+                session->sessionId, session->path, reason, (unsigned long) session->rx.expectedOffset,
+                (unsigned long) session->rx.duplicates, (unsigned long) session->rx.outOfOrder);
+  session->active = false;
+  sessionReceiverReset(&session->rx, session->rx.expectedOffset);
+  transferStats.sessionsClosed++;
+}
 
-  file_body_message file_body_gateway;
-  memcpy(&file_body_gateway, incomingData, sizeof(file_body_gateway));
-  Serial.print("Received FILE_BODY for: ");
+void expireSessions() {
+  unsigned long now = millis();
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    TransferSession* session = &sessions[i];
+    if (session->active && now - session->lastActivity > SESSION_TIMEOUT_MS) {
+      closeSession(session, "expired");
+    }
+  }
+}
 
-  String filepath = "/node/" + getDeviceNameByMac(file_body_gateway.mac)  + file_body_gateway.filename;
-  Serial.print(filepath);
-  File file = SD.open(filepath, FILE_APPEND);
-  if (!file) {
-    Serial.println("Failed to create file");
+// The node's slot is over (POLL_COMPLETE), none of its transfers continues
+void closeSenderSessions(const uint8_t* mac) {
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    TransferSession* session = &sessions[i];
+    if (session->active && compareMacAddress(session->mac, mac)) {
+      closeSession(session, "closed");
+    }
+  }
+}
+
+TransferSession* findSession(const uint8_t* mac, uint16_t sessionId) {
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    TransferSession* session = &sessions[i];
+    if (session->active && session->sessionId == sessionId && compareMacAddress(session->mac, mac)) {
+      return session;
+    }
+  }
+  return NULL;
+}
+
+// A repair session resends several ranges of a file. A frame with another
+// start is the next range when its FEC group lies past the data received so
+// far, the range then continues from that group. Older frames are dropped.
+bool nextRepairRange(TransferSession* session, uint32_t start, uint32_t offset) {
+  uint32_t groupOffset = offset - offset % FEC_GROUP_SPAN;
+  if (groupOffset < session->rx.expectedOffset) {
+    return false;
+  }
+  session->start = start;
+  sessionReceiverReset(&session->rx, groupOffset);
+  return true;
+}
+
+// A chunk or parity probe of a session already closed here, sent again
+// because the last ACK was lost: ACKed with where the session ended.
+bool ackClosedSession(const uint8_t* mac, uint16_t sessionId) {
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    TransferSession* session = &sessions[i];
+    if (!compareMacAddress(session->mac, mac)) {
+      continue;
+    }
+    if (!session->active && session->sessionId == sessionId) {
+      send_file_ack(mac, sessionId, session->rx.expectedOffset, ACK);
+      return true;
+    }
+    if (session->active && session->previousSessionId == sessionId) {
+      send_file_ack(mac, sessionId, session->previousEnd, ACK);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Peer the data of a chunk belongs to, -1 if it is not taken here. Data
+// comes over the owner's route: from the owner itself, or stored and
+// forwarded by the relay next to this device on that route.
+int chunkOwner(const uint8_t* mac, uint16_t originId) {
+  int sender = getIndexByMac(mac);
+  if (sender < 0) {
+    return -1;
+  }
+  if (originId == 0) {
+    return peers[sender].routeHops == 0 ? sender : -1; // else its relay forwards it
+  }
+  int owner = getIndexByNodeId(originId);
+  if (owner < 0 || peers[owner].routeHops == 0 || peers[owner].route[peers[owner].routeHops - 1] != peers[sender].nodeId) {
+    return -1;
+  }
+  return owner;
+}
+
+// Received files go to the owner's folder: /node/<device name><filename>
+void receivedFilePath(char* path, size_t size, int owner, const char* filename) {
+  snprintf(path, size, "/node/%s%.*s", peers[owner].deviceName, MAX_FILENAME_LEN, filename);
+}
+
+// Finds the session of a chunk, or opens one in a free entry for the owner's folder
+TransferSession* getSession(const file_body_message& chunk, int owner) {
+  expireSessions();
+
+  TransferSession* session = findSession(chunk.mac, chunk.sessionId);
+  if (session != NULL) {
+    return session;
+  }
+
+  // the sender's earlier transfer is done, it got its last ACK before this one
+  uint16_t previousSessionId = 0;
+  uint32_t previousEnd = 0;
+  TransferSession* free = NULL;
+  for (size_t i = 0; i < MAX_SESSIONS && free == NULL; i++) {
+    if (sessions[i].active && compareMacAddress(sessions[i].mac, chunk.mac)) {
+      free = &sessions[i];
+      previousSessionId = free->sessionId;
+      previousEnd = free->rx.expectedOffset;
+      closeSession(free, "done");
+    }
+  }
+  for (size_t i = 0; i < MAX_SESSIONS && free == NULL; i++) {
+    if (!sessions[i].active) {
+      free = &sessions[i];
+    }
+  }
+  if (free == NULL) {
+    return NULL;
+  }
+
+  memset(free, 0, sizeof(TransferSession));
+  free->previousSessionId = previousSessionId;
+  free->previousEnd = previousEnd;
+  free->active = true;
+  memcpy(free->mac, chunk.mac, MAC_ADDR_LENGTH);
+  free->sessionId = chunk.sessionId;
+  receivedFilePath(free->path, sizeof(free->path), owner, chunk.filename);
+  free->ownerId = peers[owner].nodeId;
+  free->positioned = chunk.flags & FILE_FLAG_AT;
+  free->repair = chunk.flags & FILE_FLAG_REPAIR;
+  free->start = free->positioned ? chunk.start : 0;
+  if (free->positioned && !free->repair && systemConfig.LORA_MODE == LORA_GATEWAY) {
+    File file = SD.open(free->path, FILE_READ);
+    free->knownEnd = file ? file.size() : 0; // part sent again after a lost ACK already has its timestamps
+    if (file) file.close();
+  }
+  free->startedAt = millis();
+  free->lastActivity = free->startedAt;
+  transferStats.sessionsOpened++;
+  return free;
+}
+
+void flushSessionStamps(TransferSession* session, const char* path, const char* lines, size_t len, uint32_t count) {
+  if (count == 0) {
     return;
   }
+  bool truncate = session->truncate && !session->stampsWritten;
+  if (sdWriterEnqueue(path, (const uint8_t*) lines, len, truncate)) {
+    session->stampsWritten = true;
+    transferStats.stampsCorrected += count;
+  } else {
+    transferStats.stampsDropped += count;
+  }
+}
 
-  // Write the file_body_gateway structure to the file
-  total_bytes_received += file_body_gateway.len;
-  bytes_written = file.write((const uint8_t*)&file_body_gateway.data, file_body_gateway.len);
-  total_bytes_written += bytes_written;
-  Serial.printf(" Wrote %d bytes. ", bytes_written);
-  file.close();
-  
-  signal_message ackMessage_gateway;
-  ackMessage_gateway.msgType = ACK;
-  memcpy(&ackMessage_gateway.mac, file_body_gateway.mac, sizeof(file_body_gateway.mac));
-  sendLoraMessage((uint8_t *) &ackMessage_gateway, sizeof(ackMessage_gateway));
+// Sample timestamps of the lines completed by newly written data, with the
+// owner's clock model correction, go to the timestamp file. The data file
+// itself stays byte for byte what the node logged.
+void writeSessionStamps(TransferSession* session, const uint8_t* data, size_t len) {
+  int owner = getIndexByNodeId(session->ownerId);
+  char path[SD_WRITER_PATH_LEN];
+  if (owner < 0 || snprintf(path, sizeof(path), "%s%s", session->path, STAMP_FILE_SUFFIX) >= (int) sizeof(path)) {
+    return;
+  }
 
-  Serial.println("Data written to file successfully");
+  char lines[SD_WRITER_CHUNK_LEN];
+  size_t used = 0;
+  uint32_t count = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] != '\n') {
+      if (session->stampLen < CLOCK_STAMP_LEN - 1) {
+        session->stamp[session->stampLen++] = data[i];
+      }
+      continue;
+    }
+    session->stamp[session->stampLen] = '\0';
+    session->stampLen = 0;
+    char* end = strchr(session->stamp, ',');
+    if (end != NULL) {
+      *end = '\0';
+    }
 
+    char line[3 * CLOCK_STAMP_LEN];
+    size_t n = clockModelCorrectStamp(&peers[owner].clock, session->stamp, line, sizeof(line));
+    if (n == 0) {
+      continue; // not a sample line, or the first one of a session that started mid-line
+    }
+    if (used + n > sizeof(lines)) {
+      flushSessionStamps(session, path, lines, used, count);
+      used = 0;
+      count = 0;
+    }
+    memcpy(lines + used, line, n);
+    used += n;
+    count++;
+  }
+  flushSessionStamps(session, path, lines, used, count);
 }
+
+// SessionWriter of the receiving sessions: queues data at the expected
+// offset for the SD writer task
+bool writeSessionData(void* context, uint32_t offset, const uint8_t* data, size_t len) {
+  TransferSession* session = (TransferSession*) context;
+  bool truncate = session->truncate && offset == 0;
+  uint32_t at = session->start + offset; // file offset of the new data
+  bool queued = session->positioned ? sdWriterEnqueueAt(session->path, at, data, len, session->repair)
+                                    : sdWriterEnqueue(session->path, data, len, truncate);
+  if (!queued) {
+    return false;
+  }
+  // a repair replaces data whose lines have their timestamps already
+  if (systemConfig.LORA_MODE == LORA_GATEWAY && !session->repair && at + len > session->knownEnd) {
+    uint32_t known = at < session->knownEnd ? session->knownEnd - at : 0;
+    writeSessionStamps(session, data + known, len - known);
+  }
+  return true;
+}
+
+void send_file_ack(const uint8_t* mac, uint16_t sessionId, uint32_t nextOffset, uint8_t msgType) {
+  file_ack_message ack;
+  ack.msgType = msgType;
+  memcpy(ack.mac, mac, MAC_ADDR_LENGTH);
+  ack.sessionId = sessionId;
+  ack.nextOffset = nextOffset;
+  sendLoraMessage((uint8_t *) &ack, sizeof(ack));
+}
+
+// ***********************
+// * Handle File Chunk
+// ***********************
+// In-order data is queued for the SD writer task and ACKed right away,
+// duplicates are only ACKed again and early chunks wait in the reorder
+// buffer. The ACK carries the next offset the session expects. Without a
+// free writer buffer the chunk is not ACKed and the sender retries.
+void handle_file_chunk(const uint8_t *incomingData, bool entire){
+
+  file_body_message chunk;
+  memcpy(&chunk, incomingData, sizeof(chunk));
+  if (chunk.len > CHUNK_SIZE || chunk.sessionId == 0) {
+    return;
+  }
+  int owner = chunkOwner(chunk.mac, chunk.originId);
+  if (owner < 0) {
+    return;
+  }
+  if (findSession(chunk.mac, chunk.sessionId) == NULL && ackClosedSession(chunk.mac, chunk.sessionId)) {
+    return;
+  }
+
+  TransferSession* session = getSession(chunk, owner);
+  if (session == NULL) {
+    Serial.println("Session table full, chunk rejected");
+    send_file_ack(chunk.mac, chunk.sessionId, 0, REJ);
+    return;
+  }
+  if (session->repair && chunk.start != session->start && !nextRepairRange(session, chunk.start, chunk.offset)) {
+    return;
+  }
+  session->lastActivity = millis();
+  if (entire) {
+    session->truncate = true; // only acts while nothing is written yet
+  }
+  bool grouped = chunk.flags & FILE_FLAG_GROUPED;
+  if (sessionReceiveChunk(&session->rx, chunk.offset, chunk.data, chunk.len, grouped, writeSessionData, session,
+                          &transferStats.receive) == CHUNK_NOT_WRITTEN) {
+    Serial.printf("%s: write queue full, not acknowledged\n", session->path);
+    return;
+  }
+
+  if (!grouped) { // the node keeps sending the group, it is ACKed after its parity
+    send_file_ack(chunk.mac, chunk.sessionId, session->rx.expectedOffset, ACK);
+  }
+}
+
+// ***********************
+// * Handle File Body
+// ***********************
+void handle_file_body(const uint8_t *incomingData){
+  handle_file_chunk(incomingData, false);
+}
+
 // ***********************
 // * Handle File Sync
 // ***********************
 void handle_file_entire(const uint8_t *incomingData){
+  handle_file_chunk(incomingData, true);
+}
 
-  file_body_message file_body_gateway;
-  memcpy(&file_body_gateway, incomingData, sizeof(file_body_gateway));
-  Serial.print("Received FILE_BODY for: ");
+// ***********************
+// * Handle File Parity
+// ***********************
+// The last parity chunk of a group, first sent or resent as a probe, is
+// answered with the session's next offset once the group has been rebuilt
+// where possible. Missing and rebuilt chunks feed the peer's loss estimate.
+void handle_file_parity(const uint8_t *incomingData){
 
-  String filepath = "/node/" + getDeviceNameByMac(file_body_gateway.mac)  + file_body_gateway.filename;
-  Serial.print(filepath);
-  File file = SD.open(filepath, FILE_WRITE);
-  if (!file) {
-    Serial.println("Failed to create file");
+  file_parity_message msg;
+  memcpy(&msg, incomingData, sizeof(msg));
+  if (msg.chunks == 0 || msg.chunks > FEC_GROUP_SIZE || msg.parity == 0 || msg.parity > FEC_MAX_PARITY
+      || msg.index >= msg.parity || msg.groupBytes > msg.chunks * CHUNK_SIZE
+      || msg.groupBytes <= (msg.chunks - 1) * CHUNK_SIZE || msg.groupOffset % FEC_GROUP_SPAN) {
     return;
   }
 
-  // Write the file_body_gateway structure to the file
-  total_bytes_received += file_body_gateway.len;
-  bytes_written = file.write((const uint8_t*)&file_body_gateway.data, file_body_gateway.len);
-  total_bytes_written += bytes_written;
-  Serial.printf(" Wrote %d bytes. ", bytes_written);
-  file.close();
-  
-  signal_message ackMessage_gateway;
-  ackMessage_gateway.msgType = ACK;
-  memcpy(&ackMessage_gateway.mac, file_body_gateway.mac, sizeof(file_body_gateway.mac));
-  sendLoraMessage((uint8_t *) &ackMessage_gateway, sizeof(ackMessage_gateway));
+  TransferSession* session = findSession(msg.mac, msg.sessionId);
+  if (session == NULL) {
+    if (msg.index == msg.parity - 1) {
+      ackClosedSession(msg.mac, msg.sessionId);
+    }
+    return; // else no chunk of the session arrived, the node times out and retries
+  }
+  if (session->repair && msg.start != session->start && !nextRepairRange(session, msg.start, msg.groupOffset)) {
+    return;
+  }
+  session->lastActivity = millis();
+
+  uint8_t sent, lost;
+  if (!sessionReceiveParity(&session->rx, msg.groupOffset, msg.chunks, msg.parity, msg.groupBytes, msg.index,
+                            msg.data, writeSessionData, session, &transferStats.receive, &sent, &lost)) {
+    return;
+  }
+  if (sent > 0) {
+    int index = getIndexByMac(msg.mac);
+    if (index >= 0) {
+      recordPeerLoss(index, sent, lost);
+    }
+    if (lost > msg.parity) {
+      Serial.printf("%s: FEC group at %lu has %u of %u chunks\n", session->path,
+                    (unsigned long) msg.groupOffset, sent - lost, msg.chunks);
+    }
+  }
+
+  send_file_ack(msg.mac, msg.sessionId, session->rx.expectedOffset, ACK);
+}
+
+// ***********************
+// * Handle File Verify
+// ***********************
+// The hashes are taken by the SD writer task, which reads up to
+// VERIFY_STEP_BYTES of the copy, and answered from there.
+void handle_file_verify(const uint8_t *incomingData, int len){
+
+  file_verify_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+  if (msg.count == 0 || msg.count > VERIFY_HASHES || msg.span == 0) {
+    return;
+  }
+  int owner = chunkOwner(msg.mac, msg.originId);
+  if (owner < 0) {
+    return;
+  }
 
-  Serial.println("Data written to file successfully");
+  char path[SD_WRITER_PATH_LEN];
+  receivedFilePath(path, sizeof(path), owner, msg.filename);
+  if (!sdWriterEnqueueVerify(path, msg)) {
+    Serial.printf("%s: verify queue full, not answered\n", path);
+  }
+}
 
-}
\ No newline at end of file
+// Hashes the same spans of the copy here and answers which differ, with the
+// size of the copy. Complete blocks come from the block cache, only data
+// received since the last verification is read.
+void answer_file_verify(const char* path, const file_verify_message& msg) {
+
+  uint32_t hashes[VERIFY_HASHES];
+  file_verify_result_message result;
+  result.msgType = FILE_VERIFY_RESULT;
+  memcpy(result.mac, msg.mac, MAC_ADDR_LENGTH);
+  result.verifyId = msg.verifyId;
+  result.mismatch = 0;
+  if (!integritySpanHashes(path, msg.size, msg.firstBlock, msg.span, msg.count, hashes, &result.size)) {
+    return;
+  }
+  for (uint8_t i = 0; i < msg.count; i++) {
+    if (hashes[i] != msg.hashes[i]) {
+      result.mismatch |= 1UL << i;
+    }
+  }
+  sendLoraMessage((uint8_t *) &result, sizeof(result));
+  verifyStats.answered++;
+  if (result.mismatch != 0) {
+    Serial.printf("%s: %u of %u spans differ from the node's\n", path, __builtin_popcount(result.mismatch), msg.count);
+  }
+}
@@ -0,0 +1,753 @@
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include "lora_firmware.h"
+#include "lora_gateway.h"
+#include "lora_slave.h"
+#include "lora_peer.h"
+#include "lora_dutycycle.h"
+#include "firmware_delta.h"
+#include "configuration.h"
+#include "utils.h"
+
+#define FW_BITMAP_BYTES ((FW_MAX_CHUNKS + 7) / 8)
+#define FW_READ_BUFFER 1024
+#define FW_EVENT_OFFER 0x01           // node: an offer for an image not seen yet
+#define FW_EVENT_COMPLETE 0x02        // node: every chunk is stored
+
+const char* firmwareStateNames[] = {"idle", "receiving", "verifying", "verified", "failed", "current", "notApplicable"};
+
+SemaphoreHandle_t xMutex_Firmware = NULL; // receive task against the control or firmware task
+
+static bool testBit(const uint8_t* map, size_t i) {
+  return map[i / 8] & (1 << (i % 8));
+}
+
+static void setBit(uint8_t* map, size_t i) {
+  map[i / 8] |= 1 << (i % 8);
+}
+
+static void clearBit(uint8_t* map, size_t i) {
+  map[i / 8] &= ~(1 << (i % 8));
+}
+
+static bool firmwareStateFinal(uint8_t state) {
+  return state == FW_VERIFIED || state == FW_FAILED || state == FW_CURRENT || state == FW_NOT_APPLICABLE;
+}
+
+static uint16_t chunkLength(uint32_t payloadSize, uint16_t index) {
+  uint32_t offset = (uint32_t) index * FW_CHUNK_SIZE;
+  return payloadSize - offset < FW_CHUNK_SIZE ? payloadSize - offset : FW_CHUNK_SIZE;
+}
+
+/******************************************************************
+ *                                                                *
+ *                       Gateway Campaign                         *
+ *                                                                *
+ ******************************************************************/
+
+FirmwareCampaign firmwareCampaign;
+uint8_t repairMap[FW_BITMAP_BYTES];   // chunks a target reported missing
+uint16_t repairCursor = 0;
+File campaignFile;
+
+// Start requested over HTTP, prepared by the control task: reading the
+// payload for its CRC takes longer than a request handler may block
+bool campaignRequested = false;
+char requestedPath[sizeof(firmwareCampaign.path)];
+uint16_t requestedNodes[FW_OFFER_TARGETS];
+size_t requestedCount = 0;
+
+void firmware_gateway_init() {
+  memset(&firmwareCampaign, 0, sizeof(firmwareCampaign));
+  xMutex_Firmware = xSemaphoreCreateMutex();
+}
+
+// No node ids: every direct, always-listening peer. Returns false if the
+// path does not exist or another campaign is still running.
+bool firmwareCampaignStart(const char* path, const uint16_t* nodeIds, size_t count) {
+  if (xMutex_Firmware == NULL || strlen(path) >= sizeof(requestedPath) || !SD.exists(path)) {
+    return false;
+  }
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  bool free = !firmwareCampaign.active && !campaignRequested;
+  if (free) {
+    strcpy(requestedPath, path);
+    requestedCount = min(count, (size_t) FW_OFFER_TARGETS);
+    memcpy(requestedNodes, nodeIds, requestedCount * sizeof(uint16_t));
+    campaignRequested = true;
+  }
+  xSemaphoreGive(xMutex_Firmware);
+  return free;
+}
+
+void firmwareCampaignCancel() {
+  if (xMutex_Firmware == NULL) {
+    return;
+  }
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  campaignRequested = false;
+  if (firmwareCampaign.active) {
+    firmwareCampaign.active = false; // the control task closes the file
+    Serial.printf("Firmware campaign %u cancelled\n", firmwareCampaign.imageId);
+  }
+  xSemaphoreGive(xMutex_Firmware);
+}
+
+// Relayed nodes would need every chunk stored and forwarded per hop and
+// deep-sleep nodes are not listening between cycles, both are left out
+static bool firmwareTargetReachable(int index) {
+  return index >= 0 && peers[index].routeHops == 0 && peers[index].wakePeriodS == 0;
+}
+
+// **************************************
+// * Prepare
+// **************************************
+static bool prepare_campaign() {
+
+  FirmwareCampaign* c = &firmwareCampaign;
+  File file = SD.open(requestedPath, FILE_READ);
+  if (!file) {
+    Serial.printf("Firmware %s: cannot open\n", requestedPath);
+    return false;
+  }
+  uint32_t size = file.size();
+  if (size == 0 || size > (uint32_t) FW_MAX_CHUNKS * FW_CHUNK_SIZE) {
+    Serial.printf("Firmware %s: %lu bytes does not fit an app partition\n", requestedPath, size);
+    file.close();
+    return false;
+  }
+
+  uint8_t buffer[FW_READ_BUFFER];
+  DeltaHeader header;
+  memset(&header, 0, sizeof(header));
+  uint32_t crc = 0;
+  size_t n;
+  bool first = true;
+  while ((n = file.read(buffer, sizeof(buffer))) > 0) {
+    if (first && n >= sizeof(header)) {
+      memcpy(&header, buffer, sizeof(header)); // a patch starts with its header
+    }
+    first = false;
+    crc = crc32Update(crc, buffer, n);
+  }
+  file.close();
+
+  memset(c, 0, sizeof(FirmwareCampaign));
+  strcpy(c->path, requestedPath);
+  c->payloadSize = size;
+  c->payloadCrc = crc;
+  c->imageId = random(1, 0x10000); // per campaign, a node that failed tries again in the next one
+  if (header.magic == DELTA_MAGIC) {
+    c->kind = FW_KIND_DELTA;
+    c->baseSize = header.baseSize;
+    c->baseCrc = header.baseCrc;
+    c->targetSize = header.targetSize;
+    c->targetCrc = header.targetCrc;
+  } else {
+    c->kind = FW_KIND_IMAGE;
+    c->targetSize = size;
+    c->targetCrc = crc;
+  }
+  c->chunkCount = (size + FW_CHUNK_SIZE - 1) / FW_CHUNK_SIZE;
+
+  for (size_t i = 0; i < (requestedCount > 0 ? requestedCount : peerCount) && c->targetCount < FW_OFFER_TARGETS; i++) {
+    int index = requestedCount > 0 ? getIndexByNodeId(requestedNodes[i]) : (int) i;
+    if (!firmwareTargetReachable(index)) {
+      if (requestedCount > 0) {
+        Serial.printf("Firmware: node %u skipped, behind a relay or sleeping\n", requestedNodes[i]);
+      }
+      continue;
+    }
+    c->targets[c->targetCount].nodeId = peers[index].nodeId;
+    c->targetCount++;
+  }
+  if (c->targetCount == 0) {
+    Serial.println("Firmware: no node to update");
+    return false;
+  }
+
+  campaignFile = SD.open(c->path, FILE_READ);
+  if (!campaignFile) {
+    return false;
+  }
+  memset(repairMap, 0, sizeof(repairMap));
+  repairCursor = 0;
+  c->startedAt = millis();
+  c->nextBurst = c->startedAt;
+  c->active = true;
+  Serial.printf("Firmware campaign %u: %s, %s of %lu bytes, %u chunks, %u nodes\n", c->imageId, c->path,
+                c->kind == FW_KIND_DELTA ? "patch" : "image", c->payloadSize, c->chunkCount, c->targetCount);
+  return true;
+}
+
+// **************************************
+// * Send
+// **************************************
+static void send_firmware_offer() {
+
+  FirmwareCampaign* c = &firmwareCampaign;
+  fw_offer_message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msgType = FW_OFFER;
+  msg.kind = c->kind;
+  msg.imageId = c->imageId;
+  msg.pairingKey = systemConfig.PAIRING_KEY;
+  msg.payloadSize = c->payloadSize;
+  msg.payloadCrc = c->payloadCrc;
+  msg.baseSize = c->baseSize;
+  msg.baseCrc = c->baseCrc;
+  msg.targetSize = c->targetSize;
+  msg.targetCrc = c->targetCrc;
+  msg.sentUpTo = c->sentUpTo;
+  // nodes that reached a final state drop out of the list and stop reporting
+  for (size_t i = 0; i < c->targetCount; i++) {
+    if (!firmwareStateFinal(c->targets[i].state)) {
+      msg.targets[msg.targetCount++] = c->targets[i].nodeId;
+    }
+  }
+
+  size_t size = offsetof(fw_offer_message, targets) + msg.targetCount * sizeof(uint16_t);
+  sendLoraMessage((uint8_t *) &msg, size);
+  c->offersSent++;
+  c->airtimeUs += frameAirtimeUs(size);
+}
+
+// Next chunk to send: reported missing first, then the first pass.
+// Returns false when nothing is left.
+static bool next_firmware_chunk(uint16_t* index, bool* repair) {
+
+  FirmwareCampaign* c = &firmwareCampaign;
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  bool found = false;
+  for (uint16_t k = 0; c->repairPending > 0 && k < c->chunkCount; k++) {
+    uint16_t i = (repairCursor + k) % c->chunkCount;
+    if (testBit(repairMap, i)) {
+      clearBit(repairMap, i);
+      c->repairPending--;
+      repairCursor = i + 1;
+      *index = i;
+      *repair = true;
+      found = true;
+      break;
+    }
+  }
+  if (!found && c->sentUpTo < c->chunkCount) {
+    *index = c->sentUpTo++;
+    *repair = false;
+    found = true;
+  }
+  xSemaphoreGive(xMutex_Firmware);
+  return found;
+}
+
+static bool send_firmware_chunk(uint16_t index) {
+
+  FirmwareCampaign* c = &firmwareCampaign;
+  fw_chunk_message msg;
+  msg.msgType = FW_CHUNK;
+  msg.imageId = c->imageId;
+  msg.index = index;
+  msg.len = chunkLength(c->payloadSize, index);
+  if (!campaignFile.seek((uint32_t) index * FW_CHUNK_SIZE) || campaignFile.read(msg.data, msg.len) != msg.len) {
+    Serial.printf("Firmware: cannot read chunk %u of %s\n", index, c->path);
+    return false;
+  }
+
+  size_t size = offsetof(fw_chunk_message, data) + msg.len;
+  sendLoraMessage((uint8_t *) &msg, size);
+  c->chunksSent++;
+  c->airtimeUs += frameAirtimeUs(size);
+  return true;
+}
+
+static void end_campaign(const char* reason) {
+  FirmwareCampaign* c = &firmwareCampaign;
+  size_t updated = 0;
+  for (size_t i = 0; i < c->targetCount; i++) {
+    updated += c->targets[i].state == FW_VERIFIED || c->targets[i].state == FW_CURRENT;
+  }
+  Serial.printf("Firmware campaign %u %s: %u of %u nodes updated, %lu chunks (%lu repairs), %lu ms airtime\n",
+                c->imageId, reason, updated, c->targetCount, c->chunksSent, c->repairsSent, (uint32_t) (c->airtimeUs / 1000));
+  c->active = false;
+  campaignFile.close();
+}
+
+// **************************************
+// * Service Campaign
+// **************************************
+// Runs between poll cycles like the config outbox: an offer, then a burst of
+// chunks as long as the duty-cycle budget allows. With everything sent and
+// nothing reported missing only the offer goes out, every FW_OFFER_REPEAT_MS.
+void service_firmware_campaign() {
+
+  FirmwareCampaign* c = &firmwareCampaign;
+  if (campaignRequested) {
+    bool started = prepare_campaign();
+    campaignRequested = false;
+    if (!started) {
+      c->active = false;
+    }
+  }
+  if (!c->active) {
+    if (campaignFile) {
+      campaignFile.close(); // cancelled
+    }
+    return;
+  }
+
+  unsigned long now = millis();
+  bool done = true;
+  for (size_t i = 0; i < c->targetCount; i++) {
+    done = done && firmwareStateFinal(c->targets[i].state);
+  }
+  if (done) {
+    end_campaign("done");
+    return;
+  }
+  if (now - c->startedAt >= FW_CAMPAIGN_TIMEOUT_MS) {
+    end_campaign("timed out");
+    return;
+  }
+  if ((long) (now - c->nextBurst) < 0) {
+    return;
+  }
+
+  uint32_t chunkUs = frameAirtimeUs(sizeof(fw_chunk_message));
+  bool work = c->sentUpTo < c->chunkCount || c->repairPending > 0;
+  bool budget = airtimeBulkAllowed(chunkUs);
+  uint32_t burstMs = work && budget ? FW_BURST_CHUNKS * chunkUs / 1000 : 0;
+  if (wake_boundary_near(burstMs + frameAirtimeUs(sizeof(fw_offer_message)) / 1000 + BEACON_GUARD_MS)) {
+    return; // the wake cycle of deep-sleep nodes comes first
+  }
+
+  size_t sent = 0;
+  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
+    send_firmware_offer();
+    uint16_t index;
+    bool repair;
+    while (work && sent < FW_BURST_CHUNKS && airtimeBulkAllowed(chunkUs) && next_firmware_chunk(&index, &repair)) {
+      if (!send_firmware_chunk(index)) {
+        break;
+      }
+      c->repairsSent += repair;
+      sent++;
+    }
+    xSemaphoreGive(xMutex_DataPoll);
+  }
+  c->nextBurst = sent > 0 ? now : now + FW_OFFER_REPEAT_MS;
+}
+
+// **************************************
+// * Node Status
+// **************************************
+void handle_firmware_status(const uint8_t *incomingData, int len) {
+
+  fw_status_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+  int index = getIndexByMac(msg.mac);
+  FirmwareCampaign* c = &firmwareCampaign;
+  if (index < 0 || !c->active || msg.imageId != c->imageId) {
+    return;
+  }
+
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  FirmwareTarget* target = NULL;
+  for (size_t i = 0; i < c->targetCount; i++) {
+    if (c->targets[i].nodeId == peers[index].nodeId) {
+      target = &c->targets[i];
+    }
+  }
+  if (target != NULL) {
+    target->state = msg.state;
+    target->received = msg.received;
+    target->lastStatus = millis();
+    c->nacks += msg.rangeCount > 0;
+    for (size_t r = 0; r < min(msg.rangeCount, (uint8_t) FW_NACK_RANGES); r++) {
+      uint32_t end = min((uint32_t) msg.missing[r].first + msg.missing[r].count, (uint32_t) c->sentUpTo);
+      for (uint32_t i = msg.missing[r].first; i < end; i++) {
+        if (!testBit(repairMap, i)) {
+          setBit(repairMap, i);
+          c->repairPending++;
+        }
+      }
+    }
+  }
+  xSemaphoreGive(xMutex_Firmware);
+
+  if (target != NULL) {
+    Serial.printf("Firmware %s: %s, %u of %u chunks\n", peers[index].deviceName, firmwareStateNames[min(msg.state, (uint8_t) FW_NOT_APPLICABLE)],
+                  msg.received, c->chunkCount);
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Node Receive                           *
+ *                                                                *
+ ******************************************************************/
+
+// Received map on SD, a restart keeps the chunks already stored and so does
+// a later campaign with the same payload
+typedef struct FirmwareMapHeader {
+  uint32_t payloadCrc;
+  uint32_t payloadSize;
+} FirmwareMapHeader;
+
+typedef struct FirmwareNode {
+  uint8_t state;
+  fw_offer_message offer;   // the image being received or checked
+  uint16_t chunkCount;
+  uint16_t received;
+  uint16_t sinceSave;       // chunks since the map was written
+  unsigned long lastOffer;  // millis() of the last offer listing this node, 0 = stop reporting
+  bool restartDue;          // verified image reported, restart after the slot
+} FirmwareNode;
+
+FirmwareNode fwNode;
+uint8_t receivedMap[FW_BITMAP_BYTES];
+File stagedFile;
+fw_offer_message pendingOffer;        // handed to the firmware task
+EventGroupHandle_t firmwareEvents = NULL;
+uint32_t runningCrcSize = 0;          // last CRC of the running image, reading 1 MB of flash takes a while
+uint32_t runningCrc = 0;
+
+static bool sameOffer(const fw_offer_message& a, const fw_offer_message& b) {
+  return a.imageId == b.imageId && a.payloadCrc == b.payloadCrc;
+}
+
+static bool offerListsMe(const fw_offer_message& msg) {
+  for (size_t i = 0; i < min(msg.targetCount, (uint8_t) FW_OFFER_TARGETS); i++) {
+    if (msg.targets[i] == myNodeId) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void handle_firmware_offer(const uint8_t *incomingData, int len) {
+
+  fw_offer_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+  if (xMutex_Firmware == NULL || msg.pairingKey != systemConfig.PAIRING_KEY || pairingStatus != PAIR_PAIRED) {
+    return;
+  }
+
+  bool listed = offerListsMe(msg);
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  if (fwNode.state != FW_IDLE && sameOffer(msg, fwNode.offer)) {
+    fwNode.offer.sentUpTo = msg.sentUpTo;
+    fwNode.lastOffer = listed ? millis() : 0;
+  } else if (listed) {
+    pendingOffer = msg;
+    xEventGroupSetBits(firmwareEvents, FW_EVENT_OFFER);
+  }
+  xSemaphoreGive(xMutex_Firmware);
+}
+
+static void save_received_map() {
+  File map = SD.open(FW_MAP_PATH, FILE_WRITE);
+  if (!map) {
+    return;
+  }
+  FirmwareMapHeader header = {fwNode.offer.payloadCrc, fwNode.offer.payloadSize};
+  map.write((uint8_t *) &header, sizeof(header));
+  map.write(receivedMap, (fwNode.chunkCount + 7) / 8);
+  map.close();
+  fwNode.sinceSave = 0;
+}
+
+// Chunks are written where they belong, seeking past the end of a file open
+// for writing extends it
+void handle_firmware_chunk(const uint8_t *incomingData, int len) {
+
+  if (xMutex_Firmware == NULL || len < (int) offsetof(fw_chunk_message, data)) {
+    return;
+  }
+  fw_chunk_message msg;
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  bool wanted = fwNode.state == FW_RECEIVING && msg.imageId == fwNode.offer.imageId && msg.index < fwNode.chunkCount
+                && !testBit(receivedMap, msg.index) && msg.len == chunkLength(fwNode.offer.payloadSize, msg.index)
+                && len >= (int) offsetof(fw_chunk_message, data) + msg.len;
+  if (wanted && stagedFile.seek((uint32_t) msg.index * FW_CHUNK_SIZE) && stagedFile.write(msg.data, msg.len) == msg.len) {
+    setBit(receivedMap, msg.index);
+    fwNode.received++;
+    fwNode.sinceSave++;
+    if (fwNode.received == fwNode.chunkCount) {
+      stagedFile.close();
+      save_received_map();
+      fwNode.state = FW_VERIFYING; // chunks are ignored from here
+      xEventGroupSetBits(firmwareEvents, FW_EVENT_COMPLETE);
+    } else if (fwNode.sinceSave >= FW_MAP_SAVE_CHUNKS) {
+      stagedFile.flush();
+      save_received_map();
+    }
+  }
+  xSemaphoreGive(xMutex_Firmware);
+}
+
+// **************************************
+// * Report
+// **************************************
+// In the node's slot before POLL_COMPLETE, while the gateway still lists it.
+// Missing ranges are only those below sentUpTo, the rest is still coming.
+void send_firmware_status() {
+
+  if (xMutex_Firmware == NULL) {
+    return;
+  }
+  fw_status_message msg;
+  memset(&msg, 0, sizeof(msg));
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  bool report = fwNode.state != FW_IDLE && fwNode.lastOffer != 0 && millis() - fwNode.lastOffer < FW_OFFER_HEARD_MS;
+  if (report) {
+    msg.msgType = FW_STATUS;
+    memcpy(msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+    msg.state = fwNode.state;
+    msg.imageId = fwNode.offer.imageId;
+    msg.received = fwNode.received;
+    uint16_t upTo = fwNode.state == FW_RECEIVING ? min(fwNode.offer.sentUpTo, fwNode.chunkCount) : 0;
+    for (uint16_t i = 0; i < upTo && msg.rangeCount < FW_NACK_RANGES; i++) {
+      if (testBit(receivedMap, i)) {
+        continue;
+      }
+      fw_range* range = &msg.missing[msg.rangeCount];
+      range->first = i;
+      while (i < upTo && !testBit(receivedMap, i)) {
+        i++;
+      }
+      range->count = i - range->first;
+      msg.rangeCount++;
+    }
+    fwNode.restartDue = fwNode.state == FW_VERIFIED;
+  }
+  xSemaphoreGive(xMutex_Firmware);
+
+  if (report) {
+    sendLoraMessage((uint8_t *) &msg, offsetof(fw_status_message, missing) + msg.rangeCount * sizeof(fw_range));
+    Serial.printf("Sent FW_STATUS %s, %u of %u chunks, %u ranges missing\n", firmwareStateNames[msg.state], msg.received,
+                  fwNode.chunkCount, msg.rangeCount);
+  }
+}
+
+// After the slot that reported the verified image, the new one boots
+void firmware_restart_if_reported() {
+  if (fwNode.restartDue) {
+    Serial.println("Restarting into the new firmware");
+    delay(100);
+    ESP.restart();
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Node Apply                            *
+ *                                                                *
+ ******************************************************************/
+
+// CRC of the first size bytes of the running app partition
+static uint32_t running_image_crc(uint32_t size) {
+  if (size == runningCrcSize) {
+    return runningCrc;
+  }
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (running == NULL || size > running->size) {
+    return 0;
+  }
+  uint8_t buffer[FW_READ_BUFFER];
+  uint32_t crc = 0;
+  for (uint32_t offset = 0; offset < size; offset += sizeof(buffer)) {
+    size_t n = min((uint32_t) sizeof(buffer), size - offset);
+    if (esp_partition_read(running, offset, buffer, n) != ESP_OK) {
+      return 0;
+    }
+    crc = crc32Update(crc, buffer, n);
+  }
+  runningCrcSize = size;
+  runningCrc = crc;
+  return crc;
+}
+
+// A new offer: nothing to do if the node already runs the target, a patch
+// only applies to its base. Otherwise reception starts, or resumes from the
+// received map of the same payload.
+static void accept_offer(const fw_offer_message& offer) {
+
+  const esp_partition_t* next = esp_ota_get_next_update_partition(NULL);
+  uint16_t chunkCount = (offer.payloadSize + FW_CHUNK_SIZE - 1) / FW_CHUNK_SIZE;
+  uint8_t state = FW_RECEIVING;
+  if (next == NULL || offer.targetSize > next->size || chunkCount == 0 || chunkCount > FW_MAX_CHUNKS) {
+    state = FW_FAILED;
+  } else if (running_image_crc(offer.targetSize) == offer.targetCrc) {
+    state = FW_CURRENT;
+  } else if (offer.kind == FW_KIND_DELTA && running_image_crc(offer.baseSize) != offer.baseCrc) {
+    state = FW_NOT_APPLICABLE;
+  }
+
+  bool resumed = false;
+  if (state == FW_RECEIVING) {
+    memset(receivedMap, 0, sizeof(receivedMap));
+    File map = SD.open(FW_MAP_PATH, FILE_READ);
+    FirmwareMapHeader header;
+    if (map && map.read((uint8_t *) &header, sizeof(header)) == sizeof(header)
+        && header.payloadCrc == offer.payloadCrc && header.payloadSize == offer.payloadSize && SD.exists(FW_STAGE_PATH)) {
+      resumed = map.read(receivedMap, (chunkCount + 7) / 8) == (chunkCount + 7) / 8;
+    }
+    if (map) {
+      map.close();
+    }
+    if (!resumed) {
+      memset(receivedMap, 0, sizeof(receivedMap));
+      SD.mkdir("/firmware");
+      File fresh = SD.open(FW_STAGE_PATH, FILE_WRITE); // truncated
+      fresh.close();
+    }
+  }
+
+  xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+  if (stagedFile) {
+    stagedFile.close();
+  }
+  fwNode.offer = offer;
+  fwNode.chunkCount = chunkCount;
+  fwNode.received = 0;
+  fwNode.sinceSave = 0;
+  fwNode.lastOffer = millis();
+  fwNode.restartDue = false;
+  if (state == FW_RECEIVING) {
+    for (uint16_t i = 0; i < chunkCount; i++) {
+      fwNode.received += testBit(receivedMap, i);
+    }
+    stagedFile = SD.open(FW_STAGE_PATH, "r+");
+    if (!stagedFile) {
+      state = FW_FAILED;
+    }
+  }
+  fwNode.state = state;
+  if (state == FW_RECEIVING && fwNode.received == chunkCount) {
+    stagedFile.close();
+    fwNode.state = FW_VERIFYING;
+    xEventGroupSetBits(firmwareEvents, FW_EVENT_COMPLETE);
+  }
+  xSemaphoreGive(xMutex_Firmware);
+
+  Serial.printf("Firmware %u offered: %s of %lu bytes, %s, %u chunks stored\n", offer.imageId,
+                offer.kind == FW_KIND_DELTA ? "patch" : "image", offer.payloadSize, firmwareStateNames[state], fwNode.received);
+}
+
+static bool read_running(void* ctx, uint32_t offset, uint8_t* data, size_t len) {
+  return esp_partition_read((const esp_partition_t*) ctx, offset, data, len) == ESP_OK;
+}
+
+static bool write_update(void* ctx, const uint8_t* data, size_t len) {
+  return Update.write((uint8_t *) data, len) == len;
+}
+
+// Whole payload against its CRC first, a corrupt one is received again.
+// Then the image goes to the inactive OTA partition through Update, as the
+// file itself or rebuilt from the patch and the running image, and is only
+// marked for boot if it matches the target CRC.
+static uint8_t apply_firmware(const fw_offer_message& offer) {
+
+  uint8_t buffer[FW_READ_BUFFER];
+  File file = SD.open(FW_STAGE_PATH, FILE_READ);
+  uint32_t crc = 0;
+  size_t n;
+  while (file && (n = file.read(buffer, sizeof(buffer))) > 0) {
+    crc = crc32Update(crc, buffer, n);
+  }
+  if (!file || file.size() != offer.payloadSize || crc != offer.payloadCrc) {
+    Serial.println("Firmware payload CRC mismatch, receiving again");
+    if (file) {
+      file.close();
+    }
+    SD.remove(FW_MAP_PATH);
+    return FW_RECEIVING;
+  }
+
+  if (!Update.begin(offer.targetSize)) {
+    Serial.printf("Firmware update: %s\n", Update.errorString());
+    file.close();
+    return FW_FAILED;
+  }
+  file.seek(0);
+  bool ok = true;
+  if (offer.kind == FW_KIND_DELTA) {
+    DeltaPatcher patcher;
+    deltaPatchBegin(&patcher, read_running, write_update, (void*) esp_ota_get_running_partition());
+    while (ok && (n = file.read(buffer, sizeof(buffer))) > 0) {
+      ok = deltaPatchFeed(&patcher, buffer, n);
+    }
+    ok = ok && deltaPatchEnd(&patcher) && patcher.header.targetCrc == offer.targetCrc;
+  } else {
+    crc = 0;
+    while (ok && (n = file.read(buffer, sizeof(buffer))) > 0) {
+      crc = crc32Update(crc, buffer, n);
+      ok = write_update(NULL, buffer, n);
+    }
+    ok = ok && crc == offer.targetCrc;
+  }
+  file.close();
+
+  if (!ok || !Update.end(true)) {
+    Serial.printf("Firmware update failed: %s\n", Update.hasError() ? Update.errorString() : "image does not match");
+    Update.abort();
+    return FW_FAILED;
+  }
+  SD.remove(FW_STAGE_PATH);
+  SD.remove(FW_MAP_PATH);
+  Serial.printf("Firmware %u written, %lu bytes\n", offer.imageId, offer.targetSize);
+  return FW_VERIFIED;
+}
+
+// **************************************
+// * Task Firmware
+// **************************************
+// Flash reads and writes take seconds, kept off the receive task
+void firmwareTask(void * parameter) {
+
+  while (true) {
+    EventBits_t bits = xEventGroupWaitBits(firmwareEvents, FW_EVENT_OFFER | FW_EVENT_COMPLETE, pdTRUE, pdFALSE, portMAX_DELAY);
+
+    if (bits & FW_EVENT_OFFER) {
+      xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+      fw_offer_message offer = pendingOffer;
+      bool fresh = fwNode.state == FW_IDLE || !sameOffer(offer, fwNode.offer);
+      bool busy = fwNode.state == FW_VERIFYING;
+      xSemaphoreGive(xMutex_Firmware);
+      if (fresh && !busy) {
+        accept_offer(offer);
+      }
+    }
+
+    if (bits & FW_EVENT_COMPLETE) {
+      xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+      fw_offer_message offer = fwNode.offer;
+      xSemaphoreGive(xMutex_Firmware);
+
+      uint8_t state = apply_firmware(offer);
+
+      xSemaphoreTake(xMutex_Firmware, portMAX_DELAY);
+      fwNode.state = state;
+      if (state == FW_RECEIVING) {
+        memset(receivedMap, 0, sizeof(receivedMap));
+        fwNode.received = 0;
+        stagedFile = SD.open(FW_STAGE_PATH, "r+");
+        if (!stagedFile) {
+          fwNode.state = FW_FAILED;
+        }
+      }
+      xSemaphoreGive(xMutex_Firmware);
+    }
+  }
+}
+
+void firmware_node_init() {
+  memset(&fwNode, 0, sizeof(fwNode));
+  xMutex_Firmware = xSemaphoreCreateMutex();
+  firmwareEvents = xEventGroupCreate();
+  xTaskCreate(firmwareTask, "Firmware Task", 8192, NULL, 1, NULL);
+}
@@ -1,18 +1,51 @@
 #include "lora_gateway.h"
 #include "lora_file_transfer.h"
 #include "lora_peer.h"
+#include "lora_scheduler.h"
+#include "lora_relay.h"
+#include "lora_radio.h"
+#include "lora_timesync.h"
+#include "sd_writer.h"
+#include "config_outbox.h"
+#include "lora_firmware.h"
 #include "configuration.h"
+#include "config_codec.h"
+#include "power_profile.h"
 #include "utils.h"
 
 unsigned long lastPollTime = 0;
-unsigned long lastTimeSyncTime = 0;
-unsigned long lastConfigSyncTime = 0;
-const unsigned long pollInterval = 60000; // 1 minute
-const unsigned long timeSyncInterval = 60000;
-const unsigned long configSyncInterval = 60000;
-
-bool poll_success = false;
-int rssi = 0;
+const unsigned long pollInterval = 60000; // 1 minute, every node gets a slot at least this often
+const unsigned long busyPollInterval = 5000; // next cycle while any node still has backlog
+unsigned long currentPollInterval = pollInterval;
+
+int64_t lastWakeBoundary = 0;          // network second of the last cycle run for deep-sleep nodes
+
+uint16_t cycleId = 0;
+PollCycleStats pollCycleStats;
+SlotAssignment slotSchedule[MAX_PEERS];
+volatile bool slotCompleted[MAX_PEERS];
+uint8_t peerSlotChannel[MAX_PEERS];    // channel of each peer's slot in the current cycle
+bool verifyWanted[MAX_PEERS];          // set at boot: the copies on this SD card may not be what the nodes sent
+bool verifyAsked[MAX_PEERS];           // SLOT_FLAG_VERIFY set in the peer's slot of this cycle
+ChannelStats channelStats[LORA_CHANNELS];
+EventGroupHandle_t cycleEvents = NULL; // CYCLE_EVENT_STATUS wakes the poll task waiting for the cycle to end
+
+#define CYCLE_EVENT_STATUS 0x01       // a POLL_COMPLETE came in
+
+// Pairing requests, heard directly and through relays, wait for the other
+// copies so the response can take the best route
+#define MAX_PENDING_PAIRINGS 4
+typedef struct PendingPairing {
+  bool used;
+  unsigned long firstSeen;
+  struct_pairing request;
+  uint8_t hops;
+  uint16_t path[RELAY_MAX_HOPS];
+  int rssi;                 // weakest link of the path
+} PendingPairing;
+
+PendingPairing pendingPairings[MAX_PENDING_PAIRINGS];
+SemaphoreHandle_t xMutex_Pairing = NULL;
 
 /******************************************************************
  *                                                                *
@@ -20,13 +53,74 @@ int rssi = 0;
  *                                                                *
  ******************************************************************/
 
+// ***********************
+// * Node Folders
+// ***********************
+// /node/<name>/data/{ADC,UART,I2C}, created when a node pairs for the first
+// time, on the gateway and on the relay it is behind
+void create_node_folders(const char* deviceName) {
+
+  char deviceFolder[MAX_DEVICE_NAME_LEN + 1]; // 10 for the name + 1 for the null terminator
+  strncpy(deviceFolder, deviceName, 10);
+  deviceFolder[MAX_DEVICE_NAME_LEN] = '\0'; // Ensure null-termination
+
+  char folderPath[MAX_DEVICE_NAME_LEN + 6]; // 1 for '/' + 4 for 'data' + 1 for '/' + 10 for the name + 1 for the null terminator
+  snprintf(folderPath, sizeof(folderPath), "/node/%s", deviceFolder);
+  Serial.println(folderPath);
+
+  if (SD.mkdir(folderPath)) {
+    Serial.println("Directory created successfully.");
+  } else {
+    Serial.println("Failed to create directory.");
+  }
+
+  // create data folder
+  char datafolderPath[MAX_DEVICE_NAME_LEN + 11]; // 10 for device name + 1 for null terminator
+  snprintf(datafolderPath, sizeof(datafolderPath), "/node/%s/data", deviceFolder);
+  if (SD.mkdir(datafolderPath)) {
+    Serial.println("Directory /data created successfully.");
+  } else {
+    Serial.println("Failed to create /data directory.");
+  }
+
+
+  // Create subdirectories for ADC, UART, and I2C
+  char subfolderADC[MAX_DEVICE_NAME_LEN + 20]; // 10 for device name + 1 for null terminator
+  char subfolderUART[MAX_DEVICE_NAME_LEN + 20];
+  char subfolderI2C[MAX_DEVICE_NAME_LEN + 20];
+  snprintf(subfolderADC, sizeof(subfolderADC), "%s/data/ADC", folderPath);
+  snprintf(subfolderUART, sizeof(subfolderUART), "%s/data/UART", folderPath);
+  snprintf(subfolderI2C, sizeof(subfolderI2C), "%s/data/I2C", folderPath);
+
+  if (SD.mkdir(subfolderADC)) {
+    Serial.println("ADC subdirectory created successfully.");
+  } else {
+    Serial.println("Failed to create ADC subdirectory.");
+  }
+
+  if (SD.mkdir(subfolderUART)) {
+    Serial.println("UART subdirectory created successfully.");
+  } else {
+    Serial.println("Failed to create UART subdirectory.");
+  }
+
+  if (SD.mkdir(subfolderI2C)) {
+    Serial.println("I2C subdirectory created successfully.");
+  } else {
+    Serial.println("Failed to create I2C subdirectory.");
+  }
+
+  Serial.println("End of dir creation.");
+}
+
 // ***********************
 // * Handle Pairing
 // ***********************
-void handle_pairing(const uint8_t *incomingData){
+// Runs in the control task once the copies of the request are in, the
+// response goes back over the best route they came by
+void handle_pairing(const PendingPairing& pending){
 
-  struct_pairing pairingDataGateway;
-  memcpy(&pairingDataGateway, incomingData, sizeof(pairingDataGateway));
+  struct_pairing pairingDataGateway = pending.request;
 
   Serial.print("\nPairing request from: ");
   printMacAddress(pairingDataGateway.mac_origin);
@@ -39,10 +133,6 @@ void handle_pairing(const uint8_t *incomingData){
   Serial.print("System pairing key: ");Serial.println(systemConfig.PAIRING_KEY);
   if(pairingDataGateway.pairingKey == systemConfig.PAIRING_KEY){
     Serial.println("Correct PAIRING_KEY");
-    oled_print("send response");
-    memcpy(&pairingDataGateway.mac_master, MAC_ADDRESS_STA, sizeof(MAC_ADDRESS_STA));
-    sendLoraMessage((uint8_t *) &pairingDataGateway, sizeof(pairingDataGateway));
-    Serial.println("Sent pairing response...");
   }
   else{
     Serial.println("Wrong PAIRING_KEY");
@@ -53,90 +143,267 @@ void handle_pairing(const uint8_t *incomingData){
 
   // If first time pairing, create a dir for this node
   if(addPeerGateway(pairingDataGateway.mac_origin, pairingDataGateway.deviceName)){
-    
     Serial.println("First time pairing, create a dir for this node");
+    create_node_folders(pairingDataGateway.deviceName);
+  }
 
-    char deviceFolder[MAX_DEVICE_NAME_LEN + 1]; // 10 for the name + 1 for the null terminator
-    strncpy(deviceFolder, pairingDataGateway.deviceName, 10);
-    deviceFolder[MAX_DEVICE_NAME_LEN] = '\0'; // Ensure null-termination
+  // Respond once the peer is in the table, the response carries its node id
+  int index = getIndexByMac(pairingDataGateway.mac_origin);
+  if (index < 0) {
+    Serial.println("Peer table full, pairing refused.");
+    return;
+  }
+  setPeerRoute(index, pending.hops, pending.path, pending.rssi);
+  oled_print("send response");
+  memcpy(&pairingDataGateway.mac_master, MAC_ADDRESS_STA, sizeof(MAC_ADDRESS_STA));
+  pairingDataGateway.nodeId = peers[index].nodeId;
+  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
+    sendToPeer(index, (uint8_t *) &pairingDataGateway, sizeof(pairingDataGateway));
+    xSemaphoreGive(xMutex_DataPoll);
+  }
+  Serial.printf("Sent pairing response, node id %u\n", pairingDataGateway.nodeId);
+}
 
-    char folderPath[MAX_DEVICE_NAME_LEN + 6]; // 1 for '/' + 4 for 'data' + 1 for '/' + 10 for the name + 1 for the null terminator
-    snprintf(folderPath, sizeof(folderPath), "/node/%s", deviceFolder);
-    Serial.println(folderPath);
+// Keeps the best copy of a request, scored by its weakest link and relay count
+void queue_pairing(const uint8_t *incomingData, int len, uint8_t hops, const uint16_t* path, int rssi){
 
-    if (SD.mkdir(folderPath)) {
-      Serial.println("Directory created successfully.");
-    } else {
-      Serial.println("Failed to create directory.");
+  struct_pairing request;
+  memset(&request, 0, sizeof(request));
+  memcpy(&request, incomingData, min((size_t) len, sizeof(request)));
+  if (request.nodeId != 0) {
+    return; // a response, e.g. repeated by a relay
+  }
+
+  xSemaphoreTake(xMutex_Pairing, portMAX_DELAY);
+  PendingPairing* entry = NULL;
+  for (size_t i = 0; i < MAX_PENDING_PAIRINGS && entry == NULL; i++) {
+    if (pendingPairings[i].used && compareMacAddress(pendingPairings[i].request.mac_origin, request.mac_origin)) {
+      entry = &pendingPairings[i];
+    }
+  }
+  if (entry != NULL && routeScore(rssi, hops) <= routeScore(entry->rssi, entry->hops)) {
+    entry = NULL; // the copy already kept came by a better route
+  } else if (entry == NULL) {
+    for (size_t i = 0; i < MAX_PENDING_PAIRINGS && entry == NULL; i++) {
+      if (!pendingPairings[i].used) {
+        entry = &pendingPairings[i];
+        entry->used = true;
+        entry->firstSeen = millis();
+      }
     }
+  }
+  if (entry != NULL) {
+    entry->request = request;
+    entry->hops = hops;
+    memset(entry->path, 0, sizeof(entry->path));
+    if (hops > 0) {
+      memcpy(entry->path, path, hops * sizeof(uint16_t));
+    }
+    entry->rssi = rssi;
+  }
+  xSemaphoreGive(xMutex_Pairing);
+}
 
-    // create data folder
-    char datafolderPath[MAX_DEVICE_NAME_LEN + 11]; // 10 for device name + 1 for null terminator
-    snprintf(datafolderPath, sizeof(datafolderPath), "/node/%s/data", deviceFolder);
-    if (SD.mkdir(datafolderPath)) {
-      Serial.println("Directory /data created successfully.");
-    } else {
-      Serial.println("Failed to create /data directory.");
+void service_pairings(){
+  for (size_t i = 0; i < MAX_PENDING_PAIRINGS; i++) {
+    xSemaphoreTake(xMutex_Pairing, portMAX_DELAY);
+    PendingPairing pending = pendingPairings[i];
+    bool due = pending.used && millis() - pending.firstSeen >= PAIRING_COLLECT_MS;
+    if (due) {
+      pendingPairings[i].used = false;
+    }
+    xSemaphoreGive(xMutex_Pairing);
+    if (due) {
+      handle_pairing(pending);
     }
+  }
+}
 
+// ***********************
+// * Handle Node Status
+// ***********************
+// POLL_COMPLETE closes the node's slot, HEARTBEAT is sent unprompted by a
+// node that has not had a slot for a while. Both carry its backlog.
+void handle_node_status(const uint8_t *incomingData){
 
-    // Create subdirectories for ADC, UART, and I2C
-    char subfolderADC[MAX_DEVICE_NAME_LEN + 20]; // 10 for device name + 1 for null terminator
-    char subfolderUART[MAX_DEVICE_NAME_LEN + 20];
-    char subfolderI2C[MAX_DEVICE_NAME_LEN + 20];
-    snprintf(subfolderADC, sizeof(subfolderADC), "%s/data/ADC", folderPath);
-    snprintf(subfolderUART, sizeof(subfolderUART), "%s/data/UART", folderPath);
-    snprintf(subfolderI2C, sizeof(subfolderI2C), "%s/data/I2C", folderPath);
+  poll_complete_message msg;
+  memcpy(&msg, incomingData, sizeof(msg));
 
-    if (SD.mkdir(subfolderADC)) {
-      Serial.println("ADC subdirectory created successfully.");
-    } else {
-      Serial.println("Failed to create ADC subdirectory.");
-    }
+  int index = getIndexByMac(msg.mac);
+  if (index < 0) {
+    Serial.println("Status from unknown peer.");
+    return;
+  }
 
-    if (SD.mkdir(subfolderUART)) {
-      Serial.println("UART subdirectory created successfully.");
-    } else {
-      Serial.println("Failed to create UART subdirectory.");
+  Serial.printf("Received %s, %lu bytes pending\n", msg.msgType == HEARTBEAT ? "HEARTBEAT" : "POLL_COMPLETE", msg.pendingBytes);
+  peers[index].pendingBytes = msg.pendingBytes;
+  peers[index].oldestUnsynced = msg.oldestUnsynced;
+  peers[index].reportedConfigHash = msg.configHash;
+  peers[index].wakePeriodS = msg.wakePeriodS;
+  peers[index].avgAwakeMs = msg.avgAwakeMs;
+  peers[index].energyMwhDay = msg.energyMwhDay;
+  recordPeerLoss(index, msg.chunksSent, msg.chunksLost);
+  if (msg.msgType == POLL_COMPLETE) {
+    if (!slotCompleted[index]) {
+      ChannelStats* channel = &channelStats[peerSlotChannel[index]];
+      channel->completed++;
+      recordChannelLoss(channel, msg.chunksSent, msg.chunksLost);
     }
-
-    if (SD.mkdir(subfolderI2C)) {
-      Serial.println("I2C subdirectory created successfully.");
-    } else {
-      Serial.println("Failed to create I2C subdirectory.");
+    slotCompleted[index] = true;
+    if (verifyAsked[index]) {
+      verifyWanted[index] = false; // the slot asked for it
     }
+    closeSenderSessions(msg.mac);
+    xEventGroupSetBits(cycleEvents, CYCLE_EVENT_STATUS);
+  }
+}
+
+// ***********************
+// * Track Node Clock
+// ***********************
+// Status frames carry their send time and time requests their t1, both give
+// the node's offset at arrival. An answered request starts a new segment of
+// the clock model, the node corrects its clock from the response.
+void track_node_clock(const uint8_t *incomingData, int len) {
+
+  int64_t arrived = rxNetworkTimeUs();
+  int index = getIndexByMac(incomingData + 1);
+  if (index < 0 || peers[index].routeHops != 0 || arrived < NETWORK_TIME_SET_US) {
+    return; // relayed frames waited in the relay queues
+  }
 
-    Serial.println("End of dir creation.");
+  bool request = incomingData[0] == TIME_REQUEST;
+  int64_t sentAt = 0;
+  if (request && len >= (int) sizeof(time_request_message)) {
+    time_request_message msg;
+    memcpy(&msg, incomingData, sizeof(msg));
+    sentAt = msg.t1;
+  } else if (!request && len >= (int) sizeof(poll_complete_message)) {
+    poll_complete_message msg;
+    memcpy(&msg, incomingData, sizeof(msg));
+    sentAt = msg.sentAt;
+  }
+  if (sentAt < NETWORK_TIME_SET_US) {
+    return;
+  }
+
+  PeerClock* clock = &peers[index].clock;
+  clockModelSample(clock, arrived, sentAt + frameAirtimeUs(len) - arrived);
+  if (request) {
+    clockModelCorrected(clock, arrived);
   }
 }
 
 // *************************************
-// * OnReceive Handlers Registration
+// * Node Frames
 // *************************************
-void OnDataRecvGateway(const uint8_t *incomingData, int len) { 
-  
+void dispatch_node_frame(const uint8_t *incomingData, int len) {
+
   uint8_t type = incomingData[0];       // first message byte is the type of message 
 
   switch (type) {
-    case PAIRING:                            // the message is a pairing request 
-      handle_pairing(incomingData);
-      break;
     case FILE_BODY:
       handle_file_body(incomingData);
       break;
     case FILE_ENTIRE:
       handle_file_entire(incomingData);
       break;
+    case FILE_PARITY:
+      handle_file_parity(incomingData);
+      break;
+    case FILE_VERIFY:
+      handle_file_verify(incomingData, len);
+      break;
     case POLL_COMPLETE:
-      Serial.println("Received POLL_COMPLETE");
-      rssi = LoRa.packetRssi();
-      poll_success = true;
+    case HEARTBEAT:
+      track_node_clock(incomingData, len);
+      handle_node_status(incomingData);
+      break;
+    case CONFIG_ACK:
+      handle_config_ack(incomingData);
+      break;
+    case TIME_REQUEST:
+      track_node_clock(incomingData, len);
+      handle_time_request(incomingData, len);
+      break;
+    case FW_STATUS:
+      handle_firmware_status(incomingData, len);
       break;
     default:
       Serial.println("Unkown message type.");
   }
 }
 
+// ***********************
+// * Handle Relay
+// ***********************
+// Frame of a node behind relays: taken if it came over the node's route, a
+// pairing request is queued with the route it came by
+void handle_relay_uplink(const uint8_t *incomingData, int len, int rssi) {
+
+  relay_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+  if ((msg.flags & RELAY_FLAG_DOWNLINK) || msg.hops == 0 || msg.hops > RELAY_MAX_HOPS
+      || msg.len < 1 + MAC_ADDR_LENGTH || msg.len > RELAY_PAYLOAD_MAX) {
+    return;
+  }
+
+  int relay = getIndexByMac(msg.mac);
+  if (relay < 0 || peers[relay].nodeId != msg.path[msg.hops - 1] || !peerFrameOnRoute(relay, 0, NULL, rssi)) {
+    return;
+  }
+  markPeerAlive(relay, rssi);
+  recordRelayedFrame(msg);
+
+  int pathRssi = min((int) msg.rssi, rssi);
+  if (msg.payload[0] == PAIRING) {
+    queue_pairing(msg.payload, msg.len, msg.hops, msg.path, pathRssi);
+    return;
+  }
+  int index = getIndexByMac(msg.payload + 1);
+  if (index < 0 || !peerFrameOnRoute(index, msg.hops, msg.path, pathRssi)) {
+    return;
+  }
+  markPeerAlive(index, pathRssi);
+  dispatch_node_frame(msg.payload, msg.len);
+}
+
+// *************************************
+// * OnReceive Handlers Registration
+// *************************************
+void OnDataRecvGateway(const uint8_t *incomingData, int len) { 
+  
+  uint8_t type = incomingData[0];       // first message byte is the type of message 
+  int rssi = lastRxRssi;
+
+  if (type == RELAY) {
+    handle_relay_uplink(incomingData, len, rssi);
+    return;
+  }
+  if (type == TIME_RESPONSE || type == POLL_BEACON) {
+    return; // a relay keeping time or repeating slots for the nodes behind it
+  }
+
+  // every node frame starts with the sender MAC, hearing from a peer re-admits it
+  int index = getIndexByMac(incomingData + 1);
+  if (type == PAIRING) {                     // the message is a pairing request 
+    if (index >= 0) {
+      markPeerAlive(index, rssi);
+    }
+    queue_pairing(incomingData, len, 0, NULL, rssi);
+    return;
+  }
+  if (index >= 0) {
+    if (!peerFrameOnRoute(index, 0, NULL, rssi)) {
+      return; // behind a relay, which forwards its frames
+    }
+    markPeerAlive(index, rssi);
+  }
+
+  dispatch_node_frame(incomingData, len);
+}
+
 /******************************************************************
  *                                                                *
  *                         Send Control                           *
@@ -144,155 +411,357 @@ void OnDataRecvGateway(const uint8_t *incomingData, int len) {
  ******************************************************************/
 
 
-int waitForPollAck() {
-  unsigned long startTime = millis();
-  while (millis() - startTime < ACK_TIMEOUT) {
-    if(poll_success){
-      poll_success = false;
-      return true;
-    }
-    vTaskDelay(1 / portTICK_PERIOD_MS); // Delay for 1 second
-  }
-  return false;
-}
-
 // ***********************
-// * Poll Data
+// * Poll Beacon
 // ***********************
 
-signal_message poll_data_struct(uint8_t *mac) {
-  signal_message msg;
-  msg.msgType = POLL_DATA;
-  memcpy(&msg.mac, mac, MAC_ADDR_LENGTH);
-  return msg;
-}
+// Broadcast the slot table for the next cycle, split into pages of
+// MAX_BEACON_SLOTS. Every page also carries the network time, stamped by the
+// radio task, and each node's config hash: all the control traffic a cycle
+// needs from the gateway.
+void send_poll_beacon(const SlotAssignment *slots, size_t count, uint32_t cycleLength) {
+
+  poll_beacon_message msg;
+  msg.msgType = POLL_BEACON;
+  msg.pairingKey = systemConfig.PAIRING_KEY;
+  msg.cycleId = cycleId;
+  msg.cycleLength = cycleLength;
+  msg.networkTime = 0;
+  msg.pageCount = (count + MAX_BEACON_SLOTS - 1) / MAX_BEACON_SLOTS;
+  pollCycleStats.controlFrames = 0;
+  pollCycleStats.controlBytes = 0;
+  pollCycleStats.controlAirtimeUs = 0;
+
+  // every relay level repeats the slots once, after the last page
+  uint8_t maxHops = 0;
+  for (size_t i = 0; i < count; i++) {
+    maxHops = max(maxHops, peers[slots[i].peerIndex].routeHops);
+  }
+  uint32_t guardMs = BEACON_GUARD_MS + maxHops * RELAY_BEACON_GAP_MS;
+
+  for (uint8_t page = 0; page < msg.pageCount; page++) {
+    size_t first = page * MAX_BEACON_SLOTS;
+    msg.page = page;
+    msg.slotCount = min((size_t)MAX_BEACON_SLOTS, count - first);
+
+    // from RxDone of this page: the gap and airtime of every later page, then the guard
+    uint32_t startDelay = guardMs;
+    for (uint8_t later = page + 1; later < msg.pageCount; later++) {
+      size_t slotsInPage = min((size_t)MAX_BEACON_SLOTS, count - later * MAX_BEACON_SLOTS);
+      startDelay += BEACON_PAGE_GAP_MS + frameAirtimeUs(offsetof(poll_beacon_message, slots) + slotsInPage * sizeof(beacon_slot)) / 1000;
+    }
+    msg.startDelay = startDelay;
+
+    for (uint8_t i = 0; i < msg.slotCount; i++) {
+      const SlotAssignment &slot = slots[first + i];
+      msg.slots[i].nodeId = peers[slot.peerIndex].nodeId;
+      msg.slots[i].flags = slot.flags | slot.channel << SLOT_CHANNEL_SHIFT;
+      msg.slots[i].fecParity = peers[slot.peerIndex].fecParity;
+      msg.slots[i].offset = slot.offsetMs / SLOT_UNIT_MS;
+      msg.slots[i].length = slot.lengthMs / SLOT_UNIT_MS;
+      msg.slots[i].configHash = peers[slot.peerIndex].configHash;
+    }
 
-void poll_data(int index){
-  
-  uint8_t * mac = peers[index].mac;
+    // only send the used part of the slot table
+    size_t size = offsetof(poll_beacon_message, slots) + msg.slotCount * sizeof(beacon_slot);
+    sendLoraMessage((uint8_t *) &msg, size);
+    pollCycleStats.controlFrames++;
+    pollCycleStats.controlBytes += size;
+    pollCycleStats.controlAirtimeUs += frameAirtimeUs(size);
 
-  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
-    poll_success = false;
-    signal_message msg = poll_data_struct(mac);
-    sendLoraMessage((uint8_t *) &msg, sizeof(msg));
-    Serial.printf("Sent data poll message to:");
-    printMacAddress(mac);Serial.println();Serial.println();
-    if(waitForPollAck()){ // check for ack before proceeding to next one
-      struct tm timeinfo;
-      getLocalTime(&timeinfo);
-      peers[index].lastCommTime = timeinfo;
-      peers[index].status = ONLINE;
-      peers[index].SignalStrength = rssi;
-    } 
-    xSemaphoreGive(xMutex_DataPoll);
+    if (page + 1 < msg.pageCount) {
+      vTaskDelay(BEACON_PAGE_GAP_MS / portTICK_PERIOD_MS);
+    }
   }
-  
+  vTaskDelay(guardMs / portTICK_PERIOD_MS);
 }
 
 // ***********************
-// * Poll Config
+// * Poll Cycle
 // ***********************
 
-signal_message poll_config_struct(uint8_t *mac) {
-  signal_message msg;
-  msg.msgType = POLL_CONFIG;
-  memcpy(&msg.mac, mac, MAC_ADDR_LENGTH);
-  return msg;
+// Effective cycle time, with and without the slots lost to unresponsive peers
+void record_cycle_stats(size_t slots, size_t completed, uint32_t boundMs, uint32_t cycleMs, uint32_t deadSlotMs) {
+  uint32_t liveMs = cycleMs > deadSlotMs ? cycleMs - deadSlotMs : 0;
+
+  pollCycleStats.cycleId = cycleId;
+  pollCycleStats.slots = slots;
+  pollCycleStats.completed = completed;
+  pollCycleStats.boundMs = boundMs;
+  pollCycleStats.cycleMs = cycleMs;
+  pollCycleStats.liveCycleMs = liveMs;
+  pollCycleStats.cycles++;
+  pollCycleStats.totalCycleMs += cycleMs;
+  pollCycleStats.totalLiveCycleMs += liveMs;
+  pollCycleStats.totalControlAirtimeUs += pollCycleStats.controlAirtimeUs;
+
+  Serial.printf("Cycle %u: %u/%u slots completed in %lu ms, %lu ms without dead peers (bound %lu ms)\n",
+                cycleId, completed, slots, cycleMs, liveMs, boundMs);
+  Serial.printf("Cycle %u: control %u frames, %u bytes, %lu ms on air\n", cycleId, pollCycleStats.controlFrames,
+                pollCycleStats.controlBytes, pollCycleStats.controlAirtimeUs / 1000);
 }
 
-void poll_config(int index){
+// Decodes a newly received /node/<name>/config.bin into the data.conf and
+// sys.conf caches read by the HTTP API. Fields missing from the encoding
+// keep their cached values.
+void update_config_cache(const String& folder, const uint8_t* encoded, size_t len) {
+  DataCollectionConfig data = DataCollectionConfig(); // zeroed, then the channel counts set
+  SystemConfig sys;
+  memset(&sys, 0, sizeof(sys));
+
+  File file = SD.open(folder + "/data.conf", FILE_READ);
+  if (file) {
+    file.read((uint8_t*) &data, sizeof(data));
+    file.close();
+  }
+  file = SD.open(folder + "/sys.conf", FILE_READ);
+  if (file) {
+    file.read((uint8_t*) &sys, sizeof(sys));
+    file.close();
+  }
 
-  uint8_t * mac = peers[index].mac;
-  
-  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
-    poll_success = false;
-    signal_message msg = poll_config_struct(mac);
-    sendLoraMessage((uint8_t *) &msg, sizeof(msg));
-    Serial.printf("Sent config poll message to:");
-    printMacAddress(mac);Serial.println();Serial.println();
-
-    if(waitForPollAck()){ // check for ack before proceeding to next one
-      struct tm timeinfo;
-      getLocalTime(&timeinfo);
-      peers[index].lastCommTime = timeinfo;
-      peers[index].status = ONLINE;
-      peers[index].SignalStrength = rssi;
-    } 
-    
-    xSemaphoreGive(xMutex_DataPoll);
+  if (!decodeConfig(encoded, len, &data, &sys)) {
+    Serial.println("Malformed configuration from " + folder);
+    return;
   }
+  memset(sys.WIFI_PASSWORD, 0, sizeof(sys.WIFI_PASSWORD)); // never sent, do not keep an old copy
 
+  file = SD.open(folder + "/data.conf", FILE_WRITE);
+  if (file) {
+    file.write((uint8_t*) &data, sizeof(data));
+    file.close();
+  }
+  file = SD.open(folder + "/sys.conf", FILE_WRITE);
+  if (file) {
+    file.write((uint8_t*) &sys, sizeof(sys));
+    file.close();
+  }
 }
 
-// ***********************
-// * Time Sync
-// ***********************
+// Hash of the encoded configuration cached under /node/<name>/, 0 if missing.
+// A changed file is decoded into the API caches.
+uint32_t cached_config_hash(size_t index) {
+  String folder = "/node/" + String(peers[index].deviceName);
+  uint8_t encoded[CONFIG_ENCODED_MAX];
 
-time_sync_message get_current_time_struct() {
-  time_sync_message msg;
+  File file = SD.open(folder + "/config.bin", FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  size_t len = file.read(encoded, sizeof(encoded));
+  file.close();
+  if (len == 0) {
+    return 0;
+  }
 
-  if (!rtc_mounted) {
-    Serial.println("External RTC not mounted. Falling back to system time.");
+  uint32_t hash = configBytesHash(encoded, len);
+  if (hash != peers[index].configHash) {
+    update_config_cache(folder, encoded, len);
+  }
+  return hash;
+}
 
-    // Attempt to get the system time
-    struct tm timeinfo;
-    if (!getLocalTime(&timeinfo)) {
-      Serial.println("Failed to obtain system time.");
-      // Return a message with an invalid type or handle this error as needed
-      msg.msgType = 0xFF; // Invalid type for error indication
-      return msg;
-    }
+// Config is pulled only while the advertised hash differs from the cache.
+// The cache is re-read on a mismatch, it may just have been updated.
+bool config_stale(size_t index) {
+  Peer &peer = peers[index];
+  if (peer.reportedConfigHash == 0 || peer.reportedConfigHash == peer.configHash) {
+    return false;
+  }
+  peer.configHash = cached_config_hash(index);
+  return peer.reportedConfigHash != peer.configHash;
+}
 
-    msg.msgType = TIME_SYNC;
-    msg.pairingKey = systemConfig.PAIRING_KEY; // key for network
-    msg.year = timeinfo.tm_year + 1900;
-    msg.month = timeinfo.tm_mon + 1;
-    msg.day = timeinfo.tm_mday;
-    msg.hour = timeinfo.tm_hour;
-    msg.minute = timeinfo.tm_min;
-    msg.second = timeinfo.tm_sec;
+// Sent with the peer's slot in the beacon, a node whose configuration
+// differs sends it in that slot. Read from the SD card once after boot.
+uint32_t expected_config_hash(size_t index) {
+  if (peers[index].configHash == 0) {
+    peers[index].configHash = cached_config_hash(index);
+  }
+  return peers[index].configHash;
+}
 
-    return msg;
+// Network second of the wake boundary deep-sleep nodes are listening at right
+// now, 0 if there is none or it has been served. Sleepers are up from shortly
+// before the boundary until LOW_POWER_LISTEN_MS after it.
+int64_t due_wake_boundary() {
+  int64_t nowUs = networkTimeUs();
+  if (nowUs < NETWORK_TIME_SET_US) {
+    return 0; // sleepers wake on network time, without it the gateway cannot meet them
   }
+  int64_t seconds = nowUs / 1000000;
+  int64_t boundary = seconds - seconds % LOW_POWER_GRID_S;
+  if (boundary == lastWakeBoundary || nowUs - boundary * 1000000 > LOW_POWER_LISTEN_MS * 1000LL) {
+    return 0;
+  }
+  for (size_t i = 0; i < peerCount; i++) {
+    if (peers[i].wakePeriodS != 0 && boundary % peers[i].wakePeriodS == 0) {
+      return boundary;
+    }
+  }
+  return 0;
+}
 
-  DateTime now = rtc.now();
+// True if deep-sleep nodes wake within the next ms, a regular cycle that long
+// waits for their cycle instead of running into it
+bool wake_boundary_near(uint32_t ms) {
+  int64_t nowUs = networkTimeUs();
+  if (nowUs < NETWORK_TIME_SET_US) {
+    return false;
+  }
+  int64_t next = (nowUs / 1000000 / LOW_POWER_GRID_S + 1) * LOW_POWER_GRID_S;
+  if (next * 1000000 - nowUs >= ms * 1000LL) {
+    return false;
+  }
+  for (size_t i = 0; i < peerCount; i++) {
+    if (peers[i].wakePeriodS != 0 && next % peers[i].wakePeriodS == 0) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  if (now.year() < 2000) {
-    Serial.println("RTC read error.");
-    // Handle RTC read failure, return appropriate error message
-    msg.msgType = 0xFF; // Invalid type for error indication
-    return msg;
+// One TDMA cycle: peers with backlog, stale config or no slot for a full
+// pollInterval get a slot sized from their reported backlog and ordered by
+// priority and backlog age. Nodes transmit on their own inside the slot and
+// end it with POLL_COMPLETE. Peers in backoff are left out, a peer that
+// missed its last slot only gets a short probe slot.
+// Deep-sleep nodes only listen at multiples of their wake period: they are
+// left out of other cycles and always get a slot at wakeBoundaryS, backoff or not.
+// Returns true if any reachable peer that is not asleep still has backlog.
+bool run_poll_cycle(int64_t wakeBoundaryS) {
+
+  unsigned long now = millis();
+  time_t epoch = time(nullptr);
+
+  size_t count = 0;
+  size_t verifies = 0;
+  static SlotRequest requests[MAX_PEERS]; // too large for the task stack
+  for (size_t i = 0; i < peerCount; i++) {
+    verifyAsked[i] = false;
+  }
+  for (size_t i = 0; i < peerCount; i++) {
+    bool sleeper = peers[i].wakePeriodS != 0;
+    bool awake = sleeper && wakeBoundaryS != 0 && wakeBoundaryS % peers[i].wakePeriodS == 0;
+    if (sleeper && !awake) {
+      continue; // radio off until its next window
+    }
+    if (!awake && peers[i].backoffUntil != 0 && (long)(peers[i].backoffUntil - now) > 0) {
+      continue; // offline, wait for the backoff or a spontaneous frame
+    }
+    bool idleDue = awake || peers[i].lastSlotTime == 0 || now - peers[i].lastSlotTime >= pollInterval;
+    bool configDue = config_stale(i);
+    if (peers[i].pendingBytes == 0 && !configDue && !idleDue) {
+      continue; // idle node, skip until its next keepalive slot
+    }
+    expected_config_hash(i);
+    requests[count].peerIndex = i;
+    requests[count].flags = 0;
+    if (peers[i].routeHops > 0) {
+      requests[count].flags |= SLOT_FLAG_HOME; // the relay listens on the home channel
+    }
+    if (awake && configOutboxPending(peers[i].mac)) {
+      requests[count].flags |= SLOT_FLAG_LISTEN;
+    }
+    // a few nodes per cycle, the gateway answers every comparison from its SD card
+    if (verifyWanted[i] && verifies < VERIFY_NODES_PER_CYCLE) {
+      requests[count].flags |= SLOT_FLAG_VERIFY;
+      verifyAsked[i] = true;
+      verifies++;
+    }
+    requests[count].priority = peers[i].priority;
+    requests[count].fecParity = peers[i].fecParity;
+    requests[count].pendingBytes = peers[i].missedPolls ? 0 : peers[i].pendingBytes;
+    requests[count].backlogAgeS = (peers[i].oldestUnsynced != 0 && epoch > peers[i].oldestUnsynced)
+                                ? epoch - peers[i].oldestUnsynced : 0;
+    count++;
+  }
+  if (count == 0) {
+    return false;
+  }
+  uint32_t cycleLength = buildSlotSchedule(requests, count, slotSchedule, GATEWAY_RECEIVERS);
+  if (wakeBoundaryS == 0 && wake_boundary_near(cycleLength + 2 * BEACON_GUARD_MS)) {
+    Serial.println("Cycle deferred to the wake boundary");
+    return true; // retried after busyPollInterval, the backlog is served in the wake cycle
+  }
+  for (size_t i = 0; i < count; i++) {
+    peers[requests[i].peerIndex].lastSlotTime = now;
   }
 
-  msg.msgType = TIME_SYNC; // Define TIME_SYNC
-  msg.pairingKey = systemConfig.PAIRING_KEY; // key for network
-  msg.year = now.year();
-  msg.month = now.month();
-  msg.day = now.day();
-  msg.hour = now.hour();
-  msg.minute = now.minute();
-  msg.second = now.second();
+  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
+    cycleId++;
+    for (size_t i = 0; i < peerCount; i++) {
+      slotCompleted[i] = false;
+    }
+    radioOwnChannel(true); // the beacon and everything until the cycle ends is scheduled
 
-  return msg;
-}
+    assignSlotChannels(slotSchedule, count, channelStats, cycleId);
+    for (size_t i = 0; i < count; i++) {
+      peerSlotChannel[slotSchedule[i].peerIndex] = slotSchedule[i].channel;
+      channelStats[slotSchedule[i].channel].slots++;
+    }
 
-void send_time_sync_message() {
-  time_sync_message msg = get_current_time_struct();
+    send_poll_beacon(slotSchedule, count, cycleLength);
+    Serial.printf("Cycle %u: %u slots, bound %lu ms\n", cycleId, count, cycleLength);
+
+    // wait for the cycle to end, or until every node has reported back,
+    // following each slot to its channel
+    unsigned long cycleStart = millis();
+    size_t completed = 0;
+    xEventGroupClearBits(cycleEvents, CYCLE_EVENT_STATUS);
+    while (true) {
+      completed = 0;
+      for (size_t i = 0; i < count; i++) {
+        if (slotCompleted[slotSchedule[i].peerIndex]) completed++;
+      }
+      long elapsed = (long) (millis() - cycleStart);
+      long left = (long) (cycleLength + BEACON_GUARD_MS) - elapsed;
+      if (completed == count || left <= 0) break;
+      long wait = left;
+      const SlotAssignment* current = NULL;
+      for (size_t i = 0; i < count; i++) {
+        long start = slotSchedule[i].offsetMs;
+        if (start <= elapsed && (current == NULL || start > (long) current->offsetMs)) {
+          current = &slotSchedule[i];
+        } else if (start > elapsed) {
+          wait = min(wait, start - elapsed);
+        }
+      }
+      if (current != NULL) {
+        radioTune(current->channel);
+      }
+      xEventGroupWaitBits(cycleEvents, CYCLE_EVENT_STATUS, pdTRUE, pdFALSE, wait / portTICK_PERIOD_MS + 1);
+    }
 
-  if (msg.msgType == 0xFF) {
-    // Handle error if time retrieval failed
-    return;
-  }
+    unsigned long cycleTime = millis() - cycleStart;
+    radioTune(LORA_HOME_CHANNEL);
+    radioOwnChannel(false);
+    xSemaphoreGive(xMutex_DataPoll);
 
-  uint8_t buffer[sizeof(time_sync_message)];
-  memcpy(buffer, &msg, sizeof(time_sync_message));
+    // slots without POLL_COMPLETE count towards the peer's backoff
+    uint32_t deadSlotTime = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!slotCompleted[slotSchedule[i].peerIndex]) {
+        markPeerMissed(slotSchedule[i].peerIndex);
+        deadSlotTime += slotSchedule[i].lengthMs;
+      }
+    }
+    record_cycle_stats(count, completed, cycleLength, cycleTime, deadSlotTime);
 
-  // only execute if not in data transfer mode
-  if (xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY) == pdTRUE) {
-    sendLoraMessage(buffer, sizeof(time_sync_message));
-    xSemaphoreGive(xMutex_DataPoll);
+    // deep-sleep nodes told to stay up take their config deltas now
+    for (size_t i = 0; i < count; i++) {
+      if (slotSchedule[i].flags & SLOT_FLAG_LISTEN) {
+        peers[slotSchedule[i].peerIndex].listenUntil = millis() + LOW_POWER_TAIL_MS;
+      }
+    }
   }
 
+  for (size_t i = 0; i < peerCount; i++) {
+    if (peers[i].pendingBytes > 0 && peers[i].backoffUntil == 0 && peers[i].wakePeriodS == 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
 /******************************************************************
@@ -304,37 +773,36 @@ void gateway_scheduled_poll(void *parameter){
 
     unsigned long currentTime = millis();
 
+    // pairing requests whose copies are all in
+    service_pairings();
+
     if(peerCount == 0){
       vTaskDelay(1000 / portTICK_PERIOD_MS); // Delay for 1 second
       continue;
     }
 
-    // Check if it's time to poll data
-    if ((currentTime - lastPollTime) >= pollInterval) {
+    // Check if it's time to run a poll cycle, stale config is collected in the same slots
+    // busy nodes are polled every busyPollInterval until drained
+    // deep-sleep nodes are only up at their wake boundaries, they come first
+    int64_t wakeBoundary = due_wake_boundary();
+    if (wakeBoundary != 0) {
+      lastWakeBoundary = wakeBoundary;
       lastPollTime = currentTime;
-      for(int i = 0; i < peerCount; i++){
-        poll_data(i);
-      }
+      bool backlog = run_poll_cycle(wakeBoundary);
+      currentPollInterval = backlog ? busyPollInterval : pollInterval;
+      Serial.println("Completed wake cycle.");
+    } else if ((currentTime - lastPollTime) >= currentPollInterval) {
+      lastPollTime = currentTime;
+      bool backlog = run_poll_cycle(0);
+      currentPollInterval = backlog ? busyPollInterval : pollInterval;
       Serial.println("Completed data synchronization.");
     }
 
-    // time synchronization (broadcast)
-    if ((currentTime - lastTimeSyncTime) >= timeSyncInterval) {
-      lastTimeSyncTime = currentTime;
-      send_time_sync_message();
-      Serial.println("Completed time synchronization.");
-    }
+    // config deltas go out between cycles, while every node listens
+    service_config_outbox();
 
-    vTaskDelay(1000 / portTICK_PERIOD_MS); // Delay for 1 second
-
-    // configuration verification
-    if ((currentTime - lastConfigSyncTime) >= configSyncInterval) {
-      lastConfigSyncTime = currentTime;
-      for(int i = 0; i < peerCount; i++){
-        poll_config(i);
-      }
-      Serial.println("Completed config synchronization.");
-    }
+    // firmware chunks too, a burst at a time so cycles are not held up
+    service_firmware_campaign();
 
     // Sleep for a short interval before next check (if needed)
     vTaskDelay(100 / portTICK_PERIOD_MS); // Delay for 1 second
@@ -353,6 +821,9 @@ void lora_gateway_init() {
   LoRa.receive();
 
   loadPeersFromSD();
+  for (size_t i = 0; i < peerCount; i++) {
+    verifyWanted[i] = true; // each node compares its synced files once in its next slot
+  }
 
   // Ensure the "data" directory exists
   if (!SD.exists("/node")) {
@@ -366,6 +837,12 @@ void lora_gateway_init() {
   
   Serial.println("Finished checking node dir");
 
+  xMutex_Pairing = xSemaphoreCreateMutex();
+  cycleEvents = xEventGroupCreate();
+  sd_writer_init();
+  config_outbox_init();
+  firmware_gateway_init();
+
   // Create the task for the receive loop
   xTaskCreate(
     taskReceive,
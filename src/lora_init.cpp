@@ -3,6 +3,11 @@
 #include "lora_peer.h"
 #include "lora_gateway.h"
 #include "lora_slave.h"
+#include "lora_relay.h"
+#include "lora_dutycycle.h"
+#include "lora_timesync.h"
+#include "lora_radio.h"
+#include "lora_channels.h"
 
 //Define the pins used by the transceiver module
 #define LORA_RST 27
@@ -15,9 +20,8 @@
 bool enableCRC = true; // Default CRC setting
 SPIClass loraSpi(HSPI);// Separate SPI bus for LoRa to avoid conflict with the SD Card
 
-volatile int dataReceived = 0;// Flag to indicate data received
-int ack_count = 0;// Flag to indicate ACK for data transfer received
-int rej_count = 0;// Flag to indicate REJ for data transfer received
+volatile int64_t lastRxAtUs = 0;
+int lastRxRssi = 0;
 uint8_t MAC_ADDRESS_STA[MAC_ADDR_LENGTH];
 
 SemaphoreHandle_t xMutex_DataPoll = NULL; // mutex for LoRa hardware usage
@@ -33,11 +37,14 @@ void lora_init(void){
 
   esp_read_mac(MAC_ADDRESS_STA, ESP_MAC_WIFI_STA);  
 
-  while (!LoRa.begin(915E6)) {  //915E6 for North America
+  while (!LoRa.begin(channelFrequencyHz(LORA_HOME_CHANNEL))) {  // 915 MHz for North America
     Serial.println(".");
     delay(500);
   }
-  LoRa.setSyncWord(0xF3);
+  LoRa.setSyncWord(LORA_SYNC_WORD);
+  LoRa.setSpreadingFactor(loraModem.spreadingFactor);
+  LoRa.setSignalBandwidth(loraModem.bandwidthHz);
+  LoRa.setCodingRate4(loraModem.codingRate);
   Serial.println("LoRa Initializing - OK");
 
   // Conditionally enable CRC
@@ -50,12 +57,20 @@ void lora_init(void){
   }
 
   xMutex_DataPoll = xSemaphoreCreateMutex();
+  airtime_init();
+  lora_radio_init();
+  lora_timesync_init();
   
   // Callback Initialization based on Mode
   if (systemConfig.LORA_MODE == LORA_SLAVE){
     Serial.println("Lora Mode: Sender");
     lora_slave_init();
   }
+  if (systemConfig.LORA_MODE == LORA_RELAY){
+    Serial.println("Lora Mode: Relay");
+    lora_relay_init();
+    lora_slave_init();
+  }
   if (systemConfig.LORA_MODE == LORA_GATEWAY){
     Serial.println("Lora Mode: Gateway");
     lora_gateway_init();
@@ -63,42 +78,50 @@ void lora_init(void){
 
 }
 
+// Queued for the radio task by the class of its type, returns once sent
 void sendLoraMessage(uint8_t* data, size_t size) {
-    uint8_t type = data[0];       // first message byte is the type of message 
-    // Serial.print("Lora Message type: "); Serial.println(type);
-    LoRa.beginPacket();
-    LoRa.write(data, size);
-    LoRa.endPacket(true);
-    LoRa.receive(); // set receive mode
+    radioSend(data, size, radioClassOf(data));
 }
 
 void onReceive(int packetSize) {
-  dataReceived++;
+  radioRxDoneFromISR();
+}
+
+void onTxDone() {
+  radioTxDoneFromISR();
+}
+
+void onCadDone(boolean detected) {
+  radioCadDoneFromISR(detected);
 }
 
+// Handles the packets the radio task read out of the FIFO, one at a time
 void taskReceive(void *parameter) {
 
   DataRecvCallback callback = (DataRecvCallback)parameter;
+  static RadioRxFrame packet; // too large for the task stack
 
-  uint8_t buffer[250]; // Define a buffer to store incoming data
-  int bufferIndex = 0; // Index to keep track of the buffer position
-  
   while (true) {
-    if (dataReceived) {
-      // int packetSize = LoRa.parsePacket();
-      dataReceived--; // Reset the flag for the next packet
-      bufferIndex = 0; // Reset the buffer index
-      
-      while (LoRa.available() && bufferIndex < 250) {
-        buffer[bufferIndex++] = LoRa.read();
-      }
-
-      // Call the callback function with the example data
-      if (callback) {
-          callback(buffer, bufferIndex);
+    if (!radioReceive(&packet, portMAX_DELAY)) {
+      continue;
+    }
+    lastRxAtUs = packet.rxAtUs;
+    lastRxRssi = packet.rssi;
+    uint8_t* buffer = packet.data;
+    int bufferIndex = packet.len;
+
+    airtimeRecordRx(buffer, bufferIndex);
+
+    // an ACK sent along with another frame, each is handled on its own
+    if (bufferIndex > 0 && buffer[0] == BUNDLE) {
+      uint8_t frame[RADIO_FRAME_MAX];
+      size_t pos = 0;
+      size_t len;
+      while (callback && (len = unbundleFrame(buffer, bufferIndex, &pos, frame)) > 0) {
+        callback(frame, len);
       }
-
+    } else if (callback) {
+        callback(buffer, bufferIndex);
     }
-    vTaskDelay(1 / portTICK_PERIOD_MS); // Delay for 1 second
   }
-}
\ No newline at end of file
+}
@@ -1,13 +1,70 @@
 #include <Arduino.h>
 #include <SD.h>
 #include "lora_peer.h"
+#include "lora_scheduler.h"
+#include "peer_index.h"
+#include "lora_fec.h"
 #include "utils.h"
 
 size_t peerCount = 0;
-const char* filename = "/peers.txt";
+const char* filename = "/peers.txt"; // legacy peer file, migrated to the peer log
 
 Peer peers[MAX_PEERS];
 
+// Lookup indexes over peers[], rebuilt whenever peers are removed or reloaded
+uint16_t macIndexSlots[PEER_INDEX_CAPACITY];
+uint16_t nameIndexSlots[PEER_INDEX_CAPACITY];
+uint16_t nodeIdIndexSlots[PEER_INDEX_CAPACITY];
+PeerIndex macIndex;
+PeerIndex nameIndex;
+PeerIndex nodeIdIndex;
+bool peerIndexReady = false;
+
+void initPeerIndex() {
+  peerIndexInit(&macIndex, macIndexSlots, PEER_INDEX_CAPACITY, peers, sizeof(Peer),
+                offsetof(Peer, mac), MAC_ADDR_LENGTH, false);
+  peerIndexInit(&nameIndex, nameIndexSlots, PEER_INDEX_CAPACITY, peers, sizeof(Peer),
+                offsetof(Peer, deviceName), DEVICE_NAME_MAX_LENGTH, true);
+  peerIndexInit(&nodeIdIndex, nodeIdIndexSlots, PEER_INDEX_CAPACITY, peers, sizeof(Peer),
+                offsetof(Peer, nodeId), sizeof(uint16_t), false);
+  peerIndexReady = true;
+}
+
+void indexPeer(size_t i) {
+  if (!peerIndexReady) {
+    initPeerIndex();
+  }
+  peerIndexInsert(&macIndex, i);
+  peerIndexInsert(&nameIndex, i);
+  peerIndexInsert(&nodeIdIndex, i);
+}
+
+void rebuildPeerIndex() {
+  if (!peerIndexReady) {
+    initPeerIndex();
+  }
+  peerIndexClear(&macIndex);
+  peerIndexClear(&nameIndex);
+  peerIndexClear(&nodeIdIndex);
+  for (size_t i = 0; i < peerCount; i++) {
+    indexPeer(i);
+  }
+}
+
+enum PeerLogOp {PEER_LOG_PUT = 1, PEER_LOG_DEL = 2};
+void schedulePeerDelete(const Peer& peer);
+
+// Highest node id handed out, including ids of removed peers still in the
+// log, so a node that was removed does not share an id with a new one
+uint16_t lastNodeId = 0;
+
+uint16_t nextNodeId() {
+  for (size_t i = 0; i < peerCount; i++) {
+    if (peers[i].nodeId > lastNodeId) lastNodeId = peers[i].nodeId;
+  }
+  return ++lastNodeId;
+}
+
 // Function to print a MAC address
 void printMacAddress(const uint8_t* mac) {
   for (int i = 0; i < MAC_ADDR_LENGTH; i++) {
@@ -34,116 +91,389 @@ bool addPeerGateway(const uint8_t peer_addr[MAC_ADDR_LENGTH], String DeviceName)
   for (size_t i = 0; i < MAC_ADDR_LENGTH; i++) {
     peers[peerCount].mac[i] = peer_addr[i];
   }
+  peers[peerCount].nodeId = nextNodeId();
   DeviceName.toCharArray(peers[peerCount].deviceName, DEVICE_NAME_MAX_LENGTH);
+  peers[peerCount].pendingBytes = 0;
+  peers[peerCount].oldestUnsynced = 0;
+  peers[peerCount].priority = PEER_PRIORITY_DEFAULT;
+  peers[peerCount].lastSlotTime = 0;
+  peers[peerCount].status = UNKNOWN;
+  peers[peerCount].missedPolls = 0;
+  peers[peerCount].backoffUntil = 0;
+  peers[peerCount].dataRate = PEER_DATA_RATE_DEFAULT;
+  peers[peerCount].configHash = 0;
+  peers[peerCount].reportedConfigHash = 0;
+  peers[peerCount].lossPermille = 0;
+  peers[peerCount].fecParity = 0;
+  peers[peerCount].routeHops = 0;
+  memset(peers[peerCount].route, 0, sizeof(peers[peerCount].route));
+  peers[peerCount].routeRssi = 0;
+  memset(peers[peerCount].airtimeHourUs, 0, sizeof(peers[peerCount].airtimeHourUs));
+  peers[peerCount].airtimeToPeerMs = 0;
+  memset(&peers[peerCount].clock, 0, sizeof(PeerClock));
+  peers[peerCount].wakePeriodS = 0;
+  peers[peerCount].avgAwakeMs = 0;
+  peers[peerCount].energyMwhDay = 0;
+  peers[peerCount].listenUntil = 0;
+  peers[peerCount].persistPending = false;
+  memset(&peers[peerCount].lastCommTime, 0, sizeof(struct tm));
+  peers[peerCount].SignalStrength = 0;
+  indexPeer(peerCount);
   peerCount++;
-  savePeersToSD();
+  schedulePersistPeer(peerCount - 1);
   Serial.println("Peer saved to SD card amd list.");
   return true;
 }
 
 // Function to remove a peer gateway
 bool removePeerGateway(const uint8_t peer_addr[MAC_ADDR_LENGTH]) {
-  for (size_t i = 0; i < peerCount; i++) {
-    bool match = true;
-    for (size_t j = 0; j < MAC_ADDR_LENGTH; j++) {
-      if (peers[i].mac[j] != peer_addr[j]) {
-        match = false;
-        break;
-      }
-    }
-    if (match) {
-      for (size_t k = i; k < peerCount - 1; k++) {
-        peers[k] = peers[k + 1];
-      }
-      peerCount--;
-      savePeersToSD();
-      return true;
-    }
+  int index = getIndexByMac(peer_addr);
+  if (index < 0) {
+    return false;
   }
-  return false;
+  Peer removed = peers[index];
+  for (size_t k = index; k < peerCount - 1; k++) {
+    peers[k] = peers[k + 1];
+  }
+  peerCount--;
+  rebuildPeerIndex(); // indexes shift, removal is rare
+  schedulePeerDelete(removed);
+  return true;
 }
 
 // Function to check if a peer gateway exists
 bool checkPeerGateway(const uint8_t peer_addr[MAC_ADDR_LENGTH]) {
-  for (size_t i = 0; i < peerCount; i++) {
-    bool match = true;
-    for (size_t j = 0; j < MAC_ADDR_LENGTH; j++) {
-      if (peers[i].mac[j] != peer_addr[j]) {
-        match = false;
-        break;
-      }
-    }
-    if (match) {
-      return true;
-    }
-  }
-  return false;
+  return getIndexByMac(peer_addr) >= 0;
 }
-// Function to check if a peer gateway exists
+
+// Function to get the peer index by MAC address
 int getIndexByMac(const uint8_t peer_addr[MAC_ADDR_LENGTH]) {
-  for (size_t i = 0; i < peerCount; i++) {
-    bool match = true;
-    for (size_t j = 0; j < MAC_ADDR_LENGTH; j++) {
-      if (peers[i].mac[j] != peer_addr[j]) {
-        match = false;
-        break;
-      }
-    }
-    if (match) {
-      return i;
-    }
+  if (!peerIndexReady) {
+    return -1;
+  }
+  return peerIndexFind(&macIndex, peer_addr);
+}
+
+// Function to get the peer index by the short node id
+int getIndexByNodeId(uint16_t nodeId) {
+  if (!peerIndexReady || nodeId == 0) {
+    return -1;
+  }
+  return peerIndexFind(&nodeIdIndex, &nodeId);
+}
+
+// Function to get the peer index by device name
+int getIndexByDeviceName(const String& deviceName) {
+  if (!peerIndexReady) {
+    return -1;
   }
-  return -1;
+  char name[DEVICE_NAME_MAX_LENGTH] = {0};
+  deviceName.toCharArray(name, DEVICE_NAME_MAX_LENGTH);
+  return peerIndexFind(&nameIndex, name);
 }
 
 // Function to check if a peer gateway exists
 bool isDeviceNameValid(String deviceName) {
+  return getIndexByDeviceName(deviceName) >= 0;
+}
+
+/******************************************************************
+ *                                                                *
+ *                            Peer Log                            *
+ *                                                                *
+ ******************************************************************/
+
+// Every change to a peer is appended to /peers.log as one fixed-size record
+// with a CRC, the last record for a MAC wins. Loading replays the log and
+// skips damaged records, compaction rewrites it with one record per peer.
+
+#define PEER_LOG_MAGIC 0xA5
+#define PEER_LOG_VERSION 1
+#define PEER_LOG_COMPACT_MIN 64      // garbage records tolerated before compacting
+#define PEER_LOG_TOUCH_MS 900000     // refresh last comm time / RSSI at most every 15 min
+#define PEER_DELETE_QUEUE 8          // removals waiting for the SD writer task
+
+typedef struct PeerLogRecord {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t op;
+  uint8_t status;
+  uint8_t mac[MAC_ADDR_LENGTH];
+  uint16_t nodeId;
+  char deviceName[DEVICE_NAME_MAX_LENGTH];
+  int16_t rssi;
+  uint8_t priority;
+  uint8_t dataRate;
+  uint32_t lastComm;    // epoch seconds, 0 = never
+  uint32_t crc;         // over all fields above
+} PeerLogRecord;
+
+const char* peerLogFile = "/peers.log";
+const char* peerLogTmpFile = "/peers.tmp";
+size_t peerLogRecords = 0; // records in the log, live or superseded
+QueueHandle_t peerDeletes = NULL; // PeerLogRecord DEL of removed peers
+
+uint32_t crc32(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+void packPeerRecord(PeerLogRecord* record, uint8_t op, const Peer& peer) {
+  memset(record, 0, sizeof(PeerLogRecord));
+  record->magic = PEER_LOG_MAGIC;
+  record->version = PEER_LOG_VERSION;
+  record->op = op;
+  record->status = peer.status;
+  memcpy(record->mac, peer.mac, MAC_ADDR_LENGTH);
+  record->nodeId = peer.nodeId;
+  memcpy(record->deviceName, peer.deviceName, DEVICE_NAME_MAX_LENGTH);
+  record->deviceName[DEVICE_NAME_MAX_LENGTH - 1] = '\0';
+  record->rssi = peer.SignalStrength;
+  record->priority = peer.priority;
+  record->dataRate = peer.dataRate;
+  struct tm timeinfo = peer.lastCommTime;
+  record->lastComm = timeinfo.tm_year > 0 ? (uint32_t) mktime(&timeinfo) : 0;
+  record->crc = crc32((const uint8_t*) record, offsetof(PeerLogRecord, crc));
+}
+
+bool validPeerRecord(const PeerLogRecord& record) {
+  return record.magic == PEER_LOG_MAGIC
+      && record.version == PEER_LOG_VERSION
+      && (record.op == PEER_LOG_PUT || record.op == PEER_LOG_DEL)
+      && record.crc == crc32((const uint8_t*) &record, offsetof(PeerLogRecord, crc))
+      && record.nodeId != 0
+      && record.deviceName[DEVICE_NAME_MAX_LENGTH - 1] == '\0';
+}
+
+// Fills a peer from a log record, runtime-only fields start fresh
+void unpackPeerRecord(const PeerLogRecord& record, Peer* peer) {
+  memset(peer, 0, sizeof(Peer));
+  memcpy(peer->mac, record.mac, MAC_ADDR_LENGTH);
+  peer->nodeId = record.nodeId;
+  memcpy(peer->deviceName, record.deviceName, DEVICE_NAME_MAX_LENGTH);
+  peer->status = record.status <= UNKNOWN ? (PeerStatus) record.status : UNKNOWN;
+  peer->SignalStrength = record.rssi;
+  peer->priority = record.priority >= PEER_PRIORITY_DEFAULT && record.priority <= PEER_PRIORITY_MAX
+                   ? record.priority : PEER_PRIORITY_DEFAULT;
+  peer->dataRate = record.dataRate ? record.dataRate : PEER_DATA_RATE_DEFAULT;
+  if (record.lastComm != 0) {
+    time_t lastComm = record.lastComm;
+    localtime_r(&lastComm, &peer->lastCommTime);
+  }
+}
+
+// Only the SD writer task appends and compacts, other tasks go through
+// schedulePersistPeer and schedulePeerDelete
+bool appendPeerRecord(const PeerLogRecord& record) {
+  File file = SD.open(peerLogFile, FILE_APPEND);
+  if (!file) {
+    Serial.println("Failed to open peer log");
+    return false;
+  }
+  size_t written = file.write((const uint8_t*) &record, sizeof(record));
+  file.close();
+  if (written != sizeof(record)) {
+    Serial.println("Peer log write incomplete");
+    return false;
+  }
+  peerLogRecords++;
+
+  if (peerLogRecords > 2 * peerCount + PEER_LOG_COMPACT_MIN) {
+    savePeersToSD();
+  }
+  return true;
+}
+
+// Appends the current state of one peer
+void persistPeer(int index) {
+  if (index < 0 || (size_t) index >= peerCount) {
+    return;
+  }
+  peers[index].persistPending = false;
+  PeerLogRecord record;
+  packPeerRecord(&record, PEER_LOG_PUT, peers[index]);
+  if (appendPeerRecord(record)) {
+    peers[index].lastPersisted = millis();
+  }
+}
+
+// Called from the receive, control and web server tasks: the record is
+// appended, and the log maybe compacted, by the SD writer task in
+// persistPendingPeers
+void schedulePersistPeer(int index) {
+  if (index < 0 || (size_t) index >= peerCount) {
+    return;
+  }
+  peers[index].persistPending = true;
+}
+
+// The removed peer is gone from peers[], its DEL record waits in a queue
+void schedulePeerDelete(const Peer& peer) {
+  PeerLogRecord record;
+  packPeerRecord(&record, PEER_LOG_DEL, peer);
+  if (peerDeletes == NULL || xQueueSend(peerDeletes, &record, 0) != pdTRUE) {
+    Serial.println("Peer log delete queue full, peer returns after a restart");
+  }
+}
+
+// Deletes first, so a peer removed and paired again ends up with its new record
+void persistPendingPeers() {
+  PeerLogRecord record;
+  while (peerDeletes != NULL && xQueueReceive(peerDeletes, &record, 0) == pdTRUE) {
+    appendPeerRecord(record);
+  }
   for (size_t i = 0; i < peerCount; i++) {
-    if(deviceName.equals(peers[i].deviceName)){
-      return true;
+    if (peers[i].persistPending) {
+      persistPeer(i);
     }
   }
-  return false;
 }
 
-// Function to save peers to SD card
+// Compaction: one record per peer into a temporary file, then swapped in.
+// The old log is only removed once the new one is complete, loadPeersFromSD
+// finishes an interrupted swap.
 void savePeersToSD() {
-  File file = SD.open(filename, FILE_WRITE);
-  if (file) {
-    file.seek(0); // Move to the beginning of the file
-    for (size_t i = 0; i < peerCount; i++) {
-      file.write(peers[i].mac, MAC_ADDR_LENGTH);
-      file.write((uint8_t*)peers[i].deviceName, DEVICE_NAME_MAX_LENGTH);
+  File file = SD.open(peerLogTmpFile, FILE_WRITE);
+  if (!file) {
+    Serial.println("Failed to create peer log");
+    return;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < peerCount && ok; i++) {
+    PeerLogRecord record;
+    packPeerRecord(&record, PEER_LOG_PUT, peers[i]);
+    ok = file.write((const uint8_t*) &record, sizeof(record)) == sizeof(record);
+  }
+  file.close();
+  if (!ok) {
+    Serial.println("Peer log compaction failed, keeping the old log");
+    SD.remove(peerLogTmpFile);
+    return;
+  }
+
+  SD.remove(peerLogFile);
+  SD.rename(peerLogTmpFile, peerLogFile);
+  peerLogRecords = peerCount;
+  Serial.printf("Compacted peer log to %u records\n", (unsigned) peerCount);
+}
+
+// Old /peers.txt format: MAC + device name per peer
+bool loadLegacyPeers() {
+  File file = SD.open(filename, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  peerCount = 0;
+  while (file.available() && peerCount < MAX_PEERS) {
+    Peer* peer = &peers[peerCount];
+    memset(peer, 0, sizeof(Peer));
+    if (file.read(peer->mac, MAC_ADDR_LENGTH) != MAC_ADDR_LENGTH
+        || file.read((uint8_t*) peer->deviceName, DEVICE_NAME_MAX_LENGTH) != DEVICE_NAME_MAX_LENGTH) {
+      break;
     }
-    file.close();
-    Serial.print("Saved peers to SD card");
+    peer->deviceName[DEVICE_NAME_MAX_LENGTH - 1] = '\0';
+    peer->nodeId = nextNodeId();
+    peer->priority = PEER_PRIORITY_DEFAULT;
+    peer->dataRate = PEER_DATA_RATE_DEFAULT;
+    peer->status = UNKNOWN;
+    peerCount++;
   }
+  file.close();
+  return true;
 }
 
 // Function to load peers from SD card
 void loadPeersFromSD() {
-  
-  if (!SD.exists(filename)) {
-    Serial.println("File does not exist, skipping loading peers.");
+
+  peerCount = 0;
+  lastNodeId = 0;
+  if (peerDeletes == NULL) {
+    peerDeletes = xQueueCreate(PEER_DELETE_QUEUE, sizeof(PeerLogRecord));
+  }
+
+  // Finish a compaction that was interrupted after the old log was removed
+  if (!SD.exists(peerLogFile) && SD.exists(peerLogTmpFile)) {
+    SD.rename(peerLogTmpFile, peerLogFile);
+  }
+  SD.remove(peerLogTmpFile);
+
+  if (!SD.exists(peerLogFile)) {
+    if (SD.exists(filename) && loadLegacyPeers()) {
+      Serial.printf("Migrating %u peers from %s\n", (unsigned) peerCount, filename);
+      rebuildPeerIndex();
+      savePeersToSD();
+      SD.remove(filename);
+    } else {
+      Serial.println("File does not exist, skipping loading peers.");
+      rebuildPeerIndex();
+    }
     return;
   }
 
-  File file = SD.open(filename, FILE_READ);
-  if (file) {
-    peerCount = 0;
-    while (file.available() && peerCount < MAX_PEERS) {
-      file.read(peers[peerCount].mac, MAC_ADDR_LENGTH);
-      file.read((uint8_t*)peers[peerCount].deviceName, DEVICE_NAME_MAX_LENGTH);
-      // Print loaded peer information to serial
-      Serial.print("Loaded Peer ");
-      Serial.print(peerCount + 1);
-      Serial.print(":\n MAC = ");
-      printMacAddress(peers[peerCount].mac);
-      Serial.print(", Device Name = ");
-      Serial.println(peers[peerCount].deviceName);
+  File file = SD.open(peerLogFile, FILE_READ);
+  if (!file) {
+    Serial.println("Failed to open peer log");
+    rebuildPeerIndex();
+    return;
+  }
+
+  rebuildPeerIndex();
+  size_t records = 0;
+  size_t damaged = 0;
+  PeerLogRecord record;
+  while (file.read((uint8_t*) &record, sizeof(record)) == sizeof(record)) {
+    records++;
+    if (!validPeerRecord(record)) {
+      damaged++;
+      continue;
+    }
+    if (record.nodeId > lastNodeId) {
+      lastNodeId = record.nodeId;
+    }
+
+    int index = getIndexByMac(record.mac);
+    if (record.op == PEER_LOG_DEL) {
+      if (index >= 0) {
+        for (size_t k = index; k < peerCount - 1; k++) {
+          peers[k] = peers[k + 1];
+        }
+        peerCount--;
+        rebuildPeerIndex();
+      }
+      continue;
+    }
+
+    if (index >= 0) {
+      unpackPeerRecord(record, &peers[index]); // key fields are unchanged, index stays valid
+    } else if (peerCount < MAX_PEERS) {
+      unpackPeerRecord(record, &peers[peerCount]);
+      indexPeer(peerCount);
       peerCount++;
     }
-    file.close();
+  }
+  bool tornTail = file.size() % sizeof(record) != 0; // power lost mid-append
+  file.close();
+
+  peerLogRecords = records;
+  for (size_t i = 0; i < peerCount; i++) {
+    Serial.print("Loaded Peer ");
+    Serial.print(i + 1);
+    Serial.print(":\n MAC = ");
+    printMacAddress(peers[i].mac);
+    Serial.print(", Device Name = ");
+    Serial.println(peers[i].deviceName);
+  }
+  Serial.printf("Peer log: %u records, %u damaged%s\n", (unsigned) records, (unsigned) damaged,
+                tornTail ? ", incomplete last record" : "");
+
+  if (damaged > 0 || tornTail || records > 2 * peerCount + PEER_LOG_COMPACT_MIN) {
+    savePeersToSD();
   }
 }
 
@@ -159,21 +489,158 @@ bool compareMacAddress(const uint8_t mac1[MAC_ADDR_LENGTH], const uint8_t mac2[M
 
 // Function to get device name by MAC address
 String getDeviceNameByMac(const uint8_t peer_addr[MAC_ADDR_LENGTH]) {
-  for (size_t i = 0; i < peerCount; i++) {
-    if (compareMacAddress(peers[i].mac, peer_addr)) {
-      return String(peers[i].deviceName);
-    }
+  int index = getIndexByMac(peer_addr);
+  if (index < 0) {
+    return String(""); // Return empty string if not found
   }
-  return String(""); // Return empty string if not found
+  return String(peers[index].deviceName);
 }
 
 // Function to get MAC address by device name
 bool getMacByDeviceName(const String& deviceName, uint8_t* mac) {
-  for (size_t i = 0; i < peerCount; i++) {
-    if (deviceName.equals(peers[i].deviceName)) {
-      memcpy(mac, peers[i].mac, MAC_ADDR_LENGTH); // Copy MAC address to the provided buffer
-      return true; // Return true if device name is found
+  int index = getIndexByDeviceName(deviceName);
+  if (index < 0) {
+    return false; // Return false if device name is not found
+  }
+  memcpy(mac, peers[index].mac, MAC_ADDR_LENGTH); // Copy MAC address to the provided buffer
+  return true;
+}
+
+// Any frame from a peer re-admits it immediately, also out of backoff
+void markPeerAlive(int index, int rssi) {
+  struct tm timeinfo;
+  getLocalTime(&timeinfo);
+  peers[index].lastCommTime = timeinfo;
+  peers[index].SignalStrength = rssi;
+  bool changed = peers[index].status != ONLINE;
+  if (changed) {
+    Serial.printf("Peer %s is online\n", peers[index].deviceName);
+  }
+  peers[index].status = ONLINE;
+  peers[index].missedPolls = 0;
+  peers[index].backoffUntil = 0;
+  if (changed || millis() - peers[index].lastPersisted > PEER_LOG_TOUCH_MS) {
+    schedulePersistPeer(index);
+  }
+}
+
+// A slot passed without POLL_COMPLETE, back off once the peer is considered offline
+void markPeerMissed(int index) {
+  if (peers[index].missedPolls < 255) {
+    peers[index].missedPolls++;
+  }
+  uint32_t backoff = peerBackoffMs(peers[index].missedPolls, esp_random());
+  if (backoff == 0) {
+    return;
+  }
+  bool changed = peers[index].status != OFFLINE;
+  if (changed) {
+    Serial.printf("Peer %s is offline\n", peers[index].deviceName);
+  }
+  peers[index].status = OFFLINE;
+  peers[index].backoffUntil = millis() + backoff;
+  if (peers[index].backoffUntil == 0) {
+    peers[index].backoffUntil = 1;
+  }
+  Serial.printf("Peer %s: %u missed slots, next probe in %lu s\n", peers[index].deviceName, peers[index].missedPolls, backoff / 1000);
+  if (changed) {
+    schedulePersistPeer(index);
+  }
+}
+
+// Folds a loss sample into the peer's estimate (weight 1/4) and picks the
+// FEC parity that keeps a group decodable at that rate
+void recordPeerLoss(int index, uint16_t sent, uint16_t lost) {
+  if (sent == 0) {
+    return;
+  }
+  peers[index].lossPermille = fecLossAverage(peers[index].lossPermille, sent, lost);
+  uint8_t parity = fecParityForLoss(FEC_GROUP_SIZE, peers[index].lossPermille);
+  if (parity != peers[index].fecParity) {
+    Serial.printf("Peer %s: loss %u.%u %%, FEC parity %u\n", peers[index].deviceName,
+                  peers[index].lossPermille / 10, peers[index].lossPermille % 10, parity);
+  }
+  peers[index].fecParity = parity;
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Lookup Benchmark                       *
+ *                                                                *
+ ******************************************************************/
+
+typedef struct BenchmarkPeer {
+  uint8_t mac[MAC_ADDR_LENGTH];
+  char deviceName[DEVICE_NAME_MAX_LENGTH];
+} BenchmarkPeer;
+
+// Linear scan vs hash index on a synthetic table of count peers, every
+// lookup hits. Runs on a separate table so it can exceed MAX_PEERS.
+bool benchmarkPeerLookup(size_t count, uint32_t lookups, PeerLookupBenchmark* result) {
+
+  size_t capacity = 1;
+  while (capacity < count * 2) capacity <<= 1;
+
+  BenchmarkPeer* table = (BenchmarkPeer*) malloc(count * sizeof(BenchmarkPeer));
+  uint16_t* macSlots = (uint16_t*) malloc(capacity * sizeof(uint16_t));
+  uint16_t* nameSlots = (uint16_t*) malloc(capacity * sizeof(uint16_t));
+  if (table == NULL || macSlots == NULL || nameSlots == NULL || count == 0 || count >= PEER_INDEX_EMPTY) {
+    free(table); free(macSlots); free(nameSlots);
+    return false;
+  }
+
+  PeerIndex benchMacIndex;
+  PeerIndex benchNameIndex;
+  peerIndexInit(&benchMacIndex, macSlots, capacity, table, sizeof(BenchmarkPeer),
+                offsetof(BenchmarkPeer, mac), MAC_ADDR_LENGTH, false);
+  peerIndexInit(&benchNameIndex, nameSlots, capacity, table, sizeof(BenchmarkPeer),
+                offsetof(BenchmarkPeer, deviceName), DEVICE_NAME_MAX_LENGTH, true);
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t r = (i + 1) * 2654435761u; // spread, but never two equal MACs
+    table[i].mac[0] = 0x30; table[i].mac[1] = 0x83;
+    memcpy(&table[i].mac[2], &r, 4);
+    snprintf(table[i].deviceName, DEVICE_NAME_MAX_LENGTH, "NODE%04u", (unsigned) i);
+    peerIndexInsert(&benchMacIndex, i);
+    peerIndexInsert(&benchNameIndex, i);
+  }
+
+  volatile int found = 0; // keep the loops from being optimized away
+  int64_t start;
+
+  start = esp_timer_get_time();
+  for (uint32_t n = 0; n < lookups; n++) {
+    const uint8_t* mac = table[(n * 7919) % count].mac;
+    for (size_t i = 0; i < count; i++) {
+      if (compareMacAddress(table[i].mac, mac)) { found += i; break; }
     }
   }
-  return false; // Return false if device name is not found
+  result->linearMacUs = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for (uint32_t n = 0; n < lookups; n++) {
+    found += peerIndexFind(&benchMacIndex, table[(n * 7919) % count].mac);
+  }
+  result->hashedMacUs = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for (uint32_t n = 0; n < lookups; n++) {
+    const char* name = table[(n * 7919) % count].deviceName;
+    for (size_t i = 0; i < count; i++) {
+      if (strncmp(table[i].deviceName, name, DEVICE_NAME_MAX_LENGTH) == 0) { found += i; break; }
+    }
+  }
+  result->linearNameUs = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for (uint32_t n = 0; n < lookups; n++) {
+    found += peerIndexFind(&benchNameIndex, table[(n * 7919) % count].deviceName);
+  }
+  result->hashedNameUs = esp_timer_get_time() - start;
+
+  result->peers = count;
+  result->lookups = lookups;
+
+  free(table); free(macSlots); free(nameSlots);
+  return true;
 }
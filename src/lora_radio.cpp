@@ -0,0 +1,411 @@
+#include <LoRa.h>
+#include "lora_radio.h"
+#include "lora_init.h"
+#include "lora_dutycycle.h"
+#include "lora_timesync.h"
+#include "lora_scheduler.h"
+#include "lora_channels.h"
+
+typedef struct RadioRequest {
+  uint8_t* data;            // the sender's buffer, it waits until the frame is on air
+  size_t size;
+  TaskHandle_t waiter;
+  int64_t queuedUs;
+  bool listen;              // channel activity detection before it goes out
+} RadioRequest;
+
+RadioStats radioStats;
+
+QueueHandle_t radioQueues[RADIO_CLASSES];
+SemaphoreHandle_t radioPending = NULL; // one count per queued frame, whichever class, or RxDone
+QueueHandle_t rxFrames = NULL;         // RadioRxFrame for the receive task
+volatile bool rxPending = false;       // RxDone, the packet is still in the FIFO
+volatile int64_t rxDoneAtUs = 0;
+TaskHandle_t radioTaskHandle = NULL;
+volatile bool channelOwned = false; // inside a slot of our own or the gateway's poll cycle
+volatile bool cadDetected = false;
+volatile uint8_t tuneTo = LORA_HOME_CHANNEL; // asked for by radioTune
+uint8_t tunedChannel = LORA_HOME_CHANNEL;    // the modem's, only this task changes it
+
+/******************************************************************
+ *                                                                *
+ *                         Frame Classes                          *
+ *                                                                *
+ ******************************************************************/
+
+// ACKs, beacons, time and status frames are control. Alarms have their own
+// class for senders that pass it to radioSend, no frame type maps to it.
+RadioClass radioClassOf(const uint8_t* data) {
+  switch (data[0]) {
+    case CONFIG_DELTA:
+    case SYS_CONFIG:
+    case DATA_CONFIG:
+      return RADIO_CONFIG;
+    case FILE_BODY:
+    case FILE_ENTIRE:
+    case FILE_PARITY:
+    case FILE_META:
+    case APPEND:
+    case FW_CHUNK:
+      return RADIO_BULK;
+    case RELAY:
+      return radioClassOf(data + offsetof(relay_message, payload)); // by what it carries
+    default:
+      return RADIO_CONTROL;
+  }
+}
+
+bool isAckFrame(uint8_t msgType) {
+  return msgType == ACK || msgType == REJ || msgType == CONFIG_ACK;
+}
+
+// Answers to a frame the other side is waiting on, sent right after it
+// like the ACK in a slot, they never listen first
+bool isReplyFrame(uint8_t msgType) {
+  return isAckFrame(msgType) || msgType == TIME_RESPONSE || msgType == FILE_VERIFY_RESULT;
+}
+
+// The receiver times these from RxDone of a packet of exactly their size,
+// they always go on air alone
+bool isTimedFrame(uint8_t msgType) {
+  switch (msgType) {
+    case POLL_BEACON:
+    case TIME_REQUEST:
+    case TIME_RESPONSE:
+    case POLL_COMPLETE:
+    case HEARTBEAT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Send times are taken here rather than by the sender, queueing and the
+// frame ahead do not end up in them
+void stampFrame(uint8_t* data) {
+  int64_t now = networkTimeUs();
+  switch (data[0]) {
+    case TIME_REQUEST:
+      memcpy(data + offsetof(time_request_message, t1), &now, sizeof(now));
+      break;
+    case TIME_RESPONSE:
+      memcpy(data + offsetof(time_response_message, t3), &now, sizeof(now));
+      break;
+    case POLL_COMPLETE:
+    case HEARTBEAT:
+      if (now < NETWORK_TIME_SET_US) {
+        now = 0;
+      }
+      memcpy(data + offsetof(poll_complete_message, sentAt), &now, sizeof(now));
+      break;
+    case POLL_BEACON:
+      if (now < NETWORK_TIME_SET_US) {
+        now = 0;
+      }
+      memcpy(data + offsetof(poll_beacon_message, networkTime), &now, sizeof(now));
+      break;
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                            Bundles                             *
+ *                                                                *
+ ******************************************************************/
+
+// Next frame of a BUNDLE packet into frame, its length or 0 at the end.
+// pos starts at 0.
+size_t unbundleFrame(const uint8_t* packet, size_t len, size_t* pos, uint8_t* frame) {
+  if (*pos == 0) {
+    *pos = BUNDLE_HEADER_SIZE;
+  }
+  if (*pos >= len) {
+    return 0;
+  }
+  size_t size = packet[*pos];
+  if (size == 0 || *pos + 1 + size > len) {
+    return 0; // malformed, the rest is dropped
+  }
+  memset(frame, 0, RADIO_FRAME_MAX); // handlers copy whole structs
+  memcpy(frame, packet + *pos + 1, size);
+  *pos += 1 + size;
+  return size;
+}
+
+size_t appendToBundle(uint8_t* packet, size_t used, const uint8_t* data, size_t size) {
+  packet[used] = size;
+  memcpy(packet + used + 1, data, size);
+  return used + 1 + size;
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Radio Task                            *
+ *                                                                *
+ ******************************************************************/
+
+// Highest class first
+bool takeRequest(RadioRequest* request, RadioClass* cls) {
+  for (int c = 0; c < RADIO_CLASSES; c++) {
+    UBaseType_t depth = uxQueueMessagesWaiting(radioQueues[c]);
+    if (xQueueReceive(radioQueues[c], request, 0) == pdTRUE) {
+      *cls = (RadioClass) c;
+      radioStats.classes[c].maxDepth = max(radioStats.classes[c].maxDepth, (uint8_t) depth);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A queued frame the ACK fits in front of, in the same packet
+bool takeCarrier(const RadioRequest& ack, RadioRequest* carrier, RadioClass* cls) {
+  for (int c = 0; c < RADIO_CLASSES; c++) {
+    if (xQueuePeek(radioQueues[c], carrier, 0) != pdTRUE || isTimedFrame(carrier->data[0])) {
+      continue;
+    }
+    if (BUNDLE_HEADER_SIZE + 2 + ack.size + carrier->size > RADIO_FRAME_MAX) {
+      continue;
+    }
+    xQueueReceive(radioQueues[c], carrier, 0); // only this task takes from the queues
+    xSemaphoreTake(radioPending, 0);
+    *cls = (RadioClass) c;
+    return true;
+  }
+  return false;
+}
+
+void onAir(const RadioRequest& request, RadioClass cls, int64_t sentUs, bool piggybacked) {
+  RadioClassStats& stats = radioStats.classes[cls];
+  uint32_t waitUs = sentUs - request.queuedUs;
+  stats.frames++;
+  stats.waitUs += waitUs;
+  stats.maxWaitUs = max(stats.maxWaitUs, waitUs);
+  if (piggybacked) {
+    stats.piggybacked++;
+  }
+}
+
+// Reads the packet of the last RxDone out of the FIFO. Done before anything
+// else touches the modem, a transmit would overwrite the FIFO.
+void drainReceived() {
+  if (!rxPending) {
+    return;
+  }
+  rxPending = false;
+  RadioRxFrame frame;
+  frame.rxAtUs = rxDoneAtUs;
+  frame.rssi = LoRa.packetRssi();
+  frame.len = 0;
+  while (LoRa.available() && frame.len < RADIO_FRAME_MAX) {
+    frame.data[frame.len++] = LoRa.read();
+  }
+  if (frame.len == 0) {
+    return;
+  }
+  radioStats.rxPackets++;
+  if (xQueueSend(rxFrames, &frame, 0) != pdTRUE) {
+    radioStats.rxDropped++;
+  }
+}
+
+// Async send, TxDone comes back as a task notification. LoRa.receive() only
+// after TxDone, switching modes earlier cuts the packet short.
+void transmit(const uint8_t* data, size_t size) {
+  drainReceived();
+  ulTaskNotifyTake(pdTRUE, 0); // TxDone of a packet that timed out
+  LoRa.beginPacket();
+  LoRa.write(data, size);
+  LoRa.endPacket(true);
+  TickType_t timeout = (frameAirtimeUs(size) / 1000 + RADIO_TX_MARGIN_MS) / portTICK_PERIOD_MS;
+  if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+    radioStats.txTimeouts++;
+    Serial.println("LoRa TxDone timeout");
+  }
+  LoRa.receive();
+  airtimeRecordTx(data, size);
+  radioStats.packets++;
+}
+
+// Channel activity detection: the modem looks for a preamble for about two
+// symbols, CadDone comes back as a task notification like TxDone. A frame
+// already past its preamble is detected less reliably, a hidden node not
+// at all, so this cuts collisions between unslotted senders but does not
+// rule them out.
+bool channelBusy() {
+  drainReceived();
+  ulTaskNotifyTake(pdTRUE, 0);
+  cadDetected = false;
+  radioStats.cadChecks++;
+  LoRa.channelActivityDetection();
+  if (ulTaskNotifyTake(pdTRUE, RADIO_CAD_TIMEOUT_MS / portTICK_PERIOD_MS) == 0) {
+    radioStats.cadTimeouts++;
+    return false; // holding the frame back would not make the modem answer
+  }
+  if (cadDetected) {
+    radioStats.channelBusy++;
+    LoRa.receive(); // whatever is on air may be for us
+    return true;
+  }
+  return false;
+}
+
+void radioTask(void *parameter) {
+  static uint8_t packet[RADIO_FRAME_MAX];
+
+  while (true) {
+    xSemaphoreTake(radioPending, portMAX_DELAY);
+    drainReceived();
+    if (tuneTo != tunedChannel) {
+      tunedChannel = tuneTo;
+      LoRa.idle();
+      LoRa.setFrequency(channelFrequencyHz(tunedChannel));
+      LoRa.receive();
+      radioStats.hops++;
+    }
+    RadioRequest request, carrier;
+    RadioClass cls, carrierCls;
+    if (!takeRequest(&request, &cls)) {
+      continue; // already sent in a bundle, or a channel change
+    }
+
+    bool bundled = isAckFrame(request.data[0]) && takeCarrier(request, &carrier, &carrierCls);
+    int64_t sentUs = esp_timer_get_time();
+    if (bundled) {
+      packet[0] = BUNDLE;
+      size_t used = appendToBundle(packet, BUNDLE_HEADER_SIZE, request.data, request.size);
+      used = appendToBundle(packet, used, carrier.data, carrier.size);
+      transmit(packet, used);
+      radioStats.bundles++;
+      onAir(carrier, carrierCls, sentUs, true);
+      xTaskNotify(carrier.waiter, RADIO_NOTIFY_SENT, eSetBits);
+    } else {
+      if (request.listen && channelBusy()) {
+        xTaskNotify(request.waiter, RADIO_NOTIFY_BUSY, eSetBits); // the sender backs off
+        continue;
+      }
+      stampFrame(request.data);
+      transmit(request.data, request.size);
+      if (request.listen) {
+        radioStats.lbtFrames++;
+      }
+    }
+    onAir(request, cls, sentUs, false);
+    xTaskNotify(request.waiter, RADIO_NOTIFY_SENT, eSetBits);
+  }
+}
+
+// Blocks the calling task until the frame has been sent. Its task
+// notification carries the signal, bits meant for the task's own wait
+// (the receive task sends ACKs) are set again before returning. Outside an
+// owned slot the frame listens first, on a busy channel the caller backs
+// off for a random, doubling window and queues it again.
+void radioSend(uint8_t* data, size_t size, RadioClass cls) {
+  if (radioTaskHandle == NULL || size == 0) {
+    return;
+  }
+  if (size > RADIO_FRAME_MAX) {
+    radioStats.oversize++;
+    return;
+  }
+  bool listen = !channelOwned && !isReplyFrame(data[0]);
+  RadioRequest request;
+  request.data = data;
+  request.size = size;
+  request.waiter = xTaskGetCurrentTaskHandle();
+  request.queuedUs = esp_timer_get_time();
+
+  uint32_t other = 0;
+  for (uint8_t attempt = 0; ; attempt++) {
+    request.listen = listen && attempt < CSMA_MAX_ATTEMPTS;
+    if (listen && attempt == CSMA_MAX_ATTEMPTS) {
+      radioStats.lbtForced++;
+    }
+    xQueueSend(radioQueues[cls], &request, portMAX_DELAY);
+    xSemaphoreGive(radioPending);
+
+    uint32_t value = 0;
+    while (!(value & (RADIO_NOTIFY_SENT | RADIO_NOTIFY_BUSY))) {
+      xTaskNotifyWait(0, UINT32_MAX, &value, portMAX_DELAY);
+      other |= value & ~(RADIO_NOTIFY_SENT | RADIO_NOTIFY_BUSY);
+    }
+    if (value & RADIO_NOTIFY_SENT) {
+      break;
+    }
+    uint32_t backoff = csmaBackoffMs(attempt, CSMA_BACKOFF_UNIT_MS, esp_random());
+    radioStats.backoffs++;
+    radioStats.backoffMs += backoff;
+    vTaskDelay(backoff / portTICK_PERIOD_MS);
+  }
+  if (other != 0) {
+    xTaskNotify(request.waiter, other, eSetBits);
+  }
+}
+
+// Set by the node for its own slot and by the gateway for its poll cycle,
+// everything sent meanwhile is scheduled and skips channel activity detection
+void radioOwnChannel(bool owned) {
+  channelOwned = owned;
+}
+
+// Retunes before the next frame goes out: every frame not yet on air is
+// sent on the new channel. Does not wait.
+void radioTune(uint8_t channel) {
+  if (radioTaskHandle == NULL || channel >= LORA_CHANNELS || channel == tuneTo) {
+    return;
+  }
+  tuneTo = channel;
+  xSemaphoreGive(radioPending);
+}
+
+uint8_t radioChannel() {
+  return tuneTo;
+}
+
+void radioTxDoneFromISR() {
+  BaseType_t woken = pdFALSE;
+  if (radioTaskHandle != NULL) {
+    vTaskNotifyGiveFromISR(radioTaskHandle, &woken);
+  }
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+void radioCadDoneFromISR(bool detected) {
+  cadDetected = detected;
+  radioTxDoneFromISR(); // same wakeup, the task waits for one or the other
+}
+
+// RxDone: the radio task reads the FIFO. A give that finds the semaphore
+// full still leaves rxPending for the next pass.
+void radioRxDoneFromISR() {
+  rxDoneAtUs = esp_timer_get_time(); // receive timestamp for time sync, before any task gets to it
+  rxPending = true;
+  BaseType_t woken = pdFALSE;
+  if (radioPending != NULL) {
+    xSemaphoreGiveFromISR(radioPending, &woken);
+  }
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Next received packet, false if none came within wait
+bool radioReceive(RadioRxFrame* frame, TickType_t wait) {
+  return rxFrames != NULL && xQueueReceive(rxFrames, frame, wait) == pdTRUE;
+}
+
+void lora_radio_init() {
+  if (radioTaskHandle != NULL) {
+    return;
+  }
+  memset(&radioStats, 0, sizeof(radioStats));
+  for (int c = 0; c < RADIO_CLASSES; c++) {
+    radioQueues[c] = xQueueCreate(RADIO_QUEUE_DEPTH, sizeof(RadioRequest));
+  }
+  radioPending = xSemaphoreCreateCounting(RADIO_CLASSES * RADIO_QUEUE_DEPTH + RADIO_RX_QUEUE_DEPTH, 0);
+  rxFrames = xQueueCreate(RADIO_RX_QUEUE_DEPTH, sizeof(RadioRxFrame));
+  LoRa.onTxDone(onTxDone);
+  LoRa.onCadDone(onCadDone);
+  xTaskCreate(radioTask, "Radio Task", 4096, NULL, 4, &radioTaskHandle);
+}
@@ -0,0 +1,492 @@
+#include "lora_relay.h"
+#include "lora_slave.h"
+#include "lora_gateway.h"
+#include "lora_file_transfer.h"
+#include "lora_dutycycle.h"
+#include "lora_timesync.h"
+#include "sd_writer.h"
+#include "configuration.h"
+
+RelayStats relayStats;
+
+// Frame waiting for the radio, data first so the wire structs stay aligned
+typedef struct RelayFrame {
+  uint8_t data[250];
+  uint8_t len;
+  unsigned long receivedAt;   // millis() the frame arrived, for the queue delay
+  unsigned long sendAt;       // not sent before this
+  unsigned long slotsAt;      // beacon: millis() of the first slot
+} RelayFrame;
+
+QueueHandle_t relayQueue = NULL;
+
+poll_beacon_message relayBeacon;   // slots of the nodes behind this relay, gathered over the pages
+uint16_t relayedCycle = 0;         // last cycle whose beacon was repeated
+unsigned long firstStoredAt = 0;   // millis() of the oldest stored file data not forwarded yet, 0 = none
+
+/******************************************************************
+ *                                                                *
+ *                             Routes                             *
+ *                                                                *
+ ******************************************************************/
+
+// Higher is better: the weakest link of a route, minus a penalty per relay
+// for the extra airtime and store delay
+int routeScore(int rssi, uint8_t hops) {
+  return rssi - hops * ROUTE_HOP_PENALTY_DB;
+}
+
+int8_t clampRssi(int rssi) {
+  return rssi < -127 ? -127 : (rssi > -1 ? -1 : rssi);
+}
+
+void setPeerRoute(int index, uint8_t hops, const uint16_t* path, int rssi) {
+  Peer &peer = peers[index];
+  bool changed = peer.routeRssi == 0 || peer.routeHops != hops
+              || (hops > 0 && memcmp(peer.route, path, hops * sizeof(uint16_t)) != 0);
+  peer.routeHops = hops;
+  memset(peer.route, 0, sizeof(peer.route));
+  if (hops > 0) {
+    memcpy(peer.route, path, hops * sizeof(uint16_t));
+  }
+  peer.routeRssi = clampRssi(rssi);
+
+  if (changed) {
+    Serial.printf("Route to %s:", peer.deviceName);
+    if (hops == 0) {
+      Serial.print(" direct");
+    }
+    for (int i = hops - 1; i >= 0; i--) {
+      Serial.printf(" > %u", peer.route[i]);
+    }
+    Serial.printf(", %d dBm\n", peer.routeRssi);
+  }
+}
+
+// A peer's frames are only taken over its route, copies heard another way
+// are dropped. A peer without a known route, e.g. after a reboot, takes the
+// route of its first frame.
+bool peerFrameOnRoute(int index, uint8_t hops, const uint16_t* path, int rssi) {
+  Peer &peer = peers[index];
+  if (peer.routeRssi == 0) {
+    setPeerRoute(index, hops, path, rssi);
+    return true;
+  }
+  if (peer.routeHops != hops || (hops > 0 && memcmp(peer.route, path, hops * sizeof(uint16_t)) != 0)) {
+    relayStats.offRoute++;
+    return false;
+  }
+  peer.routeRssi = clampRssi(rssi);
+  return true;
+}
+
+// Sends a frame to a peer over its route, wrapped for the relay next to
+// this device when the peer is out of direct range
+bool sendToPeer(int index, const uint8_t* data, size_t size) {
+  if (index < 0 || peers[index].routeHops == 0) {
+    sendLoraMessage((uint8_t*) data, size);
+    return true;
+  }
+  const Peer &peer = peers[index];
+
+  int next = getIndexByNodeId(peer.route[peer.routeHops - 1]);
+  if (next < 0 || size > RELAY_PAYLOAD_MAX) {
+    Serial.printf("No route to %s for a %u byte frame\n", peer.deviceName, (unsigned) size);
+    return false;
+  }
+  relay_message msg;
+  memset(&msg, 0, RELAY_HEADER_SIZE);
+  msg.msgType = RELAY;
+  memcpy(msg.mac, peers[next].mac, MAC_ADDR_LENGTH);
+  msg.flags = RELAY_FLAG_DOWNLINK;
+  msg.hops = peer.routeHops;
+  memcpy(msg.path, peer.route, sizeof(msg.path));
+  msg.len = size;
+  memcpy(msg.payload, data, size);
+  sendLoraMessage((uint8_t*) &msg, RELAY_HEADER_SIZE + size);
+  return true;
+}
+
+// Gateway side of the per hop measurement: every relay transmits the frame
+// once more, queued for the delay the relays added up in the header
+void recordRelayedFrame(const relay_message& msg) {
+  relayStats.received++;
+  relayStats.hops += msg.hops;
+  relayStats.delayMs += msg.delayMs;
+  if (msg.delayMs > relayStats.maxDelayMs) {
+    relayStats.maxDelayMs = msg.delayMs;
+  }
+  relayStats.airtimeUs += (uint64_t) msg.hops * frameAirtimeUs(RELAY_HEADER_SIZE + msg.len);
+}
+
+/******************************************************************
+ *                                                                *
+ *                           Relay Role                           *
+ *                                                                *
+ ******************************************************************/
+
+// The relay's peer table holds the nodes behind it, with node ids and routes
+// taken from the pairing responses it passed on.
+
+// **************************************
+// * Forwarding Queue
+// **************************************
+void relayEnqueue(const void* data, size_t len, unsigned long receivedAt, unsigned long delayMs,
+                  unsigned long slotsAt = 0) {
+  RelayFrame frame;
+  memcpy(frame.data, data, len);
+  frame.len = len;
+  frame.receivedAt = receivedAt;
+  frame.sendAt = receivedAt + delayMs;
+  frame.slotsAt = slotsAt;
+  if (xQueueSend(relayQueue, &frame, 0) != pdTRUE) {
+    relayStats.queueDrops++;
+  }
+}
+
+// Sends queued frames in order. A beacon gets the time left to the first
+// slot, an uplink frame the time it waited here.
+void relayTask(void *parameter) {
+  RelayFrame frame;
+  while (true) {
+    if (xQueueReceive(relayQueue, &frame, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    long wait = (long) (frame.sendAt - millis());
+    if (wait > 0) {
+      vTaskDelay(wait / portTICK_PERIOD_MS);
+    }
+
+    xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY); // not inside the relay's own slot
+    unsigned long now = millis();
+    uint32_t airtimeUs = frameAirtimeUs(frame.len);
+    bool send = true;
+    if (frame.data[0] == POLL_BEACON) {
+      poll_beacon_message* beacon = (poll_beacon_message*) frame.data;
+      long startDelay = (long) (frame.slotsAt - now) - (long) (airtimeUs / 1000);
+      send = startDelay > 0;
+      beacon->startDelay = send ? startDelay : 0;
+    } else if (frame.data[0] == RELAY) {
+      relay_message* msg = (relay_message*) frame.data;
+      if (!(msg->flags & RELAY_FLAG_DOWNLINK)) {
+        uint32_t delay = msg->delayMs + (now - frame.receivedAt);
+        msg->delayMs = delay > 0xFFFF ? 0xFFFF : delay;
+      }
+    }
+    if (send) {
+      sendLoraMessage(frame.data, frame.len);
+    }
+    xSemaphoreGive(xMutex_DataPoll);
+
+    if (!send) {
+      relayStats.queueDrops++;
+      continue;
+    }
+    uint32_t delay = now - frame.receivedAt;
+    relayStats.delayMs += delay;
+    if (delay > relayStats.maxDelayMs) {
+      relayStats.maxDelayMs = delay;
+    }
+    relayStats.airtimeUs += airtimeUs;
+  }
+}
+
+// **************************************
+// * Nodes Behind The Relay
+// **************************************
+// Index of a node that reaches this relay directly, -1 for anyone else
+int directChild(const uint8_t* mac, int rssi) {
+  int index = getIndexByMac(mac);
+  if (index < 0 || !peerFrameOnRoute(index, 0, NULL, rssi)) {
+    return -1;
+  }
+  return index;
+}
+
+// A pairing response on its way down adds the node, with the relays still
+// between this one and the node as its route
+void learnChild(const uint8_t* payload, size_t len, uint8_t hops, const uint16_t* path) {
+  struct_pairing response;
+  memset(&response, 0, sizeof(response));
+  memcpy(&response, payload, min(len, sizeof(response)));
+  if (response.nodeId == 0) {
+    return;
+  }
+
+  char name[MAX_DEVICE_NAME_LEN + 1];
+  memcpy(name, response.deviceName, MAX_DEVICE_NAME_LEN);
+  name[MAX_DEVICE_NAME_LEN] = '\0';
+
+  int index = getIndexByMac(response.mac_origin);
+  if (index < 0) {
+    if (!addPeerGateway(response.mac_origin, String(name))) {
+      return;
+    }
+    create_node_folders(name);
+    index = getIndexByMac(response.mac_origin);
+  }
+  if (peers[index].nodeId != response.nodeId) {
+    peers[index].nodeId = response.nodeId; // the gateway's id, also used in its beacons
+    rebuildPeerIndex();
+    schedulePersistPeer(index);
+  }
+  setPeerRoute(index, hops, path, -127); // the first frame from the node refreshes the RSSI
+}
+
+// **************************************
+// * Uplink
+// **************************************
+// Wraps a frame of a node in direct range
+void relayUplink(const uint8_t* frame, size_t len, int rssi, unsigned long receivedAt, unsigned long delayMs) {
+  if (len > RELAY_PAYLOAD_MAX) {
+    return;
+  }
+  relay_message msg;
+  memset(&msg, 0, RELAY_HEADER_SIZE);
+  msg.msgType = RELAY;
+  memcpy(msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+  msg.hops = 1;
+  msg.rssi = clampRssi(rssi);
+  msg.path[0] = myNodeId;
+  msg.len = len;
+  memcpy(msg.payload, frame, len);
+  relayEnqueue(&msg, RELAY_HEADER_SIZE + len, receivedAt, delayMs);
+  relayStats.forwardedUp++;
+}
+
+// Adds this relay to a frame wrapped by a relay further out
+void relayUplinkFrom(relay_message& msg, int child, int rssi, unsigned long receivedAt) {
+  if (msg.hops == 0 || msg.hops >= RELAY_MAX_HOPS || msg.len > RELAY_PAYLOAD_MAX
+      || msg.path[msg.hops - 1] != peers[child].nodeId) {
+    return;
+  }
+  int origin = getIndexByMac(msg.payload + 1);
+  if (origin >= 0 && peers[origin].routeRssi == 0) {
+    setPeerRoute(origin, msg.hops, msg.path, msg.rssi); // known from before a reboot
+  }
+
+  memcpy(msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+  msg.path[msg.hops++] = myNodeId;
+  if (rssi < msg.rssi) {
+    msg.rssi = clampRssi(rssi);
+  }
+  relayEnqueue(&msg, RELAY_HEADER_SIZE + msg.len, receivedAt, RELAY_TURNAROUND_MS);
+  relayStats.forwardedUp++;
+}
+
+// **************************************
+// * Downlink
+// **************************************
+// Takes this relay off the route, then sends the frame to the node or
+// wraps it again for the next relay
+void relayDownlink(relay_message& msg, unsigned long receivedAt) {
+  if (msg.hops == 0 || msg.hops > RELAY_MAX_HOPS || msg.path[msg.hops - 1] != myNodeId
+      || msg.len < 1 + MAC_ADDR_LENGTH || msg.len > RELAY_PAYLOAD_MAX) {
+    return;
+  }
+  msg.hops--;
+  msg.path[msg.hops] = 0;
+  if (msg.payload[0] == PAIRING) {
+    learnChild(msg.payload, msg.len, msg.hops, msg.path);
+  }
+
+  if (msg.hops == 0) {
+    relayEnqueue(msg.payload, msg.len, receivedAt, RELAY_TURNAROUND_MS);
+  } else {
+    int next = getIndexByNodeId(msg.path[msg.hops - 1]);
+    if (next < 0 || peers[next].routeHops != 0) {
+      return;
+    }
+    memcpy(msg.mac, peers[next].mac, MAC_ADDR_LENGTH);
+    relayEnqueue(&msg, RELAY_HEADER_SIZE + msg.len, receivedAt, RELAY_TURNAROUND_MS);
+  }
+  relayStats.forwardedDown++;
+}
+
+// **************************************
+// * Beacon
+// **************************************
+// Slots of the nodes behind this relay are gathered over the beacon pages
+// and repeated as one page after the last, the gateway leaves room for it
+// before the first slot
+void relayBeaconPage(const uint8_t* incomingData, int len, unsigned long receivedAt) {
+  poll_beacon_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+  if (msg.pairingKey != systemConfig.PAIRING_KEY || msg.cycleId == relayedCycle) {
+    return;
+  }
+
+  if (msg.cycleId != relayBeacon.cycleId) {
+    relayBeacon = msg;
+    relayBeacon.slotCount = 0;
+  }
+  for (uint8_t i = 0; i < msg.slotCount && i < MAX_BEACON_SLOTS; i++) {
+    if (getIndexByNodeId(msg.slots[i].nodeId) >= 0 && relayBeacon.slotCount < MAX_BEACON_SLOTS) {
+      relayBeacon.slots[relayBeacon.slotCount++] = msg.slots[i];
+    }
+  }
+  if (msg.page + 1 < msg.pageCount) {
+    return;
+  }
+
+  relayedCycle = msg.cycleId;
+  if (relayBeacon.slotCount == 0) {
+    return;
+  }
+  relayBeacon.page = 0;
+  relayBeacon.pageCount = 1;
+  size_t size = offsetof(poll_beacon_message, slots) + relayBeacon.slotCount * sizeof(beacon_slot);
+  relayEnqueue(&relayBeacon, size, receivedAt, RELAY_TURNAROUND_MS, receivedAt + msg.startDelay);
+  relayStats.beacons++;
+}
+
+// **************************************
+// * Receive
+// **************************************
+// Called ahead of the node's own handling, true if the frame was taken here
+bool relay_handle_frame(const uint8_t* incomingData, int len) {
+  if (relayQueue == NULL || pairingStatus != PAIR_PAIRED || myNodeId == 0 || len < 1 + MAC_ADDR_LENGTH) {
+    return false;
+  }
+  unsigned long now = millis();
+  int rssi = lastRxRssi;
+  uint8_t type = incomingData[0];
+
+  switch (type) {
+    case POLL_BEACON:
+      relayBeaconPage(incomingData, len, now);
+      return false; // may hold this node's own slot
+
+    case RELAY: {
+      relay_message msg;
+      memset(&msg, 0, sizeof(msg));
+      memcpy(&msg, incomingData, min((size_t) len, sizeof(msg)));
+      if (msg.flags & RELAY_FLAG_DOWNLINK) {
+        if (compareMacAddress(msg.mac, MAC_ADDRESS_STA)) {
+          relayDownlink(msg, now);
+        }
+      } else {
+        int child = directChild(msg.mac, rssi);
+        if (child >= 0) {
+          relayUplinkFrom(msg, child, rssi, now);
+        }
+      }
+      return true;
+    }
+
+    case PAIRING: {
+      struct_pairing request;
+      memset(&request, 0, sizeof(request));
+      memcpy(&request, incomingData, min((size_t) len, sizeof(request)));
+      if (request.nodeId != 0 || request.pairingKey != systemConfig.PAIRING_KEY
+          || compareMacAddress(request.mac_origin, MAC_ADDRESS_STA)) {
+        return false; // a response, handled as usual
+      }
+      if (getIndexByMac(request.mac_origin) >= 0) {
+        removePeerGateway(request.mac_origin); // pairs again, the response sets the new route
+      }
+      relayUplink(incomingData, len, rssi, now, RELAY_TURNAROUND_MS + random(0, RELAY_PAIRING_JITTER_MS));
+      relayStats.pairings++;
+      return true;
+    }
+  }
+
+  int child = directChild(incomingData + 1, rssi);
+  if (child < 0) {
+    return false;
+  }
+  switch (type) {
+    case FILE_BODY:
+    case FILE_ENTIRE:
+      if (firstStoredAt == 0) {
+        firstStoredAt = now;
+      }
+      if (type == FILE_BODY) {
+        handle_file_body(incomingData);
+      } else {
+        handle_file_entire(incomingData);
+      }
+      return true;
+    case FILE_PARITY:
+      handle_file_parity(incomingData);
+      return true;
+    case FILE_VERIFY:
+      handle_file_verify(incomingData, len); // compared with the copy stored here
+      return true;
+    case POLL_COMPLETE:
+    case HEARTBEAT:
+    case CONFIG_ACK:
+      relayUplink(incomingData, len, rssi, now, RELAY_TURNAROUND_MS);
+      return true;
+    case TIME_REQUEST:
+      // answered here, a round trip to the gateway would add the queue delays
+      if (timeSyncStats.lastSyncAt != 0 && xSemaphoreTake(xMutex_DataPoll, 0) == pdTRUE) {
+        handle_time_request(incomingData, len);
+        xSemaphoreGive(xMutex_DataPoll);
+      }
+      return true;
+  }
+  return false;
+}
+
+// **************************************
+// * Store And Forward
+// **************************************
+// Received file data not yet forwarded, part of the backlog the relay reports
+uint32_t relay_stored_bytes(time_t& oldest) {
+  uint32_t total = 0;
+  for (size_t i = 0; i < peerCount; i++) {
+    String folder = "/node/" + String(peers[i].deviceName);
+    total += count_unsynced_bytes(folder + "/data/ADC", oldest) + count_unsynced_bytes(folder + "/data/UART", oldest)
+           + count_unsynced_bytes(folder + "/data/I2C", oldest);
+    File config = SD.open(folder + "/config.bin", FILE_READ);
+    if (config) {
+      total += config.size();
+      config.close();
+    }
+  }
+  return total;
+}
+
+// In the relay's own slot, after its own data: the stored files of the nodes
+// behind it through the normal file transfer, sent under their node ids
+void relay_forward_stored() {
+  for (size_t i = 0; i < peerCount && !transferDeadlinePassed(); i++) {
+    String folder = "/node/" + String(peers[i].deviceName);
+    send_files_to_gateway(folder + "/data/ADC", peers[i].nodeId, folder.length());
+    send_files_to_gateway(folder + "/data/UART", peers[i].nodeId, folder.length());
+    send_files_to_gateway(folder + "/data/I2C", peers[i].nodeId, folder.length());
+
+    String config = folder + "/config.bin";
+    if (!transferDeadlinePassed() && SD.exists(config)
+        && sendLoRaFile(config.c_str(), SEND, peers[i].nodeId, "/config.bin")) {
+      SD.remove(config);
+    }
+  }
+
+  if (firstStoredAt != 0) {
+    relayStats.storeForwards++;
+    relayStats.storeDelayMs += millis() - firstStoredAt;
+    firstStoredAt = 0;
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                              Init                              *
+ *                                                                *
+ ******************************************************************/
+
+void lora_relay_init() {
+
+  loadPeersFromSD(); // nodes behind this relay, routes are learned again from their frames
+  if (!SD.exists("/node")) {
+    SD.mkdir("/node");
+  }
+  sd_writer_init();
+
+  relayQueue = xQueueCreate(RELAY_QUEUE_LENGTH, sizeof(RelayFrame));
+  xTaskCreate(relayTask, "Relay Task", 4096, NULL, 2, NULL);
+  Serial.printf("Relay for %u nodes\n", (unsigned) peerCount);
+}
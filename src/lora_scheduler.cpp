@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include "lora_scheduler.h"
+
+// **************************************
+// * Slot Length
+// **************************************
+// Enough time to drain the reported backlog with its FEC parity, rounded to
+// the wire resolution
+uint32_t slotLengthForBacklog(uint32_t pendingBytes, uint8_t fecParity) {
+  uint32_t chunks = (pendingBytes + SLOT_CHUNK_BYTES - 1) / SLOT_CHUNK_BYTES;
+  chunks += (chunks + SLOT_GROUP_CHUNKS - 1) / SLOT_GROUP_CHUNKS * fecParity;
+  uint32_t length = SLOT_BASE_MS + chunks * SLOT_CHUNK_MS;
+
+  if (length < SLOT_MIN_MS) length = SLOT_MIN_MS;
+  if (length > SLOT_MAX_MS) length = SLOT_MAX_MS;
+
+  return (length + SLOT_UNIT_MS - 1) / SLOT_UNIT_MS * SLOT_UNIT_MS;
+}
+
+// **************************************
+// * Priority
+// **************************************
+// Idle nodes score 0 and go last. A node with backlog weighs its priority,
+// plus its priority again for every PRIORITY_AGE_UNIT_S its oldest sample waited.
+uint32_t slotPriorityScore(const SlotRequest* request) {
+  if (request->pendingBytes == 0) {
+    return 0;
+  }
+  uint32_t priority = request->priority ? request->priority : 1;
+  uint32_t age = request->backlogAgeS < PRIORITY_AGE_MAX_S ? request->backlogAgeS : PRIORITY_AGE_MAX_S;
+  return (uint64_t) priority * (PRIORITY_AGE_UNIT_S + age) * 100 / PRIORITY_AGE_UNIT_S;
+}
+
+// **************************************
+// * Offline Backoff
+// **************************************
+// 0 until the peer is declared OFFLINE, then exponential with jitter
+uint32_t peerBackoffMs(uint8_t missedPolls, uint32_t random) {
+  if (missedPolls < PEER_OFFLINE_MISSES) {
+    return 0;
+  }
+  uint8_t shift = missedPolls - PEER_OFFLINE_MISSES;
+  uint32_t backoff = BACKOFF_MAX_MS;
+  if (shift < 16 && ((uint32_t) BACKOFF_BASE_MS << shift) < BACKOFF_MAX_MS) {
+    backoff = (uint32_t) BACKOFF_BASE_MS << shift;
+  }
+  return backoff + random % (backoff / BACKOFF_JITTER_DIV + 1);
+}
+
+// **************************************
+// * Unslotted Backoff
+// **************************************
+// Randomized binary exponential backoff: uniform in a window of unitMs
+// doubled for every earlier attempt, up to CSMA_MAX_EXPONENT doublings
+uint32_t csmaBackoffMs(uint8_t attempt, uint32_t unitMs, uint32_t random) {
+  uint8_t shift = attempt < CSMA_MAX_EXPONENT ? attempt : CSMA_MAX_EXPONENT;
+  uint32_t window = unitMs << shift;
+  return window ? random % window : 0;
+}
+
+// **************************************
+// * Slot End
+// **************************************
+// The gateway moves on to the next slot's channel when a slot ends, so the
+// node's status has to be on air before. ACK waits end this long before the
+// slot does.
+uint32_t slotStatusReserveUs(uint32_t statusAirtimeUs) {
+  return statusAirtimeUs + SLOT_STATUS_MARGIN_MS * 1000;
+}
+
+// No chunk is started this long before the slot ends, the last one needs
+// time for its ACK and the status. SLOT_GUARD_MS covers that at SF7, slower
+// modems need more.
+uint32_t slotTransferGuardUs(uint32_t chunkAirtimeUs, uint32_t ackAirtimeUs, uint32_t statusAirtimeUs) {
+  uint32_t roundTrip = chunkAirtimeUs + ackAirtimeUs + slotStatusReserveUs(statusAirtimeUs);
+  return roundTrip > SLOT_GUARD_MS * 1000 ? roundTrip : SLOT_GUARD_MS * 1000;
+}
+
+typedef struct ScoredRequest {
+  const SlotRequest* request;
+  uint32_t score;
+  size_t order;
+} ScoredRequest;
+
+static int compareScore(const void* a, const void* b) {
+  const ScoredRequest* ra = (const ScoredRequest*) a;
+  const ScoredRequest* rb = (const ScoredRequest*) b;
+  if (ra->score != rb->score) {
+    return ra->score > rb->score ? -1 : 1;
+  }
+  return ra->order < rb->order ? -1 : 1; // keep peer order among equals
+}
+
+// **************************************
+// * Build Cycle
+// **************************************
+// Orders the slots by priority score, lays them back to back and returns the
+// cycle length. If the cycle would exceed CYCLE_MAX_MS, every slot keeps
+// SLOT_MIN_MS and the remaining budget goes to the highest scores first, so
+// the whole cycle stays within max(CYCLE_MAX_MS, count * SLOT_MIN_MS). With
+// more than one lane each slot goes to the lane that frees up first and the
+// budget is CYCLE_MAX_MS per lane; SLOT_FLAG_HOME slots all stay on lane 0.
+uint32_t buildSlotSchedule(const SlotRequest* requests, size_t count, SlotAssignment* slots, uint8_t lanes) {
+
+  ScoredRequest* scored = (ScoredRequest*) malloc(count * sizeof(ScoredRequest));
+  if (count > 0 && scored == NULL) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    scored[i].request = &requests[i];
+    scored[i].score = slotPriorityScore(&requests[i]);
+    scored[i].order = i;
+  }
+  qsort(scored, count, sizeof(ScoredRequest), compareScore);
+
+  if (lanes < 1) lanes = 1;
+  if (lanes > SLOT_MAX_LANES) lanes = SLOT_MAX_LANES;
+  uint32_t floor = count * SLOT_MIN_MS;
+  uint32_t bound = (uint32_t) CYCLE_MAX_MS * lanes;
+  uint32_t budget = bound > floor ? bound - floor : 0;
+
+  uint32_t laneEnd[SLOT_MAX_LANES] = {0};
+  uint32_t cycleLength = 0;
+  for (size_t i = 0; i < count; i++) {
+    const SlotRequest* request = scored[i].request;
+    uint32_t extra = slotLengthForBacklog(request->pendingBytes, request->fecParity) - SLOT_MIN_MS;
+    if (extra > budget) {
+      extra = budget / SLOT_UNIT_MS * SLOT_UNIT_MS;
+    }
+    budget -= extra;
+
+    uint8_t lane = 0;
+    for (uint8_t l = 1; l < lanes && !(request->flags & SLOT_FLAG_HOME); l++) {
+      if (laneEnd[l] < laneEnd[lane]) {
+        lane = l;
+      }
+    }
+    slots[i].peerIndex = request->peerIndex;
+    slots[i].flags = request->flags;
+    slots[i].lane = lane;
+    slots[i].channel = 0;
+    slots[i].offsetMs = laneEnd[lane];
+    slots[i].lengthMs = SLOT_MIN_MS + extra;
+    laneEnd[lane] += slots[i].lengthMs;
+    if (laneEnd[lane] > cycleLength) {
+      cycleLength = laneEnd[lane];
+    }
+  }
+
+  free(scored);
+  return cycleLength;
+}
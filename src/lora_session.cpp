@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lora_session.h"
+#include "lora_scheduler.h"
+
+// Drops the buffered chunks and the FEC group, the session goes on at
+// expectedOffset. Also frees the group of a session that is closed.
+void sessionReceiverReset(SessionReceiver* rx, uint32_t expectedOffset) {
+  rx->expectedOffset = expectedOffset;
+  free(rx->group);
+  rx->group = NULL;
+  memset(rx->reorder, 0, sizeof(rx->reorder));
+}
+
+// Writes data that starts at or before the expected offset, skipping what was already written
+static bool writeFrom(SessionReceiver* rx, uint32_t offset, const uint8_t* data, size_t len,
+                      SessionWriter write, void* context, SessionCounters* counters) {
+  uint32_t skip = rx->expectedOffset - offset;
+  if (!write(context, rx->expectedOffset, data + skip, len - skip)) {
+    return false;
+  }
+  rx->expectedOffset += len - skip;
+  counters->bytes += len - skip;
+  return true;
+}
+
+// Writes buffered chunks that have become contiguous
+static void drainReorderBuffer(SessionReceiver* rx, SessionWriter write, void* context, SessionCounters* counters) {
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (size_t i = 0; i < REORDER_SLOTS; i++) {
+      ReorderEntry* entry = &rx->reorder[i];
+      if (!entry->used || entry->offset > rx->expectedOffset) {
+        continue;
+      }
+      if (entry->offset + entry->len > rx->expectedOffset
+          && !writeFrom(rx, entry->offset, entry->data, entry->len, write, context, counters)) {
+        return; // writer full, retried with the next chunk
+      }
+      entry->used = false;
+      progress = true;
+    }
+  }
+}
+
+static void bufferOutOfOrder(SessionReceiver* rx, uint32_t offset, const uint8_t* data, uint8_t len,
+                             SessionCounters* counters) {
+  ReorderEntry* free = NULL;
+  for (size_t i = 0; i < REORDER_SLOTS; i++) {
+    ReorderEntry* entry = &rx->reorder[i];
+    if (entry->used && entry->offset == offset) {
+      rx->duplicates++;
+      counters->duplicates++;
+      return;
+    }
+    if (!entry->used && free == NULL) {
+      free = entry;
+    }
+  }
+  rx->outOfOrder++;
+  counters->outOfOrder++;
+  if (free == NULL) {
+    counters->reorderDrops++; // the sender resends it
+    return;
+  }
+  free->used = true;
+  free->offset = offset;
+  free->len = len;
+  memcpy(free->data, data, len);
+}
+
+// ***********************
+// * FEC Groups
+// ***********************
+// Buffer of the group at groupOffset, a later group replaces the previous one
+static FecGroup* sessionGroup(SessionReceiver* rx, uint32_t groupOffset) {
+  if (rx->group == NULL) {
+    rx->group = (FecGroup*) malloc(sizeof(FecGroup));
+    if (rx->group == NULL) {
+      return NULL;
+    }
+    memset(rx->group, 0, sizeof(FecGroup));
+  } else if (groupOffset < rx->group->offset) {
+    return NULL; // stale chunk of an earlier group
+  }
+  FecGroup* group = rx->group;
+  if (group->offset != groupOffset || group->received == 0) {
+    memset(group, 0, sizeof(FecGroup)); // also zero pads the short last chunk
+    group->offset = groupOffset;
+  }
+  return group;
+}
+
+// Keeps a copy of a data chunk for decoding, the reorder buffer holds fewer
+// chunks than a group. Chunks resent one by one only join the current group.
+static void stashGroupChunk(SessionReceiver* rx, uint32_t offset, const uint8_t* data, uint8_t len, bool grouped) {
+  uint32_t groupOffset = offset - offset % FEC_GROUP_SPAN;
+  uint8_t i = (offset - groupOffset) / CHUNK_SIZE;
+  if (!grouped && (rx->group == NULL || rx->group->offset != groupOffset)) {
+    return;
+  }
+  FecGroup* group = sessionGroup(rx, groupOffset);
+  if (group == NULL || group->present[i]) {
+    return;
+  }
+  group->present[i] = true;
+  group->received++;
+  memcpy(group->blocks[i], data, len);
+}
+
+// Rebuilds missing data chunks, false if fewer chunks than the group size arrived
+static bool rebuildGroup(FecGroup* group, SessionCounters* counters) {
+  uint8_t* blocks[FEC_GROUP_SIZE + FEC_MAX_PARITY];
+  bool present[FEC_GROUP_SIZE + FEC_MAX_PARITY];
+  uint8_t missing = 0;
+  for (uint8_t i = 0; i < group->chunks; i++) {
+    blocks[i] = group->blocks[i];
+    present[i] = group->present[i];
+    if (!present[i]) missing++;
+  }
+  if (missing == 0) {
+    return true;
+  }
+  for (uint8_t j = 0; j < group->parity; j++) {
+    blocks[group->chunks + j] = group->blocks[FEC_GROUP_SIZE + j];
+    present[group->chunks + j] = group->present[FEC_GROUP_SIZE + j];
+  }
+  if (!fecDecode(blocks, present, group->chunks, group->parity, CHUNK_SIZE)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < group->chunks; i++) {
+    group->present[i] = true;
+  }
+  counters->fecRecovered += missing;
+  return true;
+}
+
+// Writes the group's chunks from the expected offset on, including those
+// the reorder buffer had no room for
+static void flushGroup(SessionReceiver* rx, FecGroup* group, SessionWriter write, void* context,
+                       SessionCounters* counters) {
+  for (uint8_t i = 0; group->bytes > 0 && i < group->chunks && group->present[i]; i++) {
+    uint32_t offset = group->offset + i * CHUNK_SIZE;
+    size_t len = group->bytes - i * CHUNK_SIZE < CHUNK_SIZE ? group->bytes - i * CHUNK_SIZE : CHUNK_SIZE;
+    if (offset > rx->expectedOffset) {
+      break;
+    }
+    if (offset + len > rx->expectedOffset && !writeFrom(rx, offset, group->blocks[i], len, write, context, counters)) {
+      return; // writer full, the node resends from the ACKed offset
+    }
+  }
+  drainReorderBuffer(rx, write, context, counters);
+}
+
+// ***********************
+// * Receive Chunk
+// ***********************
+// In-order data goes to the writer, duplicates are only counted and early
+// chunks wait in the reorder buffer. A chunk resent one by one may make the
+// current group decodable once its parity is in.
+SessionChunkResult sessionReceiveChunk(SessionReceiver* rx, uint32_t offset, const uint8_t* data, uint8_t len,
+                                       bool grouped, SessionWriter write, void* context, SessionCounters* counters) {
+  if (offset % CHUNK_SIZE == 0) {
+    stashGroupChunk(rx, offset, data, len, grouped);
+  }
+
+  SessionChunkResult result = CHUNK_WRITTEN;
+  uint32_t chunkEnd = offset + len;
+  if (chunkEnd <= rx->expectedOffset) {
+    rx->duplicates++;
+    counters->duplicates++;
+    result = CHUNK_DUPLICATE;
+  } else if (offset > rx->expectedOffset) {
+    bufferOutOfOrder(rx, offset, data, len, counters);
+    result = CHUNK_EARLY;
+  } else {
+    if (!writeFrom(rx, offset, data, len, write, context, counters)) {
+      return CHUNK_NOT_WRITTEN;
+    }
+    drainReorderBuffer(rx, write, context, counters);
+  }
+
+  if (!grouped && rx->group != NULL && rx->group->chunks > 0 && rebuildGroup(rx->group, counters)) {
+    flushGroup(rx, rx->group, write, context, counters);
+  }
+  return result;
+}
+
+// ***********************
+// * Receive Parity
+// ***********************
+// Returns true for the last parity chunk of a group, first sent or resent
+// as a probe, which the gateway answers with an ACK. The group is then
+// rebuilt where possible and written. The first time, sent and lost are set
+// to the group's chunks and those missing, for the peer's loss estimate.
+bool sessionReceiveParity(SessionReceiver* rx, uint32_t groupOffset, uint8_t chunks, uint8_t parity, uint16_t bytes,
+                          uint8_t index, const uint8_t* data, SessionWriter write, void* context,
+                          SessionCounters* counters, uint8_t* sent, uint8_t* lost) {
+  *sent = 0;
+  *lost = 0;
+  FecGroup* group = sessionGroup(rx, groupOffset);
+  if (group != NULL) {
+    group->chunks = chunks;
+    group->parity = parity;
+    group->bytes = bytes;
+    uint8_t slot = FEC_GROUP_SIZE + index;
+    if (!group->present[slot]) {
+      group->present[slot] = true;
+      group->received++;
+      memcpy(group->blocks[slot], data, CHUNK_SIZE);
+    }
+  }
+  if (index != parity - 1) {
+    return false;
+  }
+
+  if (group != NULL) {
+    bool rebuilt = rebuildGroup(group, counters);
+    flushGroup(rx, group, write, context, counters);
+    if (!group->accounted) {
+      group->accounted = true;
+      *sent = group->chunks + group->parity;
+      *lost = *sent - group->received;
+      if (rebuilt) {
+        counters->fecGroups++;
+      } else {
+        counters->fecFailed++;
+      }
+    }
+  }
+  return true;
+}
+
+// ***********************
+// * Sender
+// ***********************
+// Group bytes that still fit in msLeft, parity chunks budgeted like data
+// chunks. A group cut short is the last one of the slot, later groups
+// would no longer be aligned.
+uint32_t sessionGroupSpan(long msLeft, uint8_t parity) {
+  long chunks = msLeft / SLOT_CHUNK_MS - parity;
+  if (chunks <= 0) {
+    return 0;
+  }
+  return (chunks < FEC_GROUP_SIZE ? chunks : FEC_GROUP_SIZE) * CHUNK_SIZE;
+}
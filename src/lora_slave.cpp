@@ -1,13 +1,25 @@
 #include "lora_slave.h"
 #include "lora_peer.h"
 #include "lora_file_transfer.h"
+#include "lora_scheduler.h"
+#include "lora_relay.h"
+#include "lora_radio.h"
+#include "lora_channels.h"
+#include "lora_timesync.h"
+#include "lora_firmware.h"
 #include "configuration.h"
+#include "config_codec.h"
+#include "power_profile.h"
 #include "utils.h"
+#include <esp_sleep.h>
 
 
 PairingStatus pairingStatus = NOT_PAIRED;
 struct_pairing pairingDataNode;
-uint8_t mac_master_paired[MAC_ADDR_LENGTH]; // identity for master node
+// pairing is kept in RTC memory, a deep-sleeping node does not pair again on every wake
+RTC_DATA_ATTR uint8_t mac_master_paired[MAC_ADDR_LENGTH]; // identity for master node
+RTC_DATA_ATTR uint16_t myNodeId = 0; // short id from the gateway, used in beacons
+RTC_DATA_ATTR uint16_t lastConfigTxn = 0; // last config delta applied, a retry is only acknowledged again
 
 unsigned long currentMillis = millis();
 unsigned long previousMillis = 0;   // Stores last time temperature was published
@@ -15,8 +27,22 @@ const long interval = 5000;        // Interval at which to publish sensor readin
 unsigned long NodeStart;                // used to measure Pairing time
 unsigned int readingId = 0;
 
-volatile bool sendFileRequest = false;
-volatile bool sendConfigRequest = false;
+EventGroupHandle_t nodeEvents = NULL; // NODE_EVENT_*, wakes the send task and the deep-sleep radio window
+
+// Own slot in the current poll cycle, taken from the gateway beacon
+volatile bool slotScheduled = false;
+volatile unsigned long slotStart = 0;
+volatile unsigned long slotEnd = 0;
+volatile uint8_t slotFlags = 0;
+volatile uint8_t slotChannel = LORA_HOME_CHANNEL; // sub-channel the slot runs on
+volatile uint32_t slotConfigHash = 0;  // the gateway's copy of our configuration, sent again if ours differs
+volatile unsigned long lastSlotSeen = 0; // millis() of the last slot or poll addressed to this node
+volatile unsigned long lastSlotGranted = 0; // millis() of the last beacon slot or pairing, heartbeats do not count
+volatile unsigned long cycleEndAt = 0; // millis() the cycle of the last beacon ends
+volatile uint32_t slotsCompleted = 0;  // slots ended with POLL_COMPLETE since boot
+unsigned long heartbeatJitter = 0;
+uint8_t pairingAttempts = 0;          // unanswered requests in a row, widens the backoff
+unsigned long pairingRetryMs = ACK_TIMEOUT;
 
 /******************************************************************
  *                                                                *
@@ -27,7 +53,9 @@ volatile bool sendConfigRequest = false;
 // **************************************
 // * Send All .dat File From Folder
 // **************************************
-void send_files_to_gateway(String folderPath) {
+// originId and wirePrefix are set when a relay forwards a stored folder: the
+// data is sent under that node id, without the local prefix in its name
+void send_files_to_gateway(String folderPath, uint16_t originId, size_t wirePrefix) {
   File root = SD.open(folderPath);
 
   if (!root) {
@@ -40,7 +68,7 @@ void send_files_to_gateway(String folderPath) {
     String fileName = file.name();
     if (!file.isDirectory() && fileName.endsWith(".dat")) {
       String fullFilePath = folderPath + "/" + fileName;
-      if (sendLoRaFile(fullFilePath.c_str(), SYNC)) {// append mode
+      if (sendLoRaFile(fullFilePath.c_str(), SYNC, originId, fullFilePath.c_str() + wirePrefix)) {// append mode
         // String newFileName = fullFilePath.substring(0, fullFilePath.lastIndexOf('.')) + ".p";
         // SD.rename(fullFilePath, newFileName);
       }
@@ -54,67 +82,155 @@ void send_files_to_gateway(String folderPath) {
 
 void send_config_to_gateway() {
 
-  Serial.println("=== data configuration ===");
-  if(sendLoRaData((uint8_t *) &dataConfig, sizeof(dataConfig), "/data.conf")){
-    Serial.println("Sent data collection configuration to gateway.");
+  uint8_t encoded[CONFIG_ENCODED_MAX];
+  size_t len = encodeConfig(dataConfig, systemConfig, encoded, sizeof(encoded));
+  if (len == 0) {
+    Serial.println("Configuration does not fit the encoding buffer.");
+    return;
   }
-  Serial.println("=== sys configuration ===");
-  if(sendLoRaData((uint8_t *) &systemConfig, sizeof(systemConfig), "/sys.conf")){
-    Serial.println("Sent sys collection configuration to gateway.");
+
+  Serial.printf("=== configuration, %u bytes ===\n", (unsigned) len);
+  if(sendLoRaData(encoded, len, "/config.bin")){
+    Serial.println("Sent configuration to gateway.");
   }
 
 }
 
 // **************************************
-// * Task Send File
+// * Backlog
 // **************************************
-void sendFilesTask(void * parameter) {
+// Sum of unsynced bytes in a folder, oldest tracks the oldest unsynced sample
+uint32_t count_unsynced_bytes(String folderPath, time_t &oldest) {
+  uint32_t total = 0;
+  File root = SD.open(folderPath);
+  if (!root) {
+    return 0;
+  }
+  File file = root.openNextFile();
+  while (file) {
+    String fileName = file.name();
+    if (!file.isDirectory() && fileName.endsWith(".dat")) {
+      String fullFilePath = folderPath + "/" + fileName;
+      file.close();
+      time_t sample = 0;
+      total += getUnsyncedBytes(fullFilePath.c_str(), &sample);
+      if (sample != 0 && (oldest == 0 || sample < oldest)) {
+        oldest = sample;
+      }
+    }
+    file = root.openNextFile();
+  }
+  root.close();
+  return total;
+}
 
-  while(1){
+void send_node_status(uint8_t msgType) {
+  poll_complete_message msg;
+  msg.msgType = msgType;
+  memcpy(&msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+  time_t oldest = 0;
+  msg.pendingBytes = count_unsynced_bytes("/data/ADC", oldest) + count_unsynced_bytes("/data/UART", oldest)
+                   + count_unsynced_bytes("/data/I2C", oldest);
+  if (systemConfig.LORA_MODE == LORA_RELAY) {
+    msg.pendingBytes += relay_stored_bytes(oldest); // its slot also carries the nodes behind it
+  }
+  msg.oldestUnsynced = oldest;
+  msg.configHash = config_hash(dataConfig, systemConfig);
+  msg.chunksSent = chunksSent;
+  msg.chunksLost = chunksLost;
+  chunksSent = 0;
+  chunksLost = 0;
+  msg.sentAt = 0; // stamped by the radio task, the gateway's clock model takes the offset from the arrival time
+  msg.wakePeriodS = lowPowerWakePeriodS();
+  msg.avgAwakeMs = lowPowerAvgAwakeMs();
+  msg.energyMwhDay = lowPowerEnergyMwhDay();
+  sendLoraMessage((uint8_t *)&msg, sizeof(msg));
+  Serial.printf("Sent %s, %lu bytes pending\n", msgType == HEARTBEAT ? "HEARTBEAT" : "POLL_COMPLETE", msg.pendingBytes);
+}
 
-    if(sendFileRequest){
-            
-      unsigned long startTime = millis();  // Start time
-
-      Serial.println("=== ADC ===");
-      send_files_to_gateway("/data/ADC");
-      Serial.println("=== UART ===");
-      send_files_to_gateway("/data/UART");
-      Serial.println("=== I2C ===");
-      send_files_to_gateway("/data/I2C");
-
-      // send end of sync signal
-      signal_message poll_complete_msg;
-      memcpy(&poll_complete_msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
-      poll_complete_msg.msgType = POLL_COMPLETE;
-      sendLoraMessage((uint8_t *)&poll_complete_msg, sizeof(poll_complete_msg));
-
-      unsigned long endTime = millis();  // End time
-      unsigned long elapsedTime = endTime - startTime;  // Calculate elapsed time
-
-      Serial.println("Finished sending files");
-      Serial.print("Time taken: ");
-      Serial.print(elapsedTime);
-      Serial.println(" ms");
-
-      Serial.println("Finished sending files");
-      sendFileRequest = false;
-    }
+// **************************************
+// * Sync To Gateway
+// **************************************
+void sync_to_gateway(bool sendData, bool sendConfig) {
 
-    if(sendConfigRequest){
-      
-      send_config_to_gateway();
+  unsigned long startTime = millis();  // Start time
 
-      // send end of sync signal
-      signal_message poll_complete_msg;
-      memcpy(&poll_complete_msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
-      poll_complete_msg.msgType = POLL_COMPLETE;
-      sendLoraMessage((uint8_t *)&poll_complete_msg, sizeof(poll_complete_msg));
+  // two-way time exchange, in the slot so it cannot collide
+  if (transferDeadline != 0 && timeSyncDue()) {
+    requestTimeSync();
+  }
 
-      sendConfigRequest = false;
+  // the gateway restarted, every synced file is compared before new data goes
+  if (transferDeadline != 0 && (slotFlags & SLOT_FLAG_VERIFY)) {
+    fileVerifyRestart();
+  }
+
+  if (sendData) {
+    Serial.println("=== ADC ===");
+    send_files_to_gateway("/data/ADC");
+    Serial.println("=== UART ===");
+    send_files_to_gateway("/data/UART");
+    Serial.println("=== I2C ===");
+    send_files_to_gateway("/data/I2C");
+    if (systemConfig.LORA_MODE == LORA_RELAY) {
+      Serial.println("=== Relayed ===");
+      relay_forward_stored();
     }
+  }
 
-    vTaskDelay(1 / portTICK_PERIOD_MS);
+  if (sendConfig && !transferDeadlinePassed()) {
+    send_config_to_gateway();
+  }
+
+  // firmware campaign progress, what is missing is sent again
+  if (!transferDeadlinePassed()) {
+    send_firmware_status();
+  }
+
+  // send end of sync signal
+  send_node_status(POLL_COMPLETE);
+
+  unsigned long elapsedTime = millis() - startTime;  // Calculate elapsed time
+  Serial.print("Time taken: ");
+  Serial.print(elapsedTime);
+  Serial.println(" ms");
+}
+
+// **************************************
+// * Task Send File
+// **************************************
+// Sleeps until the slot starts or a beacon changes the plan
+void sendFilesTask(void * parameter) {
+
+  while(1){
+
+    TickType_t wait = portMAX_DELAY;
+    if (slotScheduled) {
+      long untilSlot = (long)(slotStart - millis());
+      wait = untilSlot > 0 ? untilSlot / portTICK_PERIOD_MS : 0;
+    }
+    xEventGroupWaitBits(nodeEvents, NODE_EVENT_SLOT, pdTRUE, pdFALSE, wait);
+
+    // scheduled slot from the poll beacon
+    if(slotScheduled && (long)(millis() - slotStart) >= 0){
+      slotScheduled = false;
+      xSemaphoreTake(xMutex_DataPoll, portMAX_DELAY); // a relay holds back forwarded frames
+      beginSlotTransfer(slotEnd);
+      if (slotChannel != LORA_HOME_CHANNEL) {
+        radioTune(slotChannel);
+        vTaskDelay(CHANNEL_SETTLE_MS / portTICK_PERIOD_MS); // the gateway retunes at the slot start too
+      }
+      radioOwnChannel(true);
+      sync_to_gateway(true, slotConfigHash != config_hash(dataConfig, systemConfig));
+      radioOwnChannel(false);
+      radioTune(LORA_HOME_CHANNEL); // back for the next beacon
+      endSlotTransfer();
+      xSemaphoreGive(xMutex_DataPoll);
+      slotsCompleted++;
+      xEventGroupSetBits(nodeEvents, NODE_EVENT_SLOT_DONE);
+      Serial.println("Finished slot");
+      firmware_restart_if_reported();
+    }
   }
 }
 
@@ -133,6 +249,8 @@ void autoPairing(void * parameter){
         strncpy(pairingDataNode.deviceName, systemConfig.DEVICE_NAME, sizeof(pairingDataNode.deviceName) - 1); // device name
         pairingDataNode.deviceName[sizeof(pairingDataNode.deviceName) - 1] = '\0'; // device name null terminate
         memcpy(pairingDataNode.mac_origin, MAC_ADDRESS_STA, sizeof(MAC_ADDRESS_STA)); // device mac address
+        memset(pairingDataNode.mac_master, 0, sizeof(pairingDataNode.mac_master)); // left from an earlier pairing
+        pairingDataNode.nodeId = 0; // marks a request, relays pass it on
         pairingDataNode.pairingKey = systemConfig.PAIRING_KEY; // paring key for network
 
         printMacAddress(pairingDataNode.mac_origin);Serial.println();
@@ -140,6 +258,11 @@ void autoPairing(void * parameter){
 
         sendLoraMessage((uint8_t *) &pairingDataNode, sizeof(pairingDataNode));
 
+        // nodes powered up together would otherwise retry in lockstep
+        pairingRetryMs = ACK_TIMEOUT + csmaBackoffMs(pairingAttempts, PAIRING_BACKOFF_UNIT_MS, esp_random());
+        if (pairingAttempts < UINT8_MAX) {
+          pairingAttempts++;
+        }
         previousMillis = millis();
         pairingStatus = PAIR_REQUESTED;
         Serial.println("Pairing request sent\n");
@@ -149,15 +272,28 @@ void autoPairing(void * parameter){
       case PAIR_REQUESTED:
         // time out to allow receiving response from server
         currentMillis = millis();
-        if(currentMillis - previousMillis > ACK_TIMEOUT) {
+        if(currentMillis - previousMillis > pairingRetryMs) {
           previousMillis = currentMillis;
           // time out expired,  try next channel
           pairingStatus = PAIR_REQUEST;
-          Serial.println("Request again...");
+          radioStats.unanswered++;
+          Serial.printf("Request again after %lu ms...\n", pairingRetryMs);
         }
         break;
 
       case PAIR_PAIRED:
+        // heartbeats are not getting through either, the route may be gone
+        if (millis() - lastSlotGranted > REPAIR_INTERVAL) {
+          Serial.println("No slot for too long, pairing again");
+          pairingStatus = PAIR_REQUEST;
+          break;
+        }
+        // no slot for a long time, the gateway may have backed off from us
+        if (millis() - lastSlotSeen > HEARTBEAT_INTERVAL + heartbeatJitter) {
+          send_node_status(HEARTBEAT);
+          lastSlotSeen = millis();
+          heartbeatJitter = random(0, HEARTBEAT_INTERVAL / 4);
+        }
         break;
     }
 
@@ -172,8 +308,81 @@ void autoPairing(void * parameter){
  *                                                                *
  ******************************************************************/
 
+// **************************************
+// * Poll Beacon
+// **************************************
+// One frame per cycle (per page) carries the slots, network time and the
+// gateway's config hash per node
+void handle_poll_beacon(const uint8_t *incomingData, int len) {
+
+  unsigned long receivedAt = millis();
+  int64_t receivedUs = rxNetworkTimeUs();
+
+  poll_beacon_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t)len, sizeof(msg)));
+
+  if (msg.pairingKey != systemConfig.PAIRING_KEY) {
+    return;
+  }
+  applyBeaconTime(msg.networkTime, len, receivedUs);
+  if (pairingStatus != PAIR_PAIRED) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < msg.slotCount && i < MAX_BEACON_SLOTS; i++) {
+    if (myNodeId != 0 && msg.slots[i].nodeId == myNodeId) {
+      slotStart = receivedAt + msg.startDelay + msg.slots[i].offset * SLOT_UNIT_MS;
+      slotEnd = slotStart + msg.slots[i].length * SLOT_UNIT_MS;
+      slotFlags = msg.slots[i].flags & ((1 << SLOT_CHANNEL_SHIFT) - 1);
+      slotChannel = msg.slots[i].flags >> SLOT_CHANNEL_SHIFT;
+      fecParity = msg.slots[i].fecParity;
+      slotConfigHash = msg.slots[i].configHash;
+      cycleEndAt = receivedAt + msg.startDelay + msg.cycleLength;
+      slotScheduled = true;
+      xEventGroupSetBits(nodeEvents, NODE_EVENT_SLOT);
+      lastSlotSeen = receivedAt;
+      lastSlotGranted = receivedAt;
+      Serial.printf("Cycle %u: slot in %lu ms for %u ms on channel %u\n", msg.cycleId,
+                    slotStart - receivedAt, msg.slots[i].length * SLOT_UNIT_MS, slotChannel);
+      return;
+    }
+  }
+}
+
+// Applies a batch of config ops from the gateway and acknowledges it
+void handle_config_delta(const uint8_t *incomingData, int len) {
+
+  config_delta_message msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, incomingData, min((size_t)len, sizeof(msg)));
+
+  config_ack_message ack;
+  ack.msgType = CONFIG_ACK;
+  memcpy(ack.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+  ack.txnId = msg.txnId;
+
+  if (msg.txnId == lastConfigTxn) {
+    ack.status = CONFIG_APPLIED; // retry after a lost ACK
+  } else if (msg.len <= sizeof(msg.ops) && apply_config_delta(msg.ops, msg.len, msg.opCount)) {
+    ack.status = CONFIG_APPLIED;
+    lastConfigTxn = msg.txnId;
+  } else {
+    ack.status = CONFIG_REJECTED;
+  }
+
+  ack.configHash = config_hash(dataConfig, systemConfig);
+  sendLoraMessage((uint8_t *) &ack, sizeof(ack));
+  Serial.printf("Config delta %u: %s\n", msg.txnId, ack.status == CONFIG_APPLIED ? "applied" : "rejected");
+}
+
 void OnDataRecvNode(const uint8_t *incomingData, int len) { 
 
+  // a relay first takes what it forwards or stores for the nodes behind it
+  if (systemConfig.LORA_MODE == LORA_RELAY && relay_handle_frame(incomingData, len)) {
+    return;
+  }
+
   // Check MAC address if message is for me
   uint8_t buffer[6];
   memcpy(buffer, incomingData + 1, 6);
@@ -194,82 +403,43 @@ void OnDataRecvNode(const uint8_t *incomingData, int len) {
       Serial.println("Master MAC:");
       printMacAddress(pairingDataNode.mac_master);
       memcpy(mac_master_paired, pairingDataNode.mac_master, sizeof(pairingDataNode.mac_master));
+      myNodeId = pairingDataNode.nodeId;
+      Serial.printf("\nNode id: %u", myNodeId);
       Serial.println();
       Serial.print("Pairing done ");
       Serial.print(" in ");
       Serial.print(millis()-NodeStart);
       Serial.println("ms\n");
       pairingStatus = PAIR_PAIRED;
+      pairingAttempts = 0;
+      lastSlotSeen = millis();
+      lastSlotGranted = lastSlotSeen;
 
       break;
     
-    case POLL_DATA:
-      if(!compareMacAddress(buffer, MAC_ADDRESS_STA)){
-        Serial.println("This message is not for me.");
-        return;
-      };
-      Serial.println("POLL_DATA Received");
-      sendFileRequest = true; // a flag to indicate that gateway requested data
-      break;
-
-    case POLL_CONFIG:
-      Serial.println("\nPOLL_CONFIG Received");
-      if(!compareMacAddress(buffer, MAC_ADDRESS_STA)){
-        Serial.println("This message is not for me.");
-        return;
-      };
-      sendConfigRequest = true; // a flag to indicate that gateway requested data
-      break;
-    
     case ACK:
+    case REJ:
       if(!compareMacAddress(buffer, MAC_ADDRESS_STA)){
         Serial.println("This message is not for me.");
         return;
       };
-      ack_count++;
+      handle_file_ack(incomingData);
       break;
 
-    case REJ:
+    case FILE_VERIFY_RESULT:
       if(!compareMacAddress(buffer, MAC_ADDRESS_STA)){
-        Serial.println("This message is not for me.");
         return;
       };
-      rej_count++;
+      handle_file_verify_result(incomingData);
       break;
     
-    case TIME_SYNC: {
-
-      Serial.print("\nTime Sync Received. ");
-      time_sync_message msg;
-      memcpy(&msg, incomingData, sizeof(msg));
-
-      // Prepare a struct tm object to hold the received time
-      struct tm timeinfo;
-      timeinfo.tm_year = msg.year - 1900; // years since 1900
-      timeinfo.tm_mon = msg.month - 1;    // months since January (0-11)
-      timeinfo.tm_mday = msg.day;         // day of the month (1-31)
-      timeinfo.tm_hour = msg.hour;        // hours since midnight (0-23)
-      timeinfo.tm_min = msg.minute;       // minutes after the hour (0-59)
-      timeinfo.tm_sec = msg.second;       // seconds after the minute (0-61, allows for leap seconds)
-
-      // Convert struct tm to time_t
-      time_t epoch = mktime(&timeinfo);
-
-      // Update system time using settimeofday
-      struct timeval tv;
-      tv.tv_sec = epoch;
-      tv.tv_usec = 0;
-      if (settimeofday(&tv, nullptr) != 0) {
-        Serial.println("Failed to set system time.");
-      } else {
-        Serial.println("System time updated successfully.");
-      }
-      
-      // update RTC Time
-      external_rtc_sync_ntp();
+    case TIME_RESPONSE:
+      handle_time_response(incomingData, len);
+      break;
 
+    case POLL_BEACON:
+      handle_poll_beacon(incomingData, len);
       break;
-    }
 
     case DATA_CONFIG:{
       collectionconfig_message msg;
@@ -294,6 +464,22 @@ void OnDataRecvNode(const uint8_t *incomingData, int len) {
       break;
     }
 
+    case CONFIG_DELTA:
+      if(!compareMacAddress(buffer, MAC_ADDRESS_STA)){
+        Serial.println("This message is not for me.");
+        return;
+      };
+      handle_config_delta(incomingData, len);
+      break;
+
+    case FW_OFFER:
+      handle_firmware_offer(incomingData, len);
+      break;
+
+    case FW_CHUNK:
+      handle_firmware_chunk(incomingData, len);
+      break;
+
     default:
       Serial.println("Unknown message type");
       break;
@@ -310,11 +496,15 @@ void OnDataRecvNode(const uint8_t *incomingData, int len) {
 
 void lora_slave_init() {
 
-  LoRa.onReceive(onReceive); // this just increment the data receive counter
+  LoRa.onReceive(onReceive); // this just wakes the radio task, which reads the FIFO
   LoRa.receive();
 
   NodeStart = millis();
-  pairingStatus = PAIR_REQUEST;
+  bool resumed = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && myNodeId != 0;
+  pairingStatus = resumed ? PAIR_PAIRED : PAIR_REQUEST;
+  file_transfer_init();
+  nodeEvents = xEventGroupCreate();
+  firmware_node_init();
   
   xTaskCreate(taskReceive, "Data Handler", 10000, (void *)OnDataRecvNode, 1, NULL); // register slave handler with receive task
   xTaskCreate(autoPairing, "Pairing Task", 10000, NULL, 1, NULL);
@@ -0,0 +1,257 @@
+#include <sys/time.h>
+#include "lora_timesync.h"
+#include "lora_dutycycle.h"
+#include "lora_file_transfer.h"
+#include "configuration.h"
+#include "utils.h"
+
+TimeSyncStats timeSyncStats;
+
+typedef struct TimeSample {
+  time_response_message msg;
+  int64_t t4;               // node network time at RxDone of the response
+} TimeSample;
+
+QueueHandle_t timeResponseQueue = NULL; // response handed over from the receive task
+int64_t lastExchangeUs = 0;             // esp_timer time of the last exchange, 0 = none
+int64_t driftAccNs = 0;                 // drift model correction not applied yet
+
+/******************************************************************
+ *                                                                *
+ *                          Network Time                          *
+ *                                                                *
+ ******************************************************************/
+
+// Days from 1970-01-01 to a calendar date, without the time zone mktime applies
+int64_t calendarToEpoch(int year, int month, int day, int hour, int minute, int second) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yearOfEra = year - era * 400;
+  int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int64_t days = era * 146097 + dayOfEra - 719468;
+  return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+// On the gateway the local time of its time zone, on nodes the system time
+int64_t networkTimeUs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  struct tm t;
+  localtime_r(&tv.tv_sec, &t);
+  return calendarToEpoch(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec) * 1000000LL
+         + tv.tv_usec;
+}
+
+// Network time at RxDone of the frame being handled, taken in onReceive
+int64_t rxNetworkTimeUs() {
+  return networkTimeUs() - (esp_timer_get_time() - lastRxAtUs);
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Node Clock                            *
+ *                                                                *
+ ******************************************************************/
+
+// Adds to the adjustment still in progress, adjtime replaces it otherwise
+void slewClock(int64_t deltaUs) {
+  struct timeval pending = {0, 0};
+  adjtime(NULL, &pending);
+  int64_t total = (int64_t) pending.tv_sec * 1000000 + pending.tv_usec + deltaUs;
+  struct timeval delta;
+  delta.tv_sec = total / 1000000;
+  delta.tv_usec = total % 1000000;
+  adjtime(&delta, NULL);
+}
+
+void stepClock(int64_t deltaUs) {
+  struct timeval zero = {0, 0};
+  adjtime(&zero, NULL); // drop a slew in progress
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t now = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec + deltaUs;
+  tv.tv_sec = now / 1000000;
+  tv.tv_usec = now % 1000000;
+  settimeofday(&tv, NULL);
+}
+
+void applyOffset(int64_t offsetUs) {
+  if (offsetUs > TIME_STEP_THRESHOLD_US || offsetUs < -TIME_STEP_THRESHOLD_US) {
+    stepClock(offsetUs);
+    timeSyncStats.steps++;
+    lastRtcWrite = 0; // the DS1307 is off by as much
+  } else {
+    slewClock(offsetUs);
+    timeSyncStats.slews++;
+  }
+  clock_synced = true;
+}
+
+// Offset (server minus node) and the delay left after both frames' airtime:
+// turnaround, interrupt and task latency
+void applyExchange(const TimeSample& sample) {
+  int64_t requestAirtime = frameAirtimeUs(sizeof(time_request_message));
+  int64_t responseAirtime = frameAirtimeUs(sizeof(time_response_message));
+  const time_response_message& msg = sample.msg;
+
+  int64_t offset = ((msg.t2 - requestAirtime - msg.t1) + (msg.t3 + responseAirtime - sample.t4)) / 2;
+  int64_t delay = (sample.t4 - msg.t1) - (msg.t3 - msg.t2) - requestAirtime - responseAirtime;
+  timeSyncStats.lastOffsetUs = offset;
+  timeSyncStats.lastDelayUs = delay;
+  if (delay > TIME_SYNC_MAX_DELAY_US || delay < -TIME_SYNC_MAX_DELAY_US) {
+    timeSyncStats.rejected++;
+    Serial.printf("Time sync rejected, %lld us delay\n", delay);
+    return;
+  }
+
+  // what is left after the drift model is the error in its skew
+  int64_t now = esp_timer_get_time();
+  uint32_t interval = TIME_SYNC_MIN_INTERVAL_MS;
+  if (lastExchangeUs != 0 && offset > -TIME_STEP_THRESHOLD_US && offset < TIME_STEP_THRESHOLD_US) {
+    int64_t residualPpb = offset * 1000000000LL / (now - lastExchangeUs);
+    int64_t skew = timeSyncStats.skewPpb + residualPpb / 2;
+    timeSyncStats.skewPpb = constrain(skew, (int64_t) -TIME_SKEW_MAX_PPB, (int64_t) TIME_SKEW_MAX_PPB);
+    if (residualPpb != 0) {
+      int64_t ms = TIME_SYNC_TARGET_US * 1000000LL / llabs(residualPpb);
+      interval = constrain(ms, (int64_t) TIME_SYNC_MIN_INTERVAL_MS, (int64_t) TIME_SYNC_MAX_INTERVAL_MS);
+    } else {
+      interval = TIME_SYNC_MAX_INTERVAL_MS;
+    }
+  }
+  timeSyncStats.intervalMs = interval;
+  lastExchangeUs = now;
+  timeSyncStats.lastSyncAt = millis();
+  timeSyncStats.exchanges++;
+
+  applyOffset(offset);
+  Serial.printf("Time sync: offset %lld us, delay %lld us, skew %ld ppb, next in %lu s\n",
+                offset, delay, (long) timeSyncStats.skewPpb, (unsigned long) interval / 1000);
+}
+
+bool timeSyncDue() {
+  return timeSyncStats.lastSyncAt == 0 || millis() - timeSyncStats.lastSyncAt >= timeSyncStats.intervalMs;
+}
+
+// Called in the node's slot, under the radio mutex
+void requestTimeSync() {
+  time_request_message msg;
+  msg.msgType = TIME_REQUEST;
+  memcpy(msg.mac, MAC_ADDRESS_STA, MAC_ADDR_LENGTH);
+
+  xQueueReset(timeResponseQueue);
+  msg.t1 = 0;
+  sendLoraMessage((uint8_t *) &msg, sizeof(msg)); // t1 is stamped by the radio task
+
+  // the response has to come back within the slot
+  unsigned long timeout = min((unsigned long) TIME_SYNC_TIMEOUT_MS, ackTimeoutMs());
+  TimeSample sample;
+  if (xQueueReceive(timeResponseQueue, &sample, timeout / portTICK_PERIOD_MS) != pdTRUE
+      || sample.msg.t1 != msg.t1) {
+    timeSyncStats.timeouts++;
+    Serial.println("Time sync: no response");
+    return;
+  }
+  applyExchange(sample);
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Receive Control                        *
+ *                                                                *
+ ******************************************************************/
+
+// Network time of a poll beacon from the gateway or a relay: only used until
+// the first exchange, or when the clock is far off. Without an exchange a
+// small offset is slewed in at most every TIME_BEACON_APPLY_MS, the slew
+// from the beacon before may still be running.
+void applyBeaconTime(int64_t sentUs, size_t frameLen, int64_t receivedUs) {
+  static unsigned long lastAppliedAt = 0;
+  if (sentUs == 0) {
+    return;
+  }
+
+  int64_t offset = sentUs + frameAirtimeUs(frameLen) - receivedUs;
+  bool far = offset > TIME_STEP_THRESHOLD_US || offset < -TIME_STEP_THRESHOLD_US;
+  bool exchangeCurrent = timeSyncStats.lastSyncAt != 0
+                         && millis() - timeSyncStats.lastSyncAt < TIME_SYNC_MAX_INTERVAL_MS;
+  if (!far && (exchangeCurrent || (lastAppliedAt != 0 && millis() - lastAppliedAt < TIME_BEACON_APPLY_MS))) {
+    return;
+  }
+  lastAppliedAt = millis();
+  timeSyncStats.broadcasts++;
+  timeSyncStats.lastOffsetUs = offset;
+  applyOffset(offset);
+  Serial.printf("Beacon time: offset %lld us\n", offset);
+}
+
+// Gateway, and a relay for the nodes behind it
+void handle_time_request(const uint8_t *incomingData, int len) {
+  int64_t received = rxNetworkTimeUs();
+  if (len < (int) sizeof(time_request_message)) {
+    return;
+  }
+  time_request_message request;
+  memcpy(&request, incomingData, sizeof(request));
+
+  time_response_message msg;
+  msg.msgType = TIME_RESPONSE;
+  memcpy(msg.mac, request.mac, MAC_ADDR_LENGTH);
+  msg.t1 = request.t1;
+  msg.t2 = received;
+  msg.t3 = 0; // stamped by the radio task
+  sendLoraMessage((uint8_t *) &msg, sizeof(msg));
+  timeSyncStats.served++;
+}
+
+// Receive task: timestamp first, the slot task does the rest
+void handle_time_response(const uint8_t *incomingData, int len) {
+  TimeSample sample;
+  sample.t4 = rxNetworkTimeUs();
+  if (len < (int) sizeof(time_response_message) || timeResponseQueue == NULL) {
+    return;
+  }
+  memcpy(&sample.msg, incomingData, sizeof(sample.msg));
+  if (compareMacAddress(sample.msg.mac, MAC_ADDRESS_STA)) {
+    xQueueOverwrite(timeResponseQueue, &sample);
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Clock Task                            *
+ *                                                                *
+ ******************************************************************/
+
+// Applies the drift model in small slews and keeps the DS1307 close
+void timeSyncTask(void *parameter) {
+  int64_t lastStep = esp_timer_get_time();
+
+  while (true) {
+    vTaskDelay(TIME_DRIFT_STEP_MS / portTICK_PERIOD_MS);
+
+    int64_t now = esp_timer_get_time();
+    driftAccNs += (int64_t) timeSyncStats.skewPpb * (now - lastStep) / 1000000;
+    lastStep = now;
+    if (driftAccNs >= 1000 || driftAccNs <= -1000) {
+      slewClock(driftAccNs / 1000);
+      driftAccNs %= 1000;
+    }
+
+    // the DS1307 only keeps whole seconds, it is written on the next one
+    if (clock_synced && rtc_mounted && (lastRtcWrite == 0 || millis() - lastRtcWrite >= RTC_WRITE_INTERVAL_MS)) {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      vTaskDelay((1000000 - tv.tv_usec) / 1000 / portTICK_PERIOD_MS);
+      external_rtc_sync_ntp();
+      timeSyncStats.rtcWrites++;
+    }
+  }
+}
+
+void lora_timesync_init() {
+  memset(&timeSyncStats, 0, sizeof(timeSyncStats));
+  timeSyncStats.intervalMs = TIME_SYNC_MIN_INTERVAL_MS;
+  timeResponseQueue = xQueueCreate(1, sizeof(TimeSample));
+  xTaskCreate(timeSyncTask, "Time Sync Task", 4096, NULL, 1, NULL);
+}
@@ -4,6 +4,10 @@
 #include "vibrating_wire.h"
 #include "lora_init.h"
 #include "configuration.h"
+#include "power_profile.h"
+#include "cpu_load.h"
+#include "mqtt_uplink.h"
+#include <esp_sleep.h>
 
 
 /* Tasks */
@@ -20,6 +24,15 @@ void taskInitiNTP(void *parameter) {
 void setup() {
 
   Serial.begin(115200);
+
+  /* Deep-sleep node woken by its timer: configuration from flash, no display or network */
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+    reload_configuration();
+    if (lowPowerProfile()) {
+      low_power_resume(); // does not return
+    }
+  }
+
   Serial.println("\n------------------Booting-------------------\n");
 
   /* Core System */
@@ -31,10 +44,15 @@ void setup() {
   pinMode(LED,OUTPUT);// onboard blue LED inidcator
   spiffs_init();
   sd_init();
+  cpu_load_init();
 
   load_system_configuration();
   loadDataConfigFromPreferences();
 
+  if (lowPowerProfile()) {
+    low_power_start(); // joins the network and sleeps, Wi-Fi and the servers stay off
+  }
+
   Serial.println("\n*** Connectivity ***");
   // wifi_setting_reset();
   wifi_init();
@@ -42,6 +60,9 @@ void setup() {
   start_http_server();// start Async server with api-interfaces
   ftp_server_init();
   lora_init();
+  if (systemConfig.LORA_MODE == LORA_GATEWAY) {
+    mqtt_uplink_init(); // node data to the broker, the SD card is its outbox
+  }
   log_data_init();
 
   Serial.println("\n------------------Boot Completed----------------\n");
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_outbox.h"
+
+void outboxReset(MqttOutbox* outbox, uint32_t committed) {
+  memset(outbox, 0, sizeof(MqttOutbox));
+  outbox->committed = committed;
+  outbox->next = committed;
+}
+
+bool outboxCanSend(const MqttOutbox* outbox) {
+  return outbox->count < MQTT_INFLIGHT;
+}
+
+// **************************************
+// * Batch End
+// **************************************
+// End of the last complete line of n bytes read into a buffer of capacity.
+// 0 while the rest of the line is still on its way, a line longer than the
+// buffer goes out in pieces.
+size_t outboxBatchEnd(const uint8_t* data, size_t n, size_t capacity) {
+  size_t end = n;
+  while (end > 0 && data[end - 1] != '\n') {
+    end--;
+  }
+  if (end == 0 && n >= capacity) {
+    end = n;
+  }
+  return end;
+}
+
+uint32_t outboxCountLines(const uint8_t* data, size_t n) {
+  uint32_t lines = 0;
+  for (size_t i = 0; i < n; i++) {
+    lines += data[i] == '\n';
+  }
+  return lines;
+}
+
+// The batch is read to payload + MQTT_HEADER_BYTES, its file offset goes
+// right in front of it. Returns the header length, the payload starts at
+// payload + MQTT_HEADER_BYTES - length.
+size_t outboxHeader(uint8_t* payload, uint32_t offset) {
+  char header[MQTT_HEADER_BYTES];
+  size_t len = snprintf(header, sizeof(header), "%lu\n", (unsigned long) offset);
+  memcpy(payload + MQTT_HEADER_BYTES - len, header, len);
+  return len;
+}
+
+void outboxSent(MqttOutbox* outbox, int msgId, size_t len, uint32_t lines, uint32_t nowMs) {
+  MqttInflight* batch = &outbox->inflight[outbox->count++];
+  outbox->next += len;
+  batch->msgId = msgId;
+  batch->end = outbox->next;
+  batch->lines = lines;
+  batch->sentMs = nowMs;
+  batch->acked = false;
+}
+
+// **************************************
+// * PUBACK
+// **************************************
+// Marks the batch acknowledged and commits the acknowledged batches at the
+// front of the window. A PUBACK may come before the one of an earlier
+// batch, the offset then waits for it. Returns the batches committed, lines
+// and bytes are what the offset moved over. A msg_id of a dropped window
+// returns -1.
+int outboxAcked(MqttOutbox* outbox, int msgId, uint32_t* lines, uint32_t* bytes, uint32_t* rttMs, uint32_t nowMs) {
+  *lines = 0;
+  *bytes = 0;
+  *rttMs = 0;
+  bool found = false;
+  for (uint8_t i = 0; i < outbox->count && !found; i++) {
+    if (outbox->inflight[i].msgId == msgId && !outbox->inflight[i].acked) {
+      outbox->inflight[i].acked = true;
+      *rttMs = nowMs - outbox->inflight[i].sentMs;
+      found = true;
+    }
+  }
+  if (!found) {
+    return -1;
+  }
+
+  uint8_t done = 0;
+  while (done < outbox->count && outbox->inflight[done].acked) {
+    *lines += outbox->inflight[done].lines;
+    *bytes += outbox->inflight[done].end - outbox->committed;
+    outbox->committed = outbox->inflight[done].end;
+    done++;
+  }
+  outbox->count -= done;
+  memmove(&outbox->inflight[0], &outbox->inflight[done], outbox->count * sizeof(MqttInflight));
+  return done;
+}
+
+// The oldest batch waited MQTT_ACK_TIMEOUT_MS for its PUBACK
+bool outboxTimedOut(const MqttOutbox* outbox, uint32_t nowMs) {
+  return outbox->count > 0 && nowMs - outbox->inflight[0].sentMs >= MQTT_ACK_TIMEOUT_MS;
+}
+
+// Disconnect, timeout or rewind: what was not acknowledged is published again
+void outboxDrop(MqttOutbox* outbox) {
+  outbox->count = 0;
+  outbox->next = outbox->committed;
+}
@@ -0,0 +1,476 @@
+#include <WiFi.h>
+#include <SD.h>
+#include <mqtt_client.h>
+#include "mqtt_uplink.h"
+#include "sd_writer.h"
+#include "configuration.h"
+
+#define UPLINK_EVENT_DATA 0x01        // the SD writer appended to a node file
+#define UPLINK_EVENT_UP 0x02          // connected to the broker
+#define UPLINK_EVENT_DOWN 0x04        // connection lost or refused, the client is set up again
+
+MqttUplinkStats mqttUplinkStats;
+
+esp_mqtt_client_handle_t mqttClient = NULL;
+QueueHandle_t pubackQueue = NULL;     // msg_ids of MQTT_EVENT_PUBLISHED, the event handler adds
+char connectedHost[sizeof(systemConfig.MQTT_HOST)];
+int connectedPort = 0;
+
+// Files written since they were published, the SD writer adds, the uplink
+// task takes. Overflow or a broker outage falls back to a full scan.
+char dirtyFiles[MQTT_DIRTY_FILES][SD_WRITER_PATH_LEN];
+size_t dirtyCount = 0;
+bool rescanAll = true;                // everything left from before the boot
+uint32_t rewindCount = 0;             // a publish in progress stops when it changes
+SemaphoreHandle_t xMutex_Uplink = NULL;
+EventGroupHandle_t uplinkEvents = NULL;
+
+uint8_t payload[MQTT_HEADER_BYTES + MQTT_BATCH_BYTES];
+unsigned long drainStart = 0;         // millis() a backlog started draining, 0 = none
+uint64_t drainBytes = 0;
+
+/******************************************************************
+ *                                                                *
+ *                            Outbox                              *
+ *                                                                *
+ ******************************************************************/
+
+// Called by the SD writer after appending to a file
+void mqttUplinkNotify(const char* path, size_t len) {
+  if (xMutex_Uplink == NULL || strncmp(path, "/node/", 6) != 0 || !String(path).endsWith(".dat")) {
+    return;
+  }
+  xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+  mqttUplinkStats.backlogBytes += len;
+  bool listed = false;
+  for (size_t i = 0; i < dirtyCount && !listed; i++) {
+    listed = strcmp(dirtyFiles[i], path) == 0;
+  }
+  if (!listed && dirtyCount < MQTT_DIRTY_FILES) {
+    strncpy(dirtyFiles[dirtyCount++], path, SD_WRITER_PATH_LEN);
+  } else if (!listed) {
+    rescanAll = true;
+  }
+  xSemaphoreGive(xMutex_Uplink);
+  xEventGroupSetBits(uplinkEvents, UPLINK_EVENT_DATA);
+}
+
+// /node/<name>/data/ADC/3.dat -> /node/<name>/data/ADC/3.mqtt
+String offsetFilename(const String& path) {
+  return path.substring(0, path.lastIndexOf('.')) + MQTT_OFFSET_SUFFIX;
+}
+
+uint32_t readPublishedOffset(const String& path) {
+  uint32_t offset = 0;
+  File file = SD.open(offsetFilename(path).c_str(), FILE_READ);
+  if (file) {
+    offset = file.parseInt();
+    file.close();
+  }
+  return offset;
+}
+
+void writePublishedOffset(const String& path, uint32_t offset) {
+  File file = SD.open(offsetFilename(path).c_str(), FILE_WRITE);
+  if (file) {
+    file.println(offset);
+    file.close();
+  }
+}
+
+// Start of the line the offset is in, looked up at most MQTT_LINE_BACK bytes back
+uint32_t lineStart(const String& path, uint32_t offset) {
+  File file = SD.open(path.c_str(), FILE_READ);
+  if (!file) {
+    return offset;
+  }
+  uint8_t back[MQTT_LINE_BACK];
+  uint32_t from = offset > sizeof(back) ? offset - sizeof(back) : 0;
+  file.seek(from);
+  size_t n = file.read(back, offset - from);
+  file.close();
+  while (n > 0 && back[n - 1] != '\n') {
+    n--;
+  }
+  return from + n;
+}
+
+// Called by the SD writer after a repair replaced data from offset on. If
+// that part was published already, its lines are published again.
+void mqttUplinkRewind(const char* path, uint32_t offset) {
+  if (xMutex_Uplink == NULL || strncmp(path, "/node/", 6) != 0 || !String(path).endsWith(".dat")) {
+    return;
+  }
+  String name = path;
+  xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+  if (readPublishedOffset(name) > offset) {
+    writePublishedOffset(name, lineStart(name, offset));
+    rewindCount++;
+    mqttUplinkStats.rewinds++;
+  }
+  xSemaphoreGive(xMutex_Uplink);
+}
+
+// /node/<name>/data/ADC/3.dat -> datalogger/<gateway>/<name>/ADC/3
+String topicFor(const String& path) {
+  String rest = path.substring(6, path.lastIndexOf('.'));
+  int slash = rest.indexOf('/');
+  if (slash > 0 && rest.substring(slash + 1).startsWith("data/")) {
+    rest = rest.substring(0, slash) + rest.substring(slash + 5);
+  }
+  return String(MQTT_TOPIC_ROOT) + "/" + systemConfig.DEVICE_NAME + "/" + rest;
+}
+
+/******************************************************************
+ *                                                                *
+ *                           Publish                              *
+ *                                                                *
+ ******************************************************************/
+
+// **************************************
+// * Publish File
+// **************************************
+// New complete lines of one data file at QoS 1, MQTT_BATCH_BYTES at a time
+// and up to MQTT_INFLIGHT batches ahead of their PUBACKs. Each payload
+// starts with the file offset of its first line, so a batch sent again
+// after an outage can be told apart. The .mqtt offset is written as PUBACKs
+// come in. Returns false once the connection dropped or a PUBACK did not
+// come, remaining is what is left of the file.
+bool publishFile(const String& path, uint32_t* remaining) {
+
+  *remaining = 0;
+  File file = SD.open(path.c_str(), FILE_READ);
+  if (!file) {
+    return true; // removed meanwhile
+  }
+  uint32_t size = file.size();
+  uint32_t offset = readPublishedOffset(path);
+  if (offset > size) {
+    offset = 0; // written again from the start by a full file transfer
+  }
+
+  xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+  uint32_t rewinds = rewindCount;
+  xSemaphoreGive(xMutex_Uplink);
+
+  String topic = topicFor(path);
+  MqttOutbox outbox;
+  outboxReset(&outbox, offset);
+  xQueueReset(pubackQueue); // PUBACKs of a window dropped before
+  bool ok = true;
+  bool partial = false;     // the rest of the line is still on its way
+
+  while (ok) {
+    if ((xEventGroupGetBits(uplinkEvents) & UPLINK_EVENT_UP) == 0) {
+      ok = false;
+      break;
+    }
+
+    if (outboxCanSend(&outbox) && outbox.next < size && !partial) {
+      uint8_t* batch = payload + MQTT_HEADER_BYTES;
+      file.seek(outbox.next);
+      size_t n = file.read(batch, min((size_t) (size - outbox.next), (size_t) MQTT_BATCH_BYTES));
+      size_t end = outboxBatchEnd(batch, n, MQTT_BATCH_BYTES);
+      if (end == 0) {
+        partial = true;
+        continue;
+      }
+      size_t headerLen = outboxHeader(payload, outbox.next);
+      int msgId = esp_mqtt_client_publish(mqttClient, topic.c_str(), (const char*) batch - headerLen,
+                                          headerLen + end, 1, 0);
+      if (msgId < 0) {
+        ok = false;
+        break;
+      }
+      outboxSent(&outbox, msgId, end, outboxCountLines(batch, end), millis());
+      continue;
+    }
+    if (outbox.count == 0) {
+      break; // everything published was acknowledged
+    }
+
+    int msgId;
+    if (xQueueReceive(pubackQueue, &msgId, MQTT_IDLE_MS / portTICK_PERIOD_MS) != pdTRUE) {
+      ok = !outboxTimedOut(&outbox, millis());
+      continue;
+    }
+    uint32_t lines, bytes, rttMs;
+    int batches = outboxAcked(&outbox, msgId, &lines, &bytes, &rttMs, millis());
+    if (batches < 0) {
+      continue;
+    }
+
+    // a repair moved the offset back meanwhile, the file is published again from there
+    xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+    if (rewindCount != rewinds) {
+      xSemaphoreGive(xMutex_Uplink);
+      outboxDrop(&outbox);
+      break;
+    }
+    if (batches > 0) {
+      writePublishedOffset(path, outbox.committed);
+    }
+    mqttUplinkStats.published += batches;
+    mqttUplinkStats.lines += lines;
+    mqttUplinkStats.bytes += bytes;
+    mqttUplinkStats.backlogBytes -= min(bytes, mqttUplinkStats.backlogBytes);
+    mqttUplinkStats.lastPublishMs = rttMs;
+    mqttUplinkStats.maxPublishMs = max(mqttUplinkStats.maxPublishMs, rttMs);
+    xSemaphoreGive(xMutex_Uplink);
+    drainBytes += bytes;
+  }
+
+  if (!ok) {
+    mqttUplinkStats.publishFailures++;
+    outboxDrop(&outbox);
+  }
+  *remaining = size > outbox.committed ? size - outbox.committed : 0;
+  file.close();
+  return ok;
+}
+
+// **************************************
+// * Full Scan
+// **************************************
+// Every data file under /node, the backlog is counted again on the way.
+// Returns false if the broker went away, the scan is then repeated.
+bool scanNodeFiles() {
+
+  uint32_t backlog = 0;
+  bool ok = true;
+  File nodes = SD.open("/node");
+  if (!nodes) {
+    return true;
+  }
+  File node = nodes.openNextFile();
+  while (node && ok) {
+    if (node.isDirectory()) {
+      String dataPath = String("/node/") + node.name() + "/data";
+      File banks = SD.open(dataPath.c_str());
+      File bank = banks ? banks.openNextFile() : File();
+      while (bank && ok) {
+        if (bank.isDirectory()) {
+          String bankPath = dataPath + "/" + bank.name();
+          File folder = SD.open(bankPath.c_str());
+          File file = folder ? folder.openNextFile() : File();
+          while (file && ok) {
+            String fileName = file.name();
+            file.close();
+            if (fileName.endsWith(".dat")) {
+              uint32_t remaining;
+              ok = publishFile(bankPath + "/" + fileName, &remaining);
+              backlog += remaining;
+            }
+            file = folder.openNextFile();
+          }
+          folder.close();
+        }
+        bank.close();
+        bank = banks.openNextFile();
+      }
+      banks.close();
+    }
+    node.close();
+    node = nodes.openNextFile();
+  }
+  nodes.close();
+
+  if (ok) {
+    xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+    mqttUplinkStats.backlogBytes = backlog;
+    mqttUplinkStats.scans++;
+    xSemaphoreGive(xMutex_Uplink);
+  }
+  return ok;
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Uplink Task                            *
+ *                                                                *
+ ******************************************************************/
+
+// Runs in the MQTT client task
+void mqttEventHandler(void* arg, esp_event_base_t base, int32_t eventId, void* eventData) {
+  esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) eventData;
+  switch ((esp_mqtt_event_id_t) eventId) {
+    case MQTT_EVENT_CONNECTED:
+      xEventGroupSetBits(uplinkEvents, UPLINK_EVENT_UP);
+      break;
+    case MQTT_EVENT_DISCONNECTED:
+      xEventGroupClearBits(uplinkEvents, UPLINK_EVENT_UP);
+      xEventGroupSetBits(uplinkEvents, UPLINK_EVENT_DOWN);
+      break;
+    case MQTT_EVENT_PUBLISHED:
+      xQueueSend(pubackQueue, &event->msg_id, 0); // a lost PUBACK times the window out
+      break;
+    case MQTT_EVENT_ERROR:
+      mqttUplinkStats.lastError = event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED
+                                  ? event->error_handle->connect_return_code : -1;
+      break;
+    default:
+      break;
+  }
+}
+
+// A new client per connection, its reconnects are timed by the uplink task
+void startBroker() {
+  int port = systemConfig.MQTT_PORT > 0 ? systemConfig.MQTT_PORT : MQTT_DEFAULT_PORT;
+  String clientId = String("datalogger-") + systemConfig.DEVICE_NAME;
+  esp_mqtt_client_config_t config = {};
+  config.host = systemConfig.MQTT_HOST;
+  config.port = port;
+  config.client_id = clientId.c_str();
+  if (systemConfig.MQTT_USER[0] != '\0') {
+    config.username = systemConfig.MQTT_USER;
+    config.password = systemConfig.MQTT_PASSWORD;
+  }
+  config.disable_auto_reconnect = true;
+  config.buffer_size = MQTT_HEADER_BYTES + MQTT_BATCH_BYTES + 256; // a batch with its topic in one write
+
+  mqttClient = esp_mqtt_client_init(&config);
+  if (mqttClient == NULL) {
+    xEventGroupSetBits(uplinkEvents, UPLINK_EVENT_DOWN);
+    return;
+  }
+  esp_mqtt_client_register_event(mqttClient, (esp_mqtt_event_id_t) ESP_EVENT_ANY_ID, mqttEventHandler, NULL);
+  strcpy(connectedHost, systemConfig.MQTT_HOST);
+  connectedPort = systemConfig.MQTT_PORT;
+  esp_mqtt_client_start(mqttClient);
+}
+
+void stopBroker() {
+  if (mqttClient != NULL) {
+    esp_mqtt_client_destroy(mqttClient);
+    mqttClient = NULL;
+  }
+  xEventGroupClearBits(uplinkEvents, UPLINK_EVENT_UP | UPLINK_EVENT_DOWN);
+  xQueueReset(pubackQueue);
+}
+
+// A drained backlog of at least one batch gives the drain rate
+void finishDrain() {
+  if (drainStart != 0 && mqttUplinkStats.backlogBytes == 0) {
+    uint32_t elapsed = millis() - drainStart;
+    if (drainBytes >= MQTT_BATCH_BYTES && elapsed > 0) {
+      mqttUplinkStats.lastDrainBps = drainBytes * 1000 / elapsed;
+      mqttUplinkStats.maxDrainBps = max(mqttUplinkStats.maxDrainBps, mqttUplinkStats.lastDrainBps);
+    }
+    drainStart = 0;
+  }
+}
+
+void taskMqttUplink(void *parameter) {
+
+  unsigned long retryMs = MQTT_RETRY_MS;
+  unsigned long nextConnect = 0;
+  bool up = false;
+
+  while (true) {
+
+    if (systemConfig.MQTT_HOST[0] == '\0' || WiFi.status() != WL_CONNECTED) {
+      stopBroker();
+      up = false;
+      mqttUplinkStats.connected = false;
+      vTaskDelay(MQTT_RETRY_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    // broker changed in the system configuration
+    if (mqttClient != NULL && (strcmp(connectedHost, systemConfig.MQTT_HOST) != 0 || connectedPort != systemConfig.MQTT_PORT)) {
+      stopBroker();
+      up = false;
+      nextConnect = millis();
+    }
+
+    EventBits_t bits = xEventGroupGetBits(uplinkEvents);
+    if (bits & UPLINK_EVENT_DOWN) {
+      int port = connectedPort > 0 ? connectedPort : MQTT_DEFAULT_PORT;
+      if (up) {
+        Serial.printf("MQTT disconnected from %s:%d\n", connectedHost, port);
+      } else {
+        mqttUplinkStats.connectFailures++;
+        Serial.printf("MQTT connect to %s:%d failed, error %d\n", connectedHost, port, mqttUplinkStats.lastError);
+      }
+      stopBroker();
+      up = false;
+      nextConnect = millis() + retryMs;
+      retryMs = min(retryMs * 2, (unsigned long) MQTT_RETRY_MAX_MS);
+      continue;
+    }
+
+    if ((bits & UPLINK_EVENT_UP) == 0) {
+      mqttUplinkStats.connected = false;
+      drainStart = 0;
+      if (mqttClient == NULL && (long) (millis() - nextConnect) >= 0) {
+        startBroker();
+      }
+      xEventGroupWaitBits(uplinkEvents, UPLINK_EVENT_UP | UPLINK_EVENT_DOWN, pdFALSE, pdFALSE, MQTT_IDLE_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    if (!up) {
+      up = true;
+      retryMs = MQTT_RETRY_MS;
+      mqttUplinkStats.connected = true;
+      mqttUplinkStats.connects++;
+      Serial.printf("MQTT connected to %s:%d\n", connectedHost, connectedPort > 0 ? connectedPort : MQTT_DEFAULT_PORT);
+      xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+      rescanAll = true; // what was written during the outage
+      xSemaphoreGive(xMutex_Uplink);
+    }
+
+    xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+    bool scan = rescanAll;
+    rescanAll = false;
+    String path;
+    if (scan) {
+      dirtyCount = 0; // the scan covers them
+    } else if (dirtyCount > 0) {
+      path = dirtyFiles[0];
+      dirtyCount--;
+      memmove(dirtyFiles[0], dirtyFiles[1], dirtyCount * SD_WRITER_PATH_LEN);
+    }
+    if ((scan || path.length() > 0) && drainStart == 0 && mqttUplinkStats.backlogBytes > 0) {
+      drainStart = millis();
+      drainBytes = 0;
+    }
+    xSemaphoreGive(xMutex_Uplink);
+
+    bool ok = true;
+    if (scan) {
+      ok = scanNodeFiles();
+    } else if (path.length() > 0) {
+      uint32_t remaining;
+      ok = publishFile(path, &remaining);
+    } else {
+      finishDrain();
+      xEventGroupWaitBits(uplinkEvents, UPLINK_EVENT_DATA | UPLINK_EVENT_DOWN, pdFALSE, pdFALSE, MQTT_IDLE_MS / portTICK_PERIOD_MS);
+      xEventGroupClearBits(uplinkEvents, UPLINK_EVENT_DATA);
+    }
+    if (!ok) {
+      xSemaphoreTake(xMutex_Uplink, portMAX_DELAY);
+      rescanAll = true; // picked up again after the reconnect
+      xSemaphoreGive(xMutex_Uplink);
+      xEventGroupSetBits(uplinkEvents, UPLINK_EVENT_DOWN); // a new connection, a missing PUBACK may be a dead one
+    }
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                        Initialization                          *
+ *                                                                *
+ ******************************************************************/
+
+void mqtt_uplink_init() {
+
+  memset(&mqttUplinkStats, 0, sizeof(mqttUplinkStats));
+  xMutex_Uplink = xSemaphoreCreateMutex();
+  uplinkEvents = xEventGroupCreate();
+  pubackQueue = xQueueCreate(MQTT_INFLIGHT * 2, sizeof(int));
+
+  // Below the LoRa tasks, the outbox waits on the SD card
+  xTaskCreate(taskMqttUplink, "MQTT Uplink", 8192, NULL, 1, NULL);
+  Serial.printf("MQTT uplink: %s\n", systemConfig.MQTT_HOST[0] != '\0' ? systemConfig.MQTT_HOST : "no broker set");
+}
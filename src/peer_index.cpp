@@ -0,0 +1,76 @@
+#include <string.h>
+#include "peer_index.h"
+
+// FNV-1a over the key, string keys stop at the terminator
+static uint32_t hashKey(const PeerIndex* index, const uint8_t* key) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < index->keyLength; i++) {
+    if (index->stringKey && key[i] == '\0') {
+      break;
+    }
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool keyEquals(const PeerIndex* index, const uint8_t* a, const uint8_t* b) {
+  if (index->stringKey) {
+    return strncmp((const char*) a, (const char*) b, index->keyLength) == 0;
+  }
+  return memcmp(a, b, index->keyLength) == 0;
+}
+
+static const uint8_t* recordKey(const PeerIndex* index, uint16_t recordIndex) {
+  return index->records + recordIndex * index->stride + index->keyOffset;
+}
+
+void peerIndexInit(PeerIndex* index, uint16_t* slots, size_t capacity, const void* records,
+                   size_t stride, size_t keyOffset, size_t keyLength, bool stringKey) {
+  index->slots = slots;
+  index->capacity = capacity;
+  index->records = (const uint8_t*) records;
+  index->stride = stride;
+  index->keyOffset = keyOffset;
+  index->keyLength = keyLength;
+  index->stringKey = stringKey;
+  peerIndexClear(index);
+}
+
+void peerIndexClear(PeerIndex* index) {
+  for (size_t i = 0; i < index->capacity; i++) {
+    index->slots[i] = PEER_INDEX_EMPTY;
+  }
+}
+
+// Linear probing. Duplicate keys are allowed, lookups return the first one inserted.
+bool peerIndexInsert(PeerIndex* index, uint16_t recordIndex) {
+  size_t mask = index->capacity - 1;
+  size_t bucket = hashKey(index, recordKey(index, recordIndex)) & mask;
+  for (size_t probe = 0; probe < index->capacity; probe++) {
+    if (index->slots[bucket] == PEER_INDEX_EMPTY) {
+      index->slots[bucket] = recordIndex;
+      return true;
+    }
+    bucket = (bucket + 1) & mask;
+  }
+  return false; // full
+}
+
+// Returns the record index, or -1 if the key is not in the index
+int peerIndexFind(const PeerIndex* index, const void* key) {
+  const uint8_t* keyBytes = (const uint8_t*) key;
+  size_t mask = index->capacity - 1;
+  size_t bucket = hashKey(index, keyBytes) & mask;
+  for (size_t probe = 0; probe < index->capacity; probe++) {
+    uint16_t recordIndex = index->slots[bucket];
+    if (recordIndex == PEER_INDEX_EMPTY) {
+      return -1;
+    }
+    if (keyEquals(index, recordKey(index, recordIndex), keyBytes)) {
+      return recordIndex;
+    }
+    bucket = (bucket + 1) & mask;
+  }
+  return -1;
+}
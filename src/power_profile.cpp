@@ -0,0 +1,325 @@
+#include <esp_sleep.h>
+#include <LoRa.h>
+#include <SD.h>
+#include "power_profile.h"
+#include "data_logging.h"
+#include "lora_init.h"
+#include "lora_slave.h"
+#include "lora_scheduler.h"
+#include "lora_timesync.h"
+#include "lora_dutycycle.h"
+#include "configuration.h"
+#include "utils.h"
+
+// RTC memory survives deep sleep, it is cleared in low_power_start after power-on
+RTC_DATA_ATTR PowerStats powerStats;
+RTC_DATA_ATTR uint8_t sampleBuffer[LOW_POWER_BUFFER_BYTES]; // records: bank, channel, length, line
+RTC_DATA_ATTR uint16_t sampleBufferUsed = 0;
+RTC_DATA_ATTR uint32_t lastSampleAt[SAMPLE_BANKS][ADC_CHANNEL_COUNT]; // epoch s, 0 = not sampled yet
+RTC_DATA_ATTR int64_t nextRadioUs = 0; // network time of the next wake boundary
+
+#define SAMPLE_RECORD_HEADER 3
+
+bool lowPowerProfile() {
+  return systemConfig.LORA_MODE == LORA_SLAVE && systemConfig.RADIO_WAKE_S > 0;
+}
+
+// The configured period rounded up to the grid, 0 while the radio is always on
+uint16_t lowPowerWakePeriodS() {
+  if (!lowPowerProfile()) {
+    return 0;
+  }
+  int period = constrain(systemConfig.RADIO_WAKE_S, LOW_POWER_GRID_S, LOW_POWER_MAX_WAKE_S);
+  return (period + LOW_POWER_GRID_S - 1) / LOW_POWER_GRID_S * LOW_POWER_GRID_S;
+}
+
+/******************************************************************
+ *                                                                *
+ *                            Energy                              *
+ *                                                                *
+ ******************************************************************/
+
+// Mean current since power-on, from the measured awake, radio and transmit
+// time and the draw of each state
+uint32_t lowPowerAverageUa() {
+  uint64_t elapsedUs = powerStats.awakeUs + powerStats.sleptUs;
+  if (!lowPowerProfile() || elapsedUs == 0) {
+    return 0;
+  }
+  uint64_t rxUs = powerStats.radioUs > powerStats.txUs ? powerStats.radioUs - powerStats.txUs : 0;
+  uint64_t charge = POWER_ACTIVE_MA * 1000ULL * powerStats.awakeUs   // uA * us
+                  + POWER_LORA_RX_MA * 1000ULL * rxUs
+                  + POWER_LORA_TX_MA * 1000ULL * powerStats.txUs
+                  + (uint64_t) POWER_SLEEP_UA * powerStats.sleptUs;
+  return charge / elapsedUs;
+}
+
+// uA * mV is nW, over 24 h in mWh
+uint16_t lowPowerEnergyMwhDay() {
+  uint64_t mwh = (uint64_t) lowPowerAverageUa() * POWER_SUPPLY_MV * 24 / 1000000;
+  return mwh > UINT16_MAX ? UINT16_MAX : mwh;
+}
+
+uint16_t lowPowerAvgAwakeMs() {
+  if (!lowPowerProfile() || powerStats.cycles == 0) {
+    return 0;
+  }
+  uint64_t ms = powerStats.awakeUs / powerStats.cycles / 1000;
+  return ms > UINT16_MAX ? UINT16_MAX : ms;
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Sample Buffer                          *
+ *                                                                *
+ ******************************************************************/
+
+bool channelSchedule(uint8_t bank, int channel, uint16_t* intervalMin) {
+  if (bank == BANK_ADC && channel < ADC_CHANNEL_COUNT) {
+    *intervalMin = dataConfig.adcInterval[channel];
+    return dataConfig.adcEnabled[channel];
+  }
+  if (bank == BANK_UART && channel < UART_CHANNEL_COUNT) {
+    *intervalMin = dataConfig.uartInterval[channel];
+    return dataConfig.uartEnabled[channel];
+  }
+  if (bank == BANK_I2C && channel < I2C_CHANNEL_COUNT) {
+    *intervalMin = dataConfig.i2cInterval[channel];
+    return dataConfig.i2cEnabled[channel];
+  }
+  return false;
+}
+
+bool bufferSample(uint8_t bank, uint8_t channel, const String& line) {
+  size_t len = min((size_t) line.length(), (size_t) UINT8_MAX);
+  if (sampleBufferUsed + SAMPLE_RECORD_HEADER + len > LOW_POWER_BUFFER_BYTES) {
+    return false;
+  }
+  uint8_t* record = sampleBuffer + sampleBufferUsed;
+  record[0] = bank;
+  record[1] = channel;
+  record[2] = len;
+  memcpy(record + SAMPLE_RECORD_HEADER, line.c_str(), len);
+  sampleBufferUsed += SAMPLE_RECORD_HEADER + len;
+  return true;
+}
+
+bool mountSd() {
+  if (SD.cardType() == CARD_NONE) {
+    sd_init();
+  }
+  return SD.cardType() != CARD_NONE;
+}
+
+// Appends the buffered lines to their files, one open per file. Records of
+// a file that cannot be opened stay in the buffer.
+void flushSamples() {
+  if (sampleBufferUsed == 0 || !mountSd()) {
+    return;
+  }
+  bool written[LOW_POWER_BUFFER_BYTES / (SAMPLE_RECORD_HEADER + 1)] = {false}; // by record
+  for (uint8_t bank = 0; bank < SAMPLE_BANKS; bank++) {
+    for (uint8_t channel = 0; channel < ADC_CHANNEL_COUNT; channel++) {
+      File file;
+      bool failed = false;
+      size_t n = 0;
+      for (size_t pos = 0; pos < sampleBufferUsed; pos += SAMPLE_RECORD_HEADER + sampleBuffer[pos + 2], n++) {
+        if (sampleBuffer[pos] != bank || sampleBuffer[pos + 1] != channel || failed) {
+          continue;
+        }
+        if (!file) {
+          file = SD.open(createFilename(sampleBankName((SampleBank) bank), channel), FILE_APPEND);
+          if (!file) {
+            failed = true;
+            continue;
+          }
+        }
+        file.write(sampleBuffer + pos + SAMPLE_RECORD_HEADER, sampleBuffer[pos + 2]);
+        file.print("\r\n"); // println of the always-on logger
+        written[n] = true;
+      }
+      if (file) {
+        file.close();
+      }
+    }
+  }
+
+  // keep what could not be written
+  size_t kept = 0;
+  size_t n = 0;
+  for (size_t pos = 0; pos < sampleBufferUsed; n++) {
+    size_t size = SAMPLE_RECORD_HEADER + sampleBuffer[pos + 2];
+    if (!written[n]) {
+      memmove(sampleBuffer + kept, sampleBuffer + pos, size);
+      kept += size;
+    }
+    pos += size;
+  }
+  sampleBufferUsed = kept;
+  powerStats.flushes++;
+  Serial.printf("\nSamples written to SD, %u bytes kept\n", (unsigned) kept);
+}
+
+// Buffers every enabled channel that is due, in the format of the always-on
+// logger. Returns the epoch second the next sample is due.
+time_t takeDueSamples() {
+  time_t now = time(NULL);
+  time_t next = now + LOW_POWER_MAX_WAKE_S;
+  String timestamp = get_current_time(true);
+
+  for (uint8_t bank = 0; bank < SAMPLE_BANKS; bank++) {
+    for (uint8_t channel = 0; channel < ADC_CHANNEL_COUNT; channel++) {
+      uint16_t intervalMin;
+      if (!channelSchedule(bank, channel, &intervalMin)) {
+        continue;
+      }
+      time_t due = lastSampleAt[bank][channel] + (time_t) intervalMin * 60;
+      if (lastSampleAt[bank][channel] == 0 || due <= now + LOW_POWER_SAMPLE_SLACK_S) {
+        String line = formatSampleLine((SampleBank) bank, channel, timestamp);
+        if (!bufferSample(bank, channel, line)) {
+          flushSamples(); // full, the SD card is powered up early
+          if (!bufferSample(bank, channel, line)) {
+            powerStats.droppedSamples++;
+          }
+        }
+        powerStats.samples++;
+        lastSampleAt[bank][channel] = now;
+        due = now + (time_t) intervalMin * 60;
+      }
+      next = min(next, due);
+    }
+  }
+  return next;
+}
+
+/******************************************************************
+ *                                                                *
+ *                         Radio Window                           *
+ *                                                                *
+ ******************************************************************/
+
+// First wake boundary after the radio lead from now
+int64_t nextBoundaryUs(int64_t nowUs) {
+  int64_t periodUs = (int64_t) lowPowerWakePeriodS() * 1000000;
+  return ((nowUs + LOW_POWER_LEAD_MS * 1000LL) / periodUs + 1) * periodUs;
+}
+
+// Starts the LoRa stack and stays up until our slot of the boundary's cycle
+// is done, or no beacon gave us one in time. Joining after power-on waits
+// until the node is paired, synced and has reported its wake period.
+void radioWindow(bool join) {
+  int64_t startUs = esp_timer_get_time();
+  unsigned long start = millis();
+  int64_t untilBoundaryMs = (nextRadioUs - networkTimeUs()) / 1000;
+  unsigned long deadline = start + (join ? LOW_POWER_JOIN_MS : max(untilBoundaryMs, (int64_t) 0) + LOW_POWER_LISTEN_MS);
+
+  lora_init();
+  uint32_t slotsBefore = slotsCompleted;
+
+  while (true) {
+    unsigned long wakeAt = 0; // end of the listen tail, 0 = the deadline
+    if (slotsCompleted != slotsBefore) {
+      unsigned long tailEnd = cycleEndAt + LOW_POWER_TAIL_MS;
+      bool listen = (slotFlags & SLOT_FLAG_LISTEN) && (long) (millis() - tailEnd) < 0;
+      if (!listen && (!join || (myNodeId != 0 && clock_synced))) {
+        break;
+      }
+      if (listen && (long) (tailEnd - deadline) > 0) {
+        deadline = tailEnd; // config deltas follow the cycle
+      }
+      if (listen) {
+        wakeAt = tailEnd;
+      }
+    } else if (slotEnd != 0 && (long) (slotEnd + LOW_POWER_LISTEN_MS - deadline) > 0) {
+      deadline = slotEnd + LOW_POWER_LISTEN_MS; // a beacon gave us a slot, wait for it
+    }
+    if ((long) (millis() - deadline) >= 0) {
+      if (slotsCompleted == slotsBefore) {
+        powerStats.missedWindows++;
+        Serial.println("Radio window without a slot");
+      }
+      break;
+    }
+
+    // woken by the end of a slot, at the latest when the tail or the window
+    // is over, which a beacon or the listen flag may have moved
+    long waitMs = (long) ((wakeAt != 0 ? wakeAt : deadline) - millis());
+    xEventGroupWaitBits(nodeEvents, NODE_EVENT_SLOT_DONE, pdTRUE, pdFALSE, max(waitMs, 1L) / portTICK_PERIOD_MS + 1);
+  }
+
+  LoRa.sleep();
+  powerStats.radioWindows++;
+  powerStats.radioUs += esp_timer_get_time() - startUs;
+  powerStats.txUs += airtimeStats.txUs;
+}
+
+/******************************************************************
+ *                                                                *
+ *                          Deep Sleep                            *
+ *                                                                *
+ ******************************************************************/
+
+// Sleeps until the next sample or the radio lead before the next boundary,
+// whichever comes first. A configuration without the profile reboots.
+void goToSleep(time_t nextSampleAt) {
+  if (!lowPowerProfile()) {
+    Serial.println("Deep-sleep profile turned off, rebooting");
+    ESP.restart();
+    return;
+  }
+
+  int64_t nowUs = networkTimeUs();
+  if (nextRadioUs - LOW_POWER_LEAD_MS * 1000LL <= nowUs) {
+    nextRadioUs = nextBoundaryUs(nowUs);
+  }
+  int64_t wakeUs = min((int64_t) (nextRadioUs - LOW_POWER_LEAD_MS * 1000LL), (int64_t) nextSampleAt * 1000000);
+  int64_t sleepUs = max(wakeUs - nowUs, (int64_t) 100000);
+
+  int64_t awakeUs = esp_timer_get_time(); // since this wake
+  powerStats.cycles++;
+  powerStats.lastAwakeMs = awakeUs / 1000;
+  powerStats.maxAwakeMs = max(powerStats.maxAwakeMs, powerStats.lastAwakeMs);
+  powerStats.awakeUs += awakeUs;
+  powerStats.sleptUs += sleepUs;
+  Serial.printf("Wake %lu: awake %lu ms, %u samples buffered, sleeping %lu s, %lu uA, %u mWh/day\n",
+                (unsigned long) powerStats.cycles, (unsigned long) powerStats.lastAwakeMs, (unsigned) sampleBufferUsed,
+                (unsigned long) (sleepUs / 1000000), (unsigned long) lowPowerAverageUa(), lowPowerEnergyMwhDay());
+  Serial.flush();
+
+  SD.end();
+  esp_sleep_enable_timer_wakeup(sleepUs);
+  esp_deep_sleep_start();
+}
+
+// After power-on: clears the RTC state, takes the first samples and stays
+// up to join the network before the first sleep
+void low_power_start() {
+  memset(&powerStats, 0, sizeof(powerStats));
+  memset(lastSampleAt, 0, sizeof(lastSampleAt));
+  sampleBufferUsed = 0;
+  nextRadioUs = 0;
+
+  Serial.printf("Deep-sleep node, radio every %u s\n", lowPowerWakePeriodS());
+  create_data_folders();
+  time_t nextSampleAt = takeDueSamples();
+  flushSamples();
+  radioWindow(true);
+  goToSleep(nextSampleAt);
+}
+
+// Timer wake: samples, and the radio window when its boundary is near. A
+// node that lost its pairing or never synced joins again.
+void low_power_resume() {
+  time_t nextSampleAt = takeDueSamples();
+  bool joined = myNodeId != 0 && clock_synced;
+  bool radioDue = !joined || networkTimeUs() + (LOW_POWER_LEAD_MS + LOW_POWER_SAMPLE_SLACK_S * 1000LL) * 1000 >= nextRadioUs;
+
+  if (radioDue || sampleBufferUsed >= LOW_POWER_FLUSH_BYTES) {
+    flushSamples();
+  }
+  if (radioDue) {
+    mountSd(); // the slot sends the files from the card
+    radioWindow(!joined);
+  }
+  goToSleep(nextSampleAt);
+}
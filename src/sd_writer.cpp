@@ -0,0 +1,317 @@
+#include <SD.h>
+#include "sd_writer.h"
+#include "mqtt_uplink.h"
+#include "file_integrity.h"
+#include "lora_peer.h"
+#include "lora_file_transfer.h"
+
+typedef struct WriteChunk {
+  char path[SD_WRITER_PATH_LEN];
+  bool truncate;              // first chunk of FILE_ENTIRE, recreates the file
+  bool positioned;            // written at `at`, otherwise appended
+  bool repair;                // replaces data the file verification found different
+  uint32_t at;
+  uint16_t len;
+  unsigned long queuedAt;
+  uint8_t data[SD_WRITER_CHUNK_LEN];
+} WriteChunk;
+
+typedef struct VerifyJob {
+  char path[SD_WRITER_PATH_LEN];
+  file_verify_message msg;
+} VerifyJob;
+
+SdWriterStats sdWriterStats;
+
+WriteChunk writeChunks[SD_WRITER_POOL];
+QueueHandle_t freeChunks = NULL;    // WriteChunk* not in use
+QueueHandle_t pendingChunks = NULL; // WriteChunk* in arrival order, NULL for a VerifyJob
+QueueHandle_t verifyJobs = NULL;    // VerifyJob, one NULL in pendingChunks each
+SemaphoreHandle_t xMutex_WriterStats = NULL;
+
+uint8_t coalesceBuffer[SD_WRITER_BUFFER];
+
+// **************************************
+// * Enqueue
+// **************************************
+// Called from the receive task. Returns false if no buffer is free, the
+// chunk is then not ACKed and the sender retries it.
+bool enqueueChunk(const char* path, const uint8_t* data, size_t len, bool truncate, bool positioned, uint32_t at,
+                  bool repair) {
+
+  if (pendingChunks == NULL || len > SD_WRITER_CHUNK_LEN || strlen(path) >= SD_WRITER_PATH_LEN) {
+    return false;
+  }
+
+  WriteChunk* chunk;
+  if (xQueueReceive(freeChunks, &chunk, 0) != pdTRUE) {
+    xSemaphoreTake(xMutex_WriterStats, portMAX_DELAY);
+    sdWriterStats.chunksDropped++;
+    xSemaphoreGive(xMutex_WriterStats);
+    return false;
+  }
+
+  strncpy(chunk->path, path, SD_WRITER_PATH_LEN);
+  chunk->truncate = truncate;
+  chunk->positioned = positioned;
+  chunk->repair = repair;
+  chunk->at = at;
+  chunk->len = len;
+  chunk->queuedAt = millis();
+  memcpy(chunk->data, data, len);
+  xQueueSend(pendingChunks, &chunk, portMAX_DELAY); // never blocks, the queue holds the whole pool
+
+  xSemaphoreTake(xMutex_WriterStats, portMAX_DELAY);
+  sdWriterStats.chunksQueued++;
+  sdWriterStats.queueDepth = uxQueueMessagesWaiting(pendingChunks);
+  if (sdWriterStats.queueDepth > sdWriterStats.maxQueueDepth) {
+    sdWriterStats.maxQueueDepth = sdWriterStats.queueDepth;
+  }
+  xSemaphoreGive(xMutex_WriterStats);
+  return true;
+}
+
+// Appended, or written from the start when truncate is set
+bool sdWriterEnqueue(const char* path, const uint8_t* data, size_t len, bool truncate) {
+  return enqueueChunk(path, data, len, truncate, false, 0, false);
+}
+
+// Written in place at file offset at
+bool sdWriterEnqueueAt(const char* path, uint32_t at, const uint8_t* data, size_t len, bool repair) {
+  return enqueueChunk(path, data, len, false, true, at, repair);
+}
+
+// Answered by the writer task after the chunks queued before it are
+// written, so the hashes include them. Dropped when the queue is full, the
+// node then times out and compares again in a later slot.
+bool sdWriterEnqueueVerify(const char* path, const file_verify_message& msg) {
+  if (verifyJobs == NULL || strlen(path) >= SD_WRITER_PATH_LEN) {
+    return false;
+  }
+  VerifyJob job;
+  strncpy(job.path, path, SD_WRITER_PATH_LEN);
+  job.msg = msg;
+  if (xQueueSend(verifyJobs, &job, 0) != pdTRUE) {
+    return false;
+  }
+  WriteChunk* marker = NULL;
+  xQueueSend(pendingChunks, &marker, portMAX_DELAY); // never blocks, room for the pool and every job
+  return true;
+}
+
+// Opens path to write at offset at, the file is created when missing
+File openAt(const char* path, uint32_t at, uint32_t* size) {
+  File file = SD.exists(path) ? SD.open(path, "r+") : SD.open(path, FILE_WRITE);
+  *size = file ? file.size() : 0;
+  if (file && !file.seek(at)) {
+    file.close();
+    return File();
+  }
+  return file;
+}
+
+// **************************************
+// * Write Batch
+// **************************************
+// Writes all chunks of the batch that belong to one file, in arrival order,
+// with a single open and as few writes as the coalescing buffer allows.
+// Positioned chunks that do not follow the previous one reopen the file.
+void writeFileChunks(WriteChunk** batch, size_t count, size_t first, bool* done) {
+
+  const char* path = batch[first]->path;
+  unsigned long start = micros();
+  size_t written = 0;
+  size_t failed = 0;
+  uint32_t writes = 0;
+  uint32_t overwrites = 0;
+  size_t overwritten = 0;         // bytes that replaced earlier data
+  uint32_t gaps = 0;
+  File file;
+  bool openPositioned = false;
+  uint32_t position = 0;          // file offset of the first buffered byte
+  uint32_t sizeAtOpen = 0;
+  uint32_t rewrittenFrom = UINT32_MAX; // lowest offset written below the end
+  uint32_t repairedFrom = UINT32_MAX;
+  size_t buffered = 0;
+
+  for (size_t i = first; i < count; i++) {
+    WriteChunk* chunk = batch[i];
+    if (done[i] || strcmp(chunk->path, path) != 0) {
+      continue;
+    }
+
+    // A truncating chunk restarts the file, earlier chunks of this batch are already flushed
+    bool follows = chunk->positioned ? openPositioned && chunk->at == position + buffered : !openPositioned;
+    if (!file || chunk->truncate || !follows) {
+      if (file) {
+        if (buffered > 0) {
+          written += file.write(coalesceBuffer, buffered);
+          writes++;
+          buffered = 0;
+        }
+        file.close();
+      }
+      if (chunk->positioned) {
+        file = openAt(path, chunk->at, &sizeAtOpen);
+        if (file && chunk->at > sizeAtOpen) {
+          gaps++;
+        }
+        position = chunk->at;
+      } else {
+        file = SD.open(path, chunk->truncate ? FILE_WRITE : FILE_APPEND);
+        if (chunk->truncate) {
+          rewrittenFrom = 0;
+        }
+      }
+      openPositioned = chunk->positioned;
+    }
+
+    if (!file) {
+      failed++;
+    } else {
+      if (buffered + chunk->len > SD_WRITER_BUFFER) {
+        written += file.write(coalesceBuffer, buffered);
+        writes++;
+        position += buffered;
+        buffered = 0;
+      }
+      memcpy(coalesceBuffer + buffered, chunk->data, chunk->len);
+      buffered += chunk->len;
+      if (chunk->positioned && chunk->at < sizeAtOpen) {
+        overwrites++;
+        overwritten += min((uint32_t) chunk->len, sizeAtOpen - chunk->at);
+        rewrittenFrom = min(rewrittenFrom, chunk->at);
+      }
+      if (chunk->repair) {
+        repairedFrom = min(repairedFrom, chunk->at);
+      }
+    }
+    done[i] = true;
+  }
+
+  if (file) {
+    if (buffered > 0) {
+      written += file.write(coalesceBuffer, buffered);
+      writes++;
+    }
+    file.close();
+  }
+  if (failed > 0) {
+    Serial.printf("SD writer: failed to open %s\n", path);
+  }
+  if (rewrittenFrom != UINT32_MAX) {
+    integrityForget(path, rewrittenFrom); // block hashes of the data replaced
+  }
+  if (repairedFrom != UINT32_MAX) {
+    mqttUplinkRewind(path, repairedFrom); // lines published from the data replaced
+  }
+  if (written > 0) {
+    mqttUplinkNotify(path, written > overwritten ? written - overwritten : 0); // new lines for the broker
+  }
+
+  uint32_t elapsed = micros() - start;
+  unsigned long now = millis();
+
+  xSemaphoreTake(xMutex_WriterStats, portMAX_DELAY);
+  sdWriterStats.bytesWritten += written;
+  sdWriterStats.writes += writes;
+  sdWriterStats.writeFailures += failed;
+  sdWriterStats.overwrites += overwrites;
+  sdWriterStats.gaps += gaps;
+  sdWriterStats.fileFlushes++;
+  sdWriterStats.lastWriteUs = elapsed;
+  if (elapsed > sdWriterStats.maxWriteUs) sdWriterStats.maxWriteUs = elapsed;
+  sdWriterStats.totalWriteUs += elapsed;
+  for (size_t i = first; i < count; i++) {
+    if (strcmp(batch[i]->path, path) != 0) continue;
+    uint32_t latency = now - batch[i]->queuedAt;
+    sdWriterStats.lastLatencyMs = latency;
+    if (latency > sdWriterStats.maxLatencyMs) sdWriterStats.maxLatencyMs = latency;
+    sdWriterStats.totalLatencyMs += latency;
+  }
+  xSemaphoreGive(xMutex_WriterStats);
+}
+
+// **************************************
+// * Writer Task
+// **************************************
+// Waits for the first chunk, then takes everything else already queued and
+// writes it grouped per file. File verifications queued among the chunks
+// are answered after the batch, peer log records the receive task asked
+// for are appended in between.
+void taskSdWriter(void *parameter) {
+
+  WriteChunk* batch[SD_WRITER_POOL];
+  bool done[SD_WRITER_POOL];
+
+  while (true) {
+    persistPendingPeers();
+
+    size_t count = 0;
+    size_t verifies = 0;
+    WriteChunk* chunk;
+    if (xQueueReceive(pendingChunks, &chunk, SD_WRITER_IDLE_MS / portTICK_PERIOD_MS) != pdTRUE) {
+      continue;
+    }
+    do {
+      if (chunk == NULL) {
+        verifies++;
+      } else {
+        batch[count++] = chunk;
+      }
+    } while (count < SD_WRITER_POOL && xQueueReceive(pendingChunks, &chunk, 0) == pdTRUE);
+
+    memset(done, 0, sizeof(done));
+    for (size_t i = 0; i < count; i++) {
+      if (!done[i]) {
+        writeFileChunks(batch, count, i, done);
+      }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      xQueueSend(freeChunks, &batch[i], portMAX_DELAY);
+    }
+
+    VerifyJob job;
+    while (verifies > 0 && xQueueReceive(verifyJobs, &job, 0) == pdTRUE) {
+      answer_file_verify(job.path, job.msg);
+      verifies--;
+    }
+
+    xSemaphoreTake(xMutex_WriterStats, portMAX_DELAY);
+    sdWriterStats.batches++;
+    sdWriterStats.queueDepth = uxQueueMessagesWaiting(pendingChunks);
+    xSemaphoreGive(xMutex_WriterStats);
+  }
+}
+
+/******************************************************************
+ *                                                                *
+ *                        Initialization                          *
+ *                                                                *
+ ******************************************************************/
+
+void sd_writer_init() {
+
+  memset(&sdWriterStats, 0, sizeof(sdWriterStats));
+  xMutex_WriterStats = xSemaphoreCreateMutex();
+  file_integrity_init();
+  freeChunks = xQueueCreate(SD_WRITER_POOL, sizeof(WriteChunk*));
+  pendingChunks = xQueueCreate(SD_WRITER_POOL + SD_WRITER_VERIFIES, sizeof(WriteChunk*));
+  verifyJobs = xQueueCreate(SD_WRITER_VERIFIES, sizeof(VerifyJob));
+
+  for (size_t i = 0; i < SD_WRITER_POOL; i++) {
+    WriteChunk* chunk = &writeChunks[i];
+    xQueueSend(freeChunks, &chunk, 0);
+  }
+
+  // Below the receive task, so incoming packets are always served first
+  xTaskCreate(
+    taskSdWriter,
+    "SD Writer",
+    6144,               // file verification hashes on this task too
+    NULL,
+    2,
+    NULL
+  );
+}
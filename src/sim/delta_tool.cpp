@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "sim.h"
+#include "lora_airtime.h"
+#include "firmware_delta.h"
+
+/* Makes the patch the gateway sends to nodes running the base image, checks
+   it by applying it the way a node does, and prints what it saves: chunks
+   and airtime of the patch against the full image. */
+
+#define DELTA_TOOL_SF 7
+
+typedef struct ToolImages {
+  const std::vector<uint8_t>* base;
+  std::vector<uint8_t> out;
+} ToolImages;
+
+static bool readFile(const char* path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data->insert(data->end(), buffer, buffer + n);
+  }
+  fclose(file);
+  return true;
+}
+
+static bool readBase(void* ctx, uint32_t offset, uint8_t* data, size_t len) {
+  const std::vector<uint8_t>& base = *((ToolImages*) ctx)->base;
+  if (offset + len > base.size()) {
+    return false;
+  }
+  memcpy(data, base.data() + offset, len);
+  return true;
+}
+
+static bool writeOut(void* ctx, const uint8_t* data, size_t len) {
+  std::vector<uint8_t>& out = ((ToolImages*) ctx)->out;
+  out.insert(out.end(), data, data + len);
+  return true;
+}
+
+static double campaignAirtimeS(size_t bytes) {
+  size_t chunks = (bytes + SIM_FW_CHUNK_DATA - 1) / SIM_FW_CHUNK_DATA;
+  return chunks * (double) loraAirtimeUs(SIM_FW_CHUNK_BYTES, DELTA_TOOL_SF) / 1e6;
+}
+
+// program delta <base image> <new image> [patch file]
+int runDeltaTool(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage: program delta <base image> <new image> [patch file]\n");
+    return 1;
+  }
+  std::vector<uint8_t> base, target;
+  if (!readFile(argv[0], &base) || !readFile(argv[1], &target)) {
+    printf("cannot read %s or %s\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  std::vector<uint8_t> patch(target.size() + target.size() / 8 + 64);
+  size_t len = deltaEncode(base.data(), base.size(), target.data(), target.size(), patch.data(), patch.size());
+  if (len == 0) {
+    printf("patch does not fit, send the full image\n");
+    return 1;
+  }
+  patch.resize(len);
+
+  // applied in chunk-sized pieces, as a node reads it from its SD card
+  ToolImages images;
+  images.base = &base;
+  DeltaPatcher patcher;
+  deltaPatchBegin(&patcher, readBase, writeOut, &images);
+  bool ok = true;
+  for (size_t pos = 0; ok && pos < patch.size(); pos += SIM_FW_CHUNK_DATA) {
+    size_t n = patch.size() - pos < SIM_FW_CHUNK_DATA ? patch.size() - pos : SIM_FW_CHUNK_DATA;
+    ok = deltaPatchFeed(&patcher, patch.data() + pos, n);
+  }
+  if (!ok || !deltaPatchEnd(&patcher) || images.out != target) {
+    printf("patch does not rebuild the new image\n");
+    return 1;
+  }
+
+  if (argc >= 3) {
+    FILE* file = fopen(argv[2], "wb");
+    if (file == NULL || fwrite(patch.data(), 1, patch.size(), file) != patch.size()) {
+      printf("cannot write %s\n", argv[2]);
+      return 1;
+    }
+    fclose(file);
+  }
+
+  printf("%-8s %9s %7s %10s\n", "send", "bytes", "chunks", "airtime s");
+  printf("%-8s %9zu %7zu %10.1f\n", "image", target.size(), (target.size() + SIM_FW_CHUNK_DATA - 1) / SIM_FW_CHUNK_DATA,
+         campaignAirtimeS(target.size()));
+  printf("%-8s %9zu %7zu %10.1f\n", "patch", patch.size(), (patch.size() + SIM_FW_CHUNK_DATA - 1) / SIM_FW_CHUNK_DATA,
+         campaignAirtimeS(patch.size()));
+  printf("base crc %08x, new image crc %08x, patch %.1f %% of the image\n", patcher.header.baseCrc,
+         patcher.header.targetCrc, 100.0 * patch.size() / target.size());
+  return 0;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "lora_airtime.h"
+#include "lora_fec.h"
+#include "lora_session.h"
+
+/* Goodput of one file upload against the frame loss rate, chunk by chunk
+   with an ACK each versus FEC groups with a fixed or adapted parity count.
+   Every frame, in either direction, is lost independently with the same
+   probability. A transfer that times out resumes right away from the last
+   acknowledged offset in a new session, where the firmware would wait for
+   its next slot. */
+
+#define BENCH_SF 7
+
+typedef struct BenchLink {
+  SimRandom random;
+  double loss;
+  uint64_t timeUs;
+  uint64_t airtimeUs;
+  uint32_t frames;
+} BenchLink;
+
+static bool transmit(BenchLink* link, size_t bytes) {
+  uint32_t airtime = loraAirtimeUs(bytes, BENCH_SF);
+  link->timeUs += airtime;
+  link->airtimeUs += airtime;
+  link->frames++;
+  return !simChance(&link->random, link->loss);
+}
+
+// Data chunk and its ACK, true if the node saw the ACK
+static bool sendChunk(BenchLink* link) {
+  if (!transmit(link, SIM_FILE_BODY_BYTES)) {
+    link->timeUs += ACK_TIMEOUT * 1000ULL;
+    return false;
+  }
+  link->timeUs += SIM_TURNAROUND_US;
+  if (!transmit(link, SIM_FILE_ACK_BYTES)) {
+    link->timeUs += ACK_TIMEOUT * 1000ULL;
+    return false;
+  }
+  return true;
+}
+
+// One group as sendGroup() and handle_file_parity() run it, returns the
+// chunks the node saw acknowledged
+static int sendGroup(BenchLink* link, int chunks, int parity) {
+  bool present[FEC_GROUP_SIZE];
+  int received = 0;
+  for (int i = 0; i < chunks; i++) {
+    present[i] = transmit(link, SIM_FILE_BODY_BYTES);
+    received += present[i];
+  }
+  bool lastParity = false;
+  for (int j = 0; j < parity; j++) {
+    lastParity = transmit(link, SIM_FILE_PARITY_BYTES);
+    received += lastParity;
+  }
+
+  // group ACK, the last parity chunk is resent as a probe when it is lost
+  bool acked = false;
+  for (int probe = 0; probe <= FEC_PROBES && !acked; probe++) {
+    if (probe > 0) {
+      lastParity = transmit(link, SIM_FILE_PARITY_BYTES);
+      if (lastParity && received < chunks + parity) {
+        received++;
+      }
+    }
+    if (lastParity) {
+      link->timeUs += SIM_TURNAROUND_US;
+      acked = transmit(link, SIM_FILE_ACK_BYTES);
+    }
+    if (!acked) {
+      link->timeUs += ACK_TIMEOUT * 1000ULL;
+    }
+  }
+  if (!acked) {
+    return 0;
+  }
+
+  // resend one by one from the first chunk the gateway could not rebuild
+  int next = 0;
+  while (true) {
+    if (received >= chunks) {
+      return chunks;
+    }
+    while (next < chunks && present[next]) {
+      next++;
+    }
+    if (!transmit(link, SIM_FILE_BODY_BYTES)) {
+      link->timeUs += ACK_TIMEOUT * 1000ULL;
+      return next;
+    }
+    present[next] = true;
+    received++;
+    link->timeUs += SIM_TURNAROUND_US;
+    if (!transmit(link, SIM_FILE_ACK_BYTES)) {
+      link->timeUs += ACK_TIMEOUT * 1000ULL;
+      return next;
+    }
+  }
+}
+
+// Time to deliver a file of the given size, parity 0 sends chunk by chunk
+static void transfer(BenchLink* link, uint32_t fileBytes, int parity) {
+  int remaining = (fileBytes + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  while (remaining > 0) {
+    if (parity == 0) {
+      remaining -= sendChunk(link) ? 1 : 0;
+      continue;
+    }
+    int chunks = remaining < FEC_GROUP_SIZE ? remaining : FEC_GROUP_SIZE;
+    remaining -= sendGroup(link, chunks, parity);
+  }
+}
+
+// Goodput in bytes/s averaged over the runs, and airtime per delivered kB
+static double measure(uint32_t fileBytes, int runs, double loss, int parity, double* airtimeMsPerKb) {
+  uint64_t timeUs = 0;
+  uint64_t airtimeUs = 0;
+  for (int run = 0; run < runs; run++) {
+    BenchLink link = {};
+    link.random.state = 2463534242u + run * 7919u;
+    link.loss = loss;
+    transfer(&link, fileBytes, parity);
+    timeUs += link.timeUs;
+    airtimeUs += link.airtimeUs;
+  }
+  double delivered = (double) fileBytes * runs;
+  *airtimeMsPerKb = airtimeUs / 1000.0 / (delivered / 1000.0);
+  return delivered / (timeUs / 1e6);
+}
+
+int runFecBenchmark(int argc, char** argv) {
+  uint32_t fileBytes = argc >= 1 ? atoi(argv[0]) : 16000;
+  int runs = argc >= 2 ? atoi(argv[1]) : 200;
+  const double losses[] = {0, 0.01, 0.02, 0.05, 0.1, 0.15, 0.2, 0.3};
+
+  printf("FEC goodput, %u byte file, SF%d/125 kHz, %d runs, group of %d chunks\n",
+         fileBytes, BENCH_SF, runs, FEC_GROUP_SIZE);
+  printf("goodput in B/s (airtime in ms per kB)\n");
+  printf("loss    ARQ            ");
+  for (int m = 1; m <= FEC_MAX_PARITY; m++) {
+    printf("m=%d            ", m);
+  }
+  printf("adaptive\n");
+
+  for (double loss : losses) {
+    double airtime;
+    printf("%4.0f %%  ", loss * 100);
+    double goodput = measure(fileBytes, runs, loss, 0, &airtime);
+    printf("%5.0f (%5.0f)  ", goodput, airtime);
+    for (int m = 1; m <= FEC_MAX_PARITY; m++) {
+      goodput = measure(fileBytes, runs, loss, m, &airtime);
+      printf("%5.0f (%5.0f)  ", goodput, airtime);
+    }
+    int adapted = fecParityForLoss(FEC_GROUP_SIZE, (uint16_t) (loss * 1000));
+    goodput = measure(fileBytes, runs, loss, adapted, &airtime);
+    printf("%5.0f (%5.0f) m=%d\n", goodput, airtime, adapted);
+  }
+  return 0;
+}
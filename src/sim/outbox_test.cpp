@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "sim.h"
+#include "mqtt_outbox.h"
+
+/* The MQTT uplink's publish window (mqtt_outbox.cpp) against a stub broker,
+   driven the way publishFile() and taskMqttUplink() drive it for one node
+   file. The broker takes QoS 1 publishes over a link of a given rate and
+   round trip and answers each with a PUBACK. An outage or a reboot drops the
+   connection with everything in flight. Every scenario checks that each
+   payload matches the file at the offset in its header, that the .mqtt
+   offset never passed a byte the broker did not have, and that the whole
+   file reached the broker by the end. Columns: drain time and rate of the
+   backlog, bytes the broker got twice, batches, windows published again,
+   connects. */
+
+#define OUTBOX_LINE_BYTES 40
+#define OUTBOX_RETRY_MS 2000        // MQTT_RETRY_MS
+#define OUTBOX_RETRY_MAX_MS 60000   // MQTT_RETRY_MAX_MS
+#define OUTBOX_BOOT_MS 3000         // reboot until the uplink task connects again
+
+typedef struct OutboxScenario {
+  const char* name;
+  const char* description;
+  uint32_t backlogBytes;    // in the file at the start
+  uint32_t logBps;          // appended while running, for the first half
+  uint32_t rttMs;
+  uint32_t linkBps;         // bytes per s to the broker
+  double ackLoss;           // PUBACKs lost on a live connection
+  bool reorder;             // PUBACKs may overtake each other
+  uint32_t outageAtS;       // broker down from here, 0 = never
+  uint32_t outageS;
+  uint32_t rebootAtS;       // gateway reboot, 0 = never
+  uint32_t runS;
+} OutboxScenario;
+
+static const OutboxScenario scenarios[] = {
+  // name        description                                          backlog  B/s  rtt  link     ackLoss reorder outage  s    reboot  s
+  {"drain-lan",  "200 kB backlog, local broker",                      200000,  0,   2,   1000000, 0,      false,  0,      0,   0,      60},
+  {"drain-wan",  "200 kB backlog, broker 150 ms away",                200000,  0,   150, 100000,  0,      false,  0,      0,   0,      60},
+  {"outage",     "drain-wan with 400 B/s logged, broker down 30 s",   200000,  400, 150, 100000,  0,      false,  2,      30,  0,      180},
+  {"reboot",     "drain-wan, gateway reboots while draining",         200000,  400, 150, 100000,  0,      false,  0,      0,   1,      120},
+  {"ack-loss",   "drain-wan losing 2 % of the PUBACKs",               200000,  400, 150, 100000,  0.02,   false,  0,      0,   0,      300},
+  {"reorder",    "drain-wan with PUBACKs out of order",               200000,  400, 150, 100000,  0,      true,   0,      0,   0,      120},
+};
+
+static const size_t scenarioCount = sizeof(scenarios) / sizeof(scenarios[0]);
+
+typedef struct BrokerEvent {
+  uint32_t atMs;
+  bool ack;                 // PUBACK to the client, else the publish reaching the broker
+  int msgId;
+  uint32_t offset;
+  uint32_t len;
+} BrokerEvent;
+
+typedef struct StubBroker {
+  bool up;
+  uint32_t epoch;           // connection the client is on, a new one drops the old one's traffic
+  int nextMsgId;
+  uint32_t linkFreeMs;
+  std::vector<BrokerEvent> events;
+  std::deque<int> pubacks;  // what the event handler queues
+  std::vector<uint8_t> received;  // times each file byte arrived
+  uint64_t duplicateBytes;
+  bool mismatch;
+} StubBroker;
+
+typedef struct OutboxResult {
+  double drainS;
+  double drainBps;
+  uint64_t duplicateBytes;
+  uint32_t batches;
+  uint32_t failures;
+  uint32_t connects;
+  bool ok;
+  const char* error;
+} OutboxResult;
+
+static void brokerDisconnect(StubBroker* broker) {
+  broker->epoch++;
+  broker->events.clear();
+  broker->pubacks.clear();
+}
+
+// esp_mqtt_client_publish(..., qos 1): the msg_id, -1 without a connection
+static int brokerPublish(StubBroker* broker, const OutboxScenario& scenario, const std::vector<uint8_t>& file,
+                         const uint8_t* payload, size_t len, uint32_t nowMs) {
+  if (!broker->up) {
+    return -1;
+  }
+  char* body;
+  uint32_t offset = strtoul((const char*) payload, &body, 10);
+  body++; // '\n'
+  uint32_t bodyLen = len - (body - (const char*) payload);
+  if (offset + bodyLen > file.size() || memcmp(&file[offset], body, bodyLen) != 0) {
+    broker->mismatch = true;
+  }
+
+  broker->linkFreeMs = std::max(broker->linkFreeMs, nowMs) + (uint32_t) ((uint64_t) len * 1000 / scenario.linkBps);
+  broker->nextMsgId = broker->nextMsgId % 65535 + 1;
+  broker->events.push_back({broker->linkFreeMs + scenario.rttMs / 2, false, broker->nextMsgId, offset, bodyLen});
+  return broker->nextMsgId;
+}
+
+static void brokerStep(StubBroker* broker, const OutboxScenario& scenario, SimRandom* random, uint32_t nowMs) {
+  std::vector<BrokerEvent> due;
+  for (size_t i = 0; i < broker->events.size();) {
+    if (broker->events[i].atMs <= nowMs) {
+      due.push_back(broker->events[i]);
+      broker->events.erase(broker->events.begin() + i);
+    } else {
+      i++;
+    }
+  }
+  std::sort(due.begin(), due.end(), [](const BrokerEvent& a, const BrokerEvent& b) { return a.atMs < b.atMs; });
+
+  for (const BrokerEvent& event : due) {
+    if (event.ack) {
+      broker->pubacks.push_back(event.msgId);
+      continue;
+    }
+    for (uint32_t i = event.offset; i < event.offset + event.len; i++) {
+      broker->duplicateBytes += broker->received[i] > 0;
+      broker->received[i]++;
+    }
+    if (!simChance(random, scenario.ackLoss)) {
+      uint32_t jitter = scenario.reorder ? simNext(random) % (scenario.rttMs + 1) : 0;
+      broker->events.push_back({event.atMs + scenario.rttMs / 2 + jitter, true, event.msgId, 0, 0});
+    }
+  }
+}
+
+// Bytes from the start of the file the broker has
+static uint32_t brokerPrefix(const StubBroker* broker, uint32_t from) {
+  while (from < broker->received.size() && broker->received[from] > 0) {
+    from++;
+  }
+  return from;
+}
+
+static void appendLines(std::vector<uint8_t>* file, uint32_t bytes) {
+  while (bytes >= OUTBOX_LINE_BYTES) {
+    char line[OUTBOX_LINE_BYTES + 1];
+    snprintf(line, sizeof(line), "%010u,%028u\n", (unsigned) (file->size() / OUTBOX_LINE_BYTES),
+             (unsigned) file->size());
+    file->insert(file->end(), line, line + OUTBOX_LINE_BYTES);
+    bytes -= OUTBOX_LINE_BYTES;
+  }
+}
+
+static void runScenario(const OutboxScenario& scenario, uint32_t seed, OutboxResult* result) {
+  memset(result, 0, sizeof(OutboxResult));
+  result->ok = true;
+  SimRandom random = {seed};
+
+  std::vector<uint8_t> file;
+  appendLines(&file, scenario.backlogBytes);
+  uint32_t backlog = file.size();
+  uint64_t logged = 0;
+
+  StubBroker broker = {};
+  broker.up = true;
+  broker.received.reserve(file.size() + (uint64_t) scenario.logBps * scenario.runS);
+
+  MqttOutbox outbox;
+  uint32_t persisted = 0;       // the .mqtt file, survives a reboot
+  bool connected = false;
+  uint32_t connectEpoch = 0;
+  uint32_t nextConnect = 0;
+  uint32_t retryMs = OUTBOX_RETRY_MS;
+  uint32_t drainedMs = 0;
+  uint8_t payload[MQTT_HEADER_BYTES + MQTT_BATCH_BYTES];
+
+  uint32_t endMs = scenario.runS * 1000;
+  for (uint32_t now = 0; now < endMs; now++) {
+
+    if (now < endMs / 2 && (uint64_t) now * scenario.logBps / 1000 >= logged + OUTBOX_LINE_BYTES) {
+      appendLines(&file, OUTBOX_LINE_BYTES);
+      logged += OUTBOX_LINE_BYTES;
+    }
+    broker.received.resize(file.size(), 0);
+
+    if (scenario.outageAtS > 0 && now == scenario.outageAtS * 1000) {
+      broker.up = false;
+      brokerDisconnect(&broker);
+    }
+    if (scenario.outageAtS > 0 && now == (scenario.outageAtS + scenario.outageS) * 1000) {
+      broker.up = true;
+    }
+    if (scenario.rebootAtS > 0 && now == scenario.rebootAtS * 1000) {
+      brokerDisconnect(&broker);
+      connected = false;
+      nextConnect = now + OUTBOX_BOOT_MS;
+    }
+    brokerStep(&broker, scenario, &random, now);
+
+    // taskMqttUplink: connect with backoff, a new connection publishes from the .mqtt offset
+    if (connected && connectEpoch != broker.epoch) {
+      connected = false;
+      result->failures += outbox.count > 0;
+      nextConnect = now + retryMs;
+      retryMs = std::min(retryMs * 2, (uint32_t) OUTBOX_RETRY_MAX_MS);
+    }
+    if (!connected) {
+      if ((int32_t) (now - nextConnect) < 0) {
+        continue;
+      }
+      if (!broker.up) {
+        nextConnect = now + retryMs;
+        retryMs = std::min(retryMs * 2, (uint32_t) OUTBOX_RETRY_MAX_MS);
+        continue;
+      }
+      connected = true;
+      connectEpoch = broker.epoch;
+      retryMs = OUTBOX_RETRY_MS;
+      result->connects++;
+      outboxReset(&outbox, persisted);
+      nextConnect = now + scenario.rttMs; // CONNACK
+      continue;
+    }
+    if ((int32_t) (now - nextConnect) < 0) {
+      continue;
+    }
+
+    // publishFile: fill the window, then take PUBACKs
+    while (outboxCanSend(&outbox) && outbox.next < file.size()) {
+      uint8_t* batch = payload + MQTT_HEADER_BYTES;
+      size_t n = std::min((size_t) (file.size() - outbox.next), (size_t) MQTT_BATCH_BYTES);
+      memcpy(batch, &file[outbox.next], n);
+      size_t end = outboxBatchEnd(batch, n, MQTT_BATCH_BYTES);
+      if (end == 0) {
+        break;
+      }
+      size_t headerLen = outboxHeader(payload, outbox.next);
+      int msgId = brokerPublish(&broker, scenario, file, batch - headerLen, headerLen + end, now);
+      if (msgId < 0) {
+        break;
+      }
+      outboxSent(&outbox, msgId, end, outboxCountLines(batch, end), now);
+    }
+    while (!broker.pubacks.empty()) {
+      int msgId = broker.pubacks.front();
+      broker.pubacks.pop_front();
+      uint32_t lines, bytes, rttMs;
+      int batches = outboxAcked(&outbox, msgId, &lines, &bytes, &rttMs, now);
+      if (batches <= 0) {
+        continue;
+      }
+      result->batches += batches;
+      persisted = outbox.committed;
+      if (persisted > brokerPrefix(&broker, 0)) {
+        result->ok = false;
+        result->error = "offset passed unacknowledged data";
+      }
+      if (drainedMs == 0 && persisted >= backlog) {
+        drainedMs = now;
+      }
+    }
+    if (outboxTimedOut(&outbox, now)) {
+      result->failures++;
+      outboxDrop(&outbox);
+      brokerDisconnect(&broker); // the uplink task sets up a new connection
+    }
+  }
+
+  if (broker.mismatch) {
+    result->ok = false;
+    result->error = "payload differs from the file at its offset";
+  } else if (brokerPrefix(&broker, 0) < file.size()) {
+    result->ok = false;
+    result->error = "data lost";
+  } else if (persisted != file.size()) {
+    result->ok = false;
+    result->error = "offset short of the end of the file";
+  }
+  result->drainS = drainedMs / 1000.0;
+  result->drainBps = drainedMs > 0 ? backlog * 1000.0 / drainedMs : 0;
+  result->duplicateBytes = broker.duplicateBytes;
+}
+
+// program outbox [name] [seed]
+int runOutboxTest(int argc, char** argv) {
+  const char* name = argc >= 1 ? argv[0] : "all";
+  uint32_t seed = argc >= 2 ? atoi(argv[1]) : 1;
+  bool found = false;
+  bool passed = true;
+
+  printf("%-10s %-5s %7s %9s %7s %7s %5s %5s\n", "scenario", "check", "drain s", "B/s", "dup B", "batches", "fail", "conn");
+  for (size_t i = 0; i < scenarioCount; i++) {
+    if (strcmp(name, "all") != 0 && strcmp(name, scenarios[i].name) != 0) {
+      continue;
+    }
+    found = true;
+    OutboxResult r;
+    runScenario(scenarios[i], seed, &r);
+    printf("%-10s %-5s %7.2f %9.0f %7llu %7u %5u %5u\n", scenarios[i].name, r.ok ? "ok" : "FAIL", r.drainS,
+           r.drainBps, (unsigned long long) r.duplicateBytes, r.batches, r.failures, r.connects);
+    if (!r.ok) {
+      printf("  %s\n", r.error);
+      passed = false;
+    }
+  }
+  if (!found) {
+    printf("unknown scenario %s, one of:\n", name);
+    for (size_t i = 0; i < scenarioCount; i++) {
+      printf("  %-10s %s\n", scenarios[i].name, scenarios[i].description);
+    }
+    return 1;
+  }
+  return passed ? 0 : 1;
+}
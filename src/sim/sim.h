@@ -0,0 +1,53 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+/* Host-side LoRa link simulator, built by the native environment */
+
+// Frame sizes of the firmware messages (sizeof of the structs in lora_init.h)
+#define SIM_FILE_BODY_BYTES 244
+#define SIM_FILE_PARITY_BYTES 220
+#define SIM_FILE_ACK_BYTES 16
+#define SIM_POLL_COMPLETE_BYTES 40
+#define SIM_BEACON_HEADER_BYTES 24 // offsetof(poll_beacon_message, slots)
+#define SIM_BEACON_SLOT_BYTES 12   // sizeof(beacon_slot)
+#define SIM_POLL_BYTES 7           // unicast POLL_DATA (type, MAC), the per-node frame the beacon replaces
+#define SIM_FW_CHUNK_BYTES 206     // sizeof(fw_chunk_message)
+#define SIM_FW_CHUNK_DATA 200      // FW_CHUNK_SIZE
+
+// Protocol constants of lora_init.h and lora_gateway.cpp, those of a session come from lora_session.h
+#define SIM_BEACON_SLOTS 18        // MAX_BEACON_SLOTS
+#define SIM_BEACON_PAGE_GAP_MS 500 // BEACON_PAGE_GAP_MS
+#define SIM_BEACON_GUARD_MS 500    // BEACON_GUARD_MS
+#define SIM_HEARTBEAT_MS 180000    // HEARTBEAT_INTERVAL
+#define SIM_POLL_INTERVAL_MS 60000 // pollInterval
+#define SIM_BUSY_POLL_MS 5000      // busyPollInterval
+#define SIM_CONTROL_TICK_MS 100    // gateway control loop period
+
+#define SIM_TURNAROUND_US 10000  // receive, handle and switch to TX on the other side
+
+// xorshift32, seeded per run so results are reproducible
+typedef struct SimRandom {
+  uint32_t state;
+} SimRandom;
+
+inline uint32_t simNext(SimRandom* random) {
+  uint32_t x = random->state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  random->state = x;
+  return x;
+}
+
+inline bool simChance(SimRandom* random, double probability) {
+  return simNext(random) < probability * 4294967296.0;
+}
+
+int runFecBenchmark(int argc, char** argv);
+int runScenarios(int argc, char** argv);
+int runDeltaTool(int argc, char** argv);
+int runOutboxTest(int argc, char** argv);
+
+#endif
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+
+// program scenarios [name] [seed]
+// program fec [file bytes] [runs]
+// program delta <base image> <new image> [patch file]
+// program outbox [name] [seed]
+int main(int argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "scenarios") == 0) {
+    return runScenarios(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "fec") == 0) {
+    return runFecBenchmark(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "delta") == 0) {
+    return runDeltaTool(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "outbox") == 0) {
+    return runOutboxTest(argc - 2, argv + 2);
+  }
+  printf("usage: %s scenarios [name] [seed]\n", argv[0]);
+  printf("       %s fec [file bytes] [runs]\n", argv[0]);
+  printf("       %s delta <base image> <new image> [patch file]\n", argv[0]);
+  printf("       %s outbox [name] [seed]\n", argv[0]);
+  return 1;
+}
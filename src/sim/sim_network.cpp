@@ -0,0 +1,839 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <queue>
+#include <vector>
+#include "sim_network.h"
+#include "lora_scheduler.h"
+#include "lora_fec.h"
+#include "lora_channels.h"
+#include "lora_airtime.h"
+#include "lora_session.h"
+
+#define MS 1000ULL
+#define SECONDS 1000000ULL
+
+/******************************************************************
+ *                            Engine                              *
+ ******************************************************************/
+
+enum SimEventKind {EV_TX_END, EV_TIMER};
+enum SimTimer {TIMER_ACK, TIMER_SLOT, TIMER_SAMPLE, TIMER_HEARTBEAT, TIMER_RETRY,
+               TIMER_CYCLE, TIMER_CYCLE_END, SIM_TIMERS};
+
+typedef struct SimEvent {
+  uint64_t time;
+  uint64_t seq;           // keeps events of the same time in order
+  uint8_t kind;
+  uint8_t timer;
+  int device;
+  uint32_t token;         // a timer is cancelled by moving its device token on
+  size_t transmission;
+} SimEvent;
+
+struct SimEventLater {
+  bool operator()(const SimEvent& a, const SimEvent& b) const {
+    return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+  }
+};
+
+typedef struct SimSample {
+  uint64_t streamEnd;     // node stream offset right after the sample
+  uint64_t createdUs;
+} SimSample;
+
+enum SimNodeState {NODE_IDLE, NODE_WAIT_CHUNK, NODE_WAIT_GROUP, NODE_BACKOFF};
+
+typedef struct SimNode {
+  std::deque<SimSample> samples;   // not yet on the gateway
+  uint64_t produced;               // stream bytes logged
+  uint64_t acked;                  // stream bytes the node saw acknowledged
+  SimNodeState state;
+  bool inSlot;
+  uint64_t slotEnd;
+  uint16_t session;
+  uint64_t sessionBase;            // stream offset of session offset 0
+  uint8_t fecParity;               // from the last beacon slot
+  uint8_t sessionParity;           // latched per transfer like sendLoRaFile
+  uint32_t chunkEnd;               // session offset the awaited ACK must reach
+  uint32_t groupOffset;
+  uint32_t groupEnd;
+  uint32_t resendEnd;              // chunks below this are resent one by one
+  bool lastGroup;                  // group cut short by the slot end
+  SimPacket lastParity;            // resent as group ACK probe
+  int probes;
+  int retries;                     // ALOHA resends of the current chunk
+  uint8_t cadAttempts;             // CSMA busy checks of the current send
+  uint8_t slotChannel;             // from the last beacon slot
+  uint16_t chunksSent;
+  uint16_t chunksLost;
+  uint64_t lastSlotSeen;
+  uint64_t heartbeatJitter;
+} SimNode;
+
+// The gateway's receiving end, lora_session.cpp as in TransferSession
+typedef struct SimSession {
+  uint16_t id;
+  uint64_t base;                   // stream offset of session offset 0
+  SessionReceiver rx;
+} SimSession;
+
+// Gateway's view of a node, as in Peer
+typedef struct SimPeer {
+  uint32_t pendingBytes;
+  uint64_t oldestUnsynced;
+  uint8_t missedPolls;
+  uint64_t backoffUntil;
+  bool polled;
+  uint64_t lastSlotTime;
+  uint16_t lossPermille;
+  uint8_t fecParity;
+  bool completed;
+  uint64_t delivered;              // unique stream bytes received
+  uint8_t slotChannel;             // channel of its slot in the current cycle
+  SimSession session;
+} SimPeer;
+
+typedef struct SimNetwork {
+  const SimScenario* scenario;
+  SimResult* result;
+  SimMedium medium;
+  SimRandom random;
+  std::priority_queue<SimEvent, std::vector<SimEvent>, SimEventLater> events;
+  uint64_t seq;
+  uint64_t now;
+  std::vector<std::array<uint32_t, SIM_TIMERS> > tokens;
+  std::vector<SimNode> nodes;      // by device, 0 is the gateway
+  std::vector<SimPeer> peers;
+  std::vector<uint8_t> tuned;      // node channels, the gateway follows gatewayChannelAt()
+  ChannelStats channelStats[LORA_CHANNELS];
+  std::vector<SlotAssignment> schedule;
+  std::vector<uint8_t> scheduleParity;
+  size_t scheduled;
+  bool inCycle;
+  uint64_t lastPollTime;
+  uint64_t cycleStart;
+  uint64_t controlAirtimeUs;       // beacon pages
+  uint64_t pollAirtimeUs;          // unicast polls the beacons stand in for
+  SessionCounters receive;
+  uint64_t corruptBytes;           // written by the gateway other than the node logged them
+  std::vector<double> latencies;
+} SimNetwork;
+
+static void setTimer(SimNetwork* net, int device, uint8_t timer, uint64_t time) {
+  SimEvent event = {};
+  event.time = time;
+  event.seq = net->seq++;
+  event.kind = EV_TIMER;
+  event.timer = timer;
+  event.device = device;
+  event.token = ++net->tokens[device][timer];
+  net->events.push(event);
+}
+
+static void cancelTimer(SimNetwork* net, int device, uint8_t timer) {
+  net->tokens[device][timer]++;
+}
+
+// Transmits after the turnaround and delay, or queued behind the sender's
+// previous frame. A node sends on the channel it is tuned to, the gateway
+// on the one the caller set. Returns the end of the frame.
+static uint64_t send(SimNetwork* net, const SimPacket& packet, uint64_t delay = 0) {
+  SimPacket onChannel = packet;
+  if (packet.src != SIM_GATEWAY) {
+    onChannel.channel = net->tuned[packet.src];
+  }
+  size_t index = simTransmit(&net->medium, net->now + SIM_TURNAROUND_US + delay, onChannel);
+  SimEvent event = {};
+  event.time = net->medium.transmissions[index].end;
+  event.seq = net->seq++;
+  event.kind = EV_TX_END;
+  event.device = packet.src;
+  event.transmission = index;
+  net->events.push(event);
+  return event.time;
+}
+
+static SimPacket packetFrom(int src, int dst, uint8_t type, uint16_t bytes) {
+  SimPacket packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.src = src;
+  packet.dst = dst;
+  packet.type = type;
+  packet.bytes = bytes;
+  return packet;
+}
+
+/******************************************************************
+ *                             Node                               *
+ ******************************************************************/
+
+static uint64_t nodePending(const SimNode& node) {
+  return node.produced - node.acked;
+}
+
+static void nodeStatus(SimNetwork* net, int id, uint8_t type) {
+  SimNode& node = net->nodes[id];
+  SimPacket packet = packetFrom(id, SIM_GATEWAY, type, SIM_POLL_COMPLETE_BYTES);
+  packet.pending = nodePending(node);
+  packet.oldest = node.samples.empty() ? 0 : node.samples.front().createdUs + 1;
+  packet.sent = node.chunksSent;
+  packet.lost = node.chunksLost;
+  node.chunksSent = 0;
+  node.chunksLost = 0;
+  send(net, packet);
+}
+
+static void nodeFinishSlot(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  node.state = NODE_IDLE;
+  node.resendEnd = 0;
+  if (node.inSlot) {
+    node.inSlot = false;
+    nodeStatus(net, id, SIM_POLL_COMPLETE);
+    net->tuned[id] = LORA_HOME_CHANNEL; // the status is already on its way on the slot's channel
+  }
+}
+
+static void nodeStartSession(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  node.session = (simNext(&net->random) & 0xFFFF) | 1;
+  node.sessionBase = node.acked;
+  node.sessionParity = node.fecParity;
+  node.resendEnd = 0;
+  node.retries = 0;
+  node.lastGroup = false;
+}
+
+// beginSlotTransfer(): ACK waits end in time for POLL_COMPLETE, chunks stop
+// early enough for their ACK
+static uint64_t statusReserveUs(SimNetwork* net) {
+  return slotStatusReserveUs(loraAirtimeUs(SIM_POLL_COMPLETE_BYTES, net->medium.spreadingFactor, net->medium.bandwidthHz));
+}
+
+static uint64_t slotGuardUs(SimNetwork* net) {
+  return slotTransferGuardUs(loraAirtimeUs(SIM_FILE_BODY_BYTES, net->medium.spreadingFactor, net->medium.bandwidthHz),
+                             loraAirtimeUs(SIM_FILE_ACK_BYTES, net->medium.spreadingFactor, net->medium.bandwidthHz),
+                             loraAirtimeUs(SIM_POLL_COMPLETE_BYTES, net->medium.spreadingFactor, net->medium.bandwidthHz));
+}
+
+static uint64_t ackDeadline(SimNetwork* net, int id, uint64_t sentEnd) {
+  const SimNode& node = net->nodes[id];
+  uint64_t deadline = sentEnd + ACK_TIMEOUT * MS;
+  if (net->scenario->mode != SIM_SLOTTED || !node.inSlot) {
+    return deadline;
+  }
+  uint64_t reserve = statusReserveUs(net);
+  uint64_t close = node.slotEnd > reserve ? node.slotEnd - reserve : 0;
+  return std::max(std::min(deadline, close), net->now);
+}
+
+// Listen before talk like radioSend: a busy channel backs off for a random,
+// doubling window and checks again, after CSMA_MAX_ATTEMPTS the frame goes out
+static bool nodeChannelClear(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  if (node.cadAttempts >= CSMA_MAX_ATTEMPTS
+      || !simChannelBusy(&net->medium, net->now + SIM_TURNAROUND_US, id, net->tuned[id])) {
+    node.cadAttempts = 0;
+    return true;
+  }
+  uint32_t backoff = csmaBackoffMs(node.cadAttempts++, CSMA_BACKOFF_UNIT_MS, simNext(&net->random));
+  node.state = NODE_BACKOFF;
+  setTimer(net, id, TIMER_RETRY, net->now + backoff * MS);
+  return false;
+}
+
+// Next chunk or FEC group, or the end of the slot (sync_to_gateway)
+static void nodeSendNext(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  const SimScenario* scenario = net->scenario;
+  uint64_t pending = nodePending(node);
+  uint32_t offset = node.acked - node.sessionBase;
+  bool resending = offset < node.resendEnd;
+  bool deadline = scenario->mode == SIM_SLOTTED && net->now + slotGuardUs(net) >= node.slotEnd;
+
+  if (pending == 0 || ((deadline || node.lastGroup) && !resending)) {
+    nodeFinishSlot(net, id);
+    return;
+  }
+  if (scenario->mode == SIM_CSMA && !nodeChannelClear(net, id)) {
+    return;
+  }
+
+  if (node.sessionParity > 0 && !resending) {
+    // groupSpanBeforeDeadline
+    uint32_t span = FEC_GROUP_SPAN;
+    if (scenario->mode == SIM_SLOTTED) {
+      span = sessionGroupSpan((long) (((int64_t) node.slotEnd - (int64_t) slotGuardUs(net) - (int64_t) net->now) / (int64_t) MS),
+                              node.sessionParity);
+    }
+    if (span == 0) {
+      node.sessionParity = 0; // no room left for a group and its parity, single chunks still fit
+      nodeSendNext(net, id);
+      return;
+    }
+    node.lastGroup = span < FEC_GROUP_SPAN;
+    uint32_t len = pending < span ? pending : span;
+    uint8_t chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    node.groupOffset = offset;
+    node.groupEnd = offset + len;
+    for (uint8_t i = 0; i < chunks; i++) {
+      SimPacket packet = packetFrom(id, SIM_GATEWAY, SIM_FILE_BODY, SIM_FILE_BODY_BYTES);
+      packet.session = node.session;
+      packet.offset = offset + i * CHUNK_SIZE;
+      packet.len = std::min<uint32_t>(CHUNK_SIZE, len - i * CHUNK_SIZE);
+      packet.grouped = true;
+      packet.streamBase = node.sessionBase;
+      send(net, packet);
+    }
+    uint64_t end = 0;
+    for (uint8_t j = 0; j < node.sessionParity; j++) {
+      SimPacket packet = packetFrom(id, SIM_GATEWAY, SIM_FILE_PARITY, SIM_FILE_PARITY_BYTES);
+      packet.session = node.session;
+      packet.offset = offset;
+      packet.len = len;
+      packet.chunks = chunks;
+      packet.parity = node.sessionParity;
+      packet.index = j;
+      packet.streamBase = node.sessionBase;
+      end = send(net, packet);
+      node.lastParity = packet;
+    }
+    node.probes = 0;
+    node.state = NODE_WAIT_GROUP;
+    setTimer(net, id, TIMER_ACK, ackDeadline(net, id, end));
+    return;
+  }
+
+  uint32_t limit = resending ? node.resendEnd - offset : CHUNK_SIZE;
+  SimPacket packet = packetFrom(id, SIM_GATEWAY, SIM_FILE_BODY, SIM_FILE_BODY_BYTES);
+  packet.session = node.session;
+  packet.offset = offset;
+  packet.len = std::min<uint64_t>(std::min<uint32_t>(limit, CHUNK_SIZE), pending);
+  packet.streamBase = node.sessionBase;
+  node.chunkEnd = offset + packet.len;
+  node.chunksSent++;
+  node.state = NODE_WAIT_CHUNK;
+  uint64_t end = send(net, packet);
+  setTimer(net, id, TIMER_ACK, ackDeadline(net, id, end));
+}
+
+static void nodeOnAck(SimNetwork* net, int id, const SimPacket& ack) {
+  SimNode& node = net->nodes[id];
+  if (ack.session != node.session) {
+    return;
+  }
+  if (node.state == NODE_WAIT_CHUNK && ack.offset >= node.chunkEnd) {
+    cancelTimer(net, id, TIMER_ACK);
+    node.acked = std::max<uint64_t>(node.acked, node.sessionBase + ack.offset);
+    node.retries = 0;
+    nodeSendNext(net, id);
+  } else if (node.state == NODE_WAIT_GROUP && ack.offset > node.groupOffset) {
+    cancelTimer(net, id, TIMER_ACK);
+    uint32_t next = std::min(ack.offset, node.groupEnd);
+    node.acked = std::max<uint64_t>(node.acked, node.sessionBase + next);
+    node.resendEnd = next < node.groupEnd ? node.groupEnd : 0;
+    nodeSendNext(net, id);
+  }
+}
+
+static void nodeOnAckTimeout(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  bool deadline = net->scenario->mode == SIM_SLOTTED && net->now + slotGuardUs(net) >= node.slotEnd;
+  if (node.state == NODE_WAIT_GROUP && node.probes < FEC_PROBES && !deadline) {
+    node.probes++;
+    net->result->probes++;
+    uint64_t end = send(net, node.lastParity);
+    setTimer(net, id, TIMER_ACK, ackDeadline(net, id, end));
+    return;
+  }
+  net->result->ackTimeouts++;
+  if (node.state == NODE_WAIT_CHUNK) {
+    node.chunksLost++;
+  }
+  if (net->scenario->mode != SIM_SLOTTED) {
+    // unslotted sender: random binary exponential backoff, then the same chunk again
+    node.retries++;
+    node.state = NODE_BACKOFF;
+    uint32_t window = 1u << std::min(node.retries, 6);
+    setTimer(net, id, TIMER_RETRY, net->now + simNext(&net->random) % (window * SECONDS));
+    return;
+  }
+  nodeFinishSlot(net, id);
+}
+
+static void nodeOnBeacon(SimNetwork* net, int id, const SimPacket& beacon) {
+  SimNode& node = net->nodes[id];
+  size_t first = beacon.page * SIM_BEACON_SLOTS;
+  uint64_t startDelay = beacon.startDelay;
+  for (size_t i = first; i < net->scheduled && i < first + SIM_BEACON_SLOTS; i++) {
+    const SlotAssignment& slot = net->schedule[i];
+    if (slot.peerIndex + 1 != (uint16_t) id) {
+      continue;
+    }
+    uint64_t slotStart = net->now + startDelay + slot.offsetMs * MS;
+    node.slotEnd = slotStart + slot.lengthMs * MS;
+    node.fecParity = net->scheduleParity[i];
+    node.slotChannel = slot.channel;
+    node.lastSlotSeen = net->now;
+    setTimer(net, id, TIMER_SLOT, slotStart + (slot.channel != LORA_HOME_CHANNEL ? CHANNEL_SETTLE_MS * MS : 0));
+    return;
+  }
+}
+
+static void nodeOnSlot(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  if (node.state != NODE_IDLE) {
+    return; // still busy with an earlier slot
+  }
+  node.inSlot = true;
+  net->tuned[id] = node.slotChannel;
+  nodeStartSession(net, id);
+  nodeSendNext(net, id);
+}
+
+static void nodeOnSample(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  const SimScenario* scenario = net->scenario;
+  node.produced += scenario->sampleBytes;
+  node.samples.push_back({node.produced, net->now});
+  net->result->samples++;
+  setTimer(net, id, TIMER_SAMPLE, net->now + scenario->sampleIntervalS * SECONDS);
+
+  if (scenario->mode != SIM_SLOTTED && node.state == NODE_IDLE) {
+    nodeStartSession(net, id);
+    nodeSendNext(net, id);
+  }
+}
+
+// Unprompted status of a node that has not had a slot for a while
+static void nodeOnHeartbeat(SimNetwork* net, int id) {
+  SimNode& node = net->nodes[id];
+  uint64_t due = node.lastSlotSeen + SIM_HEARTBEAT_MS * MS + node.heartbeatJitter;
+  if (net->now >= due && node.state == NODE_IDLE && !node.inSlot) {
+    nodeStatus(net, id, SIM_HEARTBEAT);
+    node.lastSlotSeen = net->now;
+    node.heartbeatJitter = simNext(&net->random) % (SIM_HEARTBEAT_MS / 4) * MS;
+    due = node.lastSlotSeen + SIM_HEARTBEAT_MS * MS + node.heartbeatJitter;
+  }
+  setTimer(net, id, TIMER_HEARTBEAT, std::max<uint64_t>(due, net->now + SECONDS));
+}
+
+/******************************************************************
+ *                            Gateway                             *
+ ******************************************************************/
+
+static void recordLoss(SimNetwork* net, SimPeer& peer, uint16_t sent, uint16_t lost) {
+  if (sent == 0) {
+    return;
+  }
+  peer.lossPermille = fecLossAverage(peer.lossPermille, sent, lost);
+  peer.fecParity = net->scenario->fec ? fecParityForLoss(FEC_GROUP_SIZE, peer.lossPermille) : 0;
+}
+
+// What node id logged at stream offset, so the gateway's writes can be checked
+static uint8_t streamByte(int id, uint64_t offset) {
+  return (uint8_t) ((offset * 2654435761u) >> 13) ^ (uint8_t) id;
+}
+
+static void streamData(int id, uint64_t from, uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    data[i] = streamByte(id, from + i);
+  }
+}
+
+typedef struct SimWriter {
+  SimNetwork* net;
+  int id;
+} SimWriter;
+
+// SessionWriter: session bytes reach the SD card, samples complete once all their bytes are in
+static bool gatewayWrite(void* context, uint32_t offset, const uint8_t* data, size_t len) {
+  SimNetwork* net = ((SimWriter*) context)->net;
+  int id = ((SimWriter*) context)->id;
+  SimPeer& peer = net->peers[id];
+  uint64_t from = peer.session.base + offset;
+  uint64_t to = from + len;
+  for (size_t i = 0; i < len; i++) {
+    net->corruptBytes += data[i] != streamByte(id, from + i);
+  }
+  if (to <= peer.delivered) {
+    net->result->duplicateBytes += to - from;
+    return true;
+  }
+  if (from < peer.delivered) {
+    net->result->duplicateBytes += peer.delivered - from;
+  }
+  peer.delivered = to;
+  std::deque<SimSample>& samples = net->nodes[id].samples;
+  while (!samples.empty() && samples.front().streamEnd <= peer.delivered) {
+    net->latencies.push_back((net->now - samples.front().createdUs) / 1e6);
+    samples.pop_front();
+  }
+  return true;
+}
+
+static void gatewayAck(SimNetwork* net, int id, uint8_t channel) {
+  SimPacket ack = packetFrom(SIM_GATEWAY, id, SIM_FILE_ACK, SIM_FILE_ACK_BYTES);
+  ack.channel = channel;
+  ack.session = net->peers[id].session.id;
+  ack.offset = net->peers[id].session.rx.expectedOffset;
+  send(net, ack);
+}
+
+// getSession(): the node's next session takes over from the one before
+static void openSession(SimPeer& peer, const SimPacket& packet) {
+  if (peer.session.id == packet.session) {
+    return;
+  }
+  peer.session.id = packet.session;
+  peer.session.base = packet.streamBase;
+  sessionReceiverReset(&peer.session.rx, 0);
+}
+
+// handle_file_chunk()
+static void gatewayOnChunk(SimNetwork* net, int id, const SimPacket& chunk) {
+  SimPeer& peer = net->peers[id];
+  openSession(peer, chunk);
+  uint8_t data[CHUNK_SIZE];
+  streamData(id, chunk.streamBase + chunk.offset, data, chunk.len);
+  SimWriter writer = {net, id};
+  sessionReceiveChunk(&peer.session.rx, chunk.offset, data, chunk.len, chunk.grouped, gatewayWrite, &writer,
+                      &net->receive);
+  if (!chunk.grouped) {
+    gatewayAck(net, id, chunk.channel);
+  }
+}
+
+// handle_file_parity(), the parity chunk is encoded from the node's stream
+static void gatewayOnParity(SimNetwork* net, int id, const SimPacket& parity) {
+  SimPeer& peer = net->peers[id];
+  if (peer.session.id != parity.session) {
+    return;
+  }
+  uint8_t blocks[FEC_GROUP_SIZE][CHUNK_SIZE] = {};
+  uint8_t parityData[FEC_MAX_PARITY][CHUNK_SIZE];
+  const uint8_t* data[FEC_GROUP_SIZE];
+  uint8_t* parityBlocks[FEC_MAX_PARITY];
+  for (uint8_t i = 0; i < parity.chunks; i++) {
+    uint32_t at = i * CHUNK_SIZE;
+    streamData(id, parity.streamBase + parity.offset + at, blocks[i], std::min<uint32_t>(CHUNK_SIZE, parity.len - at));
+    data[i] = blocks[i];
+  }
+  for (uint8_t j = 0; j < parity.parity; j++) {
+    parityBlocks[j] = parityData[j];
+  }
+  fecEncode(data, parity.chunks, parityBlocks, parity.parity, CHUNK_SIZE);
+
+  SimWriter writer = {net, id};
+  uint8_t sent, lost;
+  if (!sessionReceiveParity(&peer.session.rx, parity.offset, parity.chunks, parity.parity, parity.len, parity.index,
+                            parityData[parity.index], gatewayWrite, &writer, &net->receive, &sent, &lost)) {
+    return;
+  }
+  recordLoss(net, peer, sent, lost);
+  gatewayAck(net, id, parity.channel);
+}
+
+static void gatewayEndCycle(SimNetwork* net);
+
+static void gatewayOnStatus(SimNetwork* net, int id, const SimPacket& status) {
+  SimPeer& peer = net->peers[id];
+  peer.pendingBytes = status.pending;
+  peer.oldestUnsynced = status.oldest;
+  recordLoss(net, peer, status.sent, status.lost);
+  if (status.type != SIM_POLL_COMPLETE || !net->inCycle) {
+    return;
+  }
+  if (!peer.completed) {
+    net->channelStats[peer.slotChannel].completed++;
+    recordChannelLoss(&net->channelStats[peer.slotChannel], status.sent, status.lost);
+  }
+  peer.completed = true;
+  for (size_t i = 0; i < net->scheduled; i++) {
+    if (!net->peers[net->schedule[i].peerIndex + 1].completed) {
+      return;
+    }
+  }
+  // the control task notices on its next 100 ms check
+  uint64_t tick = SIM_CONTROL_TICK_MS * MS;
+  uint64_t elapsed = net->now > net->cycleStart ? net->now - net->cycleStart : 0;
+  setTimer(net, SIM_GATEWAY, TIMER_CYCLE_END, net->cycleStart + (elapsed + tick - 1) / tick * tick);
+}
+
+// run_poll_cycle(), first half
+static void gatewayStartCycle(SimNetwork* net) {
+  uint64_t now = net->now;
+  net->lastPollTime = now;
+  std::vector<SlotRequest> requests;
+  for (size_t id = 1; id < net->peers.size(); id++) {
+    SimPeer& peer = net->peers[id];
+    if (peer.backoffUntil != 0 && peer.backoffUntil > now) {
+      continue;
+    }
+    bool idleDue = !peer.polled || now - peer.lastSlotTime >= SIM_POLL_INTERVAL_MS * MS;
+    if (peer.pendingBytes == 0 && !idleDue) {
+      continue;
+    }
+    SlotRequest request = {};
+    request.peerIndex = id - 1;
+    request.priority = 1;
+    request.fecParity = peer.fecParity;
+    request.pendingBytes = peer.missedPolls ? 0 : peer.pendingBytes;
+    request.backlogAgeS = peer.oldestUnsynced != 0 && now > peer.oldestUnsynced
+                        ? (now - peer.oldestUnsynced) / SECONDS : 0;
+    requests.push_back(request);
+    peer.polled = true;
+    peer.lastSlotTime = now;
+  }
+  if (requests.empty()) {
+    setTimer(net, SIM_GATEWAY, TIMER_CYCLE, now + SIM_POLL_INTERVAL_MS * MS);
+    return;
+  }
+
+  net->schedule.resize(requests.size());
+  uint8_t lanes = net->scenario->receivers ? net->scenario->receivers : 1;
+  uint32_t cycleLength = buildSlotSchedule(requests.data(), requests.size(), net->schedule.data(), lanes);
+  net->scheduled = requests.size();
+  assignSlotChannels(net->schedule.data(), net->scheduled, net->channelStats, net->result->cycles);
+  net->scheduleParity.resize(net->scheduled);
+  for (size_t i = 0; i < net->scheduled; i++) {
+    SimPeer& peer = net->peers[net->schedule[i].peerIndex + 1];
+    net->scheduleParity[i] = peer.fecParity;
+    peer.slotChannel = net->schedule[i].channel;
+    net->channelStats[peer.slotChannel].slots++;
+  }
+  for (size_t id = 1; id < net->peers.size(); id++) {
+    net->peers[id].completed = false;
+  }
+
+  size_t pages = (net->scheduled + SIM_BEACON_SLOTS - 1) / SIM_BEACON_SLOTS;
+  // each page after the one before is on air and a gap, the slots a guard
+  // after the last: every page tells the time from its own end
+  std::vector<uint64_t> pageEnds(pages);
+  uint64_t pageAt = 0;
+  for (size_t page = 0; page < pages; page++) {
+    size_t slots = std::min<size_t>(SIM_BEACON_SLOTS, net->scheduled - page * SIM_BEACON_SLOTS);
+    uint64_t airtime = loraAirtimeUs(SIM_BEACON_HEADER_BYTES + slots * SIM_BEACON_SLOT_BYTES,
+                                     net->medium.spreadingFactor, net->medium.bandwidthHz);
+    pageEnds[page] = pageAt + airtime;
+    pageAt = pageEnds[page] + SIM_BEACON_PAGE_GAP_MS * MS;
+    net->controlAirtimeUs += airtime;
+  }
+  uint64_t firstSlot = pageEnds[pages - 1] + SIM_BEACON_GUARD_MS * MS;
+  for (size_t page = 0; page < pages; page++) {
+    size_t slots = std::min<size_t>(SIM_BEACON_SLOTS, net->scheduled - page * SIM_BEACON_SLOTS);
+    SimPacket beacon = packetFrom(SIM_GATEWAY, -1, SIM_BEACON, SIM_BEACON_HEADER_BYTES + slots * SIM_BEACON_SLOT_BYTES);
+    beacon.page = page;
+    beacon.startDelay = firstSlot - pageEnds[page];
+    send(net, beacon, page == 0 ? 0 : pageEnds[page - 1] + SIM_BEACON_PAGE_GAP_MS * MS);
+  }
+  net->pollAirtimeUs += net->scheduled * loraAirtimeUs(SIM_POLL_BYTES, net->medium.spreadingFactor, net->medium.bandwidthHz);
+  net->cycleStart = now + firstSlot;
+  net->inCycle = true;
+  net->result->cycles++;
+  setTimer(net, SIM_GATEWAY, TIMER_CYCLE_END, net->cycleStart + (cycleLength + SIM_BEACON_GUARD_MS) * MS);
+}
+
+// run_poll_cycle(), second half
+static void gatewayEndCycle(SimNetwork* net) {
+  net->inCycle = false;
+  for (size_t i = 0; i < net->scheduled; i++) {
+    SimPeer& peer = net->peers[net->schedule[i].peerIndex + 1];
+    if (peer.completed) {
+      continue;
+    }
+    net->result->missedSlots++;
+    if (peer.missedPolls < 255) {
+      peer.missedPolls++;
+    }
+    uint32_t backoff = peerBackoffMs(peer.missedPolls, simNext(&net->random));
+    if (backoff != 0) {
+      peer.backoffUntil = net->now + backoff * MS;
+    }
+  }
+
+  bool backlog = false;
+  for (size_t id = 1; id < net->peers.size(); id++) {
+    backlog |= net->peers[id].pendingBytes > 0 && net->peers[id].backoffUntil == 0;
+  }
+  uint64_t next = net->lastPollTime + (backlog ? SIM_BUSY_POLL_MS : SIM_POLL_INTERVAL_MS) * MS;
+  uint64_t tick = SIM_CONTROL_TICK_MS * MS;
+  setTimer(net, SIM_GATEWAY, TIMER_CYCLE, std::max<uint64_t>(next, net->now + tick));
+}
+
+static void gatewayOnReceive(SimNetwork* net, const SimPacket& packet) {
+  SimPeer& peer = net->peers[packet.src];
+  peer.missedPolls = 0;     // markPeerAlive()
+  peer.backoffUntil = 0;
+  switch (packet.type) {
+    case SIM_FILE_BODY:
+      gatewayOnChunk(net, packet.src, packet);
+      break;
+    case SIM_FILE_PARITY:
+      gatewayOnParity(net, packet.src, packet);
+      break;
+    case SIM_POLL_COMPLETE:
+    case SIM_HEARTBEAT:
+      gatewayOnStatus(net, packet.src, packet);
+      break;
+  }
+}
+
+/******************************************************************
+ *                            Scenario                            *
+ ******************************************************************/
+
+// A gateway with several demodulators hears every channel. With one it is on
+// the home channel between cycles and on the latest started slot's channel
+// during one, as run_poll_cycle() retunes.
+static bool gatewayHears(SimNetwork* net, uint8_t channel, uint64_t time) {
+  if (net->scenario->receivers > 1) {
+    return true;
+  }
+  uint8_t tuned = LORA_HOME_CHANNEL;
+  if (net->inCycle && time >= net->cycleStart) {
+    uint64_t latest = 0;
+    for (size_t i = 0; i < net->scheduled; i++) {
+      uint64_t start = net->cycleStart + net->schedule[i].offsetMs * MS;
+      if (start <= time && start >= latest) {
+        latest = start;
+        tuned = net->schedule[i].channel;
+      }
+    }
+  }
+  return tuned == channel;
+}
+
+static void dispatch(SimNetwork* net, const SimEvent& event) {
+  if (event.kind == EV_TX_END) {
+    const SimTransmission tx = net->medium.transmissions[event.transmission];
+    const SimPacket& packet = tx.packet;
+    for (int device = 0; device < net->medium.devices; device++) {
+      if (device == packet.src || (packet.dst >= 0 && packet.dst != device)) {
+        continue;
+      }
+      bool listening = device == SIM_GATEWAY ? gatewayHears(net, packet.channel, tx.start)
+                                             : net->tuned[device] == packet.channel;
+      if (!listening) {
+        net->medium.stats.offChannel++;
+        continue;
+      }
+      if (!simReceive(&net->medium, event.transmission, device)) {
+        continue;
+      }
+      if (device == SIM_GATEWAY) {
+        gatewayOnReceive(net, packet);
+      } else if (packet.type == SIM_BEACON) {
+        nodeOnBeacon(net, device, packet);
+      } else if (packet.type == SIM_FILE_ACK) {
+        nodeOnAck(net, device, packet);
+      }
+    }
+    return;
+  }
+
+  if (event.token != net->tokens[event.device][event.timer]) {
+    return; // cancelled
+  }
+  switch (event.timer) {
+    case TIMER_ACK:       nodeOnAckTimeout(net, event.device); break;
+    case TIMER_SLOT:      nodeOnSlot(net, event.device); break;
+    case TIMER_SAMPLE:    nodeOnSample(net, event.device); break;
+    case TIMER_HEARTBEAT: nodeOnHeartbeat(net, event.device); break;
+    case TIMER_RETRY:     nodeSendNext(net, event.device); break;
+    case TIMER_CYCLE:     gatewayStartCycle(net); break;
+    case TIMER_CYCLE_END: gatewayEndCycle(net); break;
+  }
+}
+
+static double percentile(std::vector<double>& values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+  return values[index];
+}
+
+void simRunScenario(const SimScenario& scenario, uint32_t seed, SimResult* result) {
+  SimNetwork* net = new SimNetwork();
+  net->scenario = &scenario;
+  net->result = result;
+  memset(result, 0, sizeof(SimResult));
+  net->random.state = seed * 2654435761u + 1;
+  int devices = scenario.nodes + 1;
+  simMediumInit(&net->medium, devices, scenario.spreadingFactor, scenario.bandwidthHz, seed + 17);
+  net->tokens.assign(devices, std::array<uint32_t, SIM_TIMERS>());
+  net->tuned.assign(devices, LORA_HOME_CHANNEL);
+  net->nodes.resize(devices);
+  net->peers.resize(devices);
+
+  // every node reaches the gateway at -70..-120 dBm, node pairs hear each other as configured
+  for (int a = 1; a < devices; a++) {
+    simSetLink(&net->medium, SIM_GATEWAY, a, -70 - (int) (simNext(&net->random) % 51), scenario.loss);
+    for (int b = a + 1; b < devices; b++) {
+      if (simChance(&net->random, scenario.hearing)) {
+        simSetLink(&net->medium, a, b, -70 - (int) (simNext(&net->random) % 51), scenario.loss);
+      }
+    }
+  }
+
+  for (int id = 1; id < devices; id++) {
+    SimNode& node = net->nodes[id];
+    node.state = NODE_IDLE;
+    if (scenario.initialBacklog > 0) {
+      node.produced = scenario.initialBacklog;
+      node.samples.push_back({node.produced, 0});
+      result->samples++;
+    }
+    net->peers[id].pendingBytes = scenario.initialBacklog;
+    setTimer(net, id, TIMER_SAMPLE, simNext(&net->random) % (scenario.sampleIntervalS * SECONDS));
+    if (scenario.mode == SIM_SLOTTED) {
+      node.heartbeatJitter = simNext(&net->random) % (SIM_HEARTBEAT_MS / 4) * MS;
+      setTimer(net, id, TIMER_HEARTBEAT, SIM_HEARTBEAT_MS * MS + node.heartbeatJitter);
+    }
+  }
+  if (scenario.mode == SIM_SLOTTED) {
+    setTimer(net, SIM_GATEWAY, TIMER_CYCLE, SECONDS);
+  }
+
+  uint64_t duration = (uint64_t) scenario.durationS * SECONDS;
+  while (!net->events.empty() && net->events.top().time <= duration) {
+    SimEvent event = net->events.top();
+    net->events.pop();
+    net->now = event.time;
+    dispatch(net, event);
+  }
+
+  uint64_t maxAirtime = 0;
+  for (int id = 1; id < devices; id++) {
+    result->generatedBytes += net->nodes[id].produced;
+    result->deliveredBytes += net->peers[id].delivered;
+    maxAirtime = std::max<uint64_t>(maxAirtime, net->medium.airtimeUs[id]);
+  }
+  std::sort(net->latencies.begin(), net->latencies.end());
+  result->samplesDelivered = net->latencies.size();
+  result->goodput = (double) result->deliveredBytes / scenario.durationS;
+  result->latencyP50S = percentile(net->latencies, 0.5);
+  result->latencyP90S = percentile(net->latencies, 0.9);
+  result->latencyP99S = percentile(net->latencies, 0.99);
+  result->fecRecovered = net->receive.fecRecovered;
+  result->radio = net->medium.stats;
+  result->gatewayAirtimeS = net->medium.stats.gatewayAirtimeUs / 1e6;
+  result->nodeAirtimeS = net->medium.stats.nodeAirtimeUs / 1e6;
+  result->maxNodeDutyPercent = maxAirtime / 1e4 / scenario.durationS;
+  if (result->cycles > 0) {
+    result->controlMsPerCycle = net->controlAirtimeUs / 1e3 / result->cycles;
+    result->pollMsPerCycle = net->pollAirtimeUs / 1e3 / result->cycles;
+  }
+  if (net->corruptBytes > 0) {
+    fprintf(stderr, "%s: gateway wrote %llu bytes other than logged\n", scenario.name,
+            (unsigned long long) net->corruptBytes);
+  }
+  for (int id = 1; id < devices; id++) {
+    sessionReceiverReset(&net->peers[id].session.rx, 0);
+  }
+  delete net;
+}
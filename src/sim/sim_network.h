@@ -0,0 +1,59 @@
+#ifndef SIM_NETWORK_H
+#define SIM_NETWORK_H
+
+#include <stdint.h>
+#include "sim_radio.h"
+
+/* Gateway and nodes running the poll-cycle and file-transfer protocol on a
+   simulated medium. The message flow follows lora_gateway.cpp,
+   lora_slave.cpp and lora_file_transfer.cpp. The gateway receives chunks
+   and parity with the firmware's lora_session.cpp, and the slot end, FEC
+   group span, parity, loss estimate, channel plan and airtime come from the
+   firmware's own modules. */
+
+// SIM_CSMA is SIM_ALOHA with listen before talk in front of every send
+enum SimMode {SIM_SLOTTED, SIM_ALOHA, SIM_CSMA};
+
+typedef struct SimScenario {
+  const char* name;
+  const char* description;
+  int nodes;
+  SimMode mode;
+  uint8_t spreadingFactor;
+  uint32_t bandwidthHz;
+  double loss;            // fading loss on every node-gateway link
+  double hearing;         // share of node pairs in range of each other
+  bool fec;               // gateway assigns FEC parity from measured loss
+  uint32_t sampleBytes;   // logged per node and sample
+  uint32_t sampleIntervalS;
+  uint32_t initialBacklog; // bytes per node waiting at start, e.g. after an outage
+  uint32_t durationS;
+  uint8_t receivers;      // gateway demodulators, slot lanes run in parallel; 0 counts as 1
+} SimScenario;
+
+typedef struct SimResult {
+  uint64_t generatedBytes;
+  uint64_t deliveredBytes;  // unique bytes at the gateway
+  uint64_t duplicateBytes;  // written again after a lost ACK
+  uint32_t samples;
+  uint32_t samplesDelivered;
+  double goodput;           // delivered bytes per second
+  double latencyP50S;       // sample logged to sample on the gateway
+  double latencyP90S;
+  double latencyP99S;
+  double gatewayAirtimeS;
+  double nodeAirtimeS;
+  double maxNodeDutyPercent;
+  uint32_t ackTimeouts;
+  uint32_t probes;          // FEC group ACK probes
+  uint32_t fecRecovered;    // chunks rebuilt from parity
+  uint32_t cycles;
+  uint32_t missedSlots;
+  double controlMsPerCycle; // beacon airtime per cycle
+  double pollMsPerCycle;    // airtime of one unicast poll per slot instead, for comparison
+  SimRadioStats radio;
+} SimResult;
+
+void simRunScenario(const SimScenario& scenario, uint32_t seed, SimResult* result);
+
+#endif
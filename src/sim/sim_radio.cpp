@@ -0,0 +1,109 @@
+#include "sim_radio.h"
+#include "lora_airtime.h"
+
+void simMediumInit(SimMedium* medium, int devices, uint8_t spreadingFactor, uint32_t bandwidthHz, uint32_t seed) {
+  medium->devices = devices;
+  medium->spreadingFactor = spreadingFactor;
+  medium->bandwidthHz = bandwidthHz;
+  medium->rssi.assign(devices * devices, SIM_NO_LINK);
+  medium->loss.assign(devices * devices, 1.0);
+  medium->busyUntil.assign(devices, 0);
+  medium->airtimeUs.assign(devices, 0);
+  medium->transmissions.clear();
+  medium->stats = SimRadioStats();
+  medium->random.state = seed ? seed : 1;
+}
+
+void simSetLink(SimMedium* medium, int a, int b, int rssi, double loss) {
+  medium->rssi[a * medium->devices + b] = rssi;
+  medium->rssi[b * medium->devices + a] = rssi;
+  medium->loss[a * medium->devices + b] = loss;
+  medium->loss[b * medium->devices + a] = loss;
+}
+
+// Starts the frame once the sender's previous one is out, returns its index
+size_t simTransmit(SimMedium* medium, uint64_t now, const SimPacket& packet) {
+  SimTransmission tx;
+  tx.packet = packet;
+  tx.start = now > medium->busyUntil[packet.src] ? now : medium->busyUntil[packet.src];
+  uint32_t airtime = loraAirtimeUs(packet.bytes, medium->spreadingFactor, medium->bandwidthHz);
+  tx.end = tx.start + airtime;
+  medium->busyUntil[packet.src] = tx.end;
+  medium->airtimeUs[packet.src] += airtime;
+  medium->stats.frames[packet.type]++;
+  if (packet.src == SIM_GATEWAY) {
+    medium->stats.gatewayAirtimeUs += airtime;
+  } else {
+    medium->stats.nodeAirtimeUs += airtime;
+  }
+  medium->transmissions.push_back(tx);
+  return medium->transmissions.size() - 1;
+}
+
+// Decided once the frame has ended
+bool simReceive(SimMedium* medium, size_t transmission, int receiver) {
+  const SimTransmission& tx = medium->transmissions[transmission];
+  int n = medium->devices;
+  int rssi = medium->rssi[tx.packet.src * n + receiver];
+  if (rssi <= SIM_NO_LINK) {
+    return false;
+  }
+
+  bool collided = false;
+  for (size_t i = medium->transmissions.size(); i-- > 0;) {
+    const SimTransmission& other = medium->transmissions[i];
+    if (other.start + SIM_MAX_AIRTIME_US < tx.start) {
+      break;
+    }
+    if (i == transmission) {
+      continue;
+    }
+    if (other.packet.src == receiver) {
+      if (other.start < tx.end && other.end + SIM_TURNAROUND_US > tx.start) {
+        medium->stats.halfDuplex++;
+        return false;
+      }
+      continue;
+    }
+    if (other.start >= tx.end || other.end <= tx.start || other.packet.channel != tx.packet.channel) {
+      continue;
+    }
+    int otherRssi = medium->rssi[other.packet.src * n + receiver];
+    if (otherRssi > SIM_NO_LINK && otherRssi + SIM_CAPTURE_DB > rssi) {
+      collided = true;
+    }
+  }
+  if (collided) {
+    medium->stats.collisions++;
+    return false;
+  }
+  if (simChance(&medium->random, medium->loss[tx.packet.src * n + receiver])) {
+    medium->stats.faded++;
+    return false;
+  }
+  return true;
+}
+
+// Channel activity detection at time: a frame the device can hear is on air
+// on the channel during the detection. Frames out of range stay hidden.
+// Detection past the preamble is taken as certain, the modem does worse, so
+// this is the best case.
+bool simChannelBusy(SimMedium* medium, uint64_t time, int device, uint8_t channel) {
+  uint64_t end = time + SIM_CAD_SYMBOLS * loraSymbolUs(medium->spreadingFactor, medium->bandwidthHz);
+  int n = medium->devices;
+  medium->stats.cadChecks++;
+  for (size_t i = medium->transmissions.size(); i-- > 0;) {
+    const SimTransmission& other = medium->transmissions[i];
+    if (other.start + SIM_MAX_AIRTIME_US < time) {
+      break;
+    }
+    if (other.packet.src == device || other.packet.channel != channel || other.start >= end || other.end <= time) {
+      continue;
+    }
+    if (medium->rssi[other.packet.src * n + device] > SIM_NO_LINK) {
+      medium->stats.cadBusy++;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,84 @@
+#ifndef SIM_RADIO_H
+#define SIM_RADIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "sim.h"
+
+/* Shared LoRa channels: every frame is heard by every device in range that
+   listens on its channel, and is lost to link fading, to an overlapping
+   frame on the same channel that is not at least SIM_CAPTURE_DB weaker, or
+   because the receiver was transmitting or still turning around from its
+   own transmission (half duplex, on any channel). */
+
+#define SIM_GATEWAY 0               // device 0, nodes are 1..N
+#define SIM_CAPTURE_DB 6            // a frame survives an overlap when this much stronger
+#define SIM_NO_LINK -200            // rssi of a pair out of range
+#define SIM_MAX_AIRTIME_US 20000000 // longer than any frame, bounds the overlap search
+#define SIM_CAD_SYMBOLS 2           // channel activity detection listens this long
+
+enum SimPacketType {SIM_BEACON, SIM_FILE_BODY, SIM_FILE_PARITY, SIM_FILE_ACK,
+                    SIM_POLL_COMPLETE, SIM_HEARTBEAT, SIM_PACKET_TYPES};
+
+// Logical content of a firmware message, bytes is its size on air
+typedef struct SimPacket {
+  uint8_t type;
+  int src;
+  int dst;                // -1 for broadcasts
+  uint16_t bytes;
+  uint16_t session;
+  uint32_t offset;        // FILE_BODY/FILE_PARITY: session offset, FILE_ACK: next offset
+  uint16_t len;           // FILE_BODY: data bytes, FILE_PARITY: group bytes
+  uint8_t chunks;         // FILE_PARITY
+  uint8_t parity;
+  uint8_t index;
+  bool grouped;           // FILE_FLAG_GROUPED
+  uint32_t pending;       // POLL_COMPLETE/HEARTBEAT backlog
+  uint64_t oldest;        // POLL_COMPLETE/HEARTBEAT time of the oldest unsynced sample, 0 = none
+  uint16_t sent;          // POLL_COMPLETE chunk loss report
+  uint16_t lost;
+  int page;               // BEACON page
+  uint64_t startDelay;    // BEACON: us from its end to the first slot
+  uint8_t channel;        // 0 is the home channel, set by send()
+  uint64_t streamBase;    // bookkeeping only: node stream offset of session offset 0
+} SimPacket;
+
+typedef struct SimTransmission {
+  SimPacket packet;
+  uint64_t start;
+  uint64_t end;
+} SimTransmission;
+
+typedef struct SimRadioStats {
+  uint32_t frames[SIM_PACKET_TYPES];
+  uint32_t collisions;    // receptions lost to an overlapping frame
+  uint32_t halfDuplex;    // receptions missed while transmitting or turning around
+  uint32_t faded;         // receptions lost to link loss
+  uint32_t offChannel;    // frames for a receiver tuned to another channel
+  uint32_t cadChecks;     // SIM_CSMA: channel activity detections before a frame
+  uint32_t cadBusy;       // detections that found a frame on air and backed off
+  uint64_t gatewayAirtimeUs;
+  uint64_t nodeAirtimeUs;
+} SimRadioStats;
+
+typedef struct SimMedium {
+  int devices;
+  uint8_t spreadingFactor;
+  uint32_t bandwidthHz;
+  std::vector<int> rssi;          // devices x devices, dBm
+  std::vector<double> loss;       // devices x devices, fading loss probability
+  std::vector<uint64_t> busyUntil; // end of each device's last transmission
+  std::vector<uint64_t> airtimeUs; // per device
+  std::vector<SimTransmission> transmissions;
+  SimRadioStats stats;
+  SimRandom random;
+} SimMedium;
+
+void simMediumInit(SimMedium* medium, int devices, uint8_t spreadingFactor, uint32_t bandwidthHz, uint32_t seed);
+void simSetLink(SimMedium* medium, int a, int b, int rssi, double loss);
+size_t simTransmit(SimMedium* medium, uint64_t now, const SimPacket& packet);
+bool simReceive(SimMedium* medium, size_t transmission, int receiver);
+bool simChannelBusy(SimMedium* medium, uint64_t time, int device, uint8_t channel);
+
+#endif
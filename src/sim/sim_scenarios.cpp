@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "sim_network.h"
+
+/* Fixed scenarios, so a protocol change can be compared run against run.
+   Columns: share of logged bytes delivered, goodput, sample latency
+   percentiles, airtime of gateway and nodes, highest node duty cycle,
+   ACK timeouts, FEC probes, chunks rebuilt from parity, missed slots,
+   receptions lost to collisions, half duplex and fading, CSMA backoffs
+   after a busy channel activity detection, frames missed by a receiver
+   tuned to another channel, and the gateway's control airtime per cycle:
+   the broadcast beacon against one unicast poll per slot. The multi-* scenarios give the gateway several
+   receivers, one slot lane each on its own sub-channel. */
+
+static const SimScenario scenarios[] = {
+  // name          description                                         nodes mode         SF  BW      loss  hear  FEC    bytes  s   backlog  s     rx
+  {"star-10",     "10 nodes, 2 % loss, 40 B/min each",                  10, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 0,      3600, 1},
+  {"star-50",     "50 nodes, 2 % loss, 40 B/min each",                  50, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 0,      3600, 1},
+  {"star-100",    "100 nodes, 2 % loss, 40 B/min each",                100, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 0,      3600, 1},
+  {"catchup-10",  "10 nodes draining 20 kB each after an outage",       10, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 20000,  3600, 1},
+  {"lossy-arq",   "catchup-10 at 10 % loss, FEC off",                   10, SIM_SLOTTED,  7, 125000, 0.10, 0.3, false, 40,    60, 20000,  3600, 1},
+  {"lossy-fec",   "catchup-10 at 10 % loss, FEC on",                    10, SIM_SLOTTED,  7, 125000, 0.10, 0.3, true,  40,    60, 20000,  3600, 1},
+  {"sf10-10",     "star-10 at SF10",                                    10, SIM_SLOTTED, 10, 125000, 0.02, 0.3, true,  40,    60, 0,      3600, 1},
+  {"aloha-10",    "10 nodes sending every sample unslotted",            10, SIM_ALOHA,    7, 125000, 0.02, 0.3, false, 40,    60, 0,      3600, 1},
+  {"aloha-50",    "50 nodes sending every sample unslotted",            50, SIM_ALOHA,    7, 125000, 0.02, 0.3, false, 40,    60, 0,      3600, 1},
+  {"csma-10",     "aloha-10 with channel activity detection",           10, SIM_CSMA,     7, 125000, 0.02, 0.3, false, 40,    60, 0,      3600, 1},
+  {"csma-50",     "aloha-50 with channel activity detection",           50, SIM_CSMA,     7, 125000, 0.02, 0.3, false, 40,    60, 0,      3600, 1},
+  {"csma-50-all", "csma-50 with every node in range of every other",    50, SIM_CSMA,     7, 125000, 0.02, 1.0, false, 40,    60, 0,      3600, 1},
+  {"catchup-40",  "40 nodes draining 20 kB each, one receiver",         40, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 20000,  3600, 1},
+  {"multi-2",     "catchup-40 with 2 receivers, 2 slot lanes",          40, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 20000,  3600, 2},
+  {"multi-4",     "catchup-40 with 4 receivers, 4 slot lanes",          40, SIM_SLOTTED,  7, 125000, 0.02, 0.3, true,  40,    60, 20000,  3600, 4},
+};
+
+static const size_t scenarioCount = sizeof(scenarios) / sizeof(scenarios[0]);
+
+static void printHeader() {
+  printf("%-11s %6s %7s %7s %7s %7s %7s %7s %5s %5s %5s %5s %5s %5s %5s %5s %5s %5s %6s %6s\n",
+         "scenario", "deliv%", "B/s", "p50 s", "p90 s", "p99 s", "gw air", "node air", "duty%",
+         "tmout", "probe", "fec", "miss", "coll", "hdx", "fade", "busy", "offch", "ctl ms", "poll ms");
+}
+
+static void printResult(const SimScenario& scenario, const SimResult& r) {
+  double delivered = r.generatedBytes ? 100.0 * r.deliveredBytes / r.generatedBytes : 0;
+  printf("%-11s %6.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %5.2f %5u %5u %5u %5u %5u %5u %5u %5u %5u %6.0f %6.0f\n",
+         scenario.name, delivered, r.goodput, r.latencyP50S, r.latencyP90S, r.latencyP99S,
+         r.gatewayAirtimeS, r.nodeAirtimeS, r.maxNodeDutyPercent, r.ackTimeouts, r.probes,
+         r.fecRecovered, r.missedSlots, r.radio.collisions, r.radio.halfDuplex, r.radio.faded,
+         r.radio.cadBusy, r.radio.offChannel, r.controlMsPerCycle, r.pollMsPerCycle);
+}
+
+// program scenarios [name] [seed]
+int runScenarios(int argc, char** argv) {
+  const char* name = argc >= 1 ? argv[0] : "all";
+  uint32_t seed = argc >= 2 ? atoi(argv[1]) : 1;
+  bool found = false;
+
+  printHeader();
+  for (size_t i = 0; i < scenarioCount; i++) {
+    if (strcmp(name, "all") != 0 && strcmp(name, scenarios[i].name) != 0) {
+      continue;
+    }
+    found = true;
+    SimResult result;
+    simRunScenario(scenarios[i], seed, &result);
+    printResult(scenarios[i], result);
+  }
+  if (!found) {
+    printf("unknown scenario %s, one of:\n", name);
+    for (size_t i = 0; i < scenarioCount; i++) {
+      printf("  %-11s %s\n", scenarios[i].name, scenarios[i].description);
+    }
+    return 1;
+  }
+  return 0;
+}
@@ -112,6 +112,8 @@ const int numNtpServers = sizeof(ntpServers) / sizeof(ntpServers[0]);
 int daylightOffset_sec = 3600;
 RTC_DS1307 rtc;
 bool rtc_mounted = false;
+RTC_DATA_ATTR bool clock_synced = false; // system clock set from NTP or the network, finer than the DS1307, kept over deep sleep
+unsigned long lastRtcWrite = 0;   // millis() of the last DS1307 write, 0 = none
 
 DateTime tmToDateTime(struct tm timeinfo) {
   return DateTime(timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, 
@@ -152,11 +154,13 @@ void external_rtc_sync_ntp(){
     return;
   }
 
-  // Synchronize DS1307 RTC with NTP time
+  // Synchronize DS1307 RTC with NTP time. It only keeps whole seconds, the
+  // time sync task calls this on a second boundary of the system clock.
   struct tm timeinfo;
   if (getLocalTime(&timeinfo)) {
     DateTime ntpTime = tmToDateTime(timeinfo);
     rtc.adjust(ntpTime);
+    lastRtcWrite = millis();
     Serial.println("DS1307 RTC synchronized with NTP time.");
     DateTime now = rtc.now();
     Serial.print("RTC time: ");
@@ -187,7 +191,8 @@ void ntp_sync() {
         struct tm timeinfo;
         if (getLocalTime(&timeinfo)) {
           // Serial.println(&timeinfo, "NTP Time from internet: %A, %B %d %Y %H:%M:%S");
-          external_rtc_sync_ntp();
+          clock_synced = true;
+          lastRtcWrite = 0; // the time sync task writes the DS1307 on the next second boundary
           syncSuccess = true;
           break; // Exit the retry loop if synchronization is successful
         }
@@ -204,10 +209,14 @@ void ntp_sync() {
   Serial.println("Failed to synchronize with any NTP server.");
 }
 
+// The DS1307 is the time source while it is mounted. With SAMPLE_TIME_MS set,
+// sample timestamps come from the system clock once it is synced, with
+// milliseconds.
 String get_current_time(bool getFilename) {
   struct tm timeinfo;
+  bool withMillis = getFilename && systemConfig.SAMPLE_TIME_MS && clock_synced;
 
-  if (rtc_mounted) {
+  if (rtc_mounted && !withMillis) {
     DateTime now = rtc.now();
     char buffer[30];
     if (!getFilename) {
@@ -224,10 +233,17 @@ String get_current_time(bool getFilename) {
       snprintf(buffer, sizeof(buffer), "%04d/%02d/%02d %02d:%02d:%02d", 
                timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, 
                timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
-    } else {
+    } else if (!withMillis) {
       snprintf(buffer, sizeof(buffer), "%04d_%02d_%02d_%02d_%02d_%02d", 
                timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, 
                timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+    } else {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      localtime_r(&tv.tv_sec, &timeinfo); // same second as the milliseconds
+      snprintf(buffer, sizeof(buffer), "%04d_%02d_%02d_%02d_%02d_%02d.%03ld", 
+               timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, 
+               timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec, (long) (tv.tv_usec / 1000));
     }
     return String(buffer);
   } else {
@@ -236,6 +252,18 @@ String get_current_time(bool getFilename) {
   }
 }
 
+// Parse a timestamp written by get_current_time(true), returns 0 if malformed
+time_t parseFilenameTime(const char* timestamp){
+  struct tm timeinfo = {};
+  if (sscanf(timestamp, "%4d_%2d_%2d_%2d_%2d_%2d", &timeinfo.tm_year, &timeinfo.tm_mon, &timeinfo.tm_mday,
+             &timeinfo.tm_hour, &timeinfo.tm_min, &timeinfo.tm_sec) != 6) {
+    return 0;
+  }
+  timeinfo.tm_year -= 1900;
+  timeinfo.tm_mon -= 1;
+  return mktime(&timeinfo);
+}
+
 String convertTMtoString(struct tm timeinfo){
   char buffer[30];
   snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d%+03d:00", 